@@ -23,6 +23,9 @@
 #include <linux/rcupdate.h>
 #include <linux/workqueue.h>
 
+#include <popcorn/types.h>
+#include <popcorn/syscall_server.h>
+
 int sysctl_nr_open __read_mostly = 1024*1024;
 int sysctl_nr_open_min = BITS_PER_LONG;
 /* our max() is unusable in constant expressions ;-/ */
@@ -895,6 +898,10 @@ SYSCALL_DEFINE3(dup3, unsigned int, oldfd, unsigned int, newfd, int, flags)
 	if (newfd >= rlimit(RLIMIT_NOFILE))
 		return -EBADF;
 
+#ifdef CONFIG_POPCORN
+	if (distributed_remote_process(current))
+		syscall_server_drain_fd(current, newfd);
+#endif
 	spin_lock(&files->file_lock);
 	err = expand_files(files, newfd);
 	file = fcheck(oldfd);
@@ -1850,6 +1850,7 @@ struct task_struct {
 
 	volatile void *remote_work;
 	struct completion remote_work_pended;
+	unsigned long *syscall_fds;	/* Fds with async writes at remote */
 
 	int migration_target_nid;
 	int backoff_weight;
@@ -1858,6 +1859,8 @@ struct task_struct {
 	unsigned long fault_address;
 	int fault_retry;
 	ktime_t fault_start;
+	unsigned long fault_vm_start;
+	unsigned int fault_type;
 #endif
 
 	/*
@@ -23,6 +23,17 @@ int page_server_handle_pte_fault(
 		unsigned long address, pmd_t *pmd, pte_t *pte, pte_t entry,
 		unsigned int flags);
 
+/*
+ * Entry points for huge pages. Ownership of a 2MB region is transferred as
+ * a whole and split back to pages once the region is write-shared.
+ */
+int page_server_handle_pmd_fault(
+		struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, pmd_t *pmd, unsigned int flags);
+bool page_server_split_huge_pmd(
+		struct vm_area_struct *vma, unsigned long address, pmd_t *pmd);
+void page_server_zap_pmd(struct vm_area_struct *vma, unsigned long addr);
+
 /*
  * Flush pages in remote to the origin
  */
@@ -34,7 +45,7 @@ void page_server_zap_pte(
 int page_server_get_userpage(u32 __user *uaddr, struct fault_handle **handle, char *mode);
 void page_server_put_userpage(struct fault_handle *fh, char *mode);
 
-void page_server_start_mm_fault(unsigned long address);
+void page_server_start_mm_fault(struct vm_area_struct *vma, unsigned long address, unsigned int flags);
 int page_server_end_mm_fault(int ret);
 
 void page_server_panic(bool condition, struct mm_struct *mm, unsigned long address, pte_t *pte, pte_t pte_val);
@@ -10,6 +10,7 @@
 
 #include <linux/types.h>
 #include <linux/seq_file.h>
+#include <linux/workqueue.h>
 
 /* Enumerate message types */
 enum pcn_kmsg_type {
@@ -37,10 +38,15 @@ enum pcn_kmsg_type {
 	PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH,	/* XXX page flush is not working now */
 	PCN_KMSG_TYPE_REMOTE_PAGE_RELEASE,
 	PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH_ACK,
+	PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_REQUEST,
+	PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_RESPONSE,
+	PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_CHUNK,
 
 	/* Distributed futex */
 	PCN_KMSG_TYPE_FUTEX_REQUEST,
 	PCN_KMSG_TYPE_FUTEX_RESPONSE,
+	PCN_KMSG_TYPE_FUTEX_LEASE_RECALL,
+	PCN_KMSG_TYPE_FUTEX_LEASE_RECALL_ACK,
 	PCN_KMSG_TYPE_STAT_END,
 
 	/* Performance experiments */
@@ -70,14 +76,39 @@ enum pcn_kmsg_type {
 
 	PCN_KMSG_TYPE_SYSCALL_FWD,
 	PCN_KMSG_TYPE_SYSCALL_REP,
+	PCN_KMSG_TYPE_SYSCALL_BATCH,
+	PCN_KMSG_TYPE_SYSCALL_BATCH_ACK,
 	PCN_KMSG_TYPE_MAX
 };
 
-/* Enumerate message priority. XXX Priority is not supported yet. */
+/**
+ * Enumerate message priority. Transports send out higher-priority messages
+ * ahead of lower-priority ones queued for the same node. Low-priority
+ * messages may be held back while the link is busy, so they should be sent
+ * from a sleepable context.
+ *
+ * Ordering: messages of the same priority from a thread are delivered in
+ * order. pcn_kmsg_send() returns once the message is on the link, so no
+ * later message from the thread overtakes it whatever its priority. Only a
+ * message posted with pcn_kmsg_post() may be overtaken by a later message
+ * of a higher priority from the same thread. So a message whose handling
+ * must precede a higher-priority one should be sent, not posted. Posted
+ * messages followed by higher-priority ones currently are
+ *  - SYSCALL_FWD and VMA_OP_RESPONSE; their senders wait for the reply or
+ *    have nothing else to the peer that depends on them.
+ *  - SYSCALL_BATCH; one batch per socket is in flight, and forwarded
+ *    syscalls wait for the batches they depend on to be acknowledged.
+ *  - REMOTE_HUGE_PAGE_CHUNK before REMOTE_HUGE_PAGE_RESPONSE; the remote
+ *    waits for the response and the chunks at separate stations.
+ *  - TASK_MIGRATE and TASK_MIGRATE_BACK; the thread leaves the node.
+ * Page release and flush, which should precede later page requests, and
+ * futex requests are sent synchronously.
+ */
 enum pcn_kmsg_prio {
 	PCN_KMSG_PRIO_LOW,
 	PCN_KMSG_PRIO_NORMAL,
 	PCN_KMSG_PRIO_HIGH,
+	PCN_KMSG_PRIO_MAX,
 };
 
 /* Message header */
@@ -110,6 +141,21 @@ struct pcn_kmsg_message {
 
 void pcn_kmsg_dump(struct pcn_kmsg_message *msg);
 
+/**
+ * Receive-side space in front of each received message. Transports place
+ * received messages right after it, so the receiver can hand the message
+ * over to a worker without allocating a work descriptor. It never goes on
+ * the wire.
+ */
+struct pcn_kmsg_recv_hdr {
+	struct work_struct work;
+};
+
+#define PCN_KMSG_RECV_HDR(x) \
+	((struct pcn_kmsg_recv_hdr *)(x) - 1)
+#define PCN_KMSG_RECV_MSG(x) \
+	((struct pcn_kmsg_message *)((struct pcn_kmsg_recv_hdr *)(x) + 1))
+
 
 /* SETUP */
 
@@ -122,6 +168,26 @@ int pcn_kmsg_register_callback(enum pcn_kmsg_type type, pcn_kmsg_cbftn callback)
 /* Unregister a callback function for the message type */
 int pcn_kmsg_unregister_callback(enum pcn_kmsg_type type);
 
+/**
+ * Steering key of a message. Messages with the same key are dispatched to
+ * the same CPU in the order they arrive, whereas messages with different
+ * keys are spread over CPUs and processed in parallel.
+ */
+typedef unsigned long (*pcn_kmsg_keyftn)(struct pcn_kmsg_message *);
+
+/**
+ * Steer the works queued by pcn_kmsg_queue_work() for the message type @type
+ * with @key. With a NULL @key (default), the works run on the CPU that
+ * received the message.
+ */
+int pcn_kmsg_register_steering(enum pcn_kmsg_type type, pcn_kmsg_keyftn key);
+
+/**
+ * Queue the work in the receive header of @msg into @wq according to the
+ * steering policy of the message type. The work should be initialized first.
+ */
+void pcn_kmsg_queue_work(struct workqueue_struct *wq, struct pcn_kmsg_message *msg);
+
 
 /* MESSAGING */
 
@@ -138,6 +204,13 @@ int pcn_kmsg_send(enum pcn_kmsg_type type, int dest_nid, void *msg, size_t msg_s
  */
 int pcn_kmsg_post(enum pcn_kmsg_type type, int dest_nid, void *msg, size_t msg_size);
 
+/**
+ * Same as pcn_kmsg_send() and pcn_kmsg_post() but with priority @prio.
+ * The two above send messages with PCN_KMSG_PRIO_NORMAL.
+ */
+int pcn_kmsg_send_prio(enum pcn_kmsg_type type, enum pcn_kmsg_prio prio, int dest_nid, void *msg, size_t msg_size);
+int pcn_kmsg_post_prio(enum pcn_kmsg_type type, enum pcn_kmsg_prio prio, int dest_nid, void *msg, size_t msg_size);
+
 /**
  * Get message buffer for posting. Note pcn_kmsg_put() is for returning
  * unused buffer without posting it; posted message is reclaimed automatically.
@@ -147,7 +220,8 @@ void pcn_kmsg_put(void *msg);
 
 /**
  * Process the received messag @msg. Each message layer should start processing
- * the request by calling this function
+ * the request by calling this function. @msg should be preceded by
+ * struct pcn_kmsg_recv_hdr.
  */
 void pcn_kmsg_process(struct pcn_kmsg_message *msg);
 
@@ -172,7 +246,10 @@ struct pcn_kmsg_rdma_handle {
 };
 
 /**
- * Pin @buffer for RDMA and get @rdma_addr and @rdma_key.
+ * Pin @buffer for RDMA and get @rdma_addr and @rdma_key. With a NULL
+ * @buffer, the transport provides a buffer of its own. Transports with
+ * PCN_KMSG_FEATURE_RDMA_DIRECT can pin @buffer itself, so the peer places
+ * the data in it directly.
  */
 struct pcn_kmsg_rdma_handle *pcn_kmsg_pin_rdma_buffer(void *buffer, size_t size);
 
@@ -185,6 +262,7 @@ int pcn_kmsg_rdma_read(int from_nid, void *addr, dma_addr_t rdma_addr, size_t si
 /* TRANSPORT DESCRIPTOR */
 enum {
 	PCN_KMSG_FEATURE_RDMA = 1,
+	PCN_KMSG_FEATURE_RDMA_DIRECT = 2,
 };
 
 /**
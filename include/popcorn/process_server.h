@@ -10,6 +10,10 @@ int update_frame_pointer(void);
 long process_server_do_futex_at_remote(u32 __user *uaddr, int op, u32 val,
 		bool valid_ts, struct timespec *ts,
 		u32 __user *uaddr2, u32 val2, u32 val3);
+bool process_server_futex_hold(u32 __user *uaddr);
+void process_server_futex_release(u32 __user *uaddr);
+void process_server_futex_requeue(struct task_struct *tsk,
+		u32 __user *uaddr, u32 __user *uaddr2);
 
 struct remote_context;
 void free_remote_context(struct remote_context *);
@@ -38,4 +38,7 @@ long redirect_fstat(unsigned int fd,
 long redirect_sendfile64(int out_fd, int in_fd,
 			       loff_t __user *offset, size_t count);
 long redirect_fcntl(unsigned int fd, unsigned int cmd, unsigned long arg);
+
+/* Send out the asynchronous writes to @fd before it is replaced */
+void syscall_server_drain_fd(struct task_struct *tsk, unsigned int fd);
 #endif
@@ -19,6 +19,12 @@
  */
 int vma_server_munmap_origin(unsigned long start, size_t len, int nid_except);
 
+/**
+ * Notify that the origin changed its existing regions so that remotes drop
+ * their VMA snapshots. Waits for the remotes, so it may sleep.
+ */
+void vma_server_origin_changed(struct mm_struct *mm);
+
 
 /**
  * Retrieve VMAs from origin
@@ -220,6 +220,7 @@ struct futex_pi_state {
  * @rt_waiter:		rt_waiter storage for use with requeue_pi
  * @requeue_pi_key:	the requeue_pi target futex key
  * @bitset:		bitset for the optional bitmasked wakeup
+ * @lease_uaddr:	the futex word whose leases the waiter holds off
  *
  * We use this hashed waitqueue, instead of a normal wait_queue_t, so
  * we can wake only the relevant ones (hashed queues may be shared).
@@ -242,6 +243,9 @@ struct futex_q {
 	struct rt_mutex_waiter *rt_waiter;
 	union futex_key *requeue_pi_key;
 	u32 bitset;
+#ifdef CONFIG_POPCORN
+	u32 __user *lease_uaddr;
+#endif
 };
 
 static const struct futex_q futex_q_init = {
@@ -1781,6 +1785,10 @@ static int futex_requeue(u32 __user *uaddr1, unsigned int flags,
 		if (nr_wake != 1)
 			return -EINVAL;
 	}
+#ifdef CONFIG_POPCORN
+	/* Waiters are about to move onto uaddr2 */
+	process_server_futex_hold(uaddr2);
+#endif
 
 retry:
 	ret = get_futex_key(uaddr1, flags & FLAGS_SHARED, &key1, VERIFY_READ);
@@ -1962,6 +1970,14 @@ retry_private:
 				goto out_unlock;
 			}
 		}
+#ifdef CONFIG_POPCORN
+		/* requeue_pi waiters hold uaddr2 by themselves */
+		if (!requeue_pi && this->lease_uaddr) {
+			process_server_futex_requeue(this->task,
+					this->lease_uaddr, uaddr2);
+			this->lease_uaddr = uaddr2;
+		}
+#endif
 		requeue_futex(this, hb1, hb2, &key2);
 		drop_count++;
 	}
@@ -1986,6 +2002,9 @@ out_put_keys:
 out_put_key1:
 	put_futex_key(&key1);
 out:
+#ifdef CONFIG_POPCORN
+	process_server_futex_release(uaddr2);
+#endif
 	return ret ? ret : task_count;
 }
 
@@ -2428,6 +2447,10 @@ static int futex_wait(u32 __user *uaddr, unsigned int flags, u32 val,
 	if (!bitset)
 		return -EINVAL;
 	q.bitset = bitset;
+#ifdef CONFIG_POPCORN
+	if (process_server_futex_hold(uaddr))
+		q.lease_uaddr = uaddr;
+#endif
 
 	if (abs_time) {
 		to = &timeout;
@@ -2495,6 +2518,11 @@ out:
 		hrtimer_cancel(&to->timer);
 		destroy_hrtimer_on_stack(&to->timer);
 	}
+#ifdef CONFIG_POPCORN
+	/* Might have been requeued onto another word */
+	if (q.lease_uaddr)
+		process_server_futex_release(q.lease_uaddr);
+#endif
 	return ret;
 }
 
@@ -2848,6 +2876,10 @@ static int futex_wait_requeue_pi(u32 __user *uaddr, unsigned int flags,
 
 	if (!bitset)
 		return -EINVAL;
+#ifdef CONFIG_POPCORN
+	process_server_futex_hold(uaddr);
+	process_server_futex_hold(uaddr2);
+#endif
 
 	if (abs_time) {
 		to = &timeout;
@@ -2989,6 +3021,10 @@ out:
 		hrtimer_cancel(&to->timer);
 		destroy_hrtimer_on_stack(&to->timer);
 	}
+#ifdef CONFIG_POPCORN
+	process_server_futex_release(uaddr2);
+	process_server_futex_release(uaddr);
+#endif
 	return ret;
 }
 
@@ -20,24 +20,143 @@
 #include <linux/delay.h>
 #include <linux/random.h>
 #include <linux/radix-tree.h>
+#include <linux/module.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 
 #include <asm/tlbflush.h>
+#include <asm/pgalloc.h>
 #include <asm/cacheflush.h>
 #include <asm/mmu_context.h>
 
 #include <popcorn/types.h>
 #include <popcorn/bundle.h>
 #include <popcorn/pcn_kmsg.h>
+#include <popcorn/stat.h>
 
 #include "types.h"
 #include "pgtable.h"
 #include "wait_station.h"
 #include "page_server.h"
+#include "vma_server.h"
 #include "fh_action.h"
 
 #include "trace_events.h"
 
-inline void page_server_start_mm_fault(unsigned long address)
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+static void __heat_up(struct fault_heat_map *map, unsigned long key)
+{
+	unsigned long flags;
+	int index = hash_long(key, ilog2(FAULT_HEAT_SLOTS));
+	int i, victim = -1;
+
+	spin_lock_irqsave(&map->lock, flags);
+	for (i = 0; i < FAULT_HEAT_PROBES; i++) {
+		int j = (index + i) % FAULT_HEAT_SLOTS;
+		if (map->slots[j].count && map->slots[j].key == key) {
+			map->slots[j].count++;
+			goto out;
+		}
+		if (victim < 0 || map->slots[j].count < map->slots[victim].count)
+			victim = j;
+	}
+	map->slots[victim].key = key;
+	map->slots[victim].count = 1;
+out:
+	spin_unlock_irqrestore(&map->lock, flags);
+}
+
+static void __account_fault(struct task_struct *tsk, s64 ns)
+{
+	struct remote_context *rc = tsk->mm->remote;
+	unsigned int type = tsk->fault_type;
+	int bucket = 0;
+
+	if (tsk->fault_retry) type |= FAULT_TYPE_RETRY;
+	if (ns > 0) bucket = min(ilog2(ns) + 1, FAULT_HIST_BUCKETS - 1);
+	if (rc->fault_hist) this_cpu_inc(rc->fault_hist->counts[type][bucket]);
+
+	if (!(type & FAULT_TYPE_REMOTE)) return;
+	__heat_up(&rc->fault_vmas, tsk->fault_vm_start);
+	__heat_up(&rc->fault_ips, instruction_pointer(current_pt_regs()));
+}
+
+static void __show_fault_heat(struct seq_file *seq, struct fault_heat_map *map, const char *name)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&map->lock, flags);
+	for (i = 0; i < FAULT_HEAT_SLOTS; i++) {
+		if (!map->slots[i].count) continue;
+		seq_printf(seq, "  %-4s %016lx %10lu\n", name,
+				map->slots[i].key, map->slots[i].count);
+	}
+	spin_unlock_irqrestore(&map->lock, flags);
+}
+
+void page_server_fault_stat(struct seq_file *seq, struct remote_context *rc)
+{
+	static const char *types[FAULT_TYPES] = {
+		"lr", "lw", "rr", "rw", "lr+", "lw+", "rr+", "rw+",
+	};
+	int type, bucket, cpu;
+
+	seq_printf(seq, "[%d] %s\n", rc->tgid, rc->for_remote ? "remote" : "origin");
+	if (rc->fault_hist) {
+		seq_printf(seq, "  %-8s", "<ns");
+		for (type = 0; type < FAULT_TYPES; type++) {
+			seq_printf(seq, " %8s", types[type]);
+		}
+		seq_printf(seq, "\n");
+
+		for (bucket = 0; bucket < FAULT_HIST_BUCKETS; bucket++) {
+			unsigned long counts[FAULT_TYPES] = { 0 };
+			bool empty = true;
+
+			for (type = 0; type < FAULT_TYPES; type++) {
+				for_each_possible_cpu(cpu) {
+					counts[type] += per_cpu_ptr(rc->fault_hist, cpu)
+							->counts[type][bucket];
+				}
+				if (counts[type]) empty = false;
+			}
+			if (empty) continue;
+
+			seq_printf(seq, "  %-8llu", 1ULL << bucket);
+			for (type = 0; type < FAULT_TYPES; type++) {
+				seq_printf(seq, " %8lu", counts[type]);
+			}
+			seq_printf(seq, "\n");
+		}
+	}
+	__show_fault_heat(seq, &rc->fault_vmas, "vma");
+	__show_fault_heat(seq, &rc->fault_ips, "ip");
+}
+
+void page_server_init_fault_stat(struct remote_context *rc)
+{
+	rc->fault_hist = alloc_percpu(struct fault_hist);
+	spin_lock_init(&rc->fault_vmas.lock);
+	memset(rc->fault_vmas.slots, 0x00, sizeof(rc->fault_vmas.slots));
+	spin_lock_init(&rc->fault_ips.lock);
+	memset(rc->fault_ips.slots, 0x00, sizeof(rc->fault_ips.slots));
+}
+
+void page_server_free_fault_stat(struct remote_context *rc)
+{
+	free_percpu(rc->fault_hist);
+}
+#endif
+
+static inline void __fault_went_remote(struct task_struct *tsk)
+{
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+	if (tsk == current) tsk->fault_type |= FAULT_TYPE_REMOTE;
+#endif
+}
+
+inline void page_server_start_mm_fault(struct vm_area_struct *vma, unsigned long address, unsigned int flags)
 {
 #ifdef CONFIG_POPCORN_STAT_PGFAULTS
 	if (!distributed_process(current)) return;
@@ -46,7 +165,9 @@ inline void page_server_start_mm_fault(unsigned long address)
 		current->fault_address = address;
 		current->fault_retry = 0;
 		current->fault_start = ktime_get();
-		current->fault_address = address;
+		current->fault_vm_start = vma->vm_start;
+		current->fault_type =
+				(flags & FAULT_FLAG_WRITE) ? FAULT_TYPE_WRITE : 0;
 	}
 #endif
 }
@@ -65,201 +186,233 @@ inline int page_server_end_mm_fault(int ret)
 		trace_pgfault_stat(instruction_pointer(current_pt_regs()),
 				current->fault_address, ret,
 				current->fault_retry, ktime_to_ns(dt));
+		__account_fault(current, ktime_to_ns(dt));
 		current->fault_address = 0;
 	}
 #endif
 	return ret;
 }
 
-static inline int __fault_hash_key(unsigned long address)
+static inline struct fault_bucket *__fault_bucket(struct remote_context *rc, unsigned long addr)
 {
-	return (address >> PAGE_SHIFT) % FAULTS_HASH;
+	return rc->faults + ((addr >> PAGE_SHIFT) & (rc->nr_fault_buckets - 1));
 }
 
 /**************************************************************************
  * Page ownership tracking mechanism
+ *
+ * Ownership is kept in small regions indexed by the radix tree, so a sparse
+ * address space pays for the regions it touches only. Regions come from
+ * their own slab, sized exactly, and are accessed without kmap. They live
+ * until the remote context goes away, so each CPU caches the last region it
+ * looked up; faults nearby the previous one get the info without walking the
+ * tree or sharing a cacheline with the other CPUs.
  */
-#define PER_PAGE_INFO_SIZE \
-		(sizeof(unsigned long) * BITS_TO_LONGS(MAX_POPCORN_NODES))
-#define PAGE_INFO_PER_REGION (PAGE_SIZE / PER_PAGE_INFO_SIZE)
+#define PER_PAGE_INFO_LONGS BITS_TO_LONGS(MAX_POPCORN_NODES)
+#define PAGE_INFO_PER_REGION 64
+
+struct page_info_region {
+	struct remote_context *rc;
+	unsigned long key;
+	unsigned long info[PAGE_INFO_PER_REGION * PER_PAGE_INFO_LONGS];
+};
+
+static struct kmem_cache *__page_info_cache = NULL;
+static DEFINE_PER_CPU(struct page_info_region *, __page_info_hint) = NULL;
+
+#ifdef CONFIG_POPCORN_STAT
+/* Hits and misses are counted on every fault, so keep them per CPU */
+static DEFINE_PER_CPU(unsigned long, __page_info_hits) = 0;
+static DEFINE_PER_CPU(unsigned long, __page_info_misses) = 0;
+static atomic_long_t __page_info_regions = ATOMIC_LONG_INIT(0);
+#define PI_STAT_INC(x) atomic_long_inc(&(x))
+#define PI_STAT_DEC(x) atomic_long_dec(&(x))
+#define PI_STAT_INC_CPU(x) this_cpu_inc(x)
+#else
+#define PI_STAT_INC(x)
+#define PI_STAT_DEC(x)
+#define PI_STAT_INC_CPU(x)
+#endif
 
 static inline void __get_page_info_key(unsigned long addr, unsigned long *key, unsigned long *offset)
 {
 	unsigned long paddr = addr >> PAGE_SHIFT;
 	*key = paddr / PAGE_INFO_PER_REGION;
-	*offset = (paddr % PAGE_INFO_PER_REGION) *
-			(PER_PAGE_INFO_SIZE / sizeof(unsigned long));
+	*offset = (paddr % PAGE_INFO_PER_REGION) * PER_PAGE_INFO_LONGS;
 }
 
-static inline struct page *__get_page_info_page(struct mm_struct *mm, unsigned long addr, unsigned long *offset)
+static inline struct page_info_region *__find_page_info_region(struct remote_context *rc, unsigned long key)
 {
-	unsigned long key;
-	struct page *page;
-	struct remote_context *rc = mm->remote;
-	__get_page_info_key(addr, &key, offset);
+	struct page_info_region *region = this_cpu_read(__page_info_hint);
 
-	page = radix_tree_lookup(&rc->pages, key);
-	if (!page) return NULL;
+	if (region && region->rc == rc && region->key == key) {
+		PI_STAT_INC_CPU(__page_info_hits);
+		return region;
+	}
+	PI_STAT_INC_CPU(__page_info_misses);
 
-	return page;
+	region = radix_tree_lookup(&rc->pages, key);
+	if (region) this_cpu_write(__page_info_hint, region);
+	return region;
 }
 
-static inline unsigned long *__get_page_info_mapped(struct mm_struct *mm, unsigned long addr, unsigned long *offset)
+static inline unsigned long *__get_page_info(struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long key;
-	struct page *page;
-	struct remote_context *rc = mm->remote;
-	__get_page_info_key(addr, &key, offset);
+	unsigned long key, offset;
+	struct page_info_region *region;
+	__get_page_info_key(addr, &key, &offset);
 
-	page = radix_tree_lookup(&rc->pages, key);
-	if (!page) return NULL;
+	region = __find_page_info_region(mm->remote, key);
+	if (!region) return NULL;
 
-	return (unsigned long *)kmap_atomic(page) + *offset;
+	return region->info + offset;
 }
 
 void free_remote_context_pages(struct remote_context *rc)
 {
-	int nr_pages;
+	int nr_regions;
 	const int FREE_BATCH = 16;
-	struct page *pages[FREE_BATCH];
+	struct page_info_region *regions[FREE_BATCH];
+	int cpu;
+
+	/* Drop the hints into this context before its regions go away */
+	for_each_possible_cpu(cpu) {
+		struct page_info_region **hint = per_cpu_ptr(&__page_info_hint, cpu);
+		struct page_info_region *region = READ_ONCE(*hint);
+
+		if (region && region->rc == rc) cmpxchg(hint, region, NULL);
+	}
 
 	do {
 		int i;
-		nr_pages = radix_tree_gang_lookup(&rc->pages,
-				(void **)pages, 0, FREE_BATCH);
-
-		for (i = 0; i < nr_pages; i++) {
-			struct page *page = pages[i];
-			radix_tree_delete(&rc->pages, page_private(page));
-			__free_page(page);
+		nr_regions = radix_tree_gang_lookup(&rc->pages,
+				(void **)regions, 0, FREE_BATCH);
+
+		for (i = 0; i < nr_regions; i++) {
+			struct page_info_region *region = regions[i];
+			radix_tree_delete(&rc->pages, region->key);
+			kmem_cache_free(__page_info_cache, region);
+			PI_STAT_DEC(__page_info_regions);
 		}
-	} while (nr_pages == FREE_BATCH);
+	} while (nr_regions == FREE_BATCH);
 }
 
 #define PI_FLAG_COWED 62
 #define PI_FLAG_DISTRIBUTED 63
 
-static struct page *__lookup_page_info_page(struct remote_context *rc, unsigned long key)
+static unsigned long *__lookup_page_info(struct mm_struct *mm, unsigned long addr)
 {
-	struct page *page = radix_tree_lookup(&rc->pages, key);
-	if (!page) {
+	unsigned long key, offset;
+	struct remote_context *rc = mm->remote;
+	struct page_info_region *region;
+	__get_page_info_key(addr, &key, &offset);
+
+	region = __find_page_info_region(rc, key);
+	if (!region) {
 		int ret;
-		page = alloc_page(GFP_ATOMIC | __GFP_ZERO);
-		BUG_ON(!page);
-		set_page_private(page, key);
+		region = kmem_cache_zalloc(__page_info_cache, GFP_ATOMIC);
+		BUG_ON(!region);
+		region->rc = rc;
+		region->key = key;
 
-		ret = radix_tree_insert(&rc->pages, key, page);
+		ret = radix_tree_insert(&rc->pages, key, region);
 		BUG_ON(ret);
+		PI_STAT_INC(__page_info_regions);
 	}
-	return page;
+	return region->info + offset;
 }
 
 static inline void SetPageDistributed(struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long key, offset;
-	unsigned long *region;
-	struct page *page;
-	struct remote_context *rc = mm->remote;
-	__get_page_info_key(addr, &key, &offset);
-
-	page = __lookup_page_info_page(rc, key);
-	region = kmap_atomic(page);
-	set_bit(PI_FLAG_DISTRIBUTED, region + offset);
-	kunmap_atomic(region);
+	set_bit(PI_FLAG_DISTRIBUTED, __lookup_page_info(mm, addr));
 }
 
 static inline void SetPageCowed(struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long key, offset;
-	unsigned long *region;
-	struct page *page;
-	struct remote_context *rc = mm->remote;
-	__get_page_info_key(addr, &key, &offset);
-
-	page = __lookup_page_info_page(rc, key);
-	region = kmap_atomic(page);
-	set_bit(PI_FLAG_COWED, region + offset);
-	kunmap_atomic(region);
+	set_bit(PI_FLAG_COWED, __lookup_page_info(mm, addr));
 }
 
 static inline void ClearPageInfo(struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long offset;
-	unsigned long *pi = __get_page_info_mapped(mm, addr, &offset);
+	unsigned long *pi = __get_page_info(mm, addr);
 
 	if (!pi) return;
 	clear_bit(PI_FLAG_DISTRIBUTED, pi);
 	clear_bit(PI_FLAG_COWED, pi);
 	bitmap_clear(pi, 0, MAX_POPCORN_NODES);
-	kunmap_atomic(pi - offset);
 }
 
 static inline bool PageDistributed(struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long offset;
-	unsigned long *pi = __get_page_info_mapped(mm, addr, &offset);
-	bool ret;
+	unsigned long *pi = __get_page_info(mm, addr);
 
 	if (!pi) return false;
-	ret = test_bit(PI_FLAG_DISTRIBUTED, pi);
-	kunmap_atomic(pi - offset);
-	return ret;
+	return test_bit(PI_FLAG_DISTRIBUTED, pi);
 }
 
 static inline bool PageCowed(struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long offset;
-	unsigned long *pi = __get_page_info_mapped(mm, addr, &offset);
-	bool ret;
+	unsigned long *pi = __get_page_info(mm, addr);
 
 	if (!pi) return false;
-	ret = test_bit(PI_FLAG_COWED, pi);
-	kunmap_atomic(pi - offset);
-	return ret;
+	return test_bit(PI_FLAG_COWED, pi);
 }
 
 static inline bool page_is_mine(struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long offset;
-	unsigned long *pi = __get_page_info_mapped(mm, addr, &offset);
-	bool ret = true;
+	unsigned long *pi = __get_page_info(mm, addr);
 
-	if (!pi) return true;
-	if (!test_bit(PI_FLAG_DISTRIBUTED, pi)) goto out;
-	ret = test_bit(my_nid, pi);
-out:
-	kunmap_atomic(pi - offset);
-	return ret;
+	if (!pi || !test_bit(PI_FLAG_DISTRIBUTED, pi)) return true;
+	return test_bit(my_nid, pi);
 }
 
 static inline bool test_page_owner(int nid, struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long offset;
-	unsigned long *pi = __get_page_info_mapped(mm, addr, &offset);
-	bool ret;
+	unsigned long *pi = __get_page_info(mm, addr);
 
 	if (!pi) return false;
-	ret = test_bit(nid, pi);
-	kunmap_atomic(pi - offset);
-	return ret;
+	return test_bit(nid, pi);
 }
 
 static inline void set_page_owner(int nid, struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long offset;
-	unsigned long *pi = __get_page_info_mapped(mm, addr, &offset);
+	unsigned long *pi = __get_page_info(mm, addr);
 	set_bit(nid, pi);
-	kunmap_atomic(pi - offset);
 }
 
 static inline void clear_page_owner(int nid, struct mm_struct *mm, unsigned long addr)
 {
-	unsigned long offset;
-	unsigned long *pi = __get_page_info_mapped(mm, addr, &offset);
+	unsigned long *pi = __get_page_info(mm, addr);
 	if (!pi) return;
 
 	clear_bit(nid, pi);
-	kunmap_atomic(pi - offset);
+}
+
+void page_info_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	int i;
+
+	if (seq) {
+		unsigned long long hits = 0, misses = 0;
+
+		for_each_possible_cpu(i) {
+			hits += per_cpu(__page_info_hits, i);
+			misses += per_cpu(__page_info_misses, i);
+		}
+		seq_printf(seq, POPCORN_STAT_FMT, hits, misses,
+				"page info region hits, misses");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__page_info_regions),
+				(unsigned long long)sizeof(struct page_info_region),
+				"page info regions, bytes per region");
+	} else {
+		for_each_possible_cpu(i) {
+			per_cpu(__page_info_hits, i) = 0;
+			per_cpu(__page_info_misses, i) = 0;
+		}
+	}
+#endif
 }
 
 
@@ -272,8 +425,63 @@ enum {
 	FAULT_HANDLE_REMOTE = 0x04,
 };
 
+/**
+ * Faults in flight are looked up in per-context buckets. Consecutive pages
+ * fall into different buckets, and the number of buckets scales with the
+ * number of CPUs. Handles are recycled through small per-CPU caches ahead
+ * of the slab. The slab is type-safe by RCU so that __fault_in_progress()
+ * can walk a bucket without the lock; a handle found there might be
+ * recycled already, which is fine for a hint.
+ */
 static struct kmem_cache *__fault_handle_cache = NULL;
 
+#define FH_CACHE_SIZE 16
+
+#ifdef CONFIG_POPCORN_STAT
+/* Updated on every bucket lock, so kept per CPU and summed up on read */
+struct fault_lock_stat {
+	unsigned long acquired;
+	unsigned long contended;
+	u64 held_ns;
+	u64 held_max;
+	unsigned long lookups;
+	unsigned long collisions;
+};
+static DEFINE_PER_CPU(struct fault_lock_stat, __fault_lock_stats);
+#define FH_STAT_INC(x) this_cpu_inc(__fault_lock_stats.x)
+#else
+#define FH_STAT_INC(x)
+#endif
+
+static unsigned long __lock_fault_bucket(struct fault_bucket *fb)
+{
+	unsigned long flags;
+
+	if (!spin_trylock_irqsave(&fb->lock, flags)) {
+		FH_STAT_INC(contended);
+		spin_lock_irqsave(&fb->lock, flags);
+	}
+#ifdef CONFIG_POPCORN_STAT
+	fb->locked_at = local_clock();
+#endif
+	return flags;
+}
+
+static void __unlock_fault_bucket(struct fault_bucket *fb, unsigned long flags)
+{
+#ifdef CONFIG_POPCORN_STAT
+	u64 held = local_clock() - fb->locked_at;
+
+	/* IRQs are still off with the bucket locked */
+	__this_cpu_inc(__fault_lock_stats.acquired);
+	__this_cpu_add(__fault_lock_stats.held_ns, held);
+	if (held > __this_cpu_read(__fault_lock_stats.held_max)) {
+		__this_cpu_write(__fault_lock_stats.held_max, held);
+	}
+#endif
+	spin_unlock_irqrestore(&fb->lock, flags);
+}
+
 struct fault_handle {
 	struct hlist_node list;
 
@@ -293,11 +501,53 @@ struct fault_handle {
 	struct completion *complete;
 };
 
+struct fault_handle_cache {
+	unsigned int nr;
+	struct fault_handle *fhs[FH_CACHE_SIZE];
+};
+static DEFINE_PER_CPU(struct fault_handle_cache, fault_handle_caches);
+
+static void __free_fault_handle(struct fault_handle *fh)
+{
+	struct fault_handle_cache *fc;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	fc = this_cpu_ptr(&fault_handle_caches);
+	if (fc->nr < FH_CACHE_SIZE) {
+		fc->fhs[fc->nr++] = fh;
+		fh = NULL;
+	}
+	local_irq_restore(flags);
+
+	if (fh) kmem_cache_free(__fault_handle_cache, fh);
+}
+
+/* Should be called with the bucket locked */
+static struct fault_handle *__find_fault_handle(struct fault_bucket *fb, unsigned long addr)
+{
+	struct fault_handle *fh;
+
+	FH_STAT_INC(lookups);
+	hlist_for_each_entry(fh, &fb->faults, list) {
+		if (fh->addr == addr) return fh;
+		FH_STAT_INC(collisions);
+	}
+	return NULL;
+}
+
 static struct fault_handle *__alloc_fault_handle(struct task_struct *tsk, unsigned long addr)
 {
-	struct fault_handle *fh =
-			kmem_cache_alloc(__fault_handle_cache, GFP_ATOMIC);
-	int fk = __fault_hash_key(addr);
+	struct fault_handle_cache *fc;
+	struct fault_handle *fh = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	fc = this_cpu_ptr(&fault_handle_caches);
+	if (fc->nr) fh = fc->fhs[--fc->nr];
+	local_irq_restore(flags);
+
+	if (!fh) fh = kmem_cache_alloc(__fault_handle_cache, GFP_ATOMIC);
 	BUG_ON(!fh);
 
 	INIT_HLIST_NODE(&fh->list);
@@ -315,7 +565,7 @@ static struct fault_handle *__alloc_fault_handle(struct task_struct *tsk, unsign
 	fh->pid = tsk->pid;
 	fh->complete = NULL;
 
-	hlist_add_head(&fh->list, &fh->rc->faults[fk]);
+	hlist_add_head_rcu(&fh->list, &__fault_bucket(fh->rc, addr)->faults);
 	return fh;
 }
 
@@ -327,22 +577,20 @@ static struct fault_handle *__start_invalidation(struct task_struct *tsk, unsign
 	struct fault_handle *fh;
 	bool found = false;
 	DECLARE_COMPLETION_ONSTACK(complete);
-	int fk = __fault_hash_key(addr);
-
-	spin_lock_irqsave(&rc->faults_lock[fk], flags);
-	hlist_for_each_entry(fh, &rc->faults[fk], list) {
-		if (fh->addr == addr) {
-			PGPRINTK("  [%d] %s %s ongoing, wait\n", tsk->pid,
-				fh->flags & FAULT_HANDLE_REMOTE ? "remote" : "local",
-				fh->flags & FAULT_HANDLE_WRITE ? "write" : "read");
-			BUG_ON(fh->flags & FAULT_HANDLE_INVALIDATE);
-			fh->flags |= FAULT_HANDLE_INVALIDATE;
-			fh->complete = &complete;
-			found = true;
-			break;
-		}
-	}
-	spin_unlock_irqrestore(&rc->faults_lock[fk], flags);
+	struct fault_bucket *fb = __fault_bucket(rc, addr);
+
+	flags = __lock_fault_bucket(fb);
+	fh = __find_fault_handle(fb, addr);
+	if (fh) {
+		PGPRINTK("  [%d] %s %s ongoing, wait\n", tsk->pid,
+			fh->flags & FAULT_HANDLE_REMOTE ? "remote" : "local",
+			fh->flags & FAULT_HANDLE_WRITE ? "write" : "read");
+		BUG_ON(fh->flags & FAULT_HANDLE_INVALIDATE);
+		fh->flags |= FAULT_HANDLE_INVALIDATE;
+		fh->complete = &complete;
+		found = true;
+	}
+	__unlock_fault_bucket(fb, flags);
 	put_task_remote(tsk);
 
 	if (found) {
@@ -361,21 +609,21 @@ static struct fault_handle *__start_invalidation(struct task_struct *tsk, unsign
 static void __finish_invalidation(struct fault_handle *fh)
 {
 	unsigned long flags;
-	int fk;
+	struct fault_bucket *fb;
 
 	if (!fh) return;
-	fk = __fault_hash_key(fh->addr);
+	fb = __fault_bucket(fh->rc, fh->addr);
 
 	BUG_ON(atomic_read(&fh->pendings));
-	spin_lock_irqsave(&fh->rc->faults_lock[fk], flags);
-	hlist_del(&fh->list);
-	spin_unlock_irqrestore(&fh->rc->faults_lock[fk], flags);
+	flags = __lock_fault_bucket(fb);
+	hlist_del_rcu(&fh->list);
+	__unlock_fault_bucket(fb, flags);
 
 	__put_task_remote(fh->rc);
 	if (atomic_read(&fh->pendings_retry)) {
 		wake_up_all(&fh->waits_retry);
 	} else {
-		kmem_cache_free(__fault_handle_cache, fh);
+		__free_fault_handle(fh);
 	}
 }
 
@@ -384,22 +632,15 @@ static struct fault_handle *__start_fault_handling(struct task_struct *tsk, unsi
 {
 	unsigned long flags;
 	struct fault_handle *fh;
-	bool found = false;
 	struct remote_context *rc = get_task_remote(tsk);
 	DEFINE_WAIT(wait);
-	int fk = __fault_hash_key(addr);
+	struct fault_bucket *fb = __fault_bucket(rc, addr);
 
-	spin_lock_irqsave(&rc->faults_lock[fk], flags);
+	flags = __lock_fault_bucket(fb);
 	spin_unlock(ptl);
 
-	hlist_for_each_entry(fh, &rc->faults[fk], list) {
-		if (fh->addr == addr) {
-			found = true;
-			break;
-		}
-	}
-
-	if (found) {
+	fh = __find_fault_handle(fb, addr);
+	if (fh) {
 		unsigned long action =
 				get_fh_action(tsk->at_remote, fh->flags, fault_flags);
 
@@ -426,7 +667,7 @@ static struct fault_handle *__start_fault_handling(struct task_struct *tsk, unsi
 #else
 		prepare_to_wait_exclusive(&fh->waits, &wait, TASK_UNINTERRUPTIBLE);
 #endif
-		spin_unlock_irqrestore(&rc->faults_lock[fk], flags);
+		__unlock_fault_bucket(fb, flags);
 		PGPRINTK(" +[%d] %lx %p\n", tsk->pid, addr, fh);
 		put_task_remote(tsk);
 
@@ -442,7 +683,7 @@ static struct fault_handle *__start_fault_handling(struct task_struct *tsk, unsi
 	fh->flags |= fault_for_write(fault_flags) ? FAULT_HANDLE_WRITE : 0;
 	fh->flags |= (fault_flags & FAULT_FLAG_REMOTE) ? FAULT_HANDLE_REMOTE : 0;
 
-	spin_unlock_irqrestore(&rc->faults_lock[fk], flags);
+	__unlock_fault_bucket(fb, flags);
 	put_task_remote(tsk);
 
 	*leader = true;
@@ -451,19 +692,19 @@ static struct fault_handle *__start_fault_handling(struct task_struct *tsk, unsi
 out_wait_retry:
 	atomic_inc(&fh->pendings_retry);
 	prepare_to_wait(&fh->waits_retry, &wait, TASK_UNINTERRUPTIBLE);
-	spin_unlock_irqrestore(&rc->faults_lock[fk], flags);
+	__unlock_fault_bucket(fb, flags);
 	put_task_remote(tsk);
 
 	PGPRINTK("  [%d] waits %p\n", tsk->pid, fh);
 	io_schedule();
 	finish_wait(&fh->waits_retry, &wait);
 	if (atomic_dec_and_test(&fh->pendings_retry)) {
-		kmem_cache_free(__fault_handle_cache, fh);
+		__free_fault_handle(fh);
 	}
 	return NULL;
 
 out_retry:
-	spin_unlock_irqrestore(&rc->faults_lock[fk], flags);
+	__unlock_fault_bucket(fb, flags);
 	put_task_remote(tsk);
 
 	PGPRINTK("  [%d] locked. retry %p\n", tsk->pid, fh);
@@ -474,9 +715,9 @@ static bool __finish_fault_handling(struct fault_handle *fh)
 {
 	unsigned long flags;
 	bool last = false;
-	int fk = __fault_hash_key(fh->addr);
+	struct fault_bucket *fb = __fault_bucket(fh->rc, fh->addr);
 
-	spin_lock_irqsave(&fh->rc->faults_lock[fk], flags);
+	flags = __lock_fault_bucket(fb);
 	if (atomic_dec_return(&fh->pendings)) {
 		PGPRINTK(" >[%d] %lx %p\n", fh->pid, fh->addr, fh);
 #ifndef CONFIG_POPCORN_DEBUG_PAGE_SERVER
@@ -489,23 +730,152 @@ static bool __finish_fault_handling(struct fault_handle *fh)
 		if (fh->complete) {
 			complete(fh->complete);
 		} else {
-			hlist_del(&fh->list);
+			hlist_del_rcu(&fh->list);
 			last = true;
 		}
 	}
-	spin_unlock_irqrestore(&fh->rc->faults_lock[fk], flags);
+	__unlock_fault_bucket(fb, flags);
 
 	if (last) {
 		__put_task_remote(fh->rc);
 		if (atomic_read(&fh->pendings_retry)) {
 			wake_up_all(&fh->waits_retry);
 		} else {
-			kmem_cache_free(__fault_handle_cache, fh);
+			__free_fault_handle(fh);
 		}
 	}
 	return last;
 }
 
+/**
+ * Start handling the fault at @addr only when no one is handling it.
+ * Should be called with the PTE lock held, and the lock is kept held.
+ */
+static struct fault_handle *__try_start_fault_handling(struct task_struct *tsk, unsigned long addr, unsigned long fault_flags)
+{
+	unsigned long flags;
+	struct fault_handle *fh;
+	struct remote_context *rc = get_task_remote(tsk);
+	struct fault_bucket *fb = __fault_bucket(rc, addr);
+
+	flags = __lock_fault_bucket(fb);
+	if (__find_fault_handle(fb, addr)) {
+		fh = NULL;
+		goto out;
+	}
+	fh = __alloc_fault_handle(tsk, addr);
+	fh->flags |= fault_for_write(fault_flags) ? FAULT_HANDLE_WRITE : 0;
+
+out:
+	__unlock_fault_bucket(fb, flags);
+	put_task_remote(tsk);
+	return fh;
+}
+
+/* Lockless, so the answer is a hint */
+static bool __fault_in_progress(struct remote_context *rc, unsigned long addr)
+{
+	struct fault_handle *fh;
+	bool found = false;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(fh, &__fault_bucket(rc, addr)->faults, list) {
+		if (READ_ONCE(fh->addr) == addr) {
+			found = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return found;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/**
+ * Wait for the fault on the 2MB region covering @addr to be done. A fault
+ * handle at the beginning of an unpopulated region is always for the region.
+ * Return true if there was one.
+ */
+static bool __wait_huge_fault(struct task_struct *tsk, unsigned long addr)
+{
+	unsigned long flags;
+	unsigned long haddr = addr & HPAGE_PMD_MASK;
+	struct remote_context *rc = get_task_remote(tsk);
+	struct fault_handle *fh;
+	bool found = false;
+	DEFINE_WAIT(wait);
+	struct fault_bucket *fb = __fault_bucket(rc, haddr);
+
+	flags = __lock_fault_bucket(fb);
+	fh = __find_fault_handle(fb, haddr);
+	if (fh) {
+		found = true;
+		atomic_inc(&fh->pendings);
+#ifndef CONFIG_POPCORN_DEBUG_PAGE_SERVER
+		prepare_to_wait(&fh->waits, &wait, TASK_UNINTERRUPTIBLE);
+#else
+		prepare_to_wait_exclusive(&fh->waits, &wait, TASK_UNINTERRUPTIBLE);
+#endif
+	}
+	__unlock_fault_bucket(fb, flags);
+	put_task_remote(tsk);
+
+	if (!found) return false;
+
+	PGPRINTK(" +[%d] %lx huge %p\n", tsk->pid, haddr, fh);
+	io_schedule();
+	finish_wait(&fh->waits, &wait);
+
+	__finish_fault_handling(fh);
+	return true;
+}
+#else
+static inline bool __wait_huge_fault(struct task_struct *tsk, unsigned long addr)
+{
+	return false;
+}
+#endif
+
+void fault_handle_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	int i;
+
+	if (seq) {
+		struct fault_lock_stat sum = { 0 };
+
+		for_each_possible_cpu(i) {
+			struct fault_lock_stat *st = per_cpu_ptr(&__fault_lock_stats, i);
+
+			sum.acquired += st->acquired;
+			sum.contended += st->contended;
+			sum.held_ns += st->held_ns;
+			sum.held_max = max(sum.held_max, st->held_max);
+			sum.lookups += st->lookups;
+			sum.collisions += st->collisions;
+		}
+
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)sum.acquired,
+				(unsigned long long)sum.contended,
+				"fault bucket locks, contended");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)(sum.acquired ?
+					div64_u64(sum.held_ns, sum.acquired) : 0),
+				(unsigned long long)sum.held_max,
+				"fault bucket lock held ns avg, max");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)sum.lookups,
+				(unsigned long long)sum.collisions,
+				"fault lookups, collisions");
+	} else {
+		for_each_possible_cpu(i) {
+			memset(per_cpu_ptr(&__fault_lock_stats, i), 0x00,
+					sizeof(struct fault_lock_stat));
+		}
+	}
+#endif
+}
+
 
 /**************************************************************************
  * Helper functions for PTE following
@@ -525,6 +895,9 @@ static pte_t *__get_pte_at(struct mm_struct *mm, unsigned long addr, pmd_t **ppm
 	pmd = pmd_offset(pud, addr);
 	if (!pmd || pmd_none(*pmd)) return NULL;
 
+	/* Pages are tracked at the PTE level; break up the huge page on the way */
+	if (pmd_trans_huge(*pmd)) split_huge_page_pmd_mm(mm, addr, pmd);
+
 	*ppmd = pmd;
 	*ptlp = pte_lockptr(mm, pmd);
 
@@ -547,6 +920,7 @@ static pte_t *__get_pte_at_alloc(struct mm_struct *mm, struct vm_area_struct *vm
 	pmd = pmd_alloc(mm, pud, addr);
 	if (!pmd) return NULL;
 
+	split_huge_page_pmd(vma, addr, pmd);
 	pte = pte_alloc_map(mm, vma, pmd, addr);
 
 	*ppmd = pmd;
@@ -596,14 +970,10 @@ void page_server_panic(bool condition, struct mm_struct *mm, unsigned long addre
 {
 	unsigned long *pi;
 	unsigned long pi_val = -1;
-	unsigned long offset;
 	if (!condition) return;
 
-	pi = __get_page_info_mapped(mm, address, &offset);
-	if (pi) {
-		pi_val = *pi;
-		kunmap_atomic(pi - offset);
-	}
+	pi = __get_page_info(mm, address);
+	if (pi) pi_val = *pi;
 
 	printk(KERN_ERR "------------------ Start panicking -----------------\n");
 	printk(KERN_ERR "%s: %lx %p %lx %p %lx\n", __func__,
@@ -651,13 +1021,13 @@ static void process_remote_page_flush(struct work_struct *work)
 
 	if (req->flags & FLUSH_FLAG_START) {
 		res.flags = FLUSH_FLAG_START;
-		pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH_ACK,
-				req->remote_nid, &res, sizeof(res));
+		pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH_ACK,
+				PCN_KMSG_PRIO_LOW, req->remote_nid, &res, sizeof(res));
 		goto out_put;
 	} else if (req->flags & FLUSH_FLAG_LAST) {
 		res.flags = FLUSH_FLAG_LAST;
-		pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH_ACK,
-				req->remote_nid, &res, sizeof(res));
+		pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH_ACK,
+				PCN_KMSG_PRIO_LOW, req->remote_nid, &res, sizeof(res));
 		goto out_put;
 	}
 
@@ -736,7 +1106,8 @@ static int __do_pte_flush(pte_t *pte, unsigned long addr, unsigned long next, st
 		}
 		clear_page_owner(my_nid, vma->vm_mm, addr);
 
-		pcn_kmsg_send(req_type, current->origin_nid, req, req_size);
+		pcn_kmsg_send_prio(req_type, PCN_KMSG_PRIO_LOW,
+				current->origin_nid, req, req_size);
 	} else {
 		*pte = pte_make_valid(*pte);
 		type = '-';
@@ -769,211 +1140,1090 @@ int page_server_flush_remote_pages(struct remote_context *rc)
 	req->origin_pid = current->origin_pid;
 	req->addr = 0;
 
-	/* Notify the start synchronously */
-	req->flags = FLUSH_FLAG_START;
-	pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PAGE_RELEASE,
-			current->origin_nid, req, sizeof(*req));
-	wait_at_station(ws);
+	/* Notify the start synchronously */
+	req->flags = FLUSH_FLAG_START;
+	pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PAGE_RELEASE, PCN_KMSG_PRIO_LOW,
+			current->origin_nid, req, sizeof(*req));
+	wait_at_station(ws);
+
+	/* Send pages asynchronously */
+	ws = get_wait_station(current);
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		walk.vma = vma;
+		walk_page_vma(vma, &walk);
+	}
+	up_read(&mm->mmap_sem);
+
+	/* Notify the completion synchronously */
+	req->flags = FLUSH_FLAG_LAST;
+	pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH, PCN_KMSG_PRIO_LOW,
+			current->origin_nid, req, sizeof(*req));
+	wait_at_station(ws);
+
+	kfree(req);
+
+	// XXX: make sure there is no backlog.
+	msleep(1000);
+
+	return 0;
+}
+
+static int handle_remote_page_flush_ack(struct pcn_kmsg_message *msg)
+{
+	remote_page_flush_ack_t *req = (remote_page_flush_ack_t *)msg;
+
+	wait_station_notify(req->remote_ws, NULL);
+
+	pcn_kmsg_done(req);
+	return 0;
+}
+
+
+/**************************************************************************
+ * Page invalidation protocol
+ *
+ * Revocations to a node are queued to the per-node batch. A batch is sent
+ * right away when nothing is in flight to the node, so a lone revocation
+ * does not wait for company. Otherwise, revocations pile up until the
+ * in-flight batch is acknowledged, and go out together in the next vector.
+ *
+ * The peer might not acknowledge a batch for a while; an entry can wait for
+ * a fault at the peer, which in turn waits for us. So a held batch is sent
+ * out anyway after invalidate_hold_usecs, leaving several batches in flight,
+ * and revocations never depend on the completion of other revocations.
+ * The hold is timed with an hrtimer since a jiffy is far longer than the
+ * usual hold; the timer kicks the flush work that posts the batch.
+ */
+struct invalidate_batch {
+	spinlock_t lock;
+	int nid;
+	int in_flight;
+	bool timer_armed;
+	page_invalidate_request_t *pending;
+	struct hrtimer timer;
+	struct work_struct flush;
+};
+
+static struct invalidate_batch __invalidate_batches[MAX_POPCORN_NODES];
+
+static unsigned int invalidate_hold_usecs = 100;
+module_param(invalidate_hold_usecs, uint, 0644);
+MODULE_PARM_DESC(invalidate_hold_usecs, "Max time to hold invalidations behind in-flight ones in usec");
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic_long_t __invalidate_batches_sent = ATOMIC_LONG_INIT(0);
+static atomic_long_t __invalidate_entries_sent = ATOMIC_LONG_INIT(0);
+static atomic_long_t __invalidate_batches_flushed = ATOMIC_LONG_INIT(0);
+#endif
+
+static inline size_t __invalidate_request_size(int nr)
+{
+	return sizeof(page_invalidate_request_t) -
+		(MAX_INVALIDATE_BATCH - nr) * sizeof(struct page_invalidate_entry);
+}
+
+static void __post_invalidate_batch(int nid, page_invalidate_request_t *req)
+{
+#ifdef CONFIG_POPCORN_STAT
+	atomic_long_inc(&__invalidate_batches_sent);
+	atomic_long_add(req->nr, &__invalidate_entries_sent);
+#endif
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_PAGE_INVALIDATE_REQUEST,
+			PCN_KMSG_PRIO_HIGH, nid, req, __invalidate_request_size(req->nr));
+}
+
+/* Should be called with the batch lock held */
+static page_invalidate_request_t *__detach_invalidate_batch(struct invalidate_batch *ib, bool force)
+{
+	page_invalidate_request_t *req = ib->pending;
+
+	if (!req || !req->nr) return NULL;
+	if (!force && ib->in_flight && req->nr < MAX_INVALIDATE_BATCH) return NULL;
+
+	ib->pending = NULL;
+	ib->in_flight++;
+	return req;
+}
+
+/* Send out the batch held too long behind the in-flight ones */
+static void __flush_invalidate_batch(struct work_struct *work)
+{
+	struct invalidate_batch *ib =
+			container_of(work, struct invalidate_batch, flush);
+	page_invalidate_request_t *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ib->lock, flags);
+	req = __detach_invalidate_batch(ib, true);
+	spin_unlock_irqrestore(&ib->lock, flags);
+
+	if (req) {
+#ifdef CONFIG_POPCORN_STAT
+		atomic_long_inc(&__invalidate_batches_flushed);
+#endif
+		__post_invalidate_batch(ib->nid, req);
+	}
+}
+
+static enum hrtimer_restart __invalidate_batch_timeout(struct hrtimer *timer)
+{
+	struct invalidate_batch *ib =
+			container_of(timer, struct invalidate_batch, timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ib->lock, flags);
+	ib->timer_armed = false;
+	spin_unlock_irqrestore(&ib->lock, flags);
+
+	schedule_work(&ib->flush);
+	return HRTIMER_NORESTART;
+}
+
+static void __do_invalidate_page(struct task_struct *tsk, unsigned long addr)
+{
+	struct mm_struct *mm = get_task_mm(tsk);
+	struct vm_area_struct *vma;
+	pmd_t *pmd;
+	pte_t *pte, entry;
+	spinlock_t *ptl;
+	int ret = 0;
+	struct fault_handle *fh;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, addr);
+	if (!vma || vma->vm_start > addr) {
+		ret = VM_FAULT_SIGBUS;
+		goto out;
+	}
+
+	PGPRINTK("\nINVALIDATE_PAGE [%d] %lx\n", tsk->pid, addr);
+
+	pte = __get_pte_at(mm, addr, &pmd, &ptl);
+	if (!pte) {
+		/* The page might be on the way in a huge page */
+		if (!__wait_huge_fault(tsk, addr)) goto out;
+		pte = __get_pte_at(mm, addr, &pmd, &ptl);
+		if (!pte) goto out;
+	}
+
+	spin_lock(ptl);
+	fh = __start_invalidation(tsk, addr, ptl);
+
+	clear_page_owner(my_nid, mm, addr);
+
+	BUG_ON(!pte_present(*pte));
+	entry = ptep_clear_flush(vma, addr, pte);
+	entry = pte_make_invalid(entry);
+
+	set_pte_at_notify(mm, addr, pte, entry);
+	update_mmu_cache(vma, addr, pte);
+
+	__finish_invalidation(fh);
+	pte_unmap_unlock(pte, ptl);
+
+out:
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+}
+
+static void process_page_invalidate_request(struct work_struct *work)
+{
+	START_KMSG_WORK(page_invalidate_request_t, req, work);
+	page_invalidate_response_t *res;
+	struct task_struct *tsk = NULL;
+	int i;
+
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+	BUG_ON(req->nr <= 0 || req->nr > MAX_INVALIDATE_BATCH);
+#endif
+	res = pcn_kmsg_get(sizeof(*res));
+	res->nr = req->nr;
+
+	for (i = 0; i < req->nr; i++) {
+		struct page_invalidate_entry *e = req->entries + i;
+
+		res->origin_ws[i] = e->origin_ws;
+
+		/* Only home issues invalidate requests. Hence, I am a remote */
+		if (!tsk || tsk->pid != e->remote_pid) {
+			if (tsk) put_task_struct(tsk);
+			tsk = __get_task_struct(e->remote_pid);
+		}
+		if (!tsk) {
+			PGPRINTK("%s: no such process %d %d %lx\n", __func__,
+					e->origin_pid, e->remote_pid, e->addr);
+			continue;
+		}
+		__do_invalidate_page(tsk, e->addr);
+	}
+	if (tsk) put_task_struct(tsk);
+
+	PGPRINTK(">>[%d] ->[%d] %d invalidated\n", current->pid,
+			PCN_KMSG_FROM_NID(req), req->nr);
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_PAGE_INVALIDATE_RESPONSE,
+			PCN_KMSG_PRIO_HIGH, PCN_KMSG_FROM_NID(req), res,
+			sizeof(*res) - (MAX_INVALIDATE_BATCH - res->nr) * sizeof(int));
+
+	END_KMSG_WORK(req);
+}
+
+
+static int handle_page_invalidate_response(struct pcn_kmsg_message *msg)
+{
+	page_invalidate_response_t *res = (page_invalidate_response_t *)msg;
+	int nid = PCN_KMSG_FROM_NID(res);
+	struct invalidate_batch *ib = __invalidate_batches + nid;
+	page_invalidate_request_t *req;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < res->nr; i++) {
+		wait_station_notify(res->origin_ws[i], NULL);
+	}
+	pcn_kmsg_done(res);
+
+	spin_lock_irqsave(&ib->lock, flags);
+	ib->in_flight--;
+	req = __detach_invalidate_batch(ib, false);
+	spin_unlock_irqrestore(&ib->lock, flags);
+
+	if (req) __post_invalidate_batch(nid, req);
+	return 0;
+}
+
+
+static void __revoke_page_ownership(struct task_struct *tsk, int nid, pid_t pid, unsigned long addr, int ws_id)
+{
+	struct invalidate_batch *ib = __invalidate_batches + nid;
+	page_invalidate_request_t *req, *spare = NULL;
+	struct page_invalidate_entry *e;
+	unsigned long flags;
+
+	PGPRINTK("  [%d] revoke %lx [%d/%d]\n", tsk->pid, addr, pid, nid);
+	__fault_went_remote(tsk);
+
+	spin_lock_irqsave(&ib->lock, flags);
+	while (!ib->pending) {
+		/* Getting a message buffer might sleep */
+		spin_unlock_irqrestore(&ib->lock, flags);
+		spare = pcn_kmsg_get(sizeof(*spare));
+		spare->nr = 0;
+		spin_lock_irqsave(&ib->lock, flags);
+		if (!ib->pending) {
+			ib->pending = spare;
+			spare = NULL;
+		}
+	}
+
+	e = ib->pending->entries + ib->pending->nr++;
+	e->origin_pid = tsk->pid;
+	e->origin_ws = ws_id;
+	e->remote_pid = pid;
+	e->addr = addr;
+
+	req = __detach_invalidate_batch(ib, false);
+	if (!req && !ib->timer_armed) {
+		/* Do not push an armed timer back */
+		ib->timer_armed = true;
+		hrtimer_start(&ib->timer,
+				ns_to_ktime((u64)invalidate_hold_usecs * NSEC_PER_USEC),
+				HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&ib->lock, flags);
+
+	if (spare) pcn_kmsg_put(spare);
+	if (req) __post_invalidate_batch(nid, req);
+}
+
+void invalidate_batch_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	if (seq) {
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__invalidate_batches_sent),
+				(unsigned long long)atomic_long_read(&__invalidate_entries_sent),
+				"invalidation batches, pages");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__invalidate_batches_flushed),
+				0ULL, "invalidation batches sent held");
+	} else {
+		atomic_long_set(&__invalidate_batches_sent, 0);
+		atomic_long_set(&__invalidate_entries_sent, 0);
+		atomic_long_set(&__invalidate_batches_flushed, 0);
+	}
+#endif
+}
+
+
+/**************************************************************************
+ * Voluntarily release page ownership
+ */
+int process_madvise_release_from_remote(int from_nid, unsigned long start, unsigned long end)
+{
+	struct mm_struct *mm;
+	unsigned long addr;
+	int nr_pages = 0;
+
+	mm = get_task_mm(current);
+	for (addr = start; addr < end; addr += PAGE_SIZE) {
+		pmd_t *pmd;
+		pte_t *pte;
+		spinlock_t *ptl;
+		pte = __get_pte_at(mm, addr, &pmd, &ptl);
+		if (!pte) continue;
+		spin_lock(ptl);
+		if (!pte_none(*pte)) {
+			clear_page_owner(from_nid, mm, addr);
+			nr_pages++;
+		}
+		pte_unmap_unlock(pte, ptl);
+	}
+	mmput(mm);
+	VSPRINTK("  [%d] %d %d / %ld %lx-%lx\n", current->pid, from_nid,
+			nr_pages, (end - start) / PAGE_SIZE, start, end);
+	return 0;
+}
+
+int page_server_release_page_ownership(struct vm_area_struct *vma, unsigned long addr)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	pmd_t *pmd;
+	pte_t *pte;
+	pte_t pte_val;
+	spinlock_t *ptl;
+
+	pte = __get_pte_at(mm, addr, &pmd, &ptl);
+	if (!pte) return 0;
+
+	spin_lock(ptl);
+	if (pte_none(*pte) || !pte_present(*pte)) {
+		pte_unmap_unlock(pte, ptl);
+		return 0;
+	}
+
+	clear_page_owner(my_nid, mm, addr);
+	pte_val = ptep_clear_flush(vma, addr, pte);
+	pte_val = pte_make_invalid(pte_val);
+
+	set_pte_at_notify(mm, addr, pte, pte_val);
+	update_mmu_cache(vma, addr, pte);
+	pte_unmap_unlock(pte, ptl);
+	return 1;
+}
+
+
+/**************************************************************************
+ * Fault-ahead
+ *
+ * A remote tracks the stride of read faults over fresh pages per VMA. Once
+ * the stride is confirmed, it asks the origin for up to a window of pages
+ * following the faulting page along the stride in the same page request.
+ * The window doubles whenever the next fault comes right after the pages
+ * faulted ahead, and is reset when the stride is broken. Pages to fault
+ * ahead are locked with fault handles beforehand, so they cannot be
+ * handled or invalidated until the response is applied. The origin grants
+ * the pages that it owns and are not being handled, and the remote maps
+ * the granted pages read-only.
+ */
+#define TRANSFER_PAGE_WITH_RDMA \
+		pcn_kmsg_has_features(PCN_KMSG_FEATURE_RDMA)
+
+/* The peer writes the page straight into the frame to be mapped */
+#define TRANSFER_PAGE_IN_PLACE \
+		pcn_kmsg_has_features(PCN_KMSG_FEATURE_RDMA | PCN_KMSG_FEATURE_RDMA_DIRECT)
+
+static unsigned int max_fault_ahead = MAX_FAULT_AHEAD;
+module_param(max_fault_ahead, uint, 0644);
+MODULE_PARM_DESC(max_fault_ahead, "Maximum number of pages to fetch ahead on a remote fault");
+
+#define MAX_FAULT_AHEAD_STRIDE 16
+
+struct fault_ahead_handle {
+	int nr;
+	long stride;
+	struct fault_handle *fhs[MAX_FAULT_AHEAD];
+};
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic_long_t __fault_ahead_requested = ATOMIC_LONG_INIT(0);
+static atomic_long_t __fault_ahead_granted = ATOMIC_LONG_INIT(0);
+static atomic_long_t __fault_ahead_hits = ATOMIC_LONG_INIT(0);
+static atomic_long_t __fault_ahead_misses = ATOMIC_LONG_INIT(0);
+#define FAULT_AHEAD_STAT_ADD(x, n) atomic_long_add(n, &(x))
+#else
+#define FAULT_AHEAD_STAT_ADD(x, n)
+#endif
+
+static inline unsigned long __fault_ahead_addr(unsigned long addr, long stride, int i)
+{
+	return addr + (i + 1) * stride * (long)PAGE_SIZE;
+}
+
+static inline bool __fault_ahead_addr_valid(struct vm_area_struct *vma, unsigned long base, unsigned long addr)
+{
+	return addr >= vma->vm_start && addr < vma->vm_end &&
+			(addr & PMD_MASK) == (base & PMD_MASK);
+}
+
+/* Granted pages follow the response, which is short if the page is RDMAed */
+static inline void *__fault_ahead_page(remote_page_response_t *res, bool short_res, int i)
+{
+	size_t offset = short_res ?
+			sizeof(remote_page_response_short_t) :
+			sizeof(remote_page_response_t);
+	return (void *)res + offset + i * PAGE_SIZE;
+}
+
+/* Return the number of pages to fault ahead */
+static int __detect_fault_ahead(struct remote_context *rc, struct vm_area_struct *vma, unsigned long addr, long *stride)
+{
+	struct fault_ahead *fa;
+	long delta;
+	int nr = 0;
+	unsigned int max_window = min_t(unsigned int,
+			max_fault_ahead, MAX_FAULT_AHEAD);
+
+	fa = rc->fault_ahead + (vma->vm_start >> PAGE_SHIFT) % FAULT_AHEAD_SLOTS;
+
+	spin_lock(&rc->fault_ahead_lock);
+	if (fa->vm_start != vma->vm_start) {
+		fa->vm_start = vma->vm_start;
+		fa->stride = 0;
+		fa->window = 1;
+		fa->nr_prefetched = 0;
+		goto out;
+	}
+
+	delta = ((long)addr - (long)fa->last_addr) / (long)PAGE_SIZE;
+	if (!delta) goto out;	/* Retried */
+
+	if (fa->stride && delta == fa->stride * (long)(fa->nr_prefetched + 1)) {
+		FAULT_AHEAD_STAT_ADD(__fault_ahead_hits, fa->nr_prefetched);
+		if (fa->nr_prefetched == fa->window && fa->window < max_window) {
+			fa->window <<= 1;
+		}
+		nr = min(fa->window, max_window);
+	} else {
+		FAULT_AHEAD_STAT_ADD(__fault_ahead_misses, fa->nr_prefetched);
+		fa->stride = delta;
+		fa->window = 1;
+	}
+	fa->nr_prefetched = 0;
+
+	if (abs(fa->stride) > MAX_FAULT_AHEAD_STRIDE) nr = 0;
+	*stride = fa->stride;
+
+out:
+	fa->last_addr = addr;
+	spin_unlock(&rc->fault_ahead_lock);
+	return nr;
+}
+
+static void __account_fault_ahead(struct remote_context *rc, struct vm_area_struct *vma, unsigned long addr, int nr_prefetched)
+{
+	struct fault_ahead *fa;
+
+	fa = rc->fault_ahead + (vma->vm_start >> PAGE_SHIFT) % FAULT_AHEAD_SLOTS;
+
+	spin_lock(&rc->fault_ahead_lock);
+	if (fa->vm_start == vma->vm_start && fa->last_addr == addr) {
+		fa->nr_prefetched = nr_prefetched;
+	}
+	spin_unlock(&rc->fault_ahead_lock);
+}
+
+/**
+ * Lock the pages to fault ahead. Stop at the first page that is populated
+ * or being handled so that the pages to request are consecutive along the
+ * stride. Should be called with the PTE lock held.
+ */
+static void __start_fault_ahead(struct task_struct *tsk, struct vm_area_struct *vma, unsigned long addr, pte_t *pte, unsigned long fault_flags, struct fault_ahead_handle *fah)
+{
+	int i, nr = fah->nr;
+
+	fah->nr = 0;
+	for (i = 0; i < nr; i++) {
+		unsigned long fa_addr = __fault_ahead_addr(addr, fah->stride, i);
+		pte_t *fa_pte = pte + (i + 1) * fah->stride;
+		struct fault_handle *fh;
+
+		if (!__fault_ahead_addr_valid(vma, addr, fa_addr)) break;
+		if (!pte_none(*fa_pte)) break;
+
+		fh = __try_start_fault_handling(tsk, fa_addr, fault_flags);
+		if (!fh) break;
+
+		fah->fhs[fah->nr++] = fh;
+	}
+}
+
+/**
+ * Map the pages granted by the origin, and release the pages to fault ahead.
+ * @rp is NULL if the demand fault is failed.
+ */
+static void __finish_fault_ahead(struct mm_struct *mm, struct vm_area_struct *vma, unsigned long addr, pmd_t *pmd, struct fault_ahead_handle *fah, remote_page_response_t *rp)
+{
+	spinlock_t *ptl = pte_lockptr(mm, pmd);
+	int i, granted = 0;
+
+	for (i = 0; i < fah->nr; i++) {
+		unsigned long fa_addr = __fault_ahead_addr(addr, fah->stride, i);
+		struct fault_handle *fh = fah->fhs[i];
+
+		if (rp && (rp->prefetched & (1UL << i))) {
+			struct page *page;
+			struct mem_cgroup *memcg;
+			pte_t *pte;
+			void *paddr;
+
+			page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, vma, fa_addr);
+			BUG_ON(!page);
+			if (mem_cgroup_try_charge(page, mm, GFP_KERNEL, &memcg)) {
+				BUG();
+			}
+
+			paddr = kmap(page);
+			copy_to_user_page(vma, page, fa_addr, paddr,
+					__fault_ahead_page(rp,
+						rp->header.type != PCN_KMSG_TYPE_REMOTE_PAGE_RESPONSE,
+						granted), PAGE_SIZE);
+			kunmap(page);
+			flush_dcache_page(page);
+			__SetPageUptodate(page);
+
+			pte = pte_offset_map(pmd, fa_addr);
+			spin_lock(ptl);
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+			BUG_ON(!pte_none(*pte));
+#endif
+			do_set_pte(vma, fa_addr, page, pte, false, true);
+			mem_cgroup_commit_charge(page, memcg, false);
+			lru_cache_add_active_or_unevictable(page, vma);
+
+			SetPageDistributed(mm, fa_addr);
+			set_page_owner(my_nid, mm, fa_addr);
+			pte_unmap_unlock(pte, ptl);
+
+			granted++;
+		}
+		fh->ret = 0;
+		__finish_fault_handling(fh);
+	}
+
+	FAULT_AHEAD_STAT_ADD(__fault_ahead_granted, granted);
+	__account_fault_ahead(mm->remote, vma, addr, granted);
+}
+
+/**
+ * Grant the pages requested to fault ahead at the origin. Copy the granted
+ * pages after @res and return the number of them.
+ */
+static int __grant_fault_ahead(struct task_struct *tsk, struct mm_struct *mm, struct vm_area_struct *vma, remote_page_request_t *req, remote_page_response_t *res)
+{
+	int from_nid = PCN_KMSG_FROM_NID(req);
+	unsigned long addr = req->addr;
+	spinlock_t *ptl;
+	pmd_t *pmd;
+	pte_t *pte;
+	int i, granted = 0;
+
+	if (!vma_is_anonymous(vma)) return 0;
+
+	pte = __get_pte_at(mm, addr, &pmd, &ptl);
+	if (!pte) return 0;
+
+	spin_lock(ptl);
+	for (i = 0; i < req->nr_prefetch; i++) {
+		unsigned long fa_addr = __fault_ahead_addr(addr, req->prefetch_stride, i);
+		pte_t *fa_pte = pte + (i + 1) * req->prefetch_stride;
+		struct page *page;
+		pte_t entry;
+		void *paddr;
+
+		if (!__fault_ahead_addr_valid(vma, addr, fa_addr)) break;
+		if (!pte_present(*fa_pte)) continue;
+		if (!page_is_mine(mm, fa_addr)) continue;
+		if (test_page_owner(from_nid, mm, fa_addr)) continue;
+		if (__fault_in_progress(mm->remote, fa_addr)) continue;
+
+		/* Leave pages shared for CoW alone */
+		page = vm_normal_page(vma, fa_addr, *fa_pte);
+		if (!page || page_mapcount(page) != 1) continue;
+
+		SetPageDistributed(mm, fa_addr);
+		set_page_owner(my_nid, mm, fa_addr);
+		set_page_owner(from_nid, mm, fa_addr);
+
+		entry = ptep_clear_flush(vma, fa_addr, fa_pte);
+		entry = pte_wrprotect(entry);
+		set_pte_at_notify(mm, fa_addr, fa_pte, entry);
+		update_mmu_cache(vma, fa_addr, fa_pte);
+
+		flush_cache_page(vma, fa_addr, page_to_pfn(page));
+		paddr = kmap_atomic(page);
+		copy_from_user_page(vma, page, fa_addr,
+				__fault_ahead_page(res, TRANSFER_PAGE_WITH_RDMA, granted),
+				paddr, PAGE_SIZE);
+		kunmap_atomic(paddr);
+
+		res->prefetched |= 1UL << i;
+		granted++;
+	}
+	pte_unmap_unlock(pte, ptl);
+
+	return granted;
+}
+
+void fault_ahead_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	if (seq) {
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__fault_ahead_requested),
+				(unsigned long long)atomic_long_read(&__fault_ahead_granted),
+				"fault-ahead requested, granted");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__fault_ahead_hits),
+				(unsigned long long)atomic_long_read(&__fault_ahead_misses),
+				"fault-ahead hits, misses");
+	} else {
+		atomic_long_set(&__fault_ahead_requested, 0);
+		atomic_long_set(&__fault_ahead_granted, 0);
+		atomic_long_set(&__fault_ahead_hits, 0);
+		atomic_long_set(&__fault_ahead_misses, 0);
+	}
+#endif
+}
+
+
+/**************************************************************************
+ * Huge pages
+ *
+ * A remote read fault on an unpopulated 2MB region of an anonymous VMA asks
+ * the origin for the whole region. If the origin keeps the region in a huge
+ * page that no one else holds, the origin write-protects it and grants the
+ * ownership of all the pages in the region at once, and the remote maps the
+ * data with a read-only huge PMD. Otherwise, the remote populates the page
+ * table and goes on page by page.
+ *
+ * Ownership is still tracked per page, so both sides split the huge page as
+ * soon as any page in the region is written or revoked, and the usual page
+ * protocol takes over from there.
+ */
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static bool transfer_huge_pages = true;
+module_param(transfer_huge_pages, bool, 0644);
+MODULE_PARM_DESC(transfer_huge_pages, "Transfer huge page regions as a whole");
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic_long_t __huge_page_requested = ATOMIC_LONG_INIT(0);
+static atomic_long_t __huge_page_granted = ATOMIC_LONG_INIT(0);
+static atomic_long_t __huge_page_splits = ATOMIC_LONG_INIT(0);
+#define HUGE_PAGE_STAT_INC(x) atomic_long_inc(&(x))
+#else
+#define HUGE_PAGE_STAT_INC(x)
+#endif
+
+static int handle_remote_huge_page_response(struct pcn_kmsg_message *msg)
+{
+	remote_huge_page_response_t *res = (remote_huge_page_response_t *)msg;
+
+	PGPRINTK("  [%d] <-[%d/%d] %lx huge %x\n",
+			res->origin_ws, res->remote_pid, PCN_KMSG_FROM_NID(res),
+			res->addr, res->result);
+
+	if (!wait_station_notify(res->origin_ws, res))
+		pcn_kmsg_done(res);
+	return 0;
+}
+
+/**
+ * The page to fill in is found through the data wait station of the
+ * requester, never from the message. Each chunk claims its slot in the
+ * station, so chunks from a node other than the origin, chunks at a bogus
+ * offset, and duplicates are dropped before touching the page. The requester
+ * waits for all the chunks without a timeout, so the page stays alive until
+ * the last chunk is notified, and chunks for a released station are dropped.
+ */
+static int handle_remote_huge_page_chunk(struct pcn_kmsg_message *msg)
+{
+	remote_huge_page_chunk_t *chunk = (remote_huge_page_chunk_t *)msg;
+	struct page *page = NULL;
+	int i;
+
+	BUILD_BUG_ON(HUGE_PAGE_NR_CHUNKS > BITS_PER_LONG);
+
+	if (chunk->offset < HPAGE_PMD_SIZE &&
+			!(chunk->offset % HUGE_PAGE_CHUNK_SIZE)) {
+		page = wait_station_claim(chunk->data_ws,
+				chunk->offset / HUGE_PAGE_CHUNK_SIZE,
+				PCN_KMSG_FROM_NID(chunk));
+	}
+	if (!page) {
+		printk_ratelimited(KERN_WARNING "Drop huge page chunk at %lx from %d\n",
+				chunk->offset, PCN_KMSG_FROM_NID(chunk));
+		goto out;
+	}
+
+	page += chunk->offset >> PAGE_SHIFT;
+	for (i = 0; i < HUGE_PAGE_CHUNK_SIZE >> PAGE_SHIFT; i++) {
+		void *paddr = kmap_atomic(page + i);
+		memcpy(paddr, chunk->data + (i << PAGE_SHIFT), PAGE_SIZE);
+		kunmap_atomic(paddr);
+	}
+	wait_station_notify(chunk->data_ws, NULL);
+
+out:
+	pcn_kmsg_done(chunk);
+	return 0;
+}
+
+static int __fetch_huge_page_from_origin(struct task_struct *tsk, struct mm_struct *mm, struct vm_area_struct *vma, unsigned long haddr, pmd_t *pmd)
+{
+	remote_huge_page_request_t *req;
+	remote_huge_page_response_t *rp;
+	struct wait_station *ws, *data_ws;
+	struct mem_cgroup *memcg;
+	struct page *page;
+	pgtable_t pgtable;
+	unsigned long addr;
+	int result;
+
+	if (unlikely(anon_vma_prepare(vma))) return VM_FAULT_OOM;
+
+	page = alloc_huge_page_remote(mm, vma, haddr, &memcg);
+	if (!page) return VM_FAULT_FALLBACK;
+
+	/* Nothing can fail once the origin grants the region */
+	pgtable = pte_alloc_one(mm, haddr);
+	if (!pgtable) {
+		free_huge_page_remote(page, memcg);
+		return VM_FAULT_FALLBACK;
+	}
+
+	ws = get_wait_station(tsk);
+	data_ws = get_wait_station_multiple(tsk, HUGE_PAGE_NR_CHUNKS);
+	data_ws->private = page;	/* Where the chunks go */
+	data_ws->nid = tsk->origin_nid;	/* and where they come from */
+
+	req = pcn_kmsg_get(sizeof(*req));
+	req->origin_pid = tsk->pid;
+	req->origin_ws = ws->id;
+	req->data_ws = data_ws->id;
+	req->remote_pid = tsk->origin_pid;
+	req->addr = haddr;
+	req->instr_addr = instruction_pointer(current_pt_regs());
+
+	PGPRINTK("  [%d] ->[%d/%d] %lx huge\n", tsk->pid,
+			tsk->origin_pid, tsk->origin_nid, haddr);
+	HUGE_PAGE_STAT_INC(__huge_page_requested);
+	__fault_went_remote(tsk);
+
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_REQUEST,
+			PCN_KMSG_PRIO_HIGH, tsk->origin_nid, req, sizeof(*req));
+
+	rp = wait_at_station(ws);
+	result = rp->result;
+	pcn_kmsg_done(rp);
+
+	if (result) {
+		put_wait_station(data_ws);
+		pte_free(mm, pgtable);
+		free_huge_page_remote(page, memcg);
+		return VM_FAULT_FALLBACK;
+	}
+	wait_at_station(data_ws);
+
+	if (!map_huge_page_remote(mm, vma, haddr, pmd, page, memcg, pgtable)) {
+		/**
+		 * The fault handle should keep the region unpopulated. The origin
+		 * has granted the region, so the pages cannot be fetched one by
+		 * one either.
+		 */
+		printk_ratelimited(KERN_ERR "[%d] %lx populated while fetched\n",
+				tsk->pid, haddr);
+		pte_free(mm, pgtable);
+		free_huge_page_remote(page, memcg);
+		return VM_FAULT_SIGBUS;
+	}
+
+	for (addr = haddr; addr < haddr + HPAGE_PMD_SIZE; addr += PAGE_SIZE) {
+		SetPageDistributed(mm, addr);
+		set_page_owner(my_nid, mm, addr);
+	}
+	HUGE_PAGE_STAT_INC(__huge_page_granted);
+
+	return 0;
+}
+
+/**
+ * Function:
+ *	page_server_handle_pmd_fault
+ *
+ * Description:
+ *	Handle faults on unpopulated PMDs of THP-enabled VMAs at remotes.
+ *  down_read(&mm->mmap_sem) is already held when getting in.
+ *
+ * Return values:
+ *	VM_FAULT_FALLBACK when the fault should be handled at the PTE level.
+ *	0 if the region is fetched or someone else handled the fault.
+ *  ERROR otherwise
+ */
+int page_server_handle_pmd_fault(
+		struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, pmd_t *pmd, unsigned int fault_flags)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct fault_handle *fh;
+	bool leader;
+	spinlock_t *ptl;
+	int ret = VM_FAULT_FALLBACK;
+
+	ptl = pmd_lock(mm, pmd);
+	if (!pmd_none(*pmd)) {
+		spin_unlock(ptl);
+		return VM_FAULT_FALLBACK;
+	}
+
+	/**
+	 * Serialize populating the region with the fault handle at its head
+	 * so that no page table shows up while the region is being fetched.
+	 */
+	fh = __start_fault_handling(current, haddr, fault_flags, ptl, &leader);
+	if (!fh) {
+		up_read(&mm->mmap_sem);
+		return VM_FAULT_RETRY;
+	}
+
+	if (!leader) {
+		/* Retry against what the leader has set up */
+		__finish_fault_handling(fh);
+		return 0;
+	}
 
-	/* Send pages asynchronously */
-	ws = get_wait_station(current);
-	down_read(&mm->mmap_sem);
-	for (vma = mm->mmap; vma; vma = vma->vm_next) {
-		walk.vma = vma;
-		walk_page_vma(vma, &walk);
+	if (transfer_huge_pages && fault_for_read(fault_flags) &&
+			vma_is_anonymous(vma) && !(vma->vm_flags & VM_EXEC) &&
+			haddr >= vma->vm_start && haddr + HPAGE_PMD_SIZE <= vma->vm_end) {
+		ret = __fetch_huge_page_from_origin(current, mm, vma, haddr, pmd);
 	}
-	up_read(&mm->mmap_sem);
 
-	/* Notify the completion synchronously */
-	req->flags = FLUSH_FLAG_LAST;
-	pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH,
-			current->origin_nid, req, sizeof(*req));
-	wait_at_station(ws);
+	if ((ret & VM_FAULT_FALLBACK) &&
+			unlikely(__pte_alloc(mm, vma, pmd, address))) {
+		ret = VM_FAULT_OOM;
+	}
+	PGPRINTK("  [%d] %lx huge %x\n", current->pid, haddr, ret);
 
-	kfree(req);
+	__finish_fault_handling(fh);
+	return ret;
+}
 
-	// XXX: make sure there is no backlog.
-	msleep(1000);
+bool page_server_split_huge_pmd(struct vm_area_struct *vma, unsigned long address, pmd_t *pmd)
+{
+	struct mm_struct *mm = vma->vm_mm;
 
-	return 0;
+	if (!mm->remote) return false;
+
+	/* Huge pages at the origin are kept unless they are shared */
+	if (!mm->remote->for_remote &&
+			!PageDistributed(mm, address & HPAGE_PMD_MASK)) return false;
+
+	PGPRINTK("  [%d] %lx split huge\n", current->pid, address);
+	split_huge_page_pmd(vma, address, pmd);
+	HUGE_PAGE_STAT_INC(__huge_page_splits);
+
+	return true;
 }
 
-static int handle_remote_page_flush_ack(struct pcn_kmsg_message *msg)
+void page_server_zap_pmd(struct vm_area_struct *vma, unsigned long addr)
 {
-	remote_page_flush_ack_t *req = (remote_page_flush_ack_t *)msg;
-	struct wait_station *ws = wait_station(req->remote_ws);
+	unsigned long end = addr + HPAGE_PMD_SIZE;
 
-	complete(&ws->pendings);
+	if (!vma->vm_mm->remote) return;
 
-	pcn_kmsg_done(req);
-	return 0;
+	for (; addr < end; addr += PAGE_SIZE) {
+		ClearPageInfo(vma->vm_mm, addr);
+	}
 }
 
-
-/**************************************************************************
- * Page invalidation protocol
+/**
+ * Grant the region at @haddr to @from_nid if the region is in a huge page
+ * that is neither shared with other processes nor distributed yet. Return
+ * the huge page with a reference held.
  */
-static void __do_invalidate_page(struct task_struct *tsk, page_invalidate_request_t *req)
+static struct page *__grant_huge_page(struct mm_struct *mm, struct vm_area_struct *vma, unsigned long haddr, int from_nid)
 {
-	struct mm_struct *mm = get_task_mm(tsk);
-	struct vm_area_struct *vma;
+	pgd_t *pgd;
+	pud_t *pud;
 	pmd_t *pmd;
-	pte_t *pte, entry;
 	spinlock_t *ptl;
-	int ret = 0;
-	unsigned long addr = req->addr;
-	struct fault_handle *fh;
+	struct page *page = NULL;
+	unsigned long addr;
 
-	down_read(&mm->mmap_sem);
-	vma = find_vma(mm, addr);
-	if (!vma || vma->vm_start > addr) {
-		ret = VM_FAULT_SIGBUS;
-		goto out;
-	}
+	if (!vma_is_anonymous(vma) ||
+			haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return NULL;
 
-	PGPRINTK("\nINVALIDATE_PAGE [%d] %lx [%d/%d]\n", tsk->pid, addr,
-			req->origin_pid, PCN_KMSG_FROM_NID(req));
+	pgd = pgd_offset(mm, haddr);
+	if (pgd_none(*pgd)) return NULL;
+	pud = pud_offset(pgd, haddr);
+	if (pud_none(*pud)) return NULL;
+	pmd = pmd_offset(pud, haddr);
 
-	pte = __get_pte_at(mm, addr, &pmd, &ptl);
-	if (!pte) goto out;
+	ptl = pmd_lock(mm, pmd);
+	if (!pmd_trans_huge(*pmd) || pmd_trans_splitting(*pmd)) goto out;
 
-	spin_lock(ptl);
-	fh = __start_invalidation(tsk, addr, ptl);
+	page = pmd_page(*pmd);
+	if (!PageAnon(page) || page_mapcount(page) != 1) goto out_deny;
 
-	clear_page_owner(my_nid, mm, addr);
+	for (addr = haddr; addr < haddr + HPAGE_PMD_SIZE; addr += PAGE_SIZE) {
+		if (!page_is_mine(mm, addr) || test_page_owner(from_nid, mm, addr))
+			goto out_deny;
+	}
+	for (addr = haddr; addr < haddr + HPAGE_PMD_SIZE; addr += PAGE_SIZE) {
+		SetPageDistributed(mm, addr);
+		set_page_owner(my_nid, mm, addr);
+		set_page_owner(from_nid, mm, addr);
+	}
 
-	BUG_ON(!pte_present(*pte));
-	entry = ptep_clear_flush(vma, addr, pte);
-	entry = pte_make_invalid(entry);
+	/* Writes from now on split the huge page and revoke the pages */
+	if (pmd_write(*pmd)) {
+		pmdp_set_wrprotect(mm, haddr, pmd);
+		flush_tlb_range(vma, haddr, haddr + HPAGE_PMD_SIZE);
+	}
+	get_page(page);
+	goto out;
 
-	set_pte_at_notify(mm, addr, pte, entry);
-	update_mmu_cache(vma, addr, pte);
+out_deny:
+	page = NULL;
+out:
+	spin_unlock(ptl);
+	return page;
+}
 
-	__finish_invalidation(fh);
-	pte_unmap_unlock(pte, ptl);
+/**
+ * The page data is sent after unlocking the PMD. It is still consistent since
+ * the writer has to revoke the granted pages first, and the remote holds the
+ * revocation until it finishes fetching the region.
+ */
+static void __send_huge_page(struct page *page, remote_huge_page_request_t *req)
+{
+	unsigned long offset;
+	int i;
 
-out:
-	up_read(&mm->mmap_sem);
-	mmput(mm);
+	for (offset = 0; offset < HPAGE_PMD_SIZE; offset += HUGE_PAGE_CHUNK_SIZE) {
+		remote_huge_page_chunk_t *chunk = pcn_kmsg_get(sizeof(*chunk));
+		struct page *p = page + (offset >> PAGE_SHIFT);
+
+		chunk->data_ws = req->data_ws;
+		chunk->offset = offset;
+
+		for (i = 0; i < HUGE_PAGE_CHUNK_SIZE >> PAGE_SHIFT; i++) {
+			void *paddr = kmap_atomic(p + i);
+			memcpy(chunk->data + (i << PAGE_SHIFT), paddr, PAGE_SIZE);
+			kunmap_atomic(paddr);
+		}
+		pcn_kmsg_post(PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_CHUNK,
+				PCN_KMSG_FROM_NID(req), chunk, sizeof(*chunk));
+	}
 }
 
-static void process_page_invalidate_request(struct work_struct *work)
+static void process_remote_huge_page_request(struct work_struct *work)
 {
-	START_KMSG_WORK(page_invalidate_request_t, req, work);
-	page_invalidate_response_t *res;
+	START_KMSG_WORK(remote_huge_page_request_t, req, work);
+	remote_huge_page_response_t *res;
+	int from_nid = PCN_KMSG_FROM_NID(req);
 	struct task_struct *tsk;
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;
+	struct page *page = NULL;
 
 	res = pcn_kmsg_get(sizeof(*res));
-	res->origin_pid = req->origin_pid;
-	res->origin_ws = req->origin_ws;
-	res->remote_pid = req->remote_pid;
+	res->result = VM_FAULT_FALLBACK;
 
-	/* Only home issues invalidate requests. Hence, I am a remote */
 	tsk = __get_task_struct(req->remote_pid);
 	if (!tsk) {
-		PGPRINTK("%s: no such process %d %d %lx\n", __func__,
-				req->origin_pid, req->remote_pid, req->addr);
-		pcn_kmsg_put(res);
-		goto out_free;
+		PGPRINTK("  [%d] not found\n", req->remote_pid);
+		goto out;
 	}
+	mm = get_task_mm(tsk);
+
+	PGPRINTK("\nREMOTE_HUGE_PAGE_REQUEST [%d] %lx %lx from [%d/%d]\n",
+			req->remote_pid, req->addr, req->instr_addr,
+			req->origin_pid, from_nid);
 
-	__do_invalidate_page(tsk, req);
+	/* Do not hold the remote up; it can go on page by page */
+	if (!down_read_trylock(&mm->mmap_sem)) goto out_put;
 
-	PGPRINTK(">>[%d] ->[%d/%d]\n", req->remote_pid, res->origin_pid,
-			PCN_KMSG_FROM_NID(req));
-	pcn_kmsg_post(PCN_KMSG_TYPE_PAGE_INVALIDATE_RESPONSE,
-			PCN_KMSG_FROM_NID(req), res, sizeof(*res));
+	vma = find_vma(mm, req->addr);
+	if (vma && vma->vm_start <= req->addr) {
+		page = __grant_huge_page(mm, vma, req->addr, from_nid);
+	}
+	if (page) {
+		res->result = 0;
+		__send_huge_page(page, req);
+		put_page(page);
+	}
+	up_read(&mm->mmap_sem);
 
+out_put:
+	mmput(mm);
 	put_task_struct(tsk);
 
-out_free:
+out:
+	res->addr = req->addr;
+	res->remote_pid = req->remote_pid;
+	res->origin_pid = req->origin_pid;
+	res->origin_ws = req->origin_ws;
+
+	PGPRINTK("  [%d] ->[%d/%d] huge %x\n", req->remote_pid,
+			res->origin_pid, from_nid, res->result);
+
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_RESPONSE,
+			PCN_KMSG_PRIO_HIGH, from_nid, res, sizeof(*res));
+
 	END_KMSG_WORK(req);
 }
 
-
-static int handle_page_invalidate_response(struct pcn_kmsg_message *msg)
+void huge_page_stat(struct seq_file *seq, void *v)
 {
-	page_invalidate_response_t *res = (page_invalidate_response_t *)msg;
-	struct wait_station *ws = wait_station(res->origin_ws);
-
-	if (atomic_dec_and_test(&ws->pendings_count)) {
-		complete(&ws->pendings);
+#ifdef CONFIG_POPCORN_STAT
+	if (seq) {
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__huge_page_requested),
+				(unsigned long long)atomic_long_read(&__huge_page_granted),
+				"huge pages requested, granted");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__huge_page_splits),
+				0ULL, "huge page splits");
+	} else {
+		atomic_long_set(&__huge_page_requested, 0);
+		atomic_long_set(&__huge_page_granted, 0);
+		atomic_long_set(&__huge_page_splits, 0);
 	}
-
-	pcn_kmsg_done(res);
-	return 0;
+#endif
 }
-
-
-static void __revoke_page_ownership(struct task_struct *tsk, int nid, pid_t pid, unsigned long addr, int ws_id)
+#else /* CONFIG_TRANSPARENT_HUGEPAGE */
+int page_server_handle_pmd_fault(
+		struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long address, pmd_t *pmd, unsigned int fault_flags)
 {
-	page_invalidate_request_t *req = pcn_kmsg_get(sizeof(*req));
-
-	req->addr = addr;
-	req->origin_pid = tsk->pid;
-	req->origin_ws = ws_id;
-	req->remote_pid = pid;
-
-	PGPRINTK("  [%d] revoke %lx [%d/%d]\n", tsk->pid, addr, pid, nid);
-	pcn_kmsg_post(PCN_KMSG_TYPE_PAGE_INVALIDATE_REQUEST, nid, req, sizeof(*req));
+	return VM_FAULT_FALLBACK;
 }
 
-
-/**************************************************************************
- * Voluntarily release page ownership
- */
-int process_madvise_release_from_remote(int from_nid, unsigned long start, unsigned long end)
+bool page_server_split_huge_pmd(struct vm_area_struct *vma, unsigned long address, pmd_t *pmd)
 {
-	struct mm_struct *mm;
-	unsigned long addr;
-	int nr_pages = 0;
-
-	mm = get_task_mm(current);
-	for (addr = start; addr < end; addr += PAGE_SIZE) {
-		pmd_t *pmd;
-		pte_t *pte;
-		spinlock_t *ptl;
-		pte = __get_pte_at(mm, addr, &pmd, &ptl);
-		if (!pte) continue;
-		spin_lock(ptl);
-		if (!pte_none(*pte)) {
-			clear_page_owner(from_nid, mm, addr);
-			nr_pages++;
-		}
-		pte_unmap_unlock(pte, ptl);
-	}
-	mmput(mm);
-	VSPRINTK("  [%d] %d %d / %ld %lx-%lx\n", current->pid, from_nid,
-			nr_pages, (end - start) / PAGE_SIZE, start, end);
-	return 0;
+	return false;
 }
 
-int page_server_release_page_ownership(struct vm_area_struct *vma, unsigned long addr)
+void page_server_zap_pmd(struct vm_area_struct *vma, unsigned long addr)
 {
-	struct mm_struct *mm = vma->vm_mm;
-	pmd_t *pmd;
-	pte_t *pte;
-	pte_t pte_val;
-	spinlock_t *ptl;
-
-	pte = __get_pte_at(mm, addr, &pmd, &ptl);
-	if (!pte) return 0;
-
-	spin_lock(ptl);
-	if (pte_none(*pte) || !pte_present(*pte)) {
-		pte_unmap_unlock(pte, ptl);
-		return 0;
-	}
-
-	clear_page_owner(my_nid, mm, addr);
-	pte_val = ptep_clear_flush(vma, addr, pte);
-	pte_val = pte_make_invalid(pte_val);
+}
 
-	set_pte_at_notify(mm, addr, pte, pte_val);
-	update_mmu_cache(vma, addr, pte);
-	pte_unmap_unlock(pte, ptl);
-	return 1;
+void huge_page_stat(struct seq_file *seq, void *v)
+{
 }
+#endif
 
 
 /**************************************************************************
@@ -982,22 +2232,49 @@ int page_server_release_page_ownership(struct vm_area_struct *vma, unsigned long
 static int handle_remote_page_response(struct pcn_kmsg_message *msg)
 {
 	remote_page_response_t *res = (remote_page_response_t *)msg;
-	struct wait_station *ws = wait_station(res->origin_ws);
 
 	PGPRINTK("  [%d] <-[%d/%d] %lx %x\n",
-			ws->pid, res->remote_pid, PCN_KMSG_FROM_NID(res),
+			res->origin_ws, res->remote_pid, PCN_KMSG_FROM_NID(res),
 			res->addr, res->result);
-	ws->private = res;
 
-	if (atomic_dec_and_test(&ws->pendings_count))
-		complete(&ws->pendings);
+	if (!wait_station_notify(res->origin_ws, res))
+		pcn_kmsg_done(res);
 	return 0;
 }
 
-#define TRANSFER_PAGE_WITH_RDMA \
-		pcn_kmsg_has_features(PCN_KMSG_FEATURE_RDMA)
+static inline void *__rdma_sink(struct page *page)
+{
+	if (!TRANSFER_PAGE_IN_PLACE || PageHighMem(page)) return NULL;
+	return page_address(page);
+}
+
+/**
+ * Fill @page with the content in @rp, or written through @rh by RDMA, and
+ * release @rh.
+ */
+static void __fill_remote_page(struct vm_area_struct *vma, struct page *page, unsigned long addr, remote_page_response_t *rp, struct pcn_kmsg_rdma_handle *rh)
+{
+	void *paddr;
+
+	if (rh && rh->addr == __rdma_sink(page)) {
+		pcn_kmsg_unpin_rdma_buffer(rh);
+		goto out;
+	}
+
+	paddr = kmap(page);
+	if (rh) {
+		copy_to_user_page(vma, page, addr, paddr, rh->addr, PAGE_SIZE);
+	} else {
+		copy_to_user_page(vma, page, addr, paddr, rp->page, PAGE_SIZE);
+	}
+	kunmap(page);
+	if (rh) pcn_kmsg_unpin_rdma_buffer(rh);
+out:
+	flush_dcache_page(page);
+	__SetPageUptodate(page);
+}
 
-static int __request_remote_page(struct task_struct *tsk, int from_nid, pid_t from_pid, unsigned long addr, unsigned long fault_flags, int ws_id, struct pcn_kmsg_rdma_handle **rh)
+static int __request_remote_page(struct task_struct *tsk, int from_nid, pid_t from_pid, unsigned long addr, unsigned long fault_flags, int ws_id, struct fault_ahead_handle *fah, struct page *page, struct pcn_kmsg_rdma_handle **rh)
 {
 	remote_page_request_t *req;
 
@@ -1007,6 +2284,15 @@ static int __request_remote_page(struct task_struct *tsk, int from_nid, pid_t fr
 	req->addr = addr;
 	req->fault_flags = fault_flags;
 
+	if (fah && fah->nr) {
+		req->nr_prefetch = fah->nr;
+		req->prefetch_stride = fah->stride;
+		FAULT_AHEAD_STAT_ADD(__fault_ahead_requested, fah->nr);
+	} else {
+		req->nr_prefetch = 0;
+		req->prefetch_stride = 0;
+	}
+
 	req->origin_pid = tsk->pid;
 	req->origin_ws = ws_id;
 
@@ -1015,7 +2301,7 @@ static int __request_remote_page(struct task_struct *tsk, int from_nid, pid_t fr
 
 	if (TRANSFER_PAGE_WITH_RDMA) {
 		struct pcn_kmsg_rdma_handle *handle =
-				pcn_kmsg_pin_rdma_buffer(NULL, PAGE_SIZE);
+				pcn_kmsg_pin_rdma_buffer(__rdma_sink(page), PAGE_SIZE);
 		if (IS_ERR(handle)) {
 			pcn_kmsg_put(req);
 			return PTR_ERR(handle);
@@ -1031,35 +2317,29 @@ static int __request_remote_page(struct task_struct *tsk, int from_nid, pid_t fr
 	PGPRINTK("  [%d] ->[%d/%d] %lx %lx\n", tsk->pid,
 			from_pid, from_nid, addr, req->instr_addr);
 
-	pcn_kmsg_post(PCN_KMSG_TYPE_REMOTE_PAGE_REQUEST,
+	__fault_went_remote(tsk);
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_REMOTE_PAGE_REQUEST, PCN_KMSG_PRIO_HIGH,
 			from_nid, req, sizeof(*req));
 	return 0;
 }
 
-static remote_page_response_t *__fetch_page_from_origin(struct task_struct *tsk, struct vm_area_struct *vma, unsigned long addr, unsigned long fault_flags, struct page *page)
+static remote_page_response_t *__fetch_page_from_origin(struct task_struct *tsk, struct vm_area_struct *vma, unsigned long addr, unsigned long fault_flags, struct page *page, struct fault_ahead_handle *fah)
 {
 	remote_page_response_t *rp;
 	struct wait_station *ws = get_wait_station(tsk);
 	struct pcn_kmsg_rdma_handle *rh;
 
 	__request_remote_page(tsk, tsk->origin_nid, tsk->origin_pid,
-			addr, fault_flags, ws->id, &rh);
+			addr, fault_flags, ws->id, fah, page, &rh);
 
 	rp = wait_at_station(ws);
+	vma_server_check_version(tsk->mm->remote, rp->vma_version);
 	if (rp->result == 0) {
-		void *paddr = kmap(page);
-		if (TRANSFER_PAGE_WITH_RDMA) {
-			copy_to_user_page(vma, page, addr, paddr, rh->addr, PAGE_SIZE);
-		} else {
-			copy_to_user_page(vma, page, addr, paddr, rp->page, PAGE_SIZE);
-		}
-		kunmap(page);
-		flush_dcache_page(page);
-		__SetPageUptodate(page);
+		__fill_remote_page(vma, page, addr, rp, rh);
+	} else if (rh) {
+		pcn_kmsg_unpin_rdma_buffer(rh);
 	}
 
-	if (rh) pcn_kmsg_unpin_rdma_buffer(rh);
-
 	return rp;
 }
 
@@ -1074,10 +2354,8 @@ static int __claim_remote_page(struct task_struct *tsk, struct mm_struct *mm, st
 	/* Read when @from becomes zero and save the nid to @from_nid */
 	int nid;
 	struct pcn_kmsg_rdma_handle *rh = NULL;
-	unsigned long offset;
-	struct page *pip = __get_page_info_page(mm, addr, &offset);
-	unsigned long *pi = (unsigned long *)kmap(pip) + offset;
-	BUG_ON(!pip);
+	unsigned long *pi = __get_page_info(mm, addr);
+	BUG_ON(!pi);
 
 	peers = bitmap_weight(pi, MAX_POPCORN_NODES);
 
@@ -1101,7 +2379,7 @@ static int __claim_remote_page(struct task_struct *tsk, struct mm_struct *mm, st
 		if (nid == my_nid) continue;
 		if (from-- == 0) {
 			from_nid = nid;
-			__request_remote_page(tsk, nid, pid, addr, fault_flags, ws->id, &rh);
+			__request_remote_page(tsk, nid, pid, addr, fault_flags, ws->id, NULL, page, &rh);
 		} else {
 			if (fault_for_write(fault_flags)) {
 				clear_bit(nid, pi);
@@ -1118,21 +2396,13 @@ static int __claim_remote_page(struct task_struct *tsk, struct mm_struct *mm, st
 	}
 
 	if (rp->result == 0) {
-		void *paddr = kmap(page);
-		if (TRANSFER_PAGE_WITH_RDMA) {
-			copy_to_user_page(vma, page, addr, paddr, rh->addr, PAGE_SIZE);
-		} else {
-			copy_to_user_page(vma, page, addr, paddr, rp->page, PAGE_SIZE);
-		}
-		kunmap(page);
-		flush_dcache_page(page);
-		__SetPageUptodate(page);
+		__fill_remote_page(vma, page, addr, rp, rh);
+	} else if (rh) {
+		pcn_kmsg_unpin_rdma_buffer(rh);
 	}
 	pcn_kmsg_done(rp);
 
-	if (rh) pcn_kmsg_unpin_rdma_buffer(rh);
 	__put_task_remote(rc);
-	kunmap(pip);
 	return 0;
 }
 
@@ -1140,16 +2410,12 @@ static int __claim_remote_page(struct task_struct *tsk, struct mm_struct *mm, st
 static void __claim_local_page(struct task_struct *tsk, unsigned long addr, int except_nid)
 {
 	struct mm_struct *mm = tsk->mm;
-	unsigned long offset;
-	struct page *pip = __get_page_info_page(mm, addr, &offset);
-	unsigned long *pi;
+	unsigned long *pi = __get_page_info(mm, addr);
 	int peers;
 
-	if (!pip) return; /* skip claiming non-distributed page */
-	pi = (unsigned long *)kmap(pip) + offset;
+	if (!pi) return; /* skip claiming non-distributed page */
 	peers = bitmap_weight(pi, MAX_POPCORN_NODES);
 	if (!peers) {
-		kunmap(pip);
 		return;	/* skip claiming the page that is not distributed */
 	}
 
@@ -1174,7 +2440,6 @@ static void __claim_local_page(struct task_struct *tsk, unsigned long addr, int
 
 		wait_at_station(ws);
 	}
-	kunmap(pip);
 }
 
 void page_server_zap_pte(struct vm_area_struct *vma, unsigned long addr, pte_t *pte, pte_t *pteval)
@@ -1430,12 +2695,19 @@ static void process_remote_page_request(struct work_struct *work)
 	int res_size;
 	enum pcn_kmsg_type res_type;
 	int down_read_retry = 0;
+	int nr_granted = 0;
 
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+	BUG_ON(req->nr_prefetch < 0 || req->nr_prefetch > MAX_FAULT_AHEAD);
+#endif
 	if (TRANSFER_PAGE_WITH_RDMA) {
-		res = pcn_kmsg_get(sizeof(remote_page_response_short_t));
+		res = pcn_kmsg_get(sizeof(remote_page_response_short_t) +
+				req->nr_prefetch * PAGE_SIZE);
 	} else {
-		res = pcn_kmsg_get(sizeof(*res));
+		res = pcn_kmsg_get(sizeof(*res) + req->nr_prefetch * PAGE_SIZE);
 	}
+	res->prefetched = 0;
+	res->vma_version = 0;
 
 again:
 	tsk = __get_task_struct(req->remote_pid);
@@ -1445,6 +2717,10 @@ again:
 		goto out;
 	}
 	mm = get_task_mm(tsk);
+	if (!tsk->at_remote) {
+		/* Before looking at the VMA, so that a later change is told */
+		res->vma_version = atomic_long_read(&mm->remote->vma_version);
+	}
 
 	PGPRINTK("\nREMOTE_PAGE_REQUEST [%d] %lx %c %lx from [%d/%d]\n",
 			req->remote_pid, req->addr,
@@ -1472,6 +2748,9 @@ again:
 		res->result = __handle_remotefault_at_remote(tsk, mm, vma, req, res);
 	} else {
 		res->result = __handle_remotefault_at_origin(tsk, mm, vma, req, res);
+		if (res->result == 0 && req->nr_prefetch) {
+			nr_granted = __grant_fault_ahead(tsk, mm, vma, req, res);
+		}
 	}
 
 out_up:
@@ -1493,6 +2772,7 @@ out:
 		res_type = PCN_KMSG_TYPE_REMOTE_PAGE_RESPONSE;
 		res_size = sizeof(remote_page_response_t);
 	}
+	res_size += nr_granted * PAGE_SIZE;
 	res->addr = req->addr;
 	res->remote_pid = req->remote_pid;
 
@@ -1506,7 +2786,7 @@ out:
 			fault_for_write(req->fault_flags) ? 'W' : 'R',
 			req->instr_addr, req->addr, res->result);
 
-	pcn_kmsg_post(res_type, from_nid, res, res_size);
+	pcn_kmsg_post_prio(res_type, PCN_KMSG_PRIO_HIGH, from_nid, res, res_size);
 
 	END_KMSG_WORK(req);
 }
@@ -1605,6 +2885,7 @@ static int __handle_localfault_at_remote(struct mm_struct *mm,
 	struct fault_handle *fh;
 	bool leader;
 	remote_page_response_t *rp;
+	struct fault_ahead_handle fah = { .nr = 0 };
 
 	if (anon_vma_prepare(vma)) {
 		BUG_ON("Cannot prepare vma for anonymous page");
@@ -1646,13 +2927,24 @@ static int __handle_localfault_at_remote(struct mm_struct *mm,
 	}
 	get_page(page);
 
-	rp = __fetch_page_from_origin(current, vma, addr, fault_flags, page);
+	if (fault_for_read(fault_flags) && pte_none(pte_val) &&
+			vma_is_anonymous(vma)) {
+		fah.nr = __detect_fault_ahead(mm->remote, vma, addr, &fah.stride);
+		if (fah.nr) {
+			spin_lock(ptl);
+			__start_fault_ahead(current, vma, addr, pte, fault_flags, &fah);
+			spin_unlock(ptl);
+		}
+	}
+
+	rp = __fetch_page_from_origin(current, vma, addr, fault_flags, page, &fah);
 
 	if (rp->result && rp->result != VM_FAULT_CONTINUE) {
 		if (rp->result != VM_FAULT_RETRY)
 			PGPRINTK("  [%d] failed 0x%x\n", current->pid, rp->result);
 		ret = rp->result;
 		pte_unmap(pte);
+		__finish_fault_ahead(mm, vma, addr, pmd, &fah, NULL);
 		up_read(&mm->mmap_sem);
 		goto out_free;
 	}
@@ -1694,6 +2986,8 @@ static int __handle_localfault_at_remote(struct mm_struct *mm,
 	pte_unmap_unlock(pte, ptl);
 	ret = 0;	/* The leader squashes both 0 and VM_FAULT_CONTINUE to 0 */
 
+	__finish_fault_ahead(mm, vma, addr, pmd, &fah, rp);
+
 out_free:
 	put_page(page);
 	pcn_kmsg_done(rp);
@@ -1929,9 +3223,42 @@ out:
 DEFINE_KMSG_WQ_HANDLER(remote_page_request);
 DEFINE_KMSG_WQ_HANDLER(page_invalidate_request);
 DEFINE_KMSG_ORDERED_WQ_HANDLER(remote_page_flush);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+DEFINE_KMSG_WQ_HANDLER(remote_huge_page_request);
+#endif
+
+/* Handle requests for different pages in parallel */
+static unsigned long __remote_page_request_key(struct pcn_kmsg_message *msg)
+{
+	return ((remote_page_request_t *)msg)->addr >> PAGE_SHIFT;
+}
+
+static unsigned long __page_invalidate_request_key(struct pcn_kmsg_message *msg)
+{
+	return ((page_invalidate_request_t *)msg)->entries[0].addr >> PAGE_SHIFT;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static unsigned long __remote_huge_page_request_key(struct pcn_kmsg_message *msg)
+{
+	return ((remote_huge_page_request_t *)msg)->addr >> HPAGE_PMD_SHIFT;
+}
+#endif
 
 int __init page_server_init(void)
 {
+	int i;
+
+	for (i = 0; i < MAX_POPCORN_NODES; i++) {
+		struct invalidate_batch *ib = __invalidate_batches + i;
+
+		spin_lock_init(&ib->lock);
+		ib->nid = i;
+		hrtimer_init(&ib->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		ib->timer.function = __invalidate_batch_timeout;
+		INIT_WORK(&ib->flush, __flush_invalidate_batch);
+	}
+
 	REGISTER_KMSG_WQ_HANDLER(
 			PCN_KMSG_TYPE_REMOTE_PAGE_REQUEST, remote_page_request);
 	REGISTER_KMSG_HANDLER(
@@ -1949,8 +3276,26 @@ int __init page_server_init(void)
 	REGISTER_KMSG_HANDLER(
 			PCN_KMSG_TYPE_REMOTE_PAGE_FLUSH_ACK, remote_page_flush_ack);
 
+	pcn_kmsg_register_steering(PCN_KMSG_TYPE_REMOTE_PAGE_REQUEST,
+			__remote_page_request_key);
+	pcn_kmsg_register_steering(PCN_KMSG_TYPE_PAGE_INVALIDATE_REQUEST,
+			__page_invalidate_request_key);
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	REGISTER_KMSG_WQ_HANDLER(
+			PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_REQUEST, remote_huge_page_request);
+	REGISTER_KMSG_HANDLER(
+			PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_RESPONSE, remote_huge_page_response);
+	REGISTER_KMSG_HANDLER(
+			PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_CHUNK, remote_huge_page_chunk);
+	pcn_kmsg_register_steering(PCN_KMSG_TYPE_REMOTE_HUGE_PAGE_REQUEST,
+			__remote_huge_page_request_key);
+#endif
+
 	__fault_handle_cache = kmem_cache_create("fault_handle",
-			sizeof(struct fault_handle), 0, 0, NULL);
+			sizeof(struct fault_handle), 0, SLAB_DESTROY_BY_RCU, NULL);
+	__page_info_cache = kmem_cache_create("page_info_region",
+			sizeof(struct page_info_region), 0, 0, NULL);
 
 	return 0;
 }
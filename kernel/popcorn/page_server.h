@@ -8,7 +8,17 @@ int handle_pte_fault_origin(struct mm_struct *, struct vm_area_struct *, unsigne
 struct page *get_normal_page(struct vm_area_struct *vma, unsigned long addr, pte_t *pte);
 int cow_file_at_origin(struct mm_struct *mm, struct vm_area_struct *vma, unsigned long addr, pte_t *pte);
 
+/* Implemented in mm/huge_memory.c */
+struct page *alloc_huge_page_remote(struct mm_struct *mm, struct vm_area_struct *vma, unsigned long haddr, struct mem_cgroup **memcgp);
+void free_huge_page_remote(struct page *page, struct mem_cgroup *memcg);
+bool map_huge_page_remote(struct mm_struct *mm, struct vm_area_struct *vma, unsigned long haddr, pmd_t *pmd, struct page *page, struct mem_cgroup *memcg, pgtable_t pgtable);
+
 void free_remote_context_pages(struct remote_context *rc);
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+void page_server_init_fault_stat(struct remote_context *rc);
+void page_server_free_fault_stat(struct remote_context *rc);
+void page_server_fault_stat(struct seq_file *seq, struct remote_context *rc);
+#endif
 int process_madvise_release_from_remote(int from_nid, unsigned long start, unsigned long end);
 
 #endif
@@ -8,6 +8,10 @@
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
 #include <linux/err.h>
+#include <linux/module.h>
+#include <linux/hash.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
 
 #include <popcorn/pcn_kmsg.h>
 #include <popcorn/debug.h>
@@ -42,6 +46,61 @@ int pcn_kmsg_unregister_callback(enum pcn_kmsg_type type)
 }
 EXPORT_SYMBOL(pcn_kmsg_unregister_callback);
 
+
+/**
+ * Steering works to CPUs. The CPUs that are online at boot are laid out in
+ * a table, and the key of a message picks its CPU. Each CPU keeps its own
+ * worker pool that starts works in order and spawns more workers when one
+ * blocks. Thus, the handlers for the same key start in order while they
+ * may still block on the replies from other nodes without stalling others.
+ */
+static pcn_kmsg_keyftn pcn_kmsg_keyftns[PCN_KMSG_TYPE_MAX] = { NULL };
+
+static int *__steer_cpus = NULL;
+static unsigned int __nr_steer_cpus = 0;
+
+static bool steer_works = true;
+module_param(steer_works, bool, 0644);
+MODULE_PARM_DESC(steer_works, "Spread message handling over CPUs by message keys");
+
+int pcn_kmsg_register_steering(enum pcn_kmsg_type type, pcn_kmsg_keyftn key)
+{
+	BUG_ON(type < 0 || type >= PCN_KMSG_TYPE_MAX);
+
+	pcn_kmsg_keyftns[type] = key;
+	return 0;
+}
+EXPORT_SYMBOL(pcn_kmsg_register_steering);
+
+void pcn_kmsg_queue_work(struct workqueue_struct *wq, struct pcn_kmsg_message *msg)
+{
+	pcn_kmsg_keyftn key = pcn_kmsg_keyftns[msg->header.type];
+
+	if (key && steer_works && __nr_steer_cpus) {
+		u32 hash = hash_long(key(msg), 32);
+		queue_work_on(__steer_cpus[hash % __nr_steer_cpus],
+				wq, &PCN_KMSG_RECV_HDR(msg)->work);
+	} else {
+		queue_work(wq, &PCN_KMSG_RECV_HDR(msg)->work);
+	}
+}
+EXPORT_SYMBOL(pcn_kmsg_queue_work);
+
+static int __init __setup_steering(void)
+{
+	int cpu;
+	unsigned int nr_cpus = num_online_cpus();
+
+	__steer_cpus = kmalloc(sizeof(*__steer_cpus) * nr_cpus, GFP_KERNEL);
+	if (!__steer_cpus) return -ENOMEM;
+
+	for_each_online_cpu(cpu) {
+		if (__nr_steer_cpus == nr_cpus) break;
+		__steer_cpus[__nr_steer_cpus++] = cpu;
+	}
+	return 0;
+}
+
 #ifdef CONFIG_POPCORN_CHECK_SANITY
 static atomic_t __nr_outstanding_requests[PCN_KMSG_TYPE_MAX] = { ATOMIC_INIT(0) };
 #endif
@@ -73,40 +132,53 @@ void pcn_kmsg_process(struct pcn_kmsg_message *msg)
 EXPORT_SYMBOL(pcn_kmsg_process);
 
 
-static inline int __build_and_check_msg(enum pcn_kmsg_type type, int to, struct pcn_kmsg_message *msg, size_t size)
+static inline int __build_and_check_msg(enum pcn_kmsg_type type, enum pcn_kmsg_prio prio, int to, struct pcn_kmsg_message *msg, size_t size)
 {
 #ifdef CONFIG_POPCORN_CHECK_SANITY
 	BUG_ON(type < 0 || type >= PCN_KMSG_TYPE_MAX);
+	BUG_ON(prio < PCN_KMSG_PRIO_LOW || prio > PCN_KMSG_PRIO_HIGH);
 	BUG_ON(size > PCN_KMSG_MAX_SIZE);
 	BUG_ON(to < 0 || to >= MAX_POPCORN_NODES);
 	BUG_ON(to == my_nid);
 #endif
 
 	msg->header.type = type;
-	msg->header.prio = PCN_KMSG_PRIO_NORMAL;
+	msg->header.prio = prio;
 	msg->header.size = size;
 	msg->header.from_nid = my_nid;
 	return 0;
 }
 
-int pcn_kmsg_send(enum pcn_kmsg_type type, int to, void *msg, size_t size)
+int pcn_kmsg_send_prio(enum pcn_kmsg_type type, enum pcn_kmsg_prio prio, int to, void *msg, size_t size)
 {
 	int ret;
-	if ((ret = __build_and_check_msg(type, to, msg, size))) return ret;
+	if ((ret = __build_and_check_msg(type, prio, to, msg, size))) return ret;
 
 	account_pcn_message_sent(msg);
 	return transport->send(to, msg, size);
 }
-EXPORT_SYMBOL(pcn_kmsg_send);
+EXPORT_SYMBOL(pcn_kmsg_send_prio);
 
-int pcn_kmsg_post(enum pcn_kmsg_type type, int to, void *msg, size_t size)
+int pcn_kmsg_post_prio(enum pcn_kmsg_type type, enum pcn_kmsg_prio prio, int to, void *msg, size_t size)
 {
 	int ret;
-	if ((ret = __build_and_check_msg(type, to, msg, size))) return ret;
+	if ((ret = __build_and_check_msg(type, prio, to, msg, size))) return ret;
 
 	account_pcn_message_sent(msg);
 	return transport->post(to, msg, size);
 }
+EXPORT_SYMBOL(pcn_kmsg_post_prio);
+
+int pcn_kmsg_send(enum pcn_kmsg_type type, int to, void *msg, size_t size)
+{
+	return pcn_kmsg_send_prio(type, PCN_KMSG_PRIO_NORMAL, to, msg, size);
+}
+EXPORT_SYMBOL(pcn_kmsg_send);
+
+int pcn_kmsg_post(enum pcn_kmsg_type type, int to, void *msg, size_t size)
+{
+	return pcn_kmsg_post_prio(type, PCN_KMSG_PRIO_NORMAL, to, msg, size);
+}
 EXPORT_SYMBOL(pcn_kmsg_post);
 
 void *pcn_kmsg_get(size_t size)
@@ -214,5 +286,5 @@ EXPORT_SYMBOL(pcn_kmsg_dump);
 
 int __init pcn_kmsg_init(void)
 {
-	return 0;
+	return __setup_steering();
 }
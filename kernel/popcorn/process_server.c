@@ -19,6 +19,8 @@
 #include <linux/mmu_context.h>
 #include <linux/fs.h>
 #include <linux/futex.h>
+#include <linux/seq_file.h>
+#include <linux/module.h>
 
 #include <asm/mmu_context.h>
 #include <asm/kdebug.h>
@@ -27,6 +29,7 @@
 #include <popcorn/types.h>
 #include <popcorn/bundle.h>
 #include <popcorn/cpuinfo.h>
+#include <popcorn/stat.h>
 
 #include "types.h"
 #include "process_server.h"
@@ -36,6 +39,10 @@
 #include "util.h"
 #include "syscall_server.h"
 
+static void __free_futex_leases(struct remote_context *rc);
+static void __flush_clone_requests(struct remote_context *rc, int nid);
+static void __kick_clone_requests(struct remote_context *rc, int nid);
+
 static struct list_head remote_contexts[2];
 static spinlock_t remote_contexts_lock[2];
 
@@ -87,8 +94,20 @@ inline struct remote_context *get_task_remote(struct task_struct *tsk)
 	return __get_mm_remote(tsk->mm);
 }
 
+/* Release what __alloc_remote_context() allocated */
+static void __free_remote_context(struct remote_context *rc)
+{
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+	page_server_free_fault_stat(rc);
+#endif
+	kfree(rc->faults);
+	kfree(rc);
+}
+
 inline bool __put_task_remote(struct remote_context *rc)
 {
+	int nid;
+
 	if (!atomic_dec_and_test(&rc->count)) return false;
 
 	__lock_remote_contexts(rc->for_remote);
@@ -99,7 +118,13 @@ inline bool __put_task_remote(struct remote_context *rc)
 	__unlock_remote_contexts(rc->for_remote);
 
 	free_remote_context_pages(rc);
-	kfree(rc);
+	vma_server_free_snapshot(rc);
+	__free_futex_leases(rc);
+	syscall_server_free_batches(rc);
+	for (nid = 0; nid < MAX_POPCORN_NODES; nid++) {
+		if (rc->pending_clones[nid]) pcn_kmsg_put(rc->pending_clones[nid]);
+	}
+	__free_remote_context(rc);
 	return true;
 }
 
@@ -116,6 +141,23 @@ void free_remote_context(struct remote_context *rc)
 	__put_task_remote(rc);
 }
 
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+void process_server_fault_stat(struct seq_file *seq, void *v)
+{
+	int index;
+
+	for (index = INDEX_OUTBOUND; index <= INDEX_INBOUND; index++) {
+		struct remote_context *rc;
+
+		__lock_remote_contexts(index);
+		list_for_each_entry(rc, remote_contexts + index, list) {
+			page_server_fault_stat(seq, rc);
+		}
+		__unlock_remote_contexts(index);
+	}
+}
+#endif
+
 static struct remote_context *__alloc_remote_context(int nid, int tgid, bool remote)
 {
 	struct remote_context *rc = kmalloc(sizeof(*rc), GFP_KERNEL);
@@ -130,29 +172,65 @@ static struct remote_context *__alloc_remote_context(int nid, int tgid, bool rem
 	rc->tgid = tgid;
 	rc->for_remote = remote;
 
-	for (i = 0; i < FAULTS_HASH; i++) {
-		INIT_HLIST_HEAD(&rc->faults[i]);
-		spin_lock_init(&rc->faults_lock[i]);
+	/* Faults in flight are bounded by the CPUs faulting concurrently */
+	rc->nr_fault_buckets = clamp_t(unsigned int,
+			roundup_pow_of_two(num_possible_cpus() * 4),
+			MIN_FAULT_BUCKETS, MAX_FAULT_BUCKETS);
+	rc->faults = kmalloc(sizeof(*rc->faults) * rc->nr_fault_buckets,
+			GFP_KERNEL);
+	if (!rc->faults) {
+		kfree(rc);
+		return ERR_PTR(-ENOMEM);
+	}
+	for (i = 0; i < rc->nr_fault_buckets; i++) {
+		INIT_HLIST_HEAD(&rc->faults[i].faults);
+		spin_lock_init(&rc->faults[i].lock);
+	}
+	spin_lock_init(&rc->fault_ahead_lock);
+	memset(rc->fault_ahead, 0x00, sizeof(rc->fault_ahead));
+
+	spin_lock_init(&rc->futex_leases_lock);
+	for (i = 0; i < FUTEX_LEASE_HASH; i++) {
+		INIT_HLIST_HEAD(&rc->futex_leases[i]);
 	}
+	memset(rc->futex_lease_waiters, 0x00, sizeof(rc->futex_lease_waiters));
+	rc->nr_futex_leases = 0;
+	rc->futex_lease_epoch = 0;
+
+	spin_lock_init(&rc->clones_lock);
+	memset(rc->pending_clones, 0x00, sizeof(rc->pending_clones));
+	bitmap_zero(rc->clones_in_flight, MAX_POPCORN_NODES);
+	memset(rc->clones_posted, 0x00, sizeof(rc->clones_posted));
 
 	INIT_LIST_HEAD(&rc->vmas);
 	spin_lock_init(&rc->vmas_lock);
+	rc->vma_snapshot = NULL;
+	atomic_long_set(&rc->vma_version, 0);
 
 	rc->stop_remote_worker = false;
 
 	rc->remote_worker = NULL;
 	INIT_LIST_HEAD(&rc->remote_works);
+	INIT_LIST_HEAD(&rc->remote_clones);
 	spin_lock_init(&rc->remote_works_lock);
-	init_completion(&rc->remote_works_ready);
+	init_waitqueue_head(&rc->remote_works_wait);
+	atomic_set(&rc->nr_remote_helpers, 0);
 
 	memset(rc->remote_tgids, 0x00, sizeof(rc->remote_tgids));
 
 	INIT_RADIX_TREE(&rc->pages, GFP_ATOMIC);
 
+	bitmap_zero(rc->socket_fds, MAX_SOCKET_FDS);
+	rc->syscall_batches = NULL;
+
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+	page_server_init_fault_stat(rc);
+#endif
+
 	return rc;
 }
 
-static void __build_task_comm(char *buffer, char *path)
+static void __build_task_comm(char *buffer, const char *path)
 {
 	int i, ch;
 	for (i = 0; (ch = *(path++)) != '\0';) {
@@ -168,14 +246,340 @@ static void __build_task_comm(char *buffer, char *path)
 ///////////////////////////////////////////////////////////////////////////////
 // Distributed mutex
 ///////////////////////////////////////////////////////////////////////////////
+/**
+ * Futex leases
+ *
+ * A remote wakes up a futex word at the origin since the waiters queue at
+ * the origin. Most wakes find no waiter though, e.g., unlocking an
+ * uncontended mutex. So, the origin leases a word to a remote when a wake
+ * from the remote finds no waiter, and the remote skips the wakes on the
+ * leased word locally. Any wait at the origin recalls the leases of the word
+ * before queueing itself, and so does a requeue for its target word. A
+ * requeued waiter carries its hold over to the target word.
+ *
+ * Leases are versioned by the epoch of the origin, which advances on every
+ * recall. A remote ignores a lease granted before the last recall it has
+ * seen, so a grant overtaken by a recall in flight cannot revive the lease.
+ */
+#define MAX_FUTEX_LEASES 256
+
+struct futex_lease {
+	struct hlist_node list;
+	unsigned long uaddr;
+
+	/* At the origin */
+	DECLARE_BITMAP(nodes, MAX_POPCORN_NODES);	/* Holding the lease */
+};
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic_long_t __nr_futex_local_wakes = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_futex_local_waits = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_futex_grants = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_futex_recalls = ATOMIC_LONG_INIT(0);
+#define FUTEX_STAT_INC(x) atomic_long_inc(&(x))
+#else
+#define FUTEX_STAT_INC(x)
+#endif
+
+static inline int __futex_lease_index(unsigned long uaddr)
+{
+	return (uaddr >> 2) % FUTEX_LEASE_HASH;
+}
+
+static inline struct hlist_head *__futex_lease_head(struct remote_context *rc, unsigned long uaddr)
+{
+	return &rc->futex_leases[__futex_lease_index(uaddr)];
+}
+
+/* Should be called with futex_leases_lock held */
+static struct futex_lease *__find_futex_lease(struct remote_context *rc, unsigned long uaddr)
+{
+	struct futex_lease *fl;
+
+	hlist_for_each_entry(fl, __futex_lease_head(rc, uaddr), list) {
+		if (fl->uaddr == uaddr) return fl;
+	}
+	return NULL;
+}
+
+/**
+ * Find the lease for @uaddr or add @spare for it. @spare is consumed when it
+ * is added. Should be called with futex_leases_lock held.
+ */
+static struct futex_lease *__get_futex_lease(struct remote_context *rc, unsigned long uaddr, struct futex_lease **spare)
+{
+	struct futex_lease *fl = __find_futex_lease(rc, uaddr);
+
+	if (fl || !*spare) return fl;
+
+	fl = *spare;
+	*spare = NULL;
+
+	fl->uaddr = uaddr;
+	bitmap_zero(fl->nodes, MAX_POPCORN_NODES);
+	hlist_add_head(&fl->list, __futex_lease_head(rc, uaddr));
+	rc->nr_futex_leases++;
+
+	return fl;
+}
+
+static void __del_futex_lease(struct remote_context *rc, struct futex_lease *fl)
+{
+	hlist_del(&fl->list);
+	rc->nr_futex_leases--;
+	kfree(fl);
+}
+
+static void __free_futex_leases(struct remote_context *rc)
+{
+	struct futex_lease *fl;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < FUTEX_LEASE_HASH; i++) {
+		hlist_for_each_entry_safe(fl, n, &rc->futex_leases[i], list) {
+			__del_futex_lease(rc, fl);
+		}
+	}
+}
+
+static inline bool __futex_wake_leasable(int op, u32 val3)
+{
+	int cmd = op & FUTEX_CMD_MASK;
+
+	if (!(op & FUTEX_PRIVATE_FLAG)) return false;
+	return cmd == FUTEX_WAKE ||
+		(cmd == FUTEX_WAKE_BITSET && val3 == FUTEX_BITSET_MATCH_ANY);
+}
+
+static bool __futex_leased(struct remote_context *rc, unsigned long uaddr)
+{
+	bool leased;
+
+	spin_lock(&rc->futex_leases_lock);
+	leased = !!__find_futex_lease(rc, uaddr);
+	spin_unlock(&rc->futex_leases_lock);
+
+	return leased;
+}
+
+static void __install_futex_lease(struct remote_context *rc, unsigned long uaddr, unsigned long epoch)
+{
+	struct futex_lease *spare = kmalloc(sizeof(*spare), GFP_KERNEL);
+
+	if (!spare) return;
+
+	spin_lock(&rc->futex_leases_lock);
+	if (epoch >= rc->futex_lease_epoch &&
+			rc->nr_futex_leases < MAX_FUTEX_LEASES) {
+		__get_futex_lease(rc, uaddr, &spare);
+	}
+	spin_unlock(&rc->futex_leases_lock);
+
+	kfree(spare);
+}
+
+/**
+ * Lease @uaddr to @nid unless someone is waiting on it at the origin.
+ * Waiters are counted per hash bucket, so a waiter on a word sharing the
+ * bucket holds off the lease as well.
+ */
+static bool __grant_futex_lease(struct remote_context *rc, int nid, unsigned long uaddr, unsigned long *epoch)
+{
+	struct futex_lease *fl, *spare = NULL;
+	bool granted = false;
+
+	if (rc->nr_futex_leases < MAX_FUTEX_LEASES) {
+		spare = kmalloc(sizeof(*spare), GFP_KERNEL);
+	}
+
+	spin_lock(&rc->futex_leases_lock);
+	if (rc->futex_lease_waiters[__futex_lease_index(uaddr)]) goto out;
+
+	fl = __get_futex_lease(rc, uaddr, &spare);
+	if (fl) {
+		set_bit(nid, fl->nodes);
+		*epoch = rc->futex_lease_epoch;
+		granted = true;
+	}
+out:
+	spin_unlock(&rc->futex_leases_lock);
+
+	kfree(spare);
+	return granted;
+}
+
+/**
+ * Called by futex_wait() and futex_requeue() at the origin before queueing
+ * waiters on @uaddr. Hold off the leases of the word and recall the ones
+ * given out so that remotes forward their wakes on the word from now on.
+ * Does not allocate; a word without an entry has no lease to recall.
+ * Return whether the hold is taken and thus should be released.
+ */
+bool process_server_futex_hold(u32 __user *uaddr)
+{
+	struct remote_context *rc;
+	struct futex_lease *fl;
+	struct wait_station *ws;
+	DECLARE_BITMAP(nodes, MAX_POPCORN_NODES);
+	unsigned long epoch = 0;
+	int nid, nr_nodes;
+
+	if (!distributed_process(current) || current->at_remote) return false;
+
+	rc = get_task_remote(current);
+	bitmap_zero(nodes, MAX_POPCORN_NODES);
+
+	spin_lock(&rc->futex_leases_lock);
+	rc->futex_lease_waiters[__futex_lease_index((unsigned long)uaddr)]++;
+	fl = __find_futex_lease(rc, (unsigned long)uaddr);
+	if (fl) {
+		bitmap_copy(nodes, fl->nodes, MAX_POPCORN_NODES);
+		__del_futex_lease(rc, fl);
+		epoch = ++rc->futex_lease_epoch;
+	}
+	spin_unlock(&rc->futex_leases_lock);
+
+	nr_nodes = bitmap_weight(nodes, MAX_POPCORN_NODES);
+	if (!nr_nodes) goto out;
+
+	ws = get_wait_station_multiple(current, nr_nodes);
+	for_each_set_bit(nid, nodes, MAX_POPCORN_NODES) {
+		futex_lease_recall_t *req = pcn_kmsg_get(sizeof(*req));
+
+		req->origin_pid = current->pid;
+		req->origin_ws = ws->id;
+		req->remote_pid = rc->remote_tgids[nid];
+		req->uaddr = (unsigned long)uaddr;
+		req->epoch = epoch;
+
+		FUTEX_STAT_INC(__nr_futex_recalls);
+		pcn_kmsg_post_prio(PCN_KMSG_TYPE_FUTEX_LEASE_RECALL,
+				PCN_KMSG_PRIO_HIGH, nid, req, sizeof(*req));
+	}
+	wait_at_station(ws);
+
+out:
+	__put_task_remote(rc);
+	return true;
+}
+
+/* Pairs with process_server_futex_hold() when the waiter leaves */
+void process_server_futex_release(u32 __user *uaddr)
+{
+	struct remote_context *rc;
+	int i = __futex_lease_index((unsigned long)uaddr);
+
+	if (!distributed_process(current) || current->at_remote) return;
+
+	rc = get_task_remote(current);
+
+	spin_lock(&rc->futex_leases_lock);
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+	BUG_ON(rc->futex_lease_waiters[i] <= 0);
+#endif
+	rc->futex_lease_waiters[i]--;
+	spin_unlock(&rc->futex_leases_lock);
+
+	__put_task_remote(rc);
+}
+
+/**
+ * Move the hold of the waiter @tsk from @uaddr to @uaddr2 as futex_requeue()
+ * moves the waiter, so that the requeued waiter keeps the leases of its new
+ * word held off. The requeuer holds @uaddr2 meanwhile, so the leases of
+ * @uaddr2 are recalled already. Called with the hash bucket locks held.
+ */
+void process_server_futex_requeue(struct task_struct *tsk,
+		u32 __user *uaddr, u32 __user *uaddr2)
+{
+	struct remote_context *rc = get_task_remote(tsk);
+	int i = __futex_lease_index((unsigned long)uaddr);
+	int j = __futex_lease_index((unsigned long)uaddr2);
+
+	spin_lock(&rc->futex_leases_lock);
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+	BUG_ON(rc->futex_lease_waiters[i] <= 0);
+#endif
+	rc->futex_lease_waiters[i]--;
+	rc->futex_lease_waiters[j]++;
+	spin_unlock(&rc->futex_leases_lock);
+
+	__put_task_remote(rc);
+}
+
+static void process_futex_lease_recall(struct work_struct *work)
+{
+	START_KMSG_WORK(futex_lease_recall_t, req, work);
+	futex_lease_recall_ack_t *res;
+	struct task_struct *tsk;
+	struct mm_struct *mm = NULL;
+
+	tsk = __get_task_struct(req->remote_pid);
+	if (tsk) {
+		mm = get_task_mm(tsk);
+		put_task_struct(tsk);
+	}
+	if (mm) {
+		struct remote_context *rc = mm->remote;
+		struct futex_lease *fl;
+
+		spin_lock(&rc->futex_leases_lock);
+		fl = __find_futex_lease(rc, req->uaddr);
+		if (fl) __del_futex_lease(rc, fl);
+		if (req->epoch > rc->futex_lease_epoch) {
+			rc->futex_lease_epoch = req->epoch;
+		}
+		spin_unlock(&rc->futex_leases_lock);
+		mmput(mm);
+	}
+
+	res = pcn_kmsg_get(sizeof(*res));
+	res->origin_ws = req->origin_ws;
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_FUTEX_LEASE_RECALL_ACK, PCN_KMSG_PRIO_HIGH,
+			PCN_KMSG_FROM_NID(req), res, sizeof(*res));
+
+	END_KMSG_WORK(req);
+}
+
+static int handle_futex_lease_recall_ack(struct pcn_kmsg_message *msg)
+{
+	futex_lease_recall_ack_t *res = (futex_lease_recall_ack_t *)msg;
+
+	wait_station_notify(res->origin_ws, NULL);
+	pcn_kmsg_done(res);
+	return 0;
+}
+
+void futex_lease_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	if (seq) {
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_futex_local_wakes),
+				(unsigned long long)atomic_long_read(&__nr_futex_local_waits),
+				"futex local wakes, waits");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_futex_grants),
+				(unsigned long long)atomic_long_read(&__nr_futex_recalls),
+				"futex lease grants, recalls");
+	} else {
+		atomic_long_set(&__nr_futex_local_wakes, 0);
+		atomic_long_set(&__nr_futex_local_waits, 0);
+		atomic_long_set(&__nr_futex_grants, 0);
+		atomic_long_set(&__nr_futex_recalls, 0);
+	}
+#endif
+}
+
 long process_server_do_futex_at_remote(u32 __user *uaddr, int op, u32 val,
 		bool valid_ts, struct timespec *ts,
 		u32 __user *uaddr2,u32 val2, u32 val3)
 {
-	struct wait_station *ws = get_wait_station(current);
+	struct remote_context *rc = get_task_remote(current);
+	struct wait_station *ws;
 	remote_futex_request req = {
 		.origin_pid = current->origin_pid,
-		.remote_ws = ws->id,
 		.op = op,
 		.val = val,
 		.ts = {
@@ -187,18 +591,39 @@ long process_server_do_futex_at_remote(u32 __user *uaddr, int op, u32 val,
 		.val3 = val3,
 	};
 	remote_futex_response *res;
+	int cmd = op & FUTEX_CMD_MASK;
+	u32 cur;
 	long ret;
 
+	/* Nobody is waiting on the leased word */
+	if (__futex_wake_leasable(op, val3) &&
+			__futex_leased(rc, (unsigned long)uaddr)) {
+		FUTEX_STAT_INC(__nr_futex_local_wakes);
+		ret = 0;
+		goto out;
+	}
+
+	/* The wait would fail at the origin anyway */
+	if ((cmd == FUTEX_WAIT || (cmd == FUTEX_WAIT_BITSET && val3)) &&
+			!get_user(cur, uaddr) && cur != val) {
+		FUTEX_STAT_INC(__nr_futex_local_waits);
+		ret = -EWOULDBLOCK;
+		goto out;
+	}
+
 	if (valid_ts) {
 		req.ts = *ts;
 	}
 
+	ws = get_wait_station(current);
+	req.remote_ws = ws->id;
+
 	/*
 	printk(" f[%d] ->[%d/%d] 0x%x %p 0x%x\n", current->pid,
 			current->origin_pid, current->origin_nid,
 			op, uaddr, val);
 	*/
-	pcn_kmsg_send(PCN_KMSG_TYPE_FUTEX_REQUEST,
+	pcn_kmsg_send_prio(PCN_KMSG_TYPE_FUTEX_REQUEST, PCN_KMSG_PRIO_HIGH,
 			current->origin_nid, &req, sizeof(req));
 	res = wait_at_station(ws);
 	ret = res->ret;
@@ -207,18 +632,22 @@ long process_server_do_futex_at_remote(u32 __user *uaddr, int op, u32 val,
 			current->origin_pid, current->origin_nid,
 			op, uaddr, ret);
 	*/
+	if (res->lease) {
+		__install_futex_lease(rc, (unsigned long)uaddr, res->lease_epoch);
+	}
 
 	pcn_kmsg_done(res);
+out:
+	__put_task_remote(rc);
 	return ret;
 }
 
 static int handle_remote_futex_response(struct pcn_kmsg_message *msg)
 {
 	remote_futex_response *res = (remote_futex_response *)msg;
-	struct wait_station *ws = wait_station(res->remote_ws);
 
-	ws->private = res;
-	complete(&ws->pendings);
+	if (!wait_station_notify(res->remote_ws, res))
+		pcn_kmsg_done(res);
 	return 0;
 }
 
@@ -227,6 +656,8 @@ static void process_remote_futex_request(remote_futex_request *req)
 	int ret;
 	remote_futex_response *res;
 	ktime_t t, *tp = NULL;
+	unsigned long epoch = 0;
+	bool lease = false;
 
 	if (timespec_valid(&req->ts)) {
 		t = timespec_to_ktime(req->ts);
@@ -246,11 +677,20 @@ static void process_remote_futex_request(remote_futex_request *req)
 			current->remote_pid, current->remote_nid,
 			req->op, req->uaddr, res.ret);
 	*/
+	if (ret == 0 && req->val > 0 &&
+			__futex_wake_leasable(req->op, req->val3)) {
+		lease = __grant_futex_lease(current->mm->remote, current->remote_nid,
+				(unsigned long)req->uaddr, &epoch);
+		if (lease) FUTEX_STAT_INC(__nr_futex_grants);
+	}
+
 	res = pcn_kmsg_get(sizeof(*res));
 	res->remote_ws = req->remote_ws;
 	res->ret = ret;
+	res->lease = lease;
+	res->lease_epoch = epoch;
 
-	pcn_kmsg_post(PCN_KMSG_TYPE_FUTEX_RESPONSE,
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_FUTEX_RESPONSE, PCN_KMSG_PRIO_HIGH,
 			current->remote_nid, res, sizeof(*res));
 	pcn_kmsg_done(req);
 }
@@ -301,6 +741,8 @@ static int __exit_origin_task(struct task_struct *tsk)
 
 static int __exit_remote_task(struct task_struct *tsk)
 {
+	syscall_server_task_exit(tsk);
+
 	if (tsk->exit_code == TASK_PARKED) {
 		/* Skip notifying for back-migrated threads */
 	} else {
@@ -454,7 +896,6 @@ static int __do_back_migration(struct task_struct *tsk, int dst_nid, void __user
 	req->remote_pending = tsk->pending;
 	req->sas_ss_sp = tsk->sas_ss_sp;
 	req->sas_ss_size = tsk->sas_ss_size;
-	memcpy(req->action, tsk->sighand->action, sizeof(req->action));
 
 	ret = copy_from_user(&req->arch.regsets, uregs,
 			regset_size(get_popcorn_node_arch(dst_nid)));
@@ -462,8 +903,11 @@ static int __do_back_migration(struct task_struct *tsk, int dst_nid, void __user
 
 	save_thread_info(&req->arch);
 
-	ret = pcn_kmsg_post(
-			PCN_KMSG_TYPE_TASK_MIGRATE_BACK, dst_nid, req, sizeof(*req));
+	/* The origin should see the writes before the thread comes back */
+	syscall_server_drain(tsk);
+
+	ret = pcn_kmsg_post(PCN_KMSG_TYPE_TASK_MIGRATE_BACK, dst_nid, req,
+			BACK_MIGRATION_REQUEST_SIZE(get_popcorn_node_arch(dst_nid)));
 
 	do_exit(TASK_PARKED);
 }
@@ -491,6 +935,8 @@ static int handle_remote_task_pairing(struct pcn_kmsg_message *msg)
 	tsk->remote_pid = req->my_pid;
 	tsk->remote->remote_tgids[from_nid] = req->my_tgid;
 
+	__flush_clone_requests(tsk->remote, from_nid);
+
 	put_task_struct(tsk);
 out:
 	pcn_kmsg_done(req);
@@ -508,41 +954,77 @@ static int __pair_remote_task(void)
 			PCN_KMSG_TYPE_TASK_PAIRING, current->origin_nid, &req, sizeof(req));
 }
 
+static const char *__clone_exe_path(clone_request_t *req)
+{
+	struct migration_tlv *tlv = find_migration_tlv(req->payload,
+			req->tlv_size, MIGRATION_TLV_EXE_PATH, NULL);
 
-struct remote_thread_params {
+	if (!tlv || !tlv->len || tlv->value[tlv->len - 1] != '\0') return "";
+	return tlv->value;
+}
+
+/* Only the handlers differing from the default are in the request */
+static void __restore_sigactions(clone_request_t *req)
+{
+	struct sighand_struct *sighand = current->sighand;
+	struct migration_tlv *tlv = NULL;
+
+	spin_lock_irq(&sighand->siglock);
+	memset(sighand->action, 0, sizeof(sighand->action));
+	while ((tlv = find_migration_tlv(req->payload, req->tlv_size,
+					MIGRATION_TLV_SIGACTION, tlv))) {
+		struct migration_sigaction sa;
+
+		if (tlv->len != sizeof(sa)) continue;
+		memcpy(&sa, tlv->value, sizeof(sa));
+		if (sa.sig < 1 || sa.sig > _NSIG) continue;
+		sighand->action[sa.sig - 1] = sa.action;
+	}
+	spin_unlock_irq(&sighand->siglock);
+}
+
+struct remote_clone_group {
 	clone_request_t *req;
+	atomic_t count;
+};
+
+struct remote_thread_params {
+	struct remote_clone_group *group;
+	struct clone_thread *thread;
 };
 
 static int remote_thread_main(void *_args)
 {
 	struct remote_thread_params *params = _args;
-	clone_request_t *req = params->req;
+	struct remote_clone_group *group = params->group;
+	clone_request_t *req = group->req;
+	struct clone_thread *thread = params->thread;
 
 #ifdef CONFIG_POPCORN_DEBUG_VERBOSE
 	PSPRINTK("%s [%d] started for [%d/%d]\n", __func__,
-			current->pid, req->origin_pid, PCN_KMSG_FROM_NID(req));
+			current->pid, thread->origin_pid, PCN_KMSG_FROM_NID(req));
 #endif
 
 	current->flags &= ~PF_KTHREAD;	/* Demote from temporary priviledge */
 	current->origin_nid = PCN_KMSG_FROM_NID(req);
-	current->origin_pid = req->origin_pid;
+	current->origin_pid = thread->origin_pid;
 	current->remote = get_task_remote(current);
 
 	set_fs(USER_DS);
 
 	/* Inject thread info here */
-	restore_thread_info(&req->arch, true);
+	restore_thread_info(&thread->arch, true);
 
 	/* XXX: Skip restoring signals and handlers for now */
-	sigorsets(&current->blocked, &current->blocked, &req->remote_blocked);
+	sigorsets(&current->blocked, &current->blocked, &thread->remote_blocked);
 	sigorsets(&current->real_blocked,
-			&current->real_blocked, &req->remote_real_blocked);
+			&current->real_blocked, &thread->remote_real_blocked);
 	sigorsets(&current->saved_sigmask,
-			&current->saved_sigmask, &req->remote_saved_sigmask);
-	current->pending.signal = req->remote_pending.signal;
-	current->sas_ss_sp = req->sas_ss_sp;
-	current->sas_ss_size = req->sas_ss_size;
-	memcpy(current->sighand->action, req->action, sizeof(req->action));
+			&current->saved_sigmask, &thread->remote_saved_sigmask);
+	current->pending.signal = thread->remote_pending.signal;
+	current->sas_ss_sp = thread->sas_ss_sp;
+	current->sas_ss_size = thread->sas_ss_size;
+	__restore_sigactions(req);
 	
 	__pair_remote_task();
 
@@ -550,22 +1032,36 @@ static int remote_thread_main(void *_args)
 			current->pid, my_nid, current->origin_pid, current->origin_nid);
 
 	kfree(params);
-	pcn_kmsg_done(req);
+	if (atomic_dec_and_test(&group->count)) {
+		pcn_kmsg_done(req);
+		kfree(group);
+	}
 
 	return 0;
 	/* Returning from here makes this thread jump into the user-space */
 }
 
+/* Threads in the request are set up in parallel once forked */
 static int __fork_remote_thread(clone_request_t *req)
 {
-	struct remote_thread_params *params;
-	params = kmalloc(sizeof(*params), GFP_KERNEL);
-	params->req = req;
+	struct remote_clone_group *group;
+	int i;
 
-	/* The loop deals with signals between concurrent migration */
-	while (kernel_thread(remote_thread_main, params,
-					CLONE_THREAD | CLONE_SIGHAND | SIGCHLD) < 0) {
-		schedule();
+	group = kmalloc(sizeof(*group), GFP_KERNEL);
+	group->req = req;
+	atomic_set(&group->count, req->nr_threads);
+
+	for (i = 0; i < req->nr_threads; i++) {
+		struct remote_thread_params *params;
+		params = kmalloc(sizeof(*params), GFP_KERNEL);
+		params->group = group;
+		params->thread = clone_request_threads(req) + i;
+
+		/* The loop deals with signals between concurrent migration */
+		while (kernel_thread(remote_thread_main, params,
+						CLONE_THREAD | CLONE_SIGHAND | SIGCHLD) < 0) {
+			schedule();
+		}
 	}
 	return 0;
 }
@@ -582,9 +1078,10 @@ static int __construct_mm(clone_request_t *req, struct remote_context *rc)
 
 	arch_pick_mmap_layout(mm);
 
-	f = filp_open(req->exe_path, O_RDONLY | O_LARGEFILE | O_EXCL, 0);
+	f = filp_open(__clone_exe_path(req), O_RDONLY | O_LARGEFILE | O_EXCL, 0);
 	if (IS_ERR(f)) {
-		PCNPRINTK_ERR("cannot open executable from %s\n", req->exe_path);
+		PCNPRINTK_ERR("cannot open executable from %s\n",
+				__clone_exe_path(req));
 		mmdrop(mm);
 		return -EINVAL;
 	}
@@ -610,6 +1107,8 @@ static int __construct_mm(clone_request_t *req, struct remote_context *rc)
 	rc->mm = mm;  /* No need to increase mm_users due to mm_alloc() */
 	mm->remote = rc;
 
+	vma_server_load_snapshot(rc, req->payload, req->tlv_size, req->vma_version);
+
 	return 0;
 }
 
@@ -627,28 +1126,54 @@ static void __terminate_remote_threads(struct remote_context *rc)
 	rcu_read_unlock();
 }
 
+/**
+ * Remote works of a process are served by the remote worker and a few helper
+ * threads in the thread group. VMA operations and the exit are processed by
+ * the worker in the order they arrive. Clones are independent of each other
+ * and of the VMA operations, so the helpers process them in parallel.
+ */
+static unsigned int remote_helpers = 2;
+module_param(remote_helpers, uint, 0444);
+MODULE_PARM_DESC(remote_helpers, "Number of threads to clone migrated threads in parallel");
+
+static struct pcn_kmsg_message *__dequeue_remote_work(struct remote_context *rc, struct list_head *works)
+{
+	struct work_struct *work = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rc->remote_works_lock, flags);
+	if (!list_empty(works)) {
+		work = list_first_entry(works, struct work_struct, entry);
+		list_del(&work->entry);
+	}
+	spin_unlock_irqrestore(&rc->remote_works_lock, flags);
+
+	return work ? PCN_KMSG_WORK_MSG(work) : NULL;
+}
+
+/* Wait for a work from @works, or from @more if @works is empty */
+static struct pcn_kmsg_message *__wait_remote_work(struct remote_context *rc, struct list_head *works, struct list_head *more)
+{
+	struct pcn_kmsg_message *msg = NULL;
+
+	wait_event_interruptible(rc->remote_works_wait,
+			(msg = __dequeue_remote_work(rc, works)) ||
+			(more && (msg = __dequeue_remote_work(rc, more))) ||
+			rc->stop_remote_worker);
+	return msg;
+}
+
 static void __run_remote_worker(struct remote_context *rc)
 {
+	/* Without helpers, the worker takes care of the clones as well */
+	struct list_head *clones =
+			atomic_read(&rc->nr_remote_helpers) ? NULL : &rc->remote_clones;
+
 	while (!rc->stop_remote_worker) {
-		struct work_struct *work = NULL;
 		struct pcn_kmsg_message *msg;
-		int ret;
-		unsigned long flags;
 
-		ret = wait_for_completion_interruptible_timeout(
-					&rc->remote_works_ready, HZ);
-		if (ret == 0) continue;
-
-		spin_lock_irqsave(&rc->remote_works_lock, flags);
-		if (!list_empty(&rc->remote_works)) {
-			work = list_first_entry(
-					&rc->remote_works, struct work_struct, entry);
-			list_del(&work->entry);
-		}
-		spin_unlock_irqrestore(&rc->remote_works_lock, flags);
-		if (!work) continue;
-
-		msg = ((struct pcn_kmsg_work *)work)->msg;
+		msg = __wait_remote_work(rc, &rc->remote_works, clones);
+		if (!msg) continue;
 
 		switch (msg->header.type) {
 		case PCN_KMSG_TYPE_TASK_MIGRATE:
@@ -666,7 +1191,54 @@ static void __run_remote_worker(struct remote_context *rc)
 		}
 
 		/* msg is released (pcn_kmsg_done()) in each handler */
-		kfree(work);
+	}
+
+	/* Wake up the helpers to leave, and drop the works left behind */
+	wake_up_all(&rc->remote_works_wait);
+	while (atomic_read(&rc->nr_remote_helpers)) {
+		schedule_timeout_interruptible(1);
+	}
+	while (true) {
+		struct pcn_kmsg_message *msg =
+				__dequeue_remote_work(rc, &rc->remote_works);
+		if (!msg) msg = __dequeue_remote_work(rc, &rc->remote_clones);
+		if (!msg) break;
+		pcn_kmsg_done(msg);
+	}
+}
+
+static int remote_helper_main(void *data)
+{
+	struct remote_context *rc = data;
+	struct pcn_kmsg_message *msg;
+
+	current->flags &= ~PF_KTHREAD;
+	current->is_worker = true;
+	current->at_remote = true;
+
+	while (!rc->stop_remote_worker) {
+		msg = __wait_remote_work(rc, &rc->remote_clones, NULL);
+		if (msg) __fork_remote_thread((clone_request_t *)msg);
+	}
+
+	atomic_dec(&rc->nr_remote_helpers);
+
+	/* Returning would jump into the user-space */
+	do_exit(0);
+	return 0;
+}
+
+static void __start_remote_helpers(struct remote_context *rc)
+{
+	int i;
+
+	for (i = 0; i < remote_helpers; i++) {
+		atomic_inc(&rc->nr_remote_helpers);
+		if (kernel_thread(remote_helper_main, rc,
+					CLONE_THREAD | CLONE_SIGHAND | SIGCHLD) < 0) {
+			atomic_dec(&rc->nr_remote_helpers);
+			break;
+		}
 	}
 }
 
@@ -689,7 +1261,7 @@ static int remote_worker_main(void *data)
 	PSPRINTK("%s: [%d] for [%d/%d]\n", __func__,
 			current->pid, req->origin_tgid, PCN_KMSG_FROM_NID(req));
 	PSPRINTK("%s: [%d] %s\n", __func__,
-			current->pid, req->exe_path);
+			current->pid, __clone_exe_path(req));
 
 	current->flags &= ~PF_RANDOMIZE;	/* Disable ASLR for now*/
 	current->flags &= ~PF_KTHREAD;	/* Demote to a user thread */
@@ -716,7 +1288,8 @@ static int remote_worker_main(void *data)
 
 	get_task_remote(current);
 	rc->tgid = current->tgid;
-	
+
+	__start_remote_helpers(rc);
 	__run_remote_worker(rc);
 
 	__terminate_remote_threads(rc);
@@ -727,31 +1300,34 @@ static int remote_worker_main(void *data)
 
 
 
-static void __schedule_remote_work(struct remote_context *rc, struct pcn_kmsg_work *work)
+static void __schedule_remote_work(struct remote_context *rc, struct pcn_kmsg_message *msg)
 {
 	/* Exploit the list_head in work_struct */
-	struct list_head *entry = &((struct work_struct *)work)->entry;
+	struct list_head *entry = &PCN_KMSG_RECV_HDR(msg)->work.entry;
 	unsigned long flags;
 
 	INIT_LIST_HEAD(entry);
 	spin_lock_irqsave(&rc->remote_works_lock, flags);
-	list_add(entry, &rc->remote_works);
+	if (msg->header.type == PCN_KMSG_TYPE_TASK_MIGRATE) {
+		list_add_tail(entry, &rc->remote_clones);
+	} else {
+		list_add_tail(entry, &rc->remote_works);
+	}
 	spin_unlock_irqrestore(&rc->remote_works_lock, flags);
 
-	complete(&rc->remote_works_ready);
+	wake_up_all(&rc->remote_works_wait);
 }
 
-static void clone_remote_thread(struct work_struct *_work)
+static void clone_remote_thread(struct work_struct *work)
 {
-	struct pcn_kmsg_work *work = (struct pcn_kmsg_work *)_work;
-	clone_request_t *req = work->msg;
+	clone_request_t *req = (clone_request_t *)PCN_KMSG_WORK_MSG(work);
 	int nid_from = PCN_KMSG_FROM_NID(req);
 	int tgid_from = req->origin_tgid;
 	struct remote_context *rc;
 	struct remote_context *rc_new =
 			__alloc_remote_context(nid_from, tgid_from, true);
 
-	BUG_ON(!rc_new);
+	BUG_ON(IS_ERR(rc_new));
 
 	__lock_remote_contexts_in(nid_from);
 	rc = __lookup_remote_contexts_in(nid_from, tgid_from);
@@ -768,30 +1344,27 @@ static void clone_remote_thread(struct work_struct *_work)
 
 		params->rc = rc;
 		params->req = req;
-		__build_task_comm(params->comm, req->exe_path);
+		__build_task_comm(params->comm, __clone_exe_path(req));
 		smp_wmb();
 
 		rc->remote_worker =
 				kthread_run(remote_worker_main, params, params->comm);
 	} else {
 		__unlock_remote_contexts_in(nid_from);
-		kfree(rc_new);
+		__free_remote_context(rc_new);
 	}
 
 	/* Schedule this fork request */
-	__schedule_remote_work(rc, work);
+	__schedule_remote_work(rc, (struct pcn_kmsg_message *)req);
 	return;
 }
 
 static int handle_clone_request(struct pcn_kmsg_message *msg)
 {
-	clone_request_t *req = (clone_request_t *)msg;
-	struct pcn_kmsg_work *work = kmalloc(sizeof(*work), GFP_ATOMIC);
-	BUG_ON(!work);
+	struct work_struct *work = &PCN_KMSG_RECV_HDR(msg)->work;
 
-	work->msg = req;
-	INIT_WORK((struct work_struct *)work, clone_remote_thread);
-	queue_work(popcorn_wq, (struct work_struct *)work);
+	INIT_WORK(work, clone_remote_thread);
+	queue_work(popcorn_wq, work);
 
 	return 0;
 }
@@ -818,12 +1391,9 @@ int request_remote_work(pid_t pid, struct pcn_kmsg_message *req)
 	 */
 	if (tsk->at_remote) {
 		struct remote_context *rc = get_task_remote(tsk);
-		struct pcn_kmsg_work *work = kmalloc(sizeof(*work), GFP_ATOMIC);
 
 		BUG_ON(!tsk->is_worker);
-		work->msg = req;
-
-		__schedule_remote_work(rc, work);
+		__schedule_remote_work(rc, req);
 
 		__put_task_remote(rc);
 	} else {
@@ -840,7 +1410,11 @@ out_err:
 	return ret;
 }
 
-static void __process_remote_works(void)
+/**
+ * Serve the remote works for the thread migrated to @dst_nid. Return an error
+ * if the thread could not be sent to @dst_nid.
+ */
+static int __process_remote_works(int dst_nid)
 {
 	bool run = true;
 	BUG_ON(current->at_remote);
@@ -850,12 +1424,19 @@ static void __process_remote_works(void)
 		long ret;
 		ret = wait_for_completion_interruptible_timeout(
 				&current->remote_work_pended, HZ);
-		if (ret == 0) continue; /* timeout */
+		if (ret == 0) {
+			/* Not paired yet; do not wait behind others for good */
+			if (current->remote_pid < 0) {
+				__kick_clone_requests(current->remote, dst_nid);
+			}
+			continue;
+		}
 
 		req = (struct pcn_kmsg_message *)current->remote_work;
 		current->remote_work = NULL;
 		smp_wmb();
 
+		if (IS_ERR(req)) return PTR_ERR(req);
 		if (!req) continue;
 
 		switch (req->header.type) {
@@ -888,15 +1469,167 @@ static void __process_remote_works(void)
 			}
 		}
 	}
+	return 0;
 }
 
 
 /**
- * Send a message to <dst_nid> for migrating a task <task>.
- * This function will ask the remote node to create a thread to host the task.
- * It returns <0 in error case.
+ * Threads migrating to a node are gathered into one clone request while the
+ * previous request to the node is in flight, i.e., until the remote pairs a
+ * thread in it. The process-wide state is sent once for the gathered ones.
+ *
+ * The gathered threads do not wait behind an unpaired request for more than
+ * clone_hold_msecs; they are sent out anyway. If a request cannot be sent,
+ * the threads in it fail to migrate, and the gathered ones are tried next.
  */
-static int __request_clone_remote(int dst_nid, struct task_struct *tsk, void __user *uregs)
+static unsigned int clone_hold_msecs = 1000;
+module_param(clone_hold_msecs, uint, 0644);
+MODULE_PARM_DESC(clone_hold_msecs, "Max time to hold clone requests behind an unpaired one in msec");
+
+/* Wake up the threads of a request that is not sent with @err */
+static void __fail_clone_threads(pid_t *pids, int nr, int err)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		struct task_struct *tsk = __get_task_struct(pids[i]);
+		if (!tsk) continue;
+
+		tsk->remote_work = ERR_PTR(err);
+		complete(&tsk->remote_work_pended);
+		put_task_struct(tsk);
+	}
+}
+
+/* Should be called with clones_lock held */
+static clone_request_t *__detach_clone_request(struct remote_context *rc, int nid, bool force)
+{
+	clone_request_t *req = (clone_request_t *)rc->pending_clones[nid];
+
+	if (!req) return NULL;
+	if (!force && test_bit(nid, rc->clones_in_flight) &&
+			req->nr_threads < MAX_CLONE_GROUP) return NULL;
+
+	rc->pending_clones[nid] = NULL;
+	rc->clones_posted[nid] = jiffies;
+	set_bit(nid, rc->clones_in_flight);
+	return req;
+}
+
+static void __post_clone_request(struct remote_context *rc, int dst_nid, clone_request_t *req)
+{
+	while (req) {
+		pid_t pids[MAX_CLONE_GROUP];
+		int i, nr = req->nr_threads;
+		unsigned long flags;
+		int ret;
+
+		for (i = 0; i < nr; i++) {
+			pids[i] = clone_request_threads(req)[i].origin_pid;
+		}
+		ret = pcn_kmsg_post(PCN_KMSG_TYPE_TASK_MIGRATE, dst_nid, req,
+				CLONE_REQUEST_SIZE(req));
+		if (!ret) break;
+
+		PCNPRINTK_ERR("cannot send %d threads to %d, %d\n", nr, dst_nid, ret);
+		__fail_clone_threads(pids, nr, ret);
+
+		/* Nothing is in flight to the node then */
+		spin_lock_irqsave(&rc->clones_lock, flags);
+		clear_bit(dst_nid, rc->clones_in_flight);
+		req = __detach_clone_request(rc, dst_nid, false);
+		spin_unlock_irqrestore(&rc->clones_lock, flags);
+	}
+}
+
+/* The remote is done with the request in flight. Send out the gathered ones */
+static void __flush_clone_requests(struct remote_context *rc, int nid)
+{
+	clone_request_t *req;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rc->clones_lock, flags);
+	clear_bit(nid, rc->clones_in_flight);
+	req = __detach_clone_request(rc, nid, false);
+	spin_unlock_irqrestore(&rc->clones_lock, flags);
+
+	__post_clone_request(rc, nid, req);
+}
+
+/* Send out the gathered ones if the request in flight is held too long */
+static void __kick_clone_requests(struct remote_context *rc, int nid)
+{
+	clone_request_t *req = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rc->clones_lock, flags);
+	if (test_bit(nid, rc->clones_in_flight) &&
+			time_after(jiffies, rc->clones_posted[nid] +
+				msecs_to_jiffies(clone_hold_msecs))) {
+		req = __detach_clone_request(rc, nid, true);
+	}
+	spin_unlock_irqrestore(&rc->clones_lock, flags);
+
+	__post_clone_request(rc, nid, req);
+}
+
+static struct migration_tlv *__reserve_tlv(clone_request_t *req,
+		unsigned short type, size_t len)
+{
+	struct migration_tlv *tlv = (void *)req->payload + req->tlv_size;
+
+	/* Leave the room for the end mark */
+	if (req->tlv_size + sizeof(*tlv) * 2 + len > CLONE_TLV_SIZE) return NULL;
+
+	tlv->type = type;
+	tlv->len = len;
+	req->tlv_size += sizeof(*tlv) + len;
+	return tlv;
+}
+
+static int __encode_exe_path(clone_request_t *req, struct file *exe_file)
+{
+	struct migration_tlv *tlv = (void *)req->payload + req->tlv_size;
+	size_t max = CLONE_TLV_SIZE - req->tlv_size - sizeof(*tlv) * 2;
+	size_t len;
+
+	if (get_file_path(exe_file, tlv->value, max)) return -ESRCH;
+	len = strnlen(tlv->value, max);
+	if (len == max) return -ENAMETOOLONG;
+
+	tlv = __reserve_tlv(req, MIGRATION_TLV_EXE_PATH, len + 1);
+	return tlv ? 0 : -ENAMETOOLONG;
+}
+
+static int __encode_sigactions(clone_request_t *req, struct task_struct *tsk)
+{
+	struct sighand_struct *sighand = tsk->sighand;
+	int sig;
+	int ret = 0;
+
+	spin_lock_irq(&sighand->siglock);
+	for (sig = 1; sig <= _NSIG; sig++) {
+		struct k_sigaction *ka = &sighand->action[sig - 1];
+		struct migration_sigaction sa;
+		struct migration_tlv *tlv;
+
+		if (ka->sa.sa_handler == SIG_DFL && !ka->sa.sa_flags &&
+				sigisemptyset(&ka->sa.sa_mask)) continue;
+
+		tlv = __reserve_tlv(req, MIGRATION_TLV_SIGACTION, sizeof(sa));
+		if (!tlv) {
+			ret = -ENOSPC;
+			break;
+		}
+		sa.sig = sig;
+		sa.action = *ka;
+		memcpy(tlv->value, &sa, sizeof(sa));
+	}
+	spin_unlock_irq(&sighand->siglock);
+	return ret;
+}
+
+static clone_request_t *__alloc_clone_request(struct task_struct *tsk, int dst_nid)
 {
 	struct mm_struct *mm = get_task_mm(tsk);
 	clone_request_t *req;
@@ -904,15 +1637,17 @@ static int __request_clone_remote(int dst_nid, struct task_struct *tsk, void __u
 
 	req = pcn_kmsg_get(sizeof(*req));
 	if (!req) {
-		ret = -ENOMEM;
+		req = ERR_PTR(-ENOMEM);
 		goto out;
 	}
+	req->tlv_size = 0;
 
 	/* struct mm_struct */
-	if (get_file_path(mm->exe_file, req->exe_path, sizeof(req->exe_path))) {
+	ret = __encode_exe_path(req, mm->exe_file);
+	if (ret) {
 		printk("%s: cannot get path to exe binary\n", __func__);
-		ret = -ESRCH;
 		pcn_kmsg_put(req);
+		req = ERR_PTR(ret);
 		goto out;
 	}
 
@@ -936,27 +1671,89 @@ static int __request_clone_remote(int dst_nid, struct task_struct *tsk, void __u
 
 	req->personality = tsk->personality;
 
-	/* Signals and handlers */
-	req->remote_blocked = tsk->blocked;
-	req->remote_real_blocked = tsk->real_blocked;
-	req->remote_saved_sigmask = tsk->saved_sigmask;
-	req->remote_pending = tsk->pending;
-	req->sas_ss_sp = tsk->sas_ss_sp;
-	req->sas_ss_size = tsk->sas_ss_size;
-	memcpy(req->action, tsk->sighand->action, sizeof(req->action));
+	/* Signal handlers are shared by the threads */
+	ret = __encode_sigactions(req, tsk);
+	if (ret) {
+		pcn_kmsg_put(req);
+		req = ERR_PTR(ret);
+		goto out;
+	}
+
+	/* The VMA layout for the first threads to the node */
+	req->vma_version = atomic_long_read(&tsk->remote->vma_version);
+	if (!tsk->remote->remote_tgids[dst_nid]) {
+		req->tlv_size += vma_server_encode_vmas(mm,
+				req->payload + req->tlv_size,
+				CLONE_TLV_SIZE - req->tlv_size);
+	}
+	__reserve_tlv(req, MIGRATION_TLV_END, 0);
+
+	req->nr_threads = 0;
+
+out:
+	mmput(mm);
+	return req;
+}
+
+/**
+ * Send a message to <dst_nid> for migrating a task <task>.
+ * This function will ask the remote node to create a thread to host the task.
+ * It returns <0 in error case.
+ */
+static int __request_clone_remote(int dst_nid, struct task_struct *tsk, void __user *uregs)
+{
+	struct remote_context *rc = tsk->remote;
+	struct clone_thread *thread;
+	clone_request_t *req;
+	unsigned long flags;
+	int ret;
+
+	thread = kmalloc(sizeof(*thread), GFP_KERNEL);
+	if (!thread) return -ENOMEM;
+
+	thread->origin_pid = tsk->pid;
 
+	/* Signals */
+	thread->remote_blocked = tsk->blocked;
+	thread->remote_real_blocked = tsk->real_blocked;
+	thread->remote_saved_sigmask = tsk->saved_sigmask;
+	thread->remote_pending = tsk->pending;
+	thread->sas_ss_sp = tsk->sas_ss_sp;
+	thread->sas_ss_size = tsk->sas_ss_size;
 
 	/* Register sets from userspace */
-	ret = copy_from_user(&req->arch.regsets, uregs,
+	ret = copy_from_user(&thread->arch.regsets, uregs,
 			regset_size(get_popcorn_node_arch(dst_nid)));
 	BUG_ON(ret != 0);
-	save_thread_info(&req->arch);
+	save_thread_info(&thread->arch);
+
+	spin_lock_irqsave(&rc->clones_lock, flags);
+	while (!rc->pending_clones[dst_nid]) {
+		clone_request_t *spare;
+
+		/* Getting a message buffer might sleep */
+		spin_unlock_irqrestore(&rc->clones_lock, flags);
+		spare = __alloc_clone_request(tsk, dst_nid);
+		if (IS_ERR(spare)) {
+			kfree(thread);
+			return PTR_ERR(spare);
+		}
+		spin_lock_irqsave(&rc->clones_lock, flags);
+		if (!rc->pending_clones[dst_nid]) {
+			rc->pending_clones[dst_nid] = (struct pcn_kmsg_message *)spare;
+		} else {
+			pcn_kmsg_put(spare);
+		}
+	}
+	req = (clone_request_t *)rc->pending_clones[dst_nid];
+	clone_request_threads(req)[req->nr_threads++] = *thread;
 
-	ret = pcn_kmsg_post(PCN_KMSG_TYPE_TASK_MIGRATE, dst_nid, req, sizeof(*req));
+	req = __detach_clone_request(rc, dst_nid, false);
+	spin_unlock_irqrestore(&rc->clones_lock, flags);
 
-out:
-	mmput(mm);
-	return ret;
+	kfree(thread);
+	__post_clone_request(rc, dst_nid, req);
+	return 0;
 }
 
 static int __do_migration(struct task_struct *tsk, int dst_nid, void __user *uregs)
@@ -969,7 +1766,7 @@ static int __do_migration(struct task_struct *tsk, int dst_nid, void __user *ure
 	if (IS_ERR(rc)) return PTR_ERR(rc);
 
 	if (cmpxchg(&tsk->mm->remote, 0, rc)) {
-		kfree(rc);
+		__free_remote_context(rc);
 	} else {
 		/*
 		 * This process is becoming a distributed one if it was not yet.
@@ -992,8 +1789,7 @@ static int __do_migration(struct task_struct *tsk, int dst_nid, void __user *ure
 	ret = __request_clone_remote(dst_nid, tsk, uregs);
 	if (ret) return ret;
 
-	__process_remote_works();
-	return 0;
+	return __process_remote_works(dst_nid);
 }
 
 
@@ -1027,6 +1823,7 @@ DEFINE_KMSG_RW_HANDLER(origin_task_exit, origin_task_exit_t, remote_pid);
 DEFINE_KMSG_RW_HANDLER(remote_task_exit, remote_task_exit_t, origin_pid);
 DEFINE_KMSG_RW_HANDLER(back_migration, back_migration_request_t, origin_pid);
 DEFINE_KMSG_RW_HANDLER(remote_futex_request, remote_futex_request, origin_pid);
+DEFINE_KMSG_WQ_HANDLER(futex_lease_recall);
 
 /**
  * Initialize the process server.
@@ -1049,6 +1846,8 @@ int __init process_server_init(void)
 
 	REGISTER_KMSG_HANDLER(PCN_KMSG_TYPE_FUTEX_REQUEST, remote_futex_request);
 	REGISTER_KMSG_HANDLER(PCN_KMSG_TYPE_FUTEX_RESPONSE, remote_futex_response);
+	REGISTER_KMSG_WQ_HANDLER(PCN_KMSG_TYPE_FUTEX_LEASE_RECALL, futex_lease_recall);
+	REGISTER_KMSG_HANDLER(PCN_KMSG_TYPE_FUTEX_LEASE_RECALL_ACK, futex_lease_recall_ack);
 
 	return 0;
 }
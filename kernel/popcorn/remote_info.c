@@ -31,6 +31,9 @@
 #define RIPRINTK(...)
 #endif
 
+/* Do not hang /proc readers when a node does not respond */
+#define REMOTE_INFO_TIMEOUT (10 * HZ)
+
 int fill_meminfo_response(remote_mem_info_response_t *res)
 {
 	struct sysinfo i;
@@ -168,8 +171,8 @@ static void process_remote_mem_info_request(struct work_struct *work)
 		goto out;
 	}
 
-	ret = pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PROC_MEMINFO_RESPONSE,
-			request->nid, &response, sizeof(response));
+	ret = pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PROC_MEMINFO_RESPONSE,
+			PCN_KMSG_PRIO_LOW, request->nid, &response, sizeof(response));
 	if (ret < 0) {
 		RIPRINTK("%s: failed to send response message\n", __func__);
 		goto out;
@@ -182,14 +185,9 @@ out:
 static int handle_remote_mem_info_response(struct pcn_kmsg_message *inc_msg)
 {
 	remote_mem_info_response_t *response = (remote_mem_info_response_t *)inc_msg;
-	struct wait_station *ws;
-
-	ws = wait_station(response->origin_ws);
-	ws->private = response;
-	smp_mb();
 
-	if (atomic_dec_and_test(&ws->pendings_count))
-		complete(&ws->pendings);
+	if (!wait_station_notify(response->origin_ws, response))
+		pcn_kmsg_done(response);
 
 	return 0;
 }
@@ -204,9 +202,11 @@ remote_mem_info_response_t *send_remote_mem_info_request(unsigned int nid)
 
 	request.origin_ws = ws->id;
 
-	pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PROC_MEMINFO_REQUEST,
-			nid, &request, sizeof(request));
-	response = wait_at_station(ws);
+	pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PROC_MEMINFO_REQUEST,
+			PCN_KMSG_PRIO_LOW, nid, &request, sizeof(request));
+	response = wait_at_station_timeout(ws, REMOTE_INFO_TIMEOUT);
+	if (IS_ERR(response))
+		return NULL;
 
 	return response;
 }
@@ -320,15 +320,17 @@ void send_remote_cpu_info_request(unsigned int nid)
 
 	fill_cpu_info(&request->cpu_info_data);
 
-	pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PROC_CPUINFO_REQUEST,
-			nid, request, sizeof(*request));
+	pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PROC_CPUINFO_REQUEST,
+			PCN_KMSG_PRIO_LOW, nid, request, sizeof(*request));
 
-	response = wait_at_station(ws);
+	response = wait_at_station_timeout(ws, REMOTE_INFO_TIMEOUT);
+	kfree(request);
+	if (IS_ERR(response))
+		return;
 
 	memcpy(saved_cpu_info[nid], &response->cpu_info_data,
 	       sizeof(response->cpu_info_data));
 
-	kfree(request);
 	pcn_kmsg_done(response);
 }
 
@@ -374,8 +376,8 @@ static void process_remote_cpu_info_request(struct work_struct *work)
 		goto out_err;
 	}
 
-	ret = pcn_kmsg_post(PCN_KMSG_TYPE_REMOTE_PROC_CPUINFO_RESPONSE,
-			request->nid, response, sizeof(*response));
+	ret = pcn_kmsg_post_prio(PCN_KMSG_TYPE_REMOTE_PROC_CPUINFO_RESPONSE,
+			PCN_KMSG_PRIO_LOW, request->nid, response, sizeof(*response));
 	if (ret < 0) {
 		RIPRINTK("%s: failed to send response message\n", __func__);
 	}
@@ -387,15 +389,9 @@ out_err:
 static int handle_remote_cpu_info_response(struct pcn_kmsg_message *inc_msg)
 {
 	remote_cpu_info_data_t *response = (remote_cpu_info_data_t *)inc_msg;
-	struct wait_station *ws;
-
-	ws = wait_station(response->origin_ws);
-	ws->private = response;
-
-	smp_mb();
 
-	if (atomic_dec_and_test(&ws->pendings_count))
-		complete(&ws->pendings);
+	if (!wait_station_notify(response->origin_ws, response))
+		pcn_kmsg_done(response);
 
 	return 0;
 }
@@ -180,9 +180,13 @@ static int get_remote_popcorn_ps_load(struct task_struct *tsk, int origin_nid, i
 	};
 	remote_ps_response_t *res;
 
-	pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PROC_PS_REQUEST,
-			origin_nid, &req, sizeof(req));
-	res = wait_at_station(ws);
+	pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PROC_PS_REQUEST,
+			PCN_KMSG_PRIO_LOW, origin_nid, &req, sizeof(req));
+	res = wait_at_station_timeout(ws, 10 * HZ);
+	if (IS_ERR(res)) {
+		*uload = *sload = 0;
+		return PTR_ERR(res);
+	}
 
 	*uload = res->uload;
 	*sload = res->sload;
@@ -207,22 +211,17 @@ static void process_remote_ps_request(struct work_struct *work)
 		popcorn_ps_load(tsk, &res.uload, &res.sload);
 		put_task_struct(tsk);
 	}
-	pcn_kmsg_send(PCN_KMSG_TYPE_REMOTE_PROC_PS_RESPONSE,
-			req->nid, &res, sizeof(res));
+	pcn_kmsg_send_prio(PCN_KMSG_TYPE_REMOTE_PROC_PS_RESPONSE,
+			PCN_KMSG_PRIO_LOW, req->nid, &res, sizeof(res));
 	END_KMSG_WORK(req);
 }
 
 static void process_remote_ps_response(struct work_struct *work)
 {
-	struct pcn_kmsg_work *w = (struct pcn_kmsg_work *)work;
-	remote_ps_response_t *res = w->msg;
-	struct wait_station *ws = wait_station(res->origin_ws);
-
-	ws->private = res;
-	smp_mb();
+	START_KMSG_WORK(remote_ps_response_t, res, work);
 
-	complete(&ws->pendings);
-	kfree(w);
+	if (!wait_station_notify(res->origin_ws, res))
+		pcn_kmsg_done(res);
 }
 
 #define PROC_BUFFER_PS 8192
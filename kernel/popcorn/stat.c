@@ -61,6 +61,15 @@ void account_pcn_rdma_read(size_t size)
 }
 
 void fh_action_stat(struct seq_file *seq, void *);
+void wait_station_stat(struct seq_file *seq, void *);
+void fault_ahead_stat(struct seq_file *seq, void *);
+void huge_page_stat(struct seq_file *seq, void *);
+void invalidate_batch_stat(struct seq_file *seq, void *);
+void page_info_stat(struct seq_file *seq, void *);
+void fault_handle_stat(struct seq_file *seq, void *);
+void vma_server_stat(struct seq_file *seq, void *);
+void futex_lease_stat(struct seq_file *seq, void *);
+void syscall_stat(struct seq_file *seq, void *);
 
 static int __show_stats(struct seq_file *seq, void *v)
 {
@@ -120,6 +129,15 @@ static int __show_stats(struct seq_file *seq, void *v)
 	seq_printf(seq, "---------------------------------------------------------------------------\n");
 
 	fh_action_stat(seq, v);
+	wait_station_stat(seq, v);
+	fault_ahead_stat(seq, v);
+	huge_page_stat(seq, v);
+	invalidate_batch_stat(seq, v);
+	page_info_stat(seq, v);
+	fault_handle_stat(seq, v);
+	vma_server_stat(seq, v);
+	futex_lease_stat(seq, v);
+	syscall_stat(seq, v);
 #endif
 	return 0;
 }
@@ -140,6 +158,15 @@ static ssize_t __write_stats(struct file *file, const char __user *buffer, size_
 		recv_stats[i] = 0;
 	}
 	fh_action_stat(NULL, NULL);
+	wait_station_stat(NULL, NULL);
+	fault_ahead_stat(NULL, NULL);
+	huge_page_stat(NULL, NULL);
+	invalidate_batch_stat(NULL, NULL);
+	page_info_stat(NULL, NULL);
+	fault_handle_stat(NULL, NULL);
+	vma_server_stat(NULL, NULL);
+	futex_lease_stat(NULL, NULL);
+	syscall_stat(NULL, NULL);
 
 	return size;
 }
@@ -160,6 +187,32 @@ static struct file_operations stats_ops = {
 
 static struct proc_dir_entry *proc_entry = NULL;
 
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+/**
+ * Per-process fault latency histograms and remote fault heat maps
+ */
+void process_server_fault_stat(struct seq_file *seq, void *);
+
+static int __show_fault_stats(struct seq_file *seq, void *v)
+{
+	process_server_fault_stat(seq, v);
+	return 0;
+}
+
+static int __open_fault_stats(struct inode *inode, struct file *file)
+{
+	return single_open(file, __show_fault_stats, inode->i_private);
+}
+
+static struct file_operations fault_stats_ops = {
+	.owner = THIS_MODULE,
+	.open = __open_fault_stats,
+	.read = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+#endif
+
 int statistics_init(void)
 {
 	proc_entry = proc_create("popcorn_stat", S_IRUGO | S_IWUGO, NULL, &stats_ops);
@@ -167,5 +220,10 @@ int statistics_init(void)
 		printk(KERN_ERR"cannot create proc_fs entry for popcorn stats\n");
 		return -ENOMEM;
 	}
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+	if (!proc_create("popcorn_faults", S_IRUGO, NULL, &fault_stats_ops)) {
+		printk(KERN_ERR"cannot create proc_fs entry for popcorn faults\n");
+	}
+#endif
 	return 0;
 }
@@ -7,7 +7,446 @@
 #include <linux/unistd.h>
 #include <linux/eventpoll.h>
 #include <linux/file.h>
+#include <linux/fdtable.h>
+#include <linux/fs.h>
 #include <linux/types.h>
+#include <linux/net.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/module.h>
+
+#include <popcorn/stat.h>
+
+/**
+ * Asynchronous writes
+ *
+ * Small write()s to sockets from remote threads are copied into a batch and
+ * return right away. Batches are kept per socket in the remote context, so
+ * the writes to a socket from all the threads stay in order. The first write
+ * goes out immediately, and the writes following while it is in flight are
+ * accumulated and sent together when the origin acknowledges the previous
+ * batch. writev() and sendfile() are always forwarded.
+ *
+ * The origin sends the data out in full or fails, as a blocking write does.
+ * A failure is kept at the remote and returned by the next write to the fd.
+ * So, only the sockets that the origin reports to be blocking are batched;
+ * writes to nonblocking ones are forwarded to keep their semantics.
+ *
+ * A batch is bound to the file that the fd referred to when the origin
+ * reported it, and fails as a whole if the fd refers to another file by the
+ * time the batch arrives. A thread drains the batches it wrote to before
+ * forwarding any syscall, and the batch of an fd is drained before the fd
+ * is closed, replaced, or written synchronously.
+ */
+static bool async_writes = true;
+module_param(async_writes, bool, 0644);
+MODULE_PARM_DESC(async_writes, "Write to sockets asynchronously from remote threads");
+
+#define MAX_ASYNC_WRITE (SYSCALL_BATCH_SIZE / 4)
+
+/* Leave room for the source address after the datagram */
+#define RECVFROM_DATA_SIZE (SYSCALL_DATA_SIZE - sizeof(struct sockaddr_storage))
+
+struct syscall_batch {
+	spinlock_t lock;
+	int fd;
+	uint64_t file_id;		/* The file that @fd refers to at the origin */
+	syscall_batch_t *pending;
+	int filling;			/* Threads copying into @pending */
+	unsigned long posted;
+	unsigned long acked;
+	wait_queue_head_t wait;
+
+	int error;
+};
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic_long_t __nr_async_writes = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_async_bytes = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_batches = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_drain_waits = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_inline_calls = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_inline_bytes = ATOMIC_LONG_INIT(0);
+#define SYSCALL_STAT_INC(x) atomic_long_inc(&(x))
+#define SYSCALL_STAT_ADD(x, v) atomic_long_add(v, &(x))
+#else
+#define SYSCALL_STAT_INC(x)
+#define SYSCALL_STAT_ADD(x, v)
+#endif
+
+static inline size_t __batch_entry_size(size_t count)
+{
+	return ALIGN(sizeof(struct syscall_batch_entry) + count, 8);
+}
+
+static inline bool __batch_in_flight(struct syscall_batch *b)
+{
+	return b->posted != b->acked;
+}
+
+static struct syscall_batch *__get_syscall_batch(struct remote_context *rc, unsigned int fd, bool create)
+{
+	struct syscall_batch **batches = READ_ONCE(rc->syscall_batches);
+	struct syscall_batch *b;
+
+	if (fd >= MAX_SOCKET_FDS) return NULL;
+
+	if (!batches) {
+		if (!create) return NULL;
+		batches = kcalloc(MAX_SOCKET_FDS, sizeof(*batches), GFP_KERNEL);
+		if (!batches) return NULL;
+		if (cmpxchg(&rc->syscall_batches, NULL, batches)) {
+			kfree(batches);
+			batches = rc->syscall_batches;
+		}
+	}
+
+	b = READ_ONCE(batches[fd]);
+	if (b || !create) return b;
+
+	b = kzalloc(sizeof(*b), GFP_KERNEL);
+	if (!b) return NULL;
+
+	spin_lock_init(&b->lock);
+	init_waitqueue_head(&b->wait);
+	b->fd = fd;
+	if (cmpxchg(&batches[fd], NULL, b)) {
+		kfree(b);
+		b = batches[fd];
+	}
+	return b;
+}
+
+/* Should be called with the batch lock held */
+static syscall_batch_t *__detach_syscall_batch(struct syscall_batch *b)
+{
+	syscall_batch_t *req = b->pending;
+
+	if (!req || !req->nr || __batch_in_flight(b) || b->filling) return NULL;
+
+	req->fd = b->fd;
+	req->file_id = b->file_id;
+	b->pending = NULL;
+	b->posted++;
+	return req;
+}
+
+static void __post_syscall_batch(int nid, syscall_batch_t *req)
+{
+	SYSCALL_STAT_INC(__nr_batches);
+	pcn_kmsg_post(PCN_KMSG_TYPE_SYSCALL_BATCH, nid, req,
+			offsetof(syscall_batch_t, data) + req->size);
+}
+
+static syscall_batch_t *__alloc_syscall_batch(struct remote_context *rc)
+{
+	syscall_batch_t *req = pcn_kmsg_get(sizeof(*req));
+
+	req->origin_tgid = rc->tgid;
+	req->remote_tgid = current->tgid;
+	req->nr = 0;
+	req->size = 0;
+	return req;
+}
+
+/* Reserve an entry for @count bytes, and return with the batch lock held */
+static struct syscall_batch_entry *__reserve_batch_entry(struct remote_context *rc, struct syscall_batch *b, size_t count, unsigned long *flags)
+{
+	size_t size = __batch_entry_size(count);
+	struct syscall_batch_entry *e;
+	syscall_batch_t *req;
+
+	spin_lock_irqsave(&b->lock, *flags);
+	while (!b->pending || b->pending->size + size > SYSCALL_BATCH_SIZE) {
+		syscall_batch_t *full = b->pending;
+
+		if (!full) {
+			/* Getting a message buffer might sleep */
+			spin_unlock_irqrestore(&b->lock, *flags);
+			req = __alloc_syscall_batch(rc);
+			spin_lock_irqsave(&b->lock, *flags);
+			if (!b->pending) {
+				b->pending = req;
+			} else {
+				pcn_kmsg_put(req);
+			}
+			continue;
+		}
+
+		req = __detach_syscall_batch(b);
+		spin_unlock_irqrestore(&b->lock, *flags);
+
+		if (req) {
+			__post_syscall_batch(current->origin_nid, req);
+		} else {
+			/* Full while the previous one is in flight or filled */
+			SYSCALL_STAT_INC(__nr_drain_waits);
+			wait_event(b->wait, READ_ONCE(b->pending) != full);
+		}
+		spin_lock_irqsave(&b->lock, *flags);
+	}
+
+	req = b->pending;
+	e = (struct syscall_batch_entry *)(req->data + req->size);
+	req->size += size;
+	req->nr++;
+	return e;
+}
+
+static bool __take_syscall_error(struct syscall_batch *b, long *ret)
+{
+	unsigned long flags;
+	bool taken = false;
+
+	spin_lock_irqsave(&b->lock, flags);
+	if (b->error) {
+		*ret = b->error;
+		b->error = 0;
+		taken = true;
+	}
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	if (taken && *ret == -EPIPE) send_sig(SIGPIPE, current, 0);
+	return taken;
+}
+
+/* Remember that the thread has writes to @fd in flight */
+static bool __mark_syscall_fd(struct task_struct *tsk, unsigned int fd)
+{
+	if (!tsk->syscall_fds) {
+		tsk->syscall_fds = kcalloc(BITS_TO_LONGS(MAX_SOCKET_FDS),
+				sizeof(unsigned long), GFP_KERNEL);
+		if (!tsk->syscall_fds) return false;
+	}
+	set_bit(fd, tsk->syscall_fds);
+	return true;
+}
+
+/**
+ * Queue the write to be sent asynchronously. Return false if the write
+ * should be forwarded synchronously instead.
+ */
+static bool __queue_async_write(unsigned int fd, const char __user *buf, size_t count, long *ret)
+{
+	struct remote_context *rc = current->mm->remote;
+	struct syscall_batch *b;
+	struct syscall_batch_entry *e;
+	syscall_batch_t *req;
+	unsigned long flags;
+	bool fault;
+
+	if (!async_writes || !count || count > MAX_ASYNC_WRITE) return false;
+	if (fd >= MAX_SOCKET_FDS || !test_bit(fd, rc->socket_fds)) return false;
+
+	b = __get_syscall_batch(rc, fd, false);
+	if (!b || !__mark_syscall_fd(current, fd)) return false;
+
+	/* Report the failure of the earlier writes to the fd */
+	if (__take_syscall_error(b, ret)) return true;
+
+	e = __reserve_batch_entry(rc, b, count, &flags);
+	b->filling++;
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	fault = copy_from_user(e->data, buf, count);
+	/* The origin skips the entry if the copy failed */
+	e->fd = fault ? -1 : fd;
+	e->size = count;
+
+	spin_lock_irqsave(&b->lock, flags);
+	b->filling--;
+	req = __detach_syscall_batch(b);
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	if (req) {
+		wake_up_all(&b->wait);
+		__post_syscall_batch(current->origin_nid, req);
+	}
+
+	if (fault) {
+		*ret = -EFAULT;
+	} else {
+		SYSCALL_STAT_INC(__nr_async_writes);
+		SYSCALL_STAT_ADD(__nr_async_bytes, count);
+		*ret = count;
+	}
+	return true;
+}
+
+/* Wait until the writes queued to @b so far are acknowledged */
+static void __drain_syscall_batch(struct syscall_batch *b, int nid)
+{
+	syscall_batch_t *req;
+	unsigned long flags;
+	unsigned long target;
+
+	spin_lock_irqsave(&b->lock, flags);
+	target = b->posted;
+	if (b->pending && b->pending->nr) target++;
+	req = __detach_syscall_batch(b);
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	if (req) {
+		wake_up_all(&b->wait);
+		__post_syscall_batch(nid, req);
+	}
+	if ((long)(READ_ONCE(b->acked) - target) >= 0) return;
+
+	SYSCALL_STAT_INC(__nr_drain_waits);
+	wait_event(b->wait, (long)(READ_ONCE(b->acked) - target) >= 0);
+}
+
+void syscall_server_drain(struct task_struct *tsk)
+{
+	struct remote_context *rc = tsk->mm->remote;
+	unsigned int fd;
+
+	if (!tsk->syscall_fds) return;
+
+	for_each_set_bit(fd, tsk->syscall_fds, MAX_SOCKET_FDS) {
+		struct syscall_batch *b = __get_syscall_batch(rc, fd, false);
+
+		clear_bit(fd, tsk->syscall_fds);
+		if (b) __drain_syscall_batch(b, tsk->origin_nid);
+	}
+}
+
+void syscall_server_drain_fd(struct task_struct *tsk, unsigned int fd)
+{
+	struct syscall_batch *b;
+
+	syscall_server_drain(tsk);
+
+	b = __get_syscall_batch(tsk->mm->remote, fd, false);
+	if (b) __drain_syscall_batch(b, tsk->origin_nid);
+}
+
+/* The syscalls taking an fd in @param0 that the batches should precede */
+void syscall_server_drain_for(enum pcn_syscall_types type, uint64_t param0)
+{
+	switch (type) {
+	case PCN_SYSCALL_CLOSE:
+	case PCN_SYSCALL_SHUTDOWN:
+	case PCN_SYSCALL_SETSOCKOPT:
+	case PCN_SYSCALL_FCNTL:
+	case PCN_SYSCALL_IOCTL:
+	case PCN_SYSCALL_WRITEV:
+	case PCN_SYSCALL_SENDFILE64:
+		syscall_server_drain_fd(current, (unsigned int)param0);
+		break;
+	default:
+		syscall_server_drain(current);
+	}
+}
+
+void syscall_server_task_exit(struct task_struct *tsk)
+{
+	/* Nobody will acknowledge if the origin is gone */
+	if (!tsk->mm->remote->stop_remote_worker) {
+		syscall_server_drain(tsk);
+	}
+	kfree(tsk->syscall_fds);
+	tsk->syscall_fds = NULL;
+}
+
+/* Called when the remote context goes away; nothing is in flight by then */
+void syscall_server_free_batches(struct remote_context *rc)
+{
+	int fd;
+
+	if (!rc->syscall_batches) return;
+
+	for (fd = 0; fd < MAX_SOCKET_FDS; fd++) {
+		struct syscall_batch *b = rc->syscall_batches[fd];
+		if (!b) continue;
+		if (b->pending) pcn_kmsg_put(b->pending);
+		kfree(b);
+	}
+	kfree(rc->syscall_batches);
+	rc->syscall_batches = NULL;
+}
+
+/* Keep track of the sockets that the origin hands over */
+void syscall_server_redirected(enum pcn_syscall_types type, uint64_t param0, int ret, bool batchable, uint64_t file_id)
+{
+	struct remote_context *rc = current->mm->remote;
+	unsigned int fd = param0;
+	struct syscall_batch *b;
+	unsigned long flags;
+
+	switch (type) {
+	case PCN_SYSCALL_SOCKET_CREATE:
+	case PCN_SYSCALL_ACCEPT4:
+		if (ret < 0) break;
+		fd = ret;
+		/* Fall through */
+	case PCN_SYSCALL_FCNTL:
+	case PCN_SYSCALL_IOCTL:
+		/* Might have turned O_NONBLOCK on or off */
+		if (fd >= MAX_SOCKET_FDS) break;
+		b = batchable ? __get_syscall_batch(rc, fd, true) : NULL;
+		if (b) {
+			spin_lock_irqsave(&b->lock, flags);
+			b->file_id = file_id;
+			spin_unlock_irqrestore(&b->lock, flags);
+			set_bit(fd, rc->socket_fds);
+		} else {
+			clear_bit(fd, rc->socket_fds);
+		}
+		break;
+	case PCN_SYSCALL_CLOSE:
+		if (fd >= MAX_SOCKET_FDS) break;
+		clear_bit(fd, rc->socket_fds);
+		b = __get_syscall_batch(rc, fd, false);
+		if (b) b->error = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+static void process_syscall_batch_ack(struct work_struct *work)
+{
+	START_KMSG_WORK(syscall_batch_ack_t, ack, work);
+	struct task_struct *tsk = __get_task_struct(ack->remote_tgid);
+	struct mm_struct *mm = NULL;
+	struct syscall_batch *b = NULL;
+	syscall_batch_t *req = NULL;
+	unsigned long flags;
+
+	if (tsk) {
+		mm = get_task_mm(tsk);
+		put_task_struct(tsk);
+	}
+	if (mm && mm->remote) {
+		b = __get_syscall_batch(mm->remote, ack->fd, false);
+	}
+	if (!b) {
+		pr_warn_ratelimited("syscall: drop stray batch ack for %d/%d\n",
+				ack->remote_tgid, ack->fd);
+		goto out;
+	}
+
+	spin_lock_irqsave(&b->lock, flags);
+	if (!__batch_in_flight(b)) {
+		spin_unlock_irqrestore(&b->lock, flags);
+		pr_warn_ratelimited("syscall: drop stray batch ack for %d/%d\n",
+				ack->remote_tgid, ack->fd);
+		goto out;
+	}
+	if (ack->error && !b->error) {
+		b->error = ack->error;
+	}
+	b->acked++;
+	req = __detach_syscall_batch(b);
+	spin_unlock_irqrestore(&b->lock, flags);
+
+	wake_up_all(&b->wait);
+	if (req) __post_syscall_batch(PCN_KMSG_FROM_NID(ack), req);
+out:
+	if (mm) mmput(mm);
+	END_KMSG_WORK(ack);
+}
 
 /* Syscall Definitions are put here*/
 
@@ -27,7 +466,7 @@ DEFINE_SYSCALL_REDIRECT(accept4, PCN_SYSCALL_ACCEPT4, int, fd, struct
 			sockaddr __user*, upper_sockaddr, int __user*,
 			upper_addrlen, int, flag);
 DEFINE_SYSCALL_REDIRECT(shutdown, PCN_SYSCALL_SHUTDOWN, int, fd, int, how);
-DEFINE_SYSCALL_REDIRECT(recvfrom, PCN_SYSCALL_RECVFROM, int, fd, void __user *,
+DEFINE_SYSCALL_REDIRECT(recvfrom_user, PCN_SYSCALL_RECVFROM, int, fd, void __user *,
 			ubuf, size_t, size, unsigned int, flags,
 			struct sockaddr __user *, addr, int __user *, addr_len);
 
@@ -49,10 +488,6 @@ DEFINE_SYSCALL_REDIRECT(select, PCN_SYSCALL_SELECT, int, n, fd_set __user *,
 
 
 /* General fs/driver read/write/open/close calls */
-DEFINE_SYSCALL_REDIRECT(read, PCN_SYSCALL_READ, unsigned int, fd, char __user*,
-			buf, size_t, count);
-DEFINE_SYSCALL_REDIRECT(write, PCN_SYSCALL_WRITE, unsigned int, fd, const char
-			__user *, buf, size_t, count);
 DEFINE_SYSCALL_REDIRECT(open, PCN_SYSCALL_OPEN, const char __user *, filename,
 			int, flags, umode_t, mode);
 DEFINE_SYSCALL_REDIRECT(close, PCN_SYSCALL_CLOSE, unsigned int, fd);
@@ -67,6 +502,170 @@ DEFINE_SYSCALL_REDIRECT(sendfile64, PCN_SYSCALL_SENDFILE64,int, out_fd, int,
 			in_fd, loff_t __user *, offset, size_t, count);
 DEFINE_SYSCALL_REDIRECT(fcntl, PCN_SYSCALL_FCNTL, unsigned int, fd,
 			unsigned int, cmd, unsigned long, arg);
+
+
+/**
+ * Buffer-carrying syscalls
+ *
+ * Passing the user pointer makes the origin fault in the buffer through the
+ * page server page by page. Instead, the data is carried in the messages in
+ * chunks of SYSCALL_DATA_SIZE. A read is continued over the following chunks
+ * only for regular files; for sockets and pipes the first chunk returns what
+ * is available, and the following ones should not block.
+ */
+static syscall_fwd_t *__get_data_syscall(enum pcn_syscall_types type, unsigned int data_size)
+{
+	syscall_fwd_t *req = pcn_kmsg_get(offsetof(syscall_fwd_t, data) + data_size);
+
+	req->origin_pid = current->origin_pid;
+	req->call_type = type;
+	req->flags = SYSCALL_FWD_INLINE;
+	req->data_size = data_size;
+	return req;
+}
+
+/* Forward @req and return the reply */
+static syscall_rep_t *__call_data_syscall(syscall_fwd_t *req)
+{
+	struct wait_station *ws = get_wait_station(current);
+
+	req->remote_ws = ws->id;
+	SYSCALL_STAT_ADD(__nr_inline_bytes, req->data_size);
+	pcn_kmsg_post(PCN_KMSG_TYPE_SYSCALL_FWD, current->origin_nid, req,
+			offsetof(syscall_fwd_t, data) + req->data_size);
+
+	SYSCALL_STAT_INC(__nr_inline_calls);
+	return wait_at_station(ws);
+}
+
+/* Forward @req and copy the data coming back into @in */
+static long __forward_data_syscall(syscall_fwd_t *req, void __user *in)
+{
+	syscall_rep_t *rep = __call_data_syscall(req);
+	long ret = rep->ret;
+
+	if (ret > 0 && in && rep->data_size) {
+		SYSCALL_STAT_ADD(__nr_inline_bytes, rep->data_size);
+		if (copy_to_user(in, rep->data, rep->data_size)) ret = -EFAULT;
+	}
+	pcn_kmsg_done(rep);
+
+	return ret;
+}
+
+long redirect_read(unsigned int fd, char __user *buf, size_t count)
+{
+	size_t done = 0;
+	long ret;
+
+	syscall_server_drain_fd(current, fd);
+	do {
+		size_t size = min_t(size_t, count - done, SYSCALL_DATA_SIZE);
+		syscall_fwd_t *req = __get_data_syscall(PCN_SYSCALL_READ, 0);
+
+		req->param0 = fd;
+		req->param2 = size;
+		if (done) req->flags |= SYSCALL_FWD_CONTINUED;
+
+		ret = __forward_data_syscall(req, buf + done);
+		if (ret <= 0) break;
+		done += ret;
+		if (ret < size) break;
+	} while (done < count);
+
+	return done ? done : ret;
+}
+
+static long __redirect_write(unsigned int fd, const char __user *buf, size_t count)
+{
+	size_t done = 0;
+	long ret;
+
+	syscall_server_drain_fd(current, fd);
+	do {
+		size_t size = min_t(size_t, count - done, SYSCALL_DATA_SIZE);
+		syscall_fwd_t *req = __get_data_syscall(PCN_SYSCALL_WRITE, size);
+
+		if (copy_from_user(req->data, buf + done, size)) {
+			pcn_kmsg_put(req);
+			ret = -EFAULT;
+			break;
+		}
+		req->param0 = fd;
+		req->param2 = size;
+
+		ret = __forward_data_syscall(req, NULL);
+		if (ret <= 0) break;
+		done += ret;
+		if (ret < size) break;
+	} while (done < count);
+
+	return done ? done : ret;
+}
+
+long redirect_write(unsigned int fd, const char __user *buf, size_t count)
+{
+	long ret;
+
+	if (__queue_async_write(fd, buf, count, &ret)) return ret;
+	return __redirect_write(fd, buf, count);
+}
+
+/**
+ * The source address comes back after the datagram in the reply, and is
+ * copied out here as move_addr_to_user() does. The origin never sees the
+ * user pointers.
+ */
+long redirect_recvfrom(int fd, void __user *ubuf, size_t size, unsigned flags,
+		struct sockaddr __user *addr, int __user *addr_len)
+{
+	syscall_fwd_t *req;
+	syscall_rep_t *rep;
+	int ulen = 0;
+	long ret;
+
+	/* A datagram cannot be split over chunks */
+	if (size > RECVFROM_DATA_SIZE) {
+		return redirect_recvfrom_user(fd, ubuf, size, flags, addr, addr_len);
+	}
+
+	if (addr) {
+		if (get_user(ulen, addr_len)) return -EFAULT;
+		if (ulen < 0) return -EINVAL;
+	}
+
+	syscall_server_drain_fd(current, fd);
+
+	req = __get_data_syscall(PCN_SYSCALL_RECVFROM, 0);
+	req->param0 = fd;
+	req->param2 = size;
+	req->param3 = flags;
+	req->param4 = !!addr;	/* Whether to return the source address */
+	req->param5 = 0;
+
+	rep = __call_data_syscall(req);
+	ret = rep->ret;
+	if (ret < 0) goto out;
+
+	SYSCALL_STAT_ADD(__nr_inline_bytes, rep->data_size);
+	if (ret > 0 && copy_to_user(ubuf, rep->data, ret)) {
+		ret = -EFAULT;
+		goto out;
+	}
+	if (addr) {
+		int len = min(ulen, rep->addr_len);
+
+		if (len && copy_to_user(addr, rep->data + (ret > 0 ? ret : 0), len)) {
+			ret = -EFAULT;
+		} else if (put_user(rep->addr_len, addr_len)) {
+			ret = -EFAULT;
+		}
+	}
+out:
+	pcn_kmsg_done(rep);
+	return ret;
+}
+
 /**
  * Syscalls needed in the kernel
  * */
@@ -104,11 +703,224 @@ extern long sys_select(int n, fd_set __user *inp, fd_set __user *outp,
 			fd_set __user *exp, struct timeval __user *tvp);
 extern long sys_fcntl(unsigned int fd, unsigned int cmd, unsigned long arg);
 
+/**
+ * Whether writes to @fd may be batched, i.e., it is a blocking socket. The
+ * file is identified by @file_id so that batches to a reused fd fail.
+ */
+static bool __fd_batchable(int fd, uint64_t *file_id)
+{
+	struct socket *sock;
+	bool batchable;
+	int err;
+
+	if (fd < 0) return false;
+
+	sock = sockfd_lookup(fd, &err);
+	if (!sock) return false;
+
+	batchable = !(sock->file->f_flags & O_NONBLOCK);
+	*file_id = (uint64_t)(unsigned long)sock->file;
+	sockfd_put(sock);
+	return batchable;
+}
+
+/* Report the fd that a redirected syscall created or changed */
+static bool __redirect_batchable(syscall_fwd_t *req, int ret, uint64_t *file_id)
+{
+	switch (req->call_type) {
+	case PCN_SYSCALL_SOCKET_CREATE:
+	case PCN_SYSCALL_ACCEPT4:
+		return __fd_batchable(ret, file_id);
+	case PCN_SYSCALL_FCNTL:
+	case PCN_SYSCALL_IOCTL:
+		return __fd_batchable((int)req->param0, file_id);
+	default:
+		return false;
+	}
+}
+
+/* Get the socket file of @fd in @tsk if it is still the reported one */
+static struct file *__get_batch_file(struct task_struct *tsk, int fd, uint64_t file_id)
+{
+	struct file *file = NULL;
+
+	task_lock(tsk);
+	if (tsk->files) {
+		rcu_read_lock();
+		file = fcheck_files(tsk->files, fd);
+		if (file && ((uint64_t)(unsigned long)file != file_id ||
+					!get_file_rcu(file))) {
+			file = NULL;
+		}
+		rcu_read_unlock();
+	}
+	task_unlock(tsk);
+	return file;
+}
+
+/**
+ * Send out @data in full as a blocking write does. The remote has returned
+ * already, so even a socket turned nonblocking meanwhile at the origin is
+ * written in full.
+ */
+static long __write_async(struct socket *sock, unsigned char *data, size_t size)
+{
+	long ret = 0;
+
+	while (size) {
+		struct kvec vec = {
+			.iov_base = data,
+			.iov_len = size,
+		};
+		struct msghdr msg = {
+			.msg_flags = MSG_NOSIGNAL,
+		};
+		ret = kernel_sendmsg(sock, &msg, &vec, 1, size);
+		if (ret < 0) break;
+		data += ret;
+		size -= ret;
+	}
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * Batches are run by workers at the origin rather than the paired threads,
+ * as the writes of a batch may come from any thread of the remote. A batch
+ * stops at the first failure, and fails as a whole with -EBADF if the fd
+ * no longer refers to the reported socket.
+ */
+static void process_syscall_batch(struct work_struct *work)
+{
+	START_KMSG_WORK(syscall_batch_t, req, work);
+	syscall_batch_ack_t *ack = pcn_kmsg_get(sizeof(*ack));
+	struct task_struct *tsk = __get_task_struct(req->origin_tgid);
+	struct file *file = NULL;
+	struct socket *sock = NULL;
+	unsigned int offset = 0;
+	int i, err;
+
+	ack->remote_tgid = req->remote_tgid;
+	ack->fd = req->fd;
+	ack->nr = req->nr;
+	ack->error = 0;
+
+	if (tsk) {
+		file = __get_batch_file(tsk, req->fd, req->file_id);
+		put_task_struct(tsk);
+	}
+	if (file) sock = sock_from_file(file, &err);
+	if (!sock) {
+		ack->error = -EBADF;
+		goto out;
+	}
+
+	for (i = 0; i < req->nr; i++) {
+		struct syscall_batch_entry *e =
+			(struct syscall_batch_entry *)(req->data + offset);
+
+		offset += __batch_entry_size(e->size);
+		if (e->fd != req->fd) continue;
+
+		ack->error = __write_async(sock, e->data, e->size);
+		if (ack->error) break;
+	}
+
+out:
+	if (file) fput(file);
+	pcn_kmsg_post(PCN_KMSG_TYPE_SYSCALL_BATCH_ACK, PCN_KMSG_FROM_NID(req),
+			ack, sizeof(*ack));
+	END_KMSG_WORK(req);
+}
+
+static bool __regular_file(unsigned int fd)
+{
+	struct fd f = fdget(fd);
+	bool regular = f.file && S_ISREG(file_inode(f.file)->i_mode);
+
+	fdput(f);
+	return regular;
+}
+
+/* Run the syscall over the buffers in the messages */
+static syscall_rep_t *__process_data_syscall(syscall_fwd_t *req)
+{
+	size_t size = 0;
+	size_t rep_size = 0;
+	syscall_rep_t *rep;
+	struct sockaddr_storage address;
+	int addr_len = sizeof(address);
+	bool want_addr = false;
+	mm_segment_t fs;
+	long ret;
+
+	switch (req->call_type) {
+	case PCN_SYSCALL_READ:
+		size = min_t(size_t, req->param2, SYSCALL_DATA_SIZE);
+		rep_size = size;
+		break;
+	case PCN_SYSCALL_RECVFROM:
+		size = min_t(size_t, req->param2, RECVFROM_DATA_SIZE);
+		want_addr = req->param4;
+		rep_size = size + (want_addr ? sizeof(address) : 0);
+		break;
+	default:
+		break;
+	}
+	rep = pcn_kmsg_get(offsetof(syscall_rep_t, data) + rep_size);
+	rep->addr_len = 0;
+
+	if ((req->flags & SYSCALL_FWD_CONTINUED) && !__regular_file(req->param0)) {
+		ret = 0;
+		goto out;
+	}
+
+	/* Only the kernel buffers are passed under KERNEL_DS */
+	fs = get_fs();
+	set_fs(KERNEL_DS);
+	switch (req->call_type) {
+	case PCN_SYSCALL_READ:
+		ret = sys_read((unsigned int)req->param0,
+				(char __user *)rep->data, size);
+		break;
+	case PCN_SYSCALL_WRITE:
+		ret = sys_write((unsigned int)req->param0,
+				(const char __user *)req->data,
+				min_t(size_t, req->data_size, SYSCALL_DATA_SIZE));
+		break;
+	case PCN_SYSCALL_RECVFROM:
+		ret = sys_recvfrom((int)req->param0, (void __user *)rep->data, size,
+				(unsigned)req->param3,
+				want_addr ? (struct sockaddr __user *)&address : NULL,
+				want_addr ? (int __user *)&addr_len : NULL);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	set_fs(fs);
+
+out:
+	rep->ret = ret;
+	rep->data_size = (size && ret > 0) ? ret : 0;
+	if (want_addr && ret >= 0) {
+		addr_len = min_t(int, addr_len, sizeof(address));
+		memcpy(rep->data + rep->data_size, &address, addr_len);
+		rep->addr_len = addr_len;
+		rep->data_size += addr_len;
+	}
+	return rep;
+}
+
 int process_remote_syscall(struct pcn_kmsg_message *msg)
 {
 	int retval = 0;
 	syscall_fwd_t *req = (syscall_fwd_t *)msg;
-	syscall_rep_t *rep = kmalloc(sizeof(*rep), GFP_KERNEL);
+	syscall_rep_t *rep = NULL;
+
+	if (req->flags & SYSCALL_FWD_INLINE) {
+		rep = __process_data_syscall(req);
+		retval = rep->ret;
+		goto out;
+	}
 
 	/*Call the original system call and pass in delivered params. */
 	switch(req->call_type) {
@@ -215,26 +1027,34 @@ int process_remote_syscall(struct pcn_kmsg_message *msg)
 	default:
 		retval = -EINVAL;
 	}
+	rep = pcn_kmsg_get(offsetof(syscall_rep_t, data));
+	rep->ret = retval;
+	rep->addr_len = 0;
+	rep->data_size = 0;
+out:
 	rep->origin_pid = current->origin_pid;
 	rep->remote_ws = req->remote_ws;
-	rep->ret = retval;
-	pcn_kmsg_send(PCN_KMSG_TYPE_SYSCALL_REP, current->remote_nid, rep,
-		      sizeof(*rep));
-	kfree(rep);
+	rep->file_id = 0;
+	rep->batchable = __redirect_batchable(req, retval, &rep->file_id);
+	pcn_kmsg_post_prio(PCN_KMSG_TYPE_SYSCALL_REP, PCN_KMSG_PRIO_HIGH,
+			current->remote_nid, rep,
+			offsetof(syscall_rep_t, data) + rep->data_size);
+	pcn_kmsg_done(req);
 	return retval;
 }
 
 static int handle_syscall_reply(struct pcn_kmsg_message *msg)
 {
 	syscall_rep_t *rep = (syscall_rep_t *)msg;
-	struct wait_station *ws = wait_station(rep->remote_ws);
 
-	ws->private = rep;
-	complete(&ws->pendings);
+	if (!wait_station_notify(rep->remote_ws, rep))
+		pcn_kmsg_done(rep);
 	return 0;
 }
 
 DEFINE_KMSG_RW_HANDLER(syscall_fwd, syscall_fwd_t, origin_pid);
+DEFINE_KMSG_WQ_HANDLER(syscall_batch);
+DEFINE_KMSG_WQ_HANDLER(syscall_batch_ack);
 
 int __init syscall_server_init(void)
 {
@@ -242,5 +1062,36 @@ int __init syscall_server_init(void)
 			      syscall_fwd);
 	REGISTER_KMSG_HANDLER(PCN_KMSG_TYPE_SYSCALL_REP,
 			      syscall_reply);
+	REGISTER_KMSG_WQ_HANDLER(PCN_KMSG_TYPE_SYSCALL_BATCH,
+			      syscall_batch);
+	REGISTER_KMSG_WQ_HANDLER(PCN_KMSG_TYPE_SYSCALL_BATCH_ACK,
+			      syscall_batch_ack);
 	return 0;
 }
+
+void syscall_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	if (seq) {
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_async_writes),
+				(unsigned long long)atomic_long_read(&__nr_async_bytes),
+				"async writes, bytes");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_batches),
+				(unsigned long long)atomic_long_read(&__nr_drain_waits),
+				"syscall batches, waits");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_inline_calls),
+				(unsigned long long)atomic_long_read(&__nr_inline_bytes),
+				"inline syscalls, bytes");
+	} else {
+		atomic_long_set(&__nr_async_writes, 0);
+		atomic_long_set(&__nr_async_bytes, 0);
+		atomic_long_set(&__nr_batches, 0);
+		atomic_long_set(&__nr_drain_waits, 0);
+		atomic_long_set(&__nr_inline_calls, 0);
+		atomic_long_set(&__nr_inline_bytes, 0);
+	}
+#endif
+}
@@ -16,6 +16,18 @@
 
 int process_remote_syscall(struct pcn_kmsg_message *msg);
 
+/**
+ * Asynchronous writes to a socket are sent in batches. Forwarded syscalls
+ * drain the batches that the thread wrote to, and the batch of the fd they
+ * work on, first so that the origin sees them in order.
+ */
+void syscall_server_drain(struct task_struct *tsk);
+void syscall_server_drain_fd(struct task_struct *tsk, unsigned int fd);
+void syscall_server_drain_for(enum pcn_syscall_types type, uint64_t param0);
+void syscall_server_task_exit(struct task_struct *tsk);
+void syscall_server_free_batches(struct remote_context *rc);
+void syscall_server_redirected(enum pcn_syscall_types type, uint64_t param0, int ret, bool batchable, uint64_t file_id);
+
 /*This Set of macros allows for forwarding of syscalls of up to 6 arguments,
  *with 12 arguments being input altogether, eg. SET_REQ_PARAMS(int, a, char, b)
  *This segment will fill in the RPC syscall definitions with the correct
@@ -102,21 +114,33 @@ int process_remote_syscall(struct pcn_kmsg_message *msg);
 inline int redirect_##syscall(LIST_SYSCALL_ARGS(__VA_ARGS__))		\
 {									\
 	int ret = 0;							\
-	syscall_fwd_t *req = kmalloc(sizeof(syscall_fwd_t), GFP_KERNEL);\
+	uint64_t param0;						\
+	bool batchable;							\
+	uint64_t file_id;						\
+	syscall_fwd_t *req;						\
 	syscall_rep_t *rep = NULL;					\
-	struct wait_station *ws = get_wait_station(current);		\
+	struct wait_station *ws;					\
+	req = pcn_kmsg_get(offsetof(syscall_fwd_t, data));		\
+	SET_REQ_PARAMS_ARGS(REVERSE(NUM_ARGS(__VA_ARGS__), __VA_ARGS__))\
+	param0 = req->param0;						\
+	syscall_server_drain_for(syscall_type, param0);			\
+	ws = get_wait_station(current);					\
 	req->origin_pid = current->origin_pid;				\
 	req->remote_ws = ws->id;					\
-	SET_REQ_PARAMS_ARGS(REVERSE(NUM_ARGS(__VA_ARGS__), __VA_ARGS__))\
 	req->call_type = syscall_type;					\
-	ret = pcn_kmsg_send(PCN_KMSG_TYPE_SYSCALL_FWD, (my_nid==0)?1:0, req,		\
-			    sizeof(*req));				\
-	kfree(req);							\
+	req->flags = 0;							\
+	req->data_size = 0;						\
+	pcn_kmsg_post(PCN_KMSG_TYPE_SYSCALL_FWD, current->origin_nid,	\
+			req, offsetof(syscall_fwd_t, data));		\
 	rep = wait_at_station(ws);					\
 	ret = rep->ret;							\
+	batchable = rep->batchable;					\
+	file_id = rep->file_id;						\
+	pcn_kmsg_done(rep);						\
+	syscall_server_redirected(syscall_type, param0, ret,		\
+			batchable, file_id);				\
 	/*printk(KERN_INFO "On ORIGIN: syscall redirect called for #syscall");*/\
 	return ret;							\
 }
 
-
 #endif
@@ -11,7 +11,68 @@
 #include <popcorn/pcn_kmsg.h>
 #include <popcorn/regset.h>
 
-#define FAULTS_HASH 31
+#define FUTEX_LEASE_HASH 16
+#define MAX_SOCKET_FDS 1024
+
+/**
+ * Bucket of the faults in flight. Buckets are cacheline-aligned not to
+ * bounce between CPUs faulting on neighbouring pages.
+ */
+struct fault_bucket {
+	spinlock_t lock;
+	struct hlist_head faults;
+#ifdef CONFIG_POPCORN_STAT
+	u64 locked_at;
+#endif
+} ____cacheline_aligned_in_smp;
+
+#define MIN_FAULT_BUCKETS 64
+#define MAX_FAULT_BUCKETS 4096
+
+/**
+ * Fault-ahead state of a VMA. Remote faults over the VMA in a fixed stride
+ * fetch up to @window more pages along the stride together.
+ */
+#define FAULT_AHEAD_SLOTS 8
+#define MAX_FAULT_AHEAD 8
+
+struct fault_ahead {
+	unsigned long vm_start;
+	unsigned long last_addr;
+	long stride;			/* in pages */
+	unsigned int window;
+	unsigned int nr_prefetched;	/* by the last fault */
+};
+
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+/**
+ * Fault latencies of a process in log2 nanosecond buckets by the fault type,
+ * and the VMAs and instructions causing remote faults the most. The heat maps
+ * are lossy; a newcomer evicts the coldest entry in its neighbourhood.
+ */
+enum {
+	FAULT_TYPE_WRITE = 0x01,
+	FAULT_TYPE_REMOTE = 0x02,
+	FAULT_TYPE_RETRY = 0x04,
+	FAULT_TYPES = 0x08,
+};
+#define FAULT_HIST_BUCKETS 32
+
+struct fault_hist {
+	unsigned long counts[FAULT_TYPES][FAULT_HIST_BUCKETS];
+};
+
+#define FAULT_HEAT_SLOTS 64
+#define FAULT_HEAT_PROBES 4
+
+struct fault_heat_map {
+	spinlock_t lock;
+	struct {
+		unsigned long key;
+		unsigned long count;
+	} slots[FAULT_HEAT_SLOTS];
+};
+#endif
 
 /**
  * Remote execution context
@@ -28,22 +89,52 @@ struct remote_context {
 	struct radix_tree_root pages;
 
 	/* For page replication protocol */
-	spinlock_t faults_lock[FAULTS_HASH];
-	struct hlist_head faults[FAULTS_HASH];
+	unsigned int nr_fault_buckets;	/* Power of two */
+	struct fault_bucket *faults;
+
+	spinlock_t fault_ahead_lock;
+	struct fault_ahead fault_ahead[FAULT_AHEAD_SLOTS];
+
+	/* Futex words known to have no waiter */
+	spinlock_t futex_leases_lock;
+	struct hlist_head futex_leases[FUTEX_LEASE_HASH];
+	int futex_lease_waiters[FUTEX_LEASE_HASH];
+	unsigned int nr_futex_leases;
+	unsigned long futex_lease_epoch;
+
+	/* Forwarded fds known to be sockets, and their write batches, at the remote */
+	DECLARE_BITMAP(socket_fds, MAX_SOCKET_FDS);
+	struct syscall_batch **syscall_batches;
+
+	/* Clone requests being gathered for each node, at the origin */
+	spinlock_t clones_lock;
+	struct pcn_kmsg_message *pending_clones[MAX_POPCORN_NODES];
+	DECLARE_BITMAP(clones_in_flight, MAX_POPCORN_NODES);
+	unsigned long clones_posted[MAX_POPCORN_NODES];	/* In jiffies */
 
 	/* For VMA management */
 	spinlock_t vmas_lock;
 	struct list_head vmas;
+	struct vma_snapshot *vma_snapshot;	/* at remote */
+	atomic_long_t vma_version;		/* at origin */
 
 	/* Remote worker */
 	bool stop_remote_worker;
 
 	struct task_struct *remote_worker;
-	struct completion remote_works_ready;
+	wait_queue_head_t remote_works_wait;
 	spinlock_t remote_works_lock;
-	struct list_head remote_works;
+	struct list_head remote_works;		/* In order by the worker */
+	struct list_head remote_clones;		/* In parallel by the helpers */
+	atomic_t nr_remote_helpers;
 
 	pid_t remote_tgids[MAX_POPCORN_NODES];
+
+#ifdef CONFIG_POPCORN_STAT_PGFAULTS
+	struct fault_hist __percpu *fault_hist;
+	struct fault_heat_map fault_vmas;	/* by vm_start */
+	struct fault_heat_map fault_ips;	/* by instruction address */
+#endif
 };
 
 struct remote_context *__get_mm_remote(struct mm_struct *mm);
@@ -67,15 +158,93 @@ bool __put_task_remote(struct remote_context *rc);
 	struct sigpending remote_pending;\
 	unsigned long sas_ss_sp;\
 	size_t sas_ss_size;\
-	struct k_sigaction action[_NSIG];\
 	struct field_arch arch;
 DEFINE_PCN_KMSG(back_migration_request_t, BACK_MIGRATION_FIELDS);
 
+/* Only the register set of the origin architecture is sent */
+#define BACK_MIGRATION_REQUEST_SIZE(arch_type) \
+	(offsetof(back_migration_request_t, arch) + \
+	 offsetof(struct field_arch, regsets) + regset_size(arch_type))
+
 typedef struct popcorn_fd {
     unsigned int idx;
     char file_path[128];
 } fd_t;
 
+/**
+ * Threads migrating to the same node together are cloned by one request.
+ * The process-wide state is sent once, followed by @nr_threads threads.
+ */
+#define MAX_CLONE_GROUP 32
+
+struct clone_thread {
+	pid_t origin_pid;
+	sigset_t remote_blocked;
+	sigset_t remote_real_blocked;
+	sigset_t remote_saved_sigmask;
+	struct sigpending remote_pending;
+	unsigned long sas_ss_sp;
+	size_t sas_ss_size;
+	struct field_arch arch;
+};
+
+/**
+ * Variable-length parts of migration messages are encoded as a sequence of
+ * type-length-value records ending with MIGRATION_TLV_END. Only the
+ * sigactions other than the default are sent.
+ */
+enum {
+	MIGRATION_TLV_END = 0,
+	MIGRATION_TLV_EXE_PATH,
+	MIGRATION_TLV_SIGACTION,
+	MIGRATION_TLV_VMA,
+};
+
+struct migration_tlv {
+	unsigned short type;
+	unsigned short len;
+	unsigned char value[0];
+} __attribute__((packed));
+
+struct migration_sigaction {
+	int sig;
+	struct k_sigaction action;
+} __attribute__((packed));
+
+struct migration_vma {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_flags;
+	unsigned long vm_pgoff;
+	char vm_file_path[0];
+} __attribute__((packed));
+
+static inline struct migration_tlv *next_migration_tlv(struct migration_tlv *tlv)
+{
+	return (void *)tlv + sizeof(*tlv) + tlv->len;
+}
+
+/**
+ * Find the record of @type after @from, or from the beginning of the area if
+ * @from is NULL. The writers make sure the records fit in the area, and the
+ * readers stop at the first malformed one.
+ */
+static inline struct migration_tlv *find_migration_tlv(void *start,
+		size_t size, unsigned short type, struct migration_tlv *from)
+{
+	struct migration_tlv *tlv = from ? next_migration_tlv(from) : start;
+
+	while ((void *)tlv + sizeof(*tlv) <= start + size &&
+			tlv->type != MIGRATION_TLV_END) {
+		if ((void *)next_migration_tlv(tlv) > start + size) break;
+		if (tlv->type == type) return tlv;
+		tlv = next_migration_tlv(tlv);
+	}
+	return NULL;
+}
+
+#define CLONE_TLV_SIZE (4UL << 10)
+
 #define CLONE_FIELDS \
 	pid_t origin_tgid; \
 	pid_t origin_pid; \
@@ -93,18 +262,23 @@ typedef struct popcorn_fd {
 	unsigned long end_data; \
 	unsigned int personality; \
 	unsigned long def_flags; \
-	char exe_path[512]; \
-        fd_t fds[64]; \
-	sigset_t remote_blocked; \
-	sigset_t remote_real_blocked; \
-	sigset_t remote_saved_sigmask; \
-	struct sigpending remote_pending; \
-	unsigned long sas_ss_sp; \
-	size_t sas_ss_size; \
-	struct k_sigaction action[_NSIG]; \
-	struct field_arch arch
+	unsigned long vma_version; \
+	int nr_threads; \
+	unsigned int tlv_size; \
+	unsigned char payload[CLONE_TLV_SIZE + \
+			sizeof(struct clone_thread) * MAX_CLONE_GROUP]
 DEFINE_PCN_KMSG(clone_request_t, CLONE_FIELDS);
 
+/* Threads follow the records in the payload */
+static inline struct clone_thread *clone_request_threads(clone_request_t *req)
+{
+	return (struct clone_thread *)(req->payload + ALIGN(req->tlv_size, 8));
+}
+
+#define CLONE_REQUEST_SIZE(req) \
+	(offsetof(clone_request_t, payload) + ALIGN((req)->tlv_size, 8) + \
+	 sizeof(struct clone_thread) * (req)->nr_threads)
+
 /**
  * This message is sent in response to a clone request.
  * Its purpose is to notify the requesting cpu that make
@@ -148,6 +322,7 @@ DEFINE_PCN_KMSG(vma_info_request_t, VMA_INFO_REQUEST_FIELDS);
 	unsigned long vm_end; \
 	unsigned long vm_flags;	\
 	unsigned long vm_pgoff; \
+	unsigned long vma_version; \
 	char vm_file_path[512];
 DEFINE_PCN_KMSG(vma_info_response_t, VMA_INFO_RESPONSE_FIELDS);
 
@@ -196,7 +371,8 @@ DEFINE_PCN_KMSG(vma_op_request_t, VMA_OP_REQUEST_FIELDS);
 		unsigned long start; \
 		unsigned long brk; \
 	}; \
-	unsigned long len;
+	unsigned long len; \
+	unsigned long vma_version;
 DEFINE_PCN_KMSG(vma_op_response_t, VMA_OP_RESPONSE_FIELDS);
 
 
@@ -211,15 +387,23 @@ DEFINE_PCN_KMSG(vma_op_response_t, VMA_OP_RESPONSE_FIELDS);
 	unsigned long fault_flags; \
 	unsigned long instr_addr; \
 	dma_addr_t rdma_addr; \
-	u32 rdma_key;
+	u32 rdma_key; \
+	int nr_prefetch; \
+	int prefetch_stride;
 DEFINE_PCN_KMSG(remote_page_request_t, REMOTE_PAGE_REQUEST_FIELDS);
 
+/**
+ * Pages granted for the fault-ahead are marked in @prefetched and follow the
+ * response in order.
+ */
 #define REMOTE_PAGE_RESPONSE_COMMON_FIELDS \
 	pid_t remote_pid; \
 	pid_t origin_pid; \
 	int origin_ws; \
 	unsigned long addr; \
-	int result;
+	int result; \
+	unsigned long prefetched; \
+	unsigned long vma_version;
 
 #define REMOTE_PAGE_RESPONSE_FIELDS \
 	REMOTE_PAGE_RESPONSE_COMMON_FIELDS \
@@ -254,17 +438,59 @@ DEFINE_PCN_KMSG(remote_page_release_t, REMOTE_PAGE_RELEASE_FIELDS);
 DEFINE_PCN_KMSG(remote_page_flush_ack_t, REMOTE_PAGE_FLUSH_ACK_FIELDS);
 
 
-#define PAGE_INVALIDATE_REQUEST_FIELDS \
+/**
+ * A 2MB region backed by a huge page at the origin is granted as a whole.
+ * The result comes to @origin_ws, and the page data follows in chunks to
+ * @data_ws only when the region is granted.
+ */
+#define REMOTE_HUGE_PAGE_REQUEST_FIELDS \
 	pid_t origin_pid; \
 	int origin_ws; \
+	int data_ws; \
 	pid_t remote_pid; \
-	unsigned long addr;
-DEFINE_PCN_KMSG(page_invalidate_request_t, PAGE_INVALIDATE_REQUEST_FIELDS);
+	unsigned long addr; \
+	unsigned long instr_addr;
+DEFINE_PCN_KMSG(remote_huge_page_request_t, REMOTE_HUGE_PAGE_REQUEST_FIELDS);
 
-#define PAGE_INVALIDATE_RESPONSE_FIELDS \
+#define REMOTE_HUGE_PAGE_RESPONSE_FIELDS \
+	pid_t remote_pid; \
 	pid_t origin_pid; \
 	int origin_ws; \
+	unsigned long addr; \
+	int result;
+DEFINE_PCN_KMSG(remote_huge_page_response_t, REMOTE_HUGE_PAGE_RESPONSE_FIELDS);
+
+#define HUGE_PAGE_CHUNK_SIZE (32UL << 10)
+#define HUGE_PAGE_NR_CHUNKS (HPAGE_PMD_SIZE / HUGE_PAGE_CHUNK_SIZE)
+
+#define REMOTE_HUGE_PAGE_CHUNK_FIELDS \
+	int data_ws; \
+	unsigned long offset; \
+	unsigned char data[HUGE_PAGE_CHUNK_SIZE];
+DEFINE_PCN_KMSG(remote_huge_page_chunk_t, REMOTE_HUGE_PAGE_CHUNK_FIELDS);
+
+
+/**
+ * Invalidations to a node are batched into a vector of @nr entries, and
+ * acknowledged at once with the wait stations of the entries in order.
+ */
+#define MAX_INVALIDATE_BATCH 128
+
+struct page_invalidate_entry {
+	pid_t origin_pid;
+	int origin_ws;
 	pid_t remote_pid;
+	unsigned long addr;
+} __attribute__((packed));
+
+#define PAGE_INVALIDATE_REQUEST_FIELDS \
+	int nr; \
+	struct page_invalidate_entry entries[MAX_INVALIDATE_BATCH];
+DEFINE_PCN_KMSG(page_invalidate_request_t, PAGE_INVALIDATE_REQUEST_FIELDS);
+
+#define PAGE_INVALIDATE_RESPONSE_FIELDS \
+	int nr; \
+	int origin_ws[MAX_INVALIDATE_BATCH];
 DEFINE_PCN_KMSG(page_invalidate_response_t, PAGE_INVALIDATE_RESPONSE_FIELDS);
 
 
@@ -283,11 +509,30 @@ DEFINE_PCN_KMSG(page_invalidate_response_t, PAGE_INVALIDATE_RESPONSE_FIELDS);
 	u32 val3;
 DEFINE_PCN_KMSG(remote_futex_request, REMOTE_FUTEX_REQ_FIELDS);
 
+/**
+ * A wake that finds no waiter at the origin may come back with a lease of
+ * the futex word at @lease_epoch, which lets the remote skip later wakes on
+ * the word until the lease is recalled.
+ */
 #define REMOTE_FUTEX_RES_FIELDS \
 	int remote_ws; \
-	long ret;
+	long ret; \
+	int lease; \
+	unsigned long lease_epoch;
 DEFINE_PCN_KMSG(remote_futex_response, REMOTE_FUTEX_RES_FIELDS);
 
+#define FUTEX_LEASE_RECALL_FIELDS \
+	pid_t origin_pid; \
+	int origin_ws; \
+	pid_t remote_pid; \
+	unsigned long uaddr; \
+	unsigned long epoch;
+DEFINE_PCN_KMSG(futex_lease_recall_t, FUTEX_LEASE_RECALL_FIELDS);
+
+#define FUTEX_LEASE_RECALL_ACK_FIELDS \
+	int origin_ws;
+DEFINE_PCN_KMSG(futex_lease_recall_ack_t, FUTEX_LEASE_RECALL_ACK_FIELDS);
+
 /**
  * Node information
  */
@@ -339,6 +584,18 @@ enum pcn_syscall_types
 	PCN_NUM_SYSCALLS
 };
 
+/**
+ * Buffer-carrying syscalls carry up to SYSCALL_DATA_SIZE bytes of the user
+ * buffer in @data instead of the user pointer. Only the first @data_size
+ * bytes are sent.
+ */
+#define SYSCALL_DATA_SIZE (32UL << 10)
+
+enum {
+	SYSCALL_FWD_INLINE = 0x01,	/* The buffer is in @data */
+	SYSCALL_FWD_CONTINUED = 0x02,	/* Continues the previous chunk */
+};
+
 #define SYSCALL_FWD_FIELDS				\
 	pid_t origin_pid;				\
 	uint64_t param0;				\
@@ -349,35 +606,64 @@ enum pcn_syscall_types
 	uint64_t param5;				\
 	int remote_ws;					\
 	enum pcn_syscall_types call_type;		\
-	int ret;
+	int ret;					\
+	int flags;					\
+	unsigned int data_size;				\
+	unsigned char data[SYSCALL_DATA_SIZE];
 DEFINE_PCN_KMSG(syscall_fwd_t, SYSCALL_FWD_FIELDS);
 
 #define SYSCALL_REP_FIELDS				\
 	pid_t origin_pid;				\
 	int remote_ws;					\
-	int ret;
+	int ret;					\
+	bool batchable;					\
+	uint64_t file_id;				\
+	int addr_len;		/* Source address after the data */ \
+	unsigned int data_size;				\
+	unsigned char data[SYSCALL_DATA_SIZE];
 DEFINE_PCN_KMSG(syscall_rep_t, SYSCALL_REP_FIELDS);
 
+/**
+ * Asynchronous writes to the socket @fd are packed into @data as a sequence
+ * of 8-byte aligned entries, and acknowledged at once with the first error
+ * among them. An entry with a different fd is skipped.
+ */
+#define SYSCALL_BATCH_SIZE (16UL << 10)
+
+struct syscall_batch_entry {
+	int fd;
+	unsigned int size;
+	unsigned char data[0];
+} __attribute__((packed));
+
+#define SYSCALL_BATCH_FIELDS \
+	pid_t origin_tgid; \
+	pid_t remote_tgid; \
+	int fd; \
+	uint64_t file_id; \
+	int nr; \
+	unsigned int size; \
+	unsigned char data[SYSCALL_BATCH_SIZE];
+DEFINE_PCN_KMSG(syscall_batch_t, SYSCALL_BATCH_FIELDS);
+
+#define SYSCALL_BATCH_ACK_FIELDS \
+	pid_t remote_tgid; \
+	int fd; \
+	int nr; \
+	int error;
+DEFINE_PCN_KMSG(syscall_batch_ack_t, SYSCALL_BATCH_ACK_FIELDS);
+
 /**
  * Message routing using work queues
  */
 extern struct workqueue_struct *popcorn_wq;
 extern struct workqueue_struct *popcorn_ordered_wq;
 
-struct pcn_kmsg_work {
-	struct work_struct work;
-	void *msg;
-};
-
+/* The work lives in the receive header of the message; nothing is allocated */
 static inline int __handle_popcorn_work(struct pcn_kmsg_message *msg, void (*handler)(struct work_struct *), struct workqueue_struct *wq)
 {
-	struct pcn_kmsg_work *w = kmalloc(sizeof(*w), GFP_ATOMIC);
-	BUG_ON(!w);
-
-	w->msg = msg;
-	INIT_WORK(&w->work, handler);
-	smp_wmb();
-	queue_work(wq, &w->work);
+	INIT_WORK(&PCN_KMSG_RECV_HDR(msg)->work, handler);
+	pcn_kmsg_queue_work(wq, msg);
 
 	return 0;
 }
@@ -404,13 +690,14 @@ static inline int handle_##x(struct pcn_kmsg_message *msg) {\
 #define REGISTER_KMSG_HANDLER(x, y) \
 	pcn_kmsg_register_callback(x, handle_##y)
 
+#define PCN_KMSG_WORK_MSG(work) \
+	PCN_KMSG_RECV_MSG(container_of(work, struct pcn_kmsg_recv_hdr, work))
+
 #define START_KMSG_WORK(type, name, work) \
-	struct pcn_kmsg_work *__pcn_kmsg_work__ = (struct pcn_kmsg_work *)(work); \
-	type *name = __pcn_kmsg_work__->msg
+	type *name = (type *)PCN_KMSG_WORK_MSG(work)
 
 #define END_KMSG_WORK(name) \
-	pcn_kmsg_done(name); \
-	kfree(__pcn_kmsg_work__);
+	pcn_kmsg_done(name);
 
 
 #include <linux/sched.h>
@@ -22,9 +22,11 @@
 #include <linux/syscalls.h>
 
 #include <linux/elf.h>
+#include <linux/seq_file.h>
 
 #include <popcorn/types.h>
 #include <popcorn/bundle.h>
+#include <popcorn/stat.h>
 
 #include "types.h"
 #include "util.h"
@@ -40,11 +42,12 @@ enum vma_op_code {
 	VMA_OP_MREMAP,
 	VMA_OP_MADVISE,
 	VMA_OP_BRK,
+	VMA_OP_INVALIDATE,
 	VMA_OP_MAX,
 };
 
 const char *vma_op_code_sz[] = {
-	"mmap", "munmap", "mprotect", "mremap", "madvise", "brk"
+	"mmap", "munmap", "mprotect", "mremap", "madvise", "brk", "invalidate"
 };
 
 
@@ -189,6 +192,247 @@ out:
 #endif
 
 
+/**
+ * VMA snapshot
+ *
+ * The origin pushes the VMA layout with the clone request so that the remote
+ * maps the regions it touches without asking the origin each time. The origin
+ * bumps its VMA version when it changes existing regions, e.g., mprotect or
+ * mremap, and pushes an invalidation to the remotes and waits for them to
+ * drop their snapshots, so no VMA is installed from a stale snapshot after
+ * the change. Responses from the origin carry the version as well, which
+ * catches a remote that loaded its snapshot while the invalidation was out.
+ * Regions unmapped are removed from the snapshot as munmap is propagated.
+ */
+struct vma_snapshot_entry {
+	unsigned long vm_start;
+	unsigned long vm_end;
+	unsigned long vm_flags;
+	unsigned long vm_pgoff;
+	char *vm_file_path;
+};
+
+struct vma_snapshot {
+	unsigned long version;
+	int nr;
+	struct vma_snapshot_entry entries[0];
+};
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic_long_t __vma_snapshot_hits = ATOMIC_LONG_INIT(0);
+static atomic_long_t __vma_snapshot_misses = ATOMIC_LONG_INIT(0);
+static atomic_long_t __vma_snapshot_drops = ATOMIC_LONG_INIT(0);
+#define VMA_STAT_INC(x) atomic_long_inc(&(x))
+#else
+#define VMA_STAT_INC(x)
+#endif
+
+static unsigned long __vma_version(struct mm_struct *mm)
+{
+	if (!mm || !mm->remote) return 0;
+	return atomic_long_read(&mm->remote->vma_version);
+}
+
+/**
+ * Encode the VMAs of @mm as records into @buf until it is filled up.
+ * The room for the end mark is left. Return the bytes used.
+ */
+size_t vma_server_encode_vmas(struct mm_struct *mm, void *buf, size_t size)
+{
+	struct vm_area_struct *vma;
+	size_t used = 0;
+
+	down_read(&mm->mmap_sem);
+	for (vma = mm->mmap; vma; vma = vma->vm_next) {
+		struct migration_tlv *tlv = buf + used;
+		struct migration_vma *mv = (void *)tlv->value;
+		size_t max, len;
+
+		if (used + sizeof(*tlv) * 2 + sizeof(*mv) + 1 > size) break;
+		max = size - used - sizeof(*tlv) * 2 - sizeof(*mv);
+
+		if (get_file_path(vma->vm_file, mv->vm_file_path, max)) {
+			if (vma->vm_file) break;
+		}
+		len = strnlen(mv->vm_file_path, max);
+		if (len == max) break;
+
+		mv->vm_start = vma->vm_start;
+		mv->vm_end = vma->vm_end;
+		mv->vm_flags = vma->vm_flags;
+		mv->vm_pgoff = vma->vm_pgoff;
+
+		tlv->type = MIGRATION_TLV_VMA;
+		tlv->len = sizeof(*mv) + len + 1;
+		used += sizeof(*tlv) + tlv->len;
+	}
+	up_read(&mm->mmap_sem);
+
+	return used;
+}
+
+/**
+ * Build the snapshot from the records in @buf at the remote. The snapshot
+ * is kept until the remote context goes away or a newer version is heard.
+ */
+void vma_server_load_snapshot(struct remote_context *rc, void *buf, size_t size, unsigned long version)
+{
+	struct migration_tlv *tlv = NULL;
+	struct vma_snapshot *snapshot;
+	size_t paths = 0;
+	char *path;
+	int nr = 0;
+	unsigned long flags;
+
+	while ((tlv = find_migration_tlv(buf, size, MIGRATION_TLV_VMA, tlv))) {
+		if (tlv->len <= sizeof(struct migration_vma)) continue;
+		paths += tlv->len - sizeof(struct migration_vma);
+		nr++;
+	}
+	if (!nr) return;
+
+	snapshot = kmalloc(sizeof(*snapshot) +
+			sizeof(struct vma_snapshot_entry) * nr + paths, GFP_KERNEL);
+	if (!snapshot) return;
+
+	snapshot->version = version;
+	snapshot->nr = 0;
+	path = (char *)(snapshot->entries + nr);
+
+	while ((tlv = find_migration_tlv(buf, size, MIGRATION_TLV_VMA, tlv))) {
+		struct migration_vma *mv = (void *)tlv->value;
+		struct vma_snapshot_entry *e = snapshot->entries + snapshot->nr;
+		size_t len = tlv->len - sizeof(*mv);
+
+		if (tlv->len <= sizeof(*mv)) continue;
+		e->vm_start = mv->vm_start;
+		e->vm_end = mv->vm_end;
+		e->vm_flags = mv->vm_flags;
+		e->vm_pgoff = mv->vm_pgoff;
+		e->vm_file_path = path;
+		memcpy(path, mv->vm_file_path, len);
+		path[len - 1] = '\0';
+		path += len;
+		snapshot->nr++;
+	}
+
+	spin_lock_irqsave(&rc->vmas_lock, flags);
+	swap(rc->vma_snapshot, snapshot);
+	spin_unlock_irqrestore(&rc->vmas_lock, flags);
+
+	kfree(snapshot);
+}
+
+void vma_server_free_snapshot(struct remote_context *rc)
+{
+	kfree(rc->vma_snapshot);
+	rc->vma_snapshot = NULL;
+}
+
+static void __drop_vma_snapshot(struct remote_context *rc, bool force, unsigned long version)
+{
+	struct vma_snapshot *snapshot = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rc->vmas_lock, flags);
+	if (rc->vma_snapshot && (force || rc->vma_snapshot->version != version)) {
+		snapshot = rc->vma_snapshot;
+		rc->vma_snapshot = NULL;
+	}
+	spin_unlock_irqrestore(&rc->vmas_lock, flags);
+
+	if (snapshot) {
+		VMA_STAT_INC(__vma_snapshot_drops);
+		kfree(snapshot);
+	}
+}
+
+/* The origin changed its regions, so the snapshot may be stale */
+void vma_server_check_version(struct remote_context *rc, unsigned long version)
+{
+	__drop_vma_snapshot(rc, false, version);
+}
+
+static void __trim_vma_snapshot(struct remote_context *rc, unsigned long start, unsigned long end)
+{
+	struct vma_snapshot *snapshot;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&rc->vmas_lock, flags);
+	snapshot = rc->vma_snapshot;
+	for (i = 0; snapshot && i < snapshot->nr; i++) {
+		struct vma_snapshot_entry *e = snapshot->entries + i;
+		if (e->vm_start < end && start < e->vm_end) {
+			e->vm_start = e->vm_end = 0;
+		}
+	}
+	spin_unlock_irqrestore(&rc->vmas_lock, flags);
+}
+
+/* Return the VMA info for @addr from the snapshot, or NULL if it has none */
+static vma_info_response_t *__lookup_vma_snapshot(struct remote_context *rc, unsigned long addr)
+{
+	vma_info_response_t *res;
+	struct vma_snapshot *snapshot;
+	unsigned long flags;
+	bool found = false;
+	int i;
+
+	if (!READ_ONCE(rc->vma_snapshot)) return NULL;
+
+	res = kmalloc(sizeof(*res), GFP_KERNEL);
+	if (!res) return NULL;
+
+	spin_lock_irqsave(&rc->vmas_lock, flags);
+	snapshot = rc->vma_snapshot;
+	for (i = 0; snapshot && i < snapshot->nr; i++) {
+		struct vma_snapshot_entry *e = snapshot->entries + i;
+		if (e->vm_start <= addr && addr < e->vm_end) {
+			res->vm_start = e->vm_start;
+			res->vm_end = e->vm_end;
+			res->vm_flags = e->vm_flags;
+			res->vm_pgoff = e->vm_pgoff;
+			strlcpy(res->vm_file_path, e->vm_file_path,
+					sizeof(res->vm_file_path));
+			found = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&rc->vmas_lock, flags);
+
+	if (!found) {
+		VMA_STAT_INC(__vma_snapshot_misses);
+		kfree(res);
+		return NULL;
+	}
+	VMA_STAT_INC(__vma_snapshot_hits);
+
+	res->addr = addr;
+	res->result = 0;
+	return res;
+}
+
+void vma_server_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	if (seq) {
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__vma_snapshot_hits),
+				(unsigned long long)atomic_long_read(&__vma_snapshot_misses),
+				"VMA snapshot hits, misses");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__vma_snapshot_drops),
+				0ULL, "VMA snapshot drops");
+	} else {
+		atomic_long_set(&__vma_snapshot_hits, 0);
+		atomic_long_set(&__vma_snapshot_misses, 0);
+		atomic_long_set(&__vma_snapshot_drops, 0);
+	}
+#endif
+}
+
+
 /**
  * VMA operation delegators at remotes
  */
@@ -214,6 +458,7 @@ static int __delegate_vma_op(vma_op_request_t *req, vma_op_response_t **resp)
 			current->origin_nid, req, sizeof(*req));
 	res = wait_at_station(ws);
 	BUG_ON(res->operation != req->operation);
+	vma_server_check_version(current->mm->remote, res->vma_version);
 
 	*resp = res;
 	return res->ret;
@@ -222,10 +467,9 @@ static int __delegate_vma_op(vma_op_request_t *req, vma_op_response_t **resp)
 static int handle_vma_op_response(struct pcn_kmsg_message *msg)
 {
 	vma_op_response_t *res = (vma_op_response_t *)msg;
-	struct wait_station *ws = wait_station(res->remote_ws);
 
-	ws->private = res;
-	complete(&ws->pendings);
+	if (!wait_station_notify(res->remote_ws, res))
+		pcn_kmsg_done(res);
 
 	return 0;
 }
@@ -282,6 +526,7 @@ int vma_server_munmap_remote(unsigned long start, size_t len)
 
 	ret = vm_munmap(start, len);
 	if (ret) return ret;
+	__trim_vma_snapshot(current->mm->remote, start, start + len);
 
 	req = __alloc_vma_op_request(VMA_OP_MUNMAP);
 	req->addr = start;
@@ -413,6 +658,32 @@ int vma_server_munmap_origin(unsigned long start, size_t len, int nid_except)
 	return 0;
 }
 
+void vma_server_origin_changed(struct mm_struct *mm)
+{
+	int nid;
+	struct remote_context *rc = mm->remote;
+	vma_op_request_t *req = __alloc_vma_op_request(VMA_OP_INVALIDATE);
+
+	atomic_long_inc(&rc->vma_version);
+
+	for (nid = 0; nid < MAX_POPCORN_NODES; nid++) {
+		struct wait_station *ws;
+		vma_op_response_t *res;
+
+		if (!get_popcorn_node_online(nid) || !rc->remote_tgids[nid]) continue;
+		if (nid == my_nid) continue;
+
+		ws = get_wait_station(current);
+		req->remote_ws = ws->id;
+		req->origin_pid = rc->remote_tgids[nid];
+
+		pcn_kmsg_send(PCN_KMSG_TYPE_VMA_OP_REQUEST, nid, req, sizeof(*req));
+		res = wait_at_station(ws);
+		pcn_kmsg_done(res);
+	}
+	kfree(req);
+}
+
 
 /**
  * VMA worker
@@ -432,6 +703,7 @@ static void __reply_vma_op(vma_op_request_t *req, long ret)
 	res->ret = ret;
 	res->addr = req->addr;
 	res->len = req->len;
+	res->vma_version = __vma_version(current->mm);
 
 	pcn_kmsg_post(PCN_KMSG_TYPE_VMA_OP_RESPONSE,
 			PCN_KMSG_FROM_NID(req), res, sizeof(*res));
@@ -449,6 +721,15 @@ static long __process_vma_op_at_remote(vma_op_request_t *req)
 	switch (req->operation) {
 	case VMA_OP_MUNMAP:
 		ret = vm_munmap(req->addr, req->len);
+		__trim_vma_snapshot(current->mm->remote,
+				req->addr, req->addr + req->len);
+		break;
+	case VMA_OP_INVALIDATE:
+		/* Wait out the faults installing from the snapshot */
+		down_write(&current->mm->mmap_sem);
+		__drop_vma_snapshot(current->mm->remote, true, 0);
+		up_write(&current->mm->mmap_sem);
+		ret = 0;
 		break;
 	case VMA_OP_MMAP:
 	case VMA_OP_MPROTECT:
@@ -490,6 +771,7 @@ static long __process_vma_op_at_origin(vma_op_request_t *req)
 				req->flags, req->pgoff, &populate);
 		up_write(&mm->mmap_sem);
 		if (populate) mm_populate(raddr, populate);
+		if (req->flags & MAP_FIXED) vma_server_origin_changed(mm);
 
 		ret = IS_ERR_VALUE(raddr) ? raddr : 0;
 		req->addr = raddr;
@@ -668,6 +950,7 @@ out_up:
 	}
 
 	res->remote_pid = req->remote_pid;
+	res->vma_version = __vma_version(current->mm);
 	pcn_kmsg_send(PCN_KMSG_TYPE_VMA_INFO_RESPONSE,
 			PCN_KMSG_FROM_NID(req), res, sizeof(*res));
 
@@ -703,7 +986,8 @@ static struct vma_info *__alloc_vma_info_request(struct task_struct *tsk, unsign
 }
 
 
-static int __update_vma(struct task_struct *tsk, vma_info_response_t *res)
+/* Install the VMA described by @res. mm->mmap_sem is down_write()'ed */
+static int __install_vma(struct task_struct *tsk, vma_info_response_t *res)
 {
 	struct mm_struct *mm = tsk->mm;
 	struct vm_area_struct *vma;
@@ -711,22 +995,13 @@ static int __update_vma(struct task_struct *tsk, vma_info_response_t *res)
 	unsigned flags = MAP_FIXED;
 	struct file *f = NULL;
 	unsigned long err = 0;
-	int ret = 0;
 	unsigned long addr = res->addr;
 
-	if (res->result) {
-		down_read(&mm->mmap_sem);
-		return res->result;
-	}
-
-	while (!down_write_trylock(&mm->mmap_sem)) {
-		schedule();
-	}
 	vma = find_vma(mm, addr);
 	VSPRINTK("  [%d] %lx %lx\n", tsk->pid, vma ? vma->vm_start : 0, addr);
 	if (vma && vma->vm_start <= addr) {
 		/* somebody already done for me. */
-		goto out;
+		return 0;
 	}
 
 	if (vma_info_anon(res) || vma_info_dev_zero(res)) {
@@ -740,8 +1015,7 @@ static int __update_vma(struct task_struct *tsk, vma_info_response_t *res)
 		if (IS_ERR(f)) {
 			printk(KERN_ERR"%s: cannot find backing file %s\n",__func__,
 				res->vm_file_path);
-			ret = -EIO;
-			goto out;
+			return -EIO;
 		}
 		/*
 		unsigned long orig_pgoff = res->vm_pgoff;
@@ -771,11 +1045,56 @@ static int __update_vma(struct task_struct *tsk, vma_info_response_t *res)
 	BUG_ON(!vma || vma->vm_start > addr);
 	if (res->vm_flags & VM_FETCH_LOCAL) vma->vm_flags |= VM_FETCH_LOCAL;
 	*/
-out:
+	return 0;
+}
+
+static int __update_vma(struct task_struct *tsk, vma_info_response_t *res)
+{
+	struct mm_struct *mm = tsk->mm;
+	int ret;
+
+	if (res->result) {
+		down_read(&mm->mmap_sem);
+		return res->result;
+	}
+
+	while (!down_write_trylock(&mm->mmap_sem)) {
+		schedule();
+	}
+	ret = __install_vma(tsk, res);
 	downgrade_write(&mm->mmap_sem);
 	return ret;
 }
 
+/**
+ * Install the VMA for @addr from the snapshot. The snapshot is looked up and
+ * used with mmap_sem held for write, and the origin's invalidation drops the
+ * snapshot under mmap_sem, so a stale entry is never installed. Return false
+ * without mmap_sem if the snapshot has no entry for @addr.
+ */
+static bool __update_vma_from_snapshot(struct task_struct *tsk, struct remote_context *rc, unsigned long addr, int *ret)
+{
+	struct mm_struct *mm = tsk->mm;
+	vma_info_response_t *res;
+
+	if (!READ_ONCE(rc->vma_snapshot)) return false;
+
+	while (!down_write_trylock(&mm->mmap_sem)) {
+		schedule();
+	}
+	res = __lookup_vma_snapshot(rc, addr);
+	if (!res) {
+		up_write(&mm->mmap_sem);
+		return false;
+	}
+	VSPRINTK("  [%d] %lx from snapshot\n", current->pid, addr);
+
+	*ret = __install_vma(tsk, res);
+	downgrade_write(&mm->mmap_sem);
+	kfree(res);
+	return true;
+}
+
 
 /**
  * Fetch VMA information from the origin.
@@ -820,20 +1139,23 @@ int vma_server_fetch_vma(struct task_struct *tsk, unsigned long address)
 	if (req) {
 		spin_unlock_irqrestore(&rc->vmas_lock, flags);
 
-		VSPRINTK("  [%d] %lx ->[%d/%d]\n", current->pid,
-				addr, tsk->origin_pid, tsk->origin_nid);
-		pcn_kmsg_send(PCN_KMSG_TYPE_VMA_INFO_REQUEST,
-				tsk->origin_nid, req, sizeof(*req));
-		wait_for_completion(&vi->complete);
+		if (!__update_vma_from_snapshot(tsk, rc, addr, &ret)) {
+			VSPRINTK("  [%d] %lx ->[%d/%d]\n", current->pid,
+					addr, tsk->origin_pid, tsk->origin_nid);
+			pcn_kmsg_send(PCN_KMSG_TYPE_VMA_INFO_REQUEST,
+					tsk->origin_nid, req, sizeof(*req));
+			wait_for_completion(&vi->complete);
+			vma_server_check_version(rc, vi->response->vma_version);
 
-		ret = vi->ret =
-			__update_vma(tsk, (vma_info_response_t *)vi->response);
+			ret = __update_vma(tsk, (vma_info_response_t *)vi->response);
+			pcn_kmsg_done((void *)vi->response);
+		}
+		vi->ret = ret;
 
 		spin_lock_irqsave(&rc->vmas_lock, flags);
 		list_del(&vi->list);
 		spin_unlock_irqrestore(&rc->vmas_lock, flags);
 
-		pcn_kmsg_done((void *)vi->response);
 		wake_up_all(&vi->pendings_wait);
 
 		kfree(req);
@@ -13,9 +13,15 @@
 #define KERNEL_POPCORN_VMA_SERVER_H_
 
 struct remote_context;
+struct mm_struct;
 
 void process_vma_info_request(vma_info_request_t *req);
 
 void process_vma_op_request(vma_op_request_t *req);
 
+size_t vma_server_encode_vmas(struct mm_struct *mm, void *buf, size_t size);
+void vma_server_load_snapshot(struct remote_context *rc, void *buf, size_t size, unsigned long version);
+void vma_server_free_snapshot(struct remote_context *rc);
+void vma_server_check_version(struct remote_context *rc, unsigned long version);
+
 #endif /* KERNEL_POPCORN_VMA_SERVER_H_ */
@@ -1,58 +1,311 @@
 /**
- * Waiting stations allows threads to be waited for a given 
+ * Waiting stations allows threads to be waited for a given
  * number of events are completed
+ *
+ * Stations are allocated in chunks on demand and recycled through per-CPU
+ * caches, so getting and putting a station does not touch the global lock
+ * most of the time. A station id carries the generation of the station in
+ * its upper bits. The generation advances whenever the station is released,
+ * so a late reply to a released station is detected and dropped instead of
+ * waking up an unrelated waiter.
  */
 
 #include <linux/kernel.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
 #include <linux/err.h>
 
+#include <popcorn/stat.h>
+
 #include "wait_station.h"
 
-#define MAX_WAIT_STATIONS 1024
+#define WS_INDEX_BITS		16
+#define WS_INDEX_MASK		((1 << WS_INDEX_BITS) - 1)
+#define WS_GENERATION_MASK	0x7fff	/* Keep ids positive */
+#define MAX_WAIT_STATIONS	(1 << WS_INDEX_BITS)
+
+#define WS_CHUNK_SIZE		64
+#define WS_MAX_CHUNKS		(MAX_WAIT_STATIONS / WS_CHUNK_SIZE)
+
+#define WS_CACHE_SIZE		32
+#define WS_CACHE_BATCH		(WS_CACHE_SIZE / 2)
+
+#define WS_LONG_WAIT		(60 * HZ)
 
-static struct wait_station wait_stations[MAX_WAIT_STATIONS];
+static struct wait_station *wait_station_chunks[WS_MAX_CHUNKS] = { NULL };
+static unsigned int nr_wait_stations = 0;
 
 static DEFINE_SPINLOCK(wait_station_lock);
-static DECLARE_BITMAP(wait_station_available, MAX_WAIT_STATIONS) = { 0 };
+static int wait_station_free = -1;
+
+struct wait_station_cache {
+	unsigned int nr;
+	int indices[WS_CACHE_SIZE];
+};
+static DEFINE_PER_CPU(struct wait_station_cache, wait_station_caches);
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic_t __nr_in_use = ATOMIC_INIT(0);
+static int __peak_in_use = 0;
+static atomic_long_t __nr_refills = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_contended = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_stale = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_timeouts = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_long_waits = ATOMIC_LONG_INIT(0);
+static atomic_long_t __nr_exhausted = ATOMIC_LONG_INIT(0);
+#define WS_STAT_INC(x) atomic_long_inc(&(x))
+#else
+#define WS_STAT_INC(x)
+#endif
+
+static inline struct wait_station *__wait_station_at(int index)
+{
+	return wait_station_chunks[index / WS_CHUNK_SIZE] + (index % WS_CHUNK_SIZE);
+}
+
+/**
+ * Add a chunk of stations to the free list. The chunk is allocated outside
+ * the lock so that the table can grow under memory pressure; it is dropped
+ * if another thread has refilled the free list in the meantime.
+ */
+static int __grow_wait_stations(void)
+{
+	struct wait_station *chunk;
+	unsigned long flags;
+	int base;
+	int i;
+
+	might_sleep();
+	chunk = kcalloc(WS_CHUNK_SIZE, sizeof(*chunk), GFP_KERNEL);
+	if (!chunk) return -ENOMEM;
+
+	spin_lock_irqsave(&wait_station_lock, flags);
+	base = nr_wait_stations;
+	if (wait_station_free >= 0 || base >= MAX_WAIT_STATIONS) {
+		int ret = wait_station_free >= 0 ? 0 : -ENOSPC;
+		spin_unlock_irqrestore(&wait_station_lock, flags);
+		kfree(chunk);
+		return ret;
+	}
+
+	for (i = 0; i < WS_CHUNK_SIZE; i++) {
+		struct wait_station *ws = chunk + i;
+		ws->id = -1;
+		spin_lock_init(&ws->lock);
+		ws->next_free = (i == WS_CHUNK_SIZE - 1) ? -1 : base + i + 1;
+	}
+	wait_station_free = base;
+	wait_station_chunks[base / WS_CHUNK_SIZE] = chunk;
+
+	/* Publish the chunk before the lookups can reach it */
+	smp_wmb();
+	WRITE_ONCE(nr_wait_stations, base + WS_CHUNK_SIZE);
+	spin_unlock_irqrestore(&wait_station_lock, flags);
+	return 0;
+}
+
+static void __lock_wait_stations(void)
+{
+	if (!spin_trylock(&wait_station_lock)) {
+		WS_STAT_INC(__nr_contended);
+		spin_lock(&wait_station_lock);
+	}
+}
+
+static int __alloc_index(void)
+{
+	struct wait_station_cache *wc;
+	unsigned long flags;
+	int index = -1;
+
+	local_irq_save(flags);
+	wc = this_cpu_ptr(&wait_station_caches);
+	if (!wc->nr) {
+		WS_STAT_INC(__nr_refills);
+		__lock_wait_stations();
+		while (wc->nr < WS_CACHE_BATCH) {
+			int i = wait_station_free;
+			if (i < 0) break;
+			wait_station_free = __wait_station_at(i)->next_free;
+			wc->indices[wc->nr++] = i;
+		}
+		spin_unlock(&wait_station_lock);
+	}
+	if (wc->nr) {
+		index = wc->indices[--wc->nr];
+	}
+	local_irq_restore(flags);
+
+	return index;
+}
+
+static void __free_index(int index)
+{
+	struct wait_station_cache *wc;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	wc = this_cpu_ptr(&wait_station_caches);
+	if (wc->nr == WS_CACHE_SIZE) {
+		__lock_wait_stations();
+		while (wc->nr > WS_CACHE_BATCH) {
+			int i = wc->indices[--wc->nr];
+			__wait_station_at(i)->next_free = wait_station_free;
+			wait_station_free = i;
+		}
+		spin_unlock(&wait_station_lock);
+	}
+	wc->indices[wc->nr++] = index;
+	local_irq_restore(flags);
+}
 
 struct wait_station *get_wait_station_multiple(struct task_struct *tsk, int count)
 {
-	int id;
 	struct wait_station *ws;
+	unsigned long flags;
+	int index;
 
-	spin_lock(&wait_station_lock);
-	id = find_first_zero_bit(wait_station_available, MAX_WAIT_STATIONS);
-	BUG_ON(id >= MAX_WAIT_STATIONS);
-	ws = wait_stations + id;
-	set_bit(id, wait_station_available);
-	spin_unlock(&wait_station_lock);
+	while ((index = __alloc_index()) < 0) {
+		int ret = __grow_wait_stations();
+		if (ret) {
+			/* Wait for in-flight stations to be released */
+			WS_STAT_INC(__nr_exhausted);
+			printk_ratelimited(KERN_WARNING
+					"[%d] no wait station available, %d\n",
+					tsk->pid, ret);
+			schedule_timeout_uninterruptible(1);
+		}
+	}
+	ws = __wait_station_at(index);
 
-	ws->id = id;
 	ws->pid = tsk->pid;
 	ws->private = (void *)0xbad0face;
+	ws->nid = -1;
+	ws->claimed = 0;
 	init_completion(&ws->pendings);
 	atomic_set(&ws->pendings_count, count);
-	smp_wmb();
 
+	/* Open the station to notifiers */
+	spin_lock_irqsave(&ws->lock, flags);
+	ws->id = (ws->generation << WS_INDEX_BITS) | index;
+	spin_unlock_irqrestore(&ws->lock, flags);
+
+#ifdef CONFIG_POPCORN_STAT
+	{
+		int in_use = atomic_inc_return(&__nr_in_use);
+		if (in_use > __peak_in_use) __peak_in_use = in_use;
+	}
+#endif
 	return ws;
 }
 EXPORT_SYMBOL_GPL(get_wait_station_multiple);
 
-struct wait_station *wait_station(int id)
+bool wait_station_notify(int id, void *private)
 {
+	int index = id & WS_INDEX_MASK;
+	struct wait_station *ws;
+	unsigned long flags;
+	bool notified = false;
+
+	if (id < 0 || index >= READ_ONCE(nr_wait_stations)) goto out;
 	smp_rmb();
-	return wait_stations + id;
+
+	ws = __wait_station_at(index);
+	spin_lock_irqsave(&ws->lock, flags);
+	if (ws->id == id) {
+		if (private) ws->private = private;
+		if (atomic_dec_and_test(&ws->pendings_count)) {
+			complete(&ws->pendings);
+		}
+		notified = true;
+	}
+	spin_unlock_irqrestore(&ws->lock, flags);
+
+out:
+	if (!notified) {
+		WS_STAT_INC(__nr_stale);
+	}
+	return notified;
+}
+EXPORT_SYMBOL_GPL(wait_station_notify);
+
+void *wait_station_lookup(int id)
+{
+	int index = id & WS_INDEX_MASK;
+	struct wait_station *ws;
+	unsigned long flags;
+	void *private = NULL;
+
+	if (id < 0 || index >= READ_ONCE(nr_wait_stations)) goto out;
+	smp_rmb();
+
+	ws = __wait_station_at(index);
+	spin_lock_irqsave(&ws->lock, flags);
+	if (ws->id == id && atomic_read(&ws->pendings_count) > 0) {
+		private = (void *)ws->private;
+	}
+	spin_unlock_irqrestore(&ws->lock, flags);
+
+out:
+	if (!private) {
+		WS_STAT_INC(__nr_stale);
+	}
+	return private;
+}
+EXPORT_SYMBOL_GPL(wait_station_lookup);
+
+void *wait_station_claim(int id, unsigned int event, int from_nid)
+{
+	int index = id & WS_INDEX_MASK;
+	struct wait_station *ws;
+	unsigned long flags;
+	void *private = NULL;
+
+	if (id < 0 || index >= READ_ONCE(nr_wait_stations)) goto out;
+	if (event >= BITS_PER_LONG) goto out;
+	smp_rmb();
+
+	ws = __wait_station_at(index);
+	spin_lock_irqsave(&ws->lock, flags);
+	if (ws->id == id && atomic_read(&ws->pendings_count) > 0 &&
+			(ws->nid < 0 || ws->nid == from_nid) &&
+			!__test_and_set_bit(event, &ws->claimed)) {
+		private = (void *)ws->private;
+	}
+	spin_unlock_irqrestore(&ws->lock, flags);
+
+out:
+	if (!private) {
+		WS_STAT_INC(__nr_stale);
+	}
+	return private;
+}
+EXPORT_SYMBOL_GPL(wait_station_claim);
+
+static void __put_wait_station(struct wait_station *ws, int index)
+{
+	unsigned long flags;
+
+	/* Close the station so that late notifications are dropped */
+	spin_lock_irqsave(&ws->lock, flags);
+	ws->id = -1;
+	ws->generation = (ws->generation + 1) & WS_GENERATION_MASK;
+	spin_unlock_irqrestore(&ws->lock, flags);
+
+	__free_index(index);
+#ifdef CONFIG_POPCORN_STAT
+	atomic_dec(&__nr_in_use);
+#endif
 }
-EXPORT_SYMBOL_GPL(wait_station);
 
 void put_wait_station(struct wait_station *ws)
 {
-	int id = ws->id;
-	spin_lock(&wait_station_lock);
-	BUG_ON(!test_bit(id, wait_station_available));
-	clear_bit(id, wait_station_available);
-	spin_unlock(&wait_station_lock);
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+	BUG_ON(ws->id < 0);
+#endif
+	__put_wait_station(ws, ws->id & WS_INDEX_MASK);
 }
 EXPORT_SYMBOL_GPL(put_wait_station);
 
@@ -60,17 +313,81 @@ void *wait_at_station(struct wait_station *ws)
 {
 	void *ret;
 	if (!try_wait_for_completion(&ws->pendings)) {
-		//if (wait_for_completion_io_timeout(&ws->pendings, 300 * HZ) == 0) {
-		if (wait_for_completion_io_timeout(&ws->pendings,
-						   MAX_SCHEDULE_TIMEOUT) == 0) {
-			ret = ERR_PTR(-ETIMEDOUT);
-			goto out;
+		while (wait_for_completion_io_timeout(&ws->pendings,
+						   WS_LONG_WAIT) == 0) {
+			WS_STAT_INC(__nr_long_waits);
+			printk_ratelimited(KERN_WARNING
+					"[%d] waiting for %d events too long at %d\n",
+					ws->pid, atomic_read(&ws->pendings_count), ws->id);
 		}
 	}
 	smp_rmb();
 	ret = (void *)ws->private;
-out:
 	put_wait_station(ws);
 	return ret;
 }
 EXPORT_SYMBOL_GPL(wait_at_station);
+
+void *wait_at_station_timeout(struct wait_station *ws, unsigned long timeout)
+{
+	int index = ws->id & WS_INDEX_MASK;
+	void *ret;
+	if (!try_wait_for_completion(&ws->pendings)) {
+		if (wait_for_completion_io_timeout(&ws->pendings, timeout) == 0) {
+			unsigned long flags;
+
+			spin_lock_irqsave(&ws->lock, flags);
+			ws->id = -1;
+			spin_unlock_irqrestore(&ws->lock, flags);
+
+			/* Events might be completed just before closing */
+			if (!try_wait_for_completion(&ws->pendings)) {
+				WS_STAT_INC(__nr_timeouts);
+				ret = ERR_PTR(-ETIMEDOUT);
+				goto out;
+			}
+		}
+	}
+	smp_rmb();
+	ret = (void *)ws->private;
+out:
+	__put_wait_station(ws, index);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(wait_at_station_timeout);
+
+void wait_station_stat(struct seq_file *seq, void *v)
+{
+#ifdef CONFIG_POPCORN_STAT
+	if (seq) {
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_read(&__nr_in_use),
+				(unsigned long long)__peak_in_use,
+				"wait stations in use");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)READ_ONCE(nr_wait_stations),
+				(unsigned long long)MAX_WAIT_STATIONS,
+				"wait stations allocated");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_refills),
+				(unsigned long long)atomic_long_read(&__nr_contended),
+				"wait station refills, contended");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_stale),
+				(unsigned long long)atomic_long_read(&__nr_timeouts),
+				"stale notifications, timeouts");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic_long_read(&__nr_long_waits),
+				(unsigned long long)atomic_long_read(&__nr_exhausted),
+				"long waits, exhausted");
+	} else {
+		__peak_in_use = atomic_read(&__nr_in_use);
+		atomic_long_set(&__nr_refills, 0);
+		atomic_long_set(&__nr_contended, 0);
+		atomic_long_set(&__nr_stale, 0);
+		atomic_long_set(&__nr_timeouts, 0);
+		atomic_long_set(&__nr_long_waits, 0);
+		atomic_long_set(&__nr_exhausted, 0);
+	}
+#endif
+}
@@ -3,6 +3,7 @@
 
 #include <linux/completion.h>
 #include <linux/atomic.h>
+#include <linux/spinlock.h>
 
 struct wait_station {
 	int id;
@@ -10,16 +11,60 @@ struct wait_station {
 	volatile void *private;
 	struct completion pendings;
 	atomic_t pendings_count;
+
+	int nid;			/* Node expected to notify, or -1 */
+	unsigned long claimed;		/* Events claimed so far */
+
+	spinlock_t lock;
+	unsigned short generation;
+	int next_free;
 };
 
 struct task_struct;
+struct seq_file;
 
+/**
+ * Get a station expecting @count events. May sleep to grow the station table
+ * or, once it is full, until another station is released.
+ */
 struct wait_station *get_wait_station_multiple(struct task_struct *tsk, int count);
 static inline struct wait_station *get_wait_station(struct task_struct *tsk)
 {
 	return get_wait_station_multiple(tsk, 1);
 }
-struct wait_station *wait_station(int id);
 void put_wait_station(struct wait_station *ws);
+
+/**
+ * Notify an event to the station @id, and wake up the waiter once all the
+ * expected events have arrived. @private is passed to the waiter unless it
+ * is NULL. Return false if the waiter is gone (e.g., timed out) so that the
+ * caller can release what it was about to hand over.
+ */
+bool wait_station_notify(int id, void *private);
+
+/**
+ * Return the private data of the station @id if it still expects events,
+ * or NULL if @id is stale. The data is set by the waiter before handing
+ * out @id, and stays valid until the caller notifies the station.
+ */
+void *wait_station_lookup(int id);
+
+/**
+ * Like wait_station_lookup(), but also claim the event @event (less than
+ * BITS_PER_LONG) on behalf of node @from_nid. Return NULL if the event was
+ * claimed already or @from_nid is not the node the waiter expects. Since
+ * each claimed event accounts for one pending event, the private data stays
+ * valid until the caller notifies the station.
+ */
+void *wait_station_claim(int id, unsigned int event, int from_nid);
+
+/**
+ * Wait for the events and return the private data. The station is released
+ * on return. wait_at_station_timeout() gives up after @timeout jiffies and
+ * returns ERR_PTR(-ETIMEDOUT); late events to the station are dropped.
+ */
 void *wait_at_station(struct wait_station *ws);
+void *wait_at_station_timeout(struct wait_station *ws, unsigned long timeout);
+
+void wait_station_stat(struct seq_file *seq, void *v);
 #endif
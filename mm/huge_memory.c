@@ -869,6 +869,72 @@ int do_huge_pmd_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 					    flags);
 }
 
+#ifdef CONFIG_POPCORN
+/*
+ * Allocate and charge a huge page at @haddr for the popcorn page server to
+ * fill in with the data from the origin.
+ */
+struct page *alloc_huge_page_remote(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long haddr,
+		struct mem_cgroup **memcgp)
+{
+	gfp_t gfp = alloc_hugepage_gfpmask(transparent_hugepage_defrag(vma), 0);
+	struct page *page;
+
+	page = alloc_hugepage_vma(gfp, vma, haddr, HPAGE_PMD_ORDER);
+	if (unlikely(!page)) {
+		count_vm_event(THP_FAULT_FALLBACK);
+		return NULL;
+	}
+	if (mem_cgroup_try_charge(page, mm, gfp, memcgp)) {
+		put_page(page);
+		count_vm_event(THP_FAULT_FALLBACK);
+		return NULL;
+	}
+	return page;
+}
+
+void free_huge_page_remote(struct page *page, struct mem_cgroup *memcg)
+{
+	mem_cgroup_cancel_charge(page, memcg);
+	put_page(page);
+}
+
+/*
+ * Map the filled huge page read-only at @haddr. Return false if @pmd is
+ * populated in the meantime; the caller still owns the page and @pgtable.
+ */
+bool map_huge_page_remote(struct mm_struct *mm, struct vm_area_struct *vma,
+		unsigned long haddr, pmd_t *pmd, struct page *page,
+		struct mem_cgroup *memcg, pgtable_t pgtable)
+{
+	spinlock_t *ptl;
+	pmd_t entry;
+
+	VM_BUG_ON_PAGE(!PageCompound(page), page);
+	__SetPageUptodate(page);
+
+	ptl = pmd_lock(mm, pmd);
+	if (unlikely(!pmd_none(*pmd))) {
+		spin_unlock(ptl);
+		return false;
+	}
+	entry = mk_huge_pmd(page, vma->vm_page_prot);
+	entry = pmd_mkyoung(pmd_wrprotect(entry));
+	page_add_new_anon_rmap(page, vma, haddr);
+	mem_cgroup_commit_charge(page, memcg, false);
+	lru_cache_add_active_or_unevictable(page, vma);
+	pgtable_trans_huge_deposit(mm, pmd, pgtable);
+	set_pmd_at(mm, haddr, pmd, entry);
+	add_mm_counter(mm, MM_ANONPAGES, HPAGE_PMD_NR);
+	atomic_long_inc(&mm->nr_ptes);
+	spin_unlock(ptl);
+	count_vm_event(THP_FAULT_ALLOC);
+
+	return true;
+}
+#endif
+
 static void insert_pfn_pmd(struct vm_area_struct *vma, unsigned long addr,
 		pmd_t *pmd, unsigned long pfn, pgprot_t prot, bool write)
 {
@@ -2541,6 +2607,11 @@ static bool hugepage_vma_check(struct vm_area_struct *vma)
 		return false;
 	if (is_vma_temporary_stack(vma))
 		return false;
+#ifdef CONFIG_POPCORN
+	/* Collapsing loses the per-page ownership of distributed processes */
+	if (vma->vm_mm->remote)
+		return false;
+#endif
 	return !(vma->vm_flags & VM_NO_THP);
 }
 
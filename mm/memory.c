@@ -1260,8 +1260,12 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 				}
 #endif
 				split_huge_page_pmd(vma, addr, pmd);
-			} else if (zap_huge_pmd(tlb, vma, pmd, addr))
+			} else if (zap_huge_pmd(tlb, vma, pmd, addr)) {
+#ifdef CONFIG_POPCORN
+				page_server_zap_pmd(vma, addr);
+#endif
 				goto next;
+			}
 			/* fall through */
 		}
 		/*
@@ -3556,7 +3560,13 @@ static int __handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (!pmd)
 		return VM_FAULT_OOM;
 	if (pmd_none(*pmd) && transparent_hugepage_enabled(vma)) {
-		int ret = create_huge_pmd(mm, vma, address, pmd, flags);
+		int ret;
+#ifdef CONFIG_POPCORN
+		if (distributed_remote_process(current))
+			ret = page_server_handle_pmd_fault(mm, vma, address, pmd, flags);
+		else
+#endif
+		ret = create_huge_pmd(mm, vma, address, pmd, flags);
 		if (!(ret & VM_FAULT_FALLBACK))
 			return ret;
 	} else {
@@ -3580,6 +3590,12 @@ static int __handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 							     orig_pmd, pmd);
 
 			if (dirty && !pmd_write(orig_pmd)) {
+#ifdef CONFIG_POPCORN
+				/* Write-shared huge page goes down to the PTE level */
+				if (page_server_split_huge_pmd(vma, address, pmd))
+					ret = VM_FAULT_FALLBACK;
+				else
+#endif
 				ret = wp_huge_pmd(mm, vma, address, pmd,
 							orig_pmd, flags);
 				if (!(ret & VM_FAULT_FALLBACK))
@@ -3640,7 +3656,7 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	count_vm_event(PGFAULT);
 	mem_cgroup_count_vm_event(mm, PGFAULT);
 #ifdef CONFIG_POPCORN_STAT_PGFAULTS
-	page_server_start_mm_fault(address);
+	page_server_start_mm_fault(vma, address, flags);
 #endif
 
 	/* do counter updates before entering really critical section. */
@@ -367,6 +367,8 @@ set_brk:
 		if (vma_server_brk_remote(oldbrk, brk)) {
 			return brk;
 		}
+	} else if (distributed_process(current) && newbrk < oldbrk) {
+		vma_server_origin_changed(mm);
 	}
 #endif
 	return brk;
@@ -1525,6 +1527,8 @@ SYSCALL_DEFINE6(mmap_pgoff, unsigned long, addr, unsigned long, len,
 	if (distributed_remote_process(current)) {
 		retval = vma_server_mmap_remote(file, addr, len, prot, flags, pgoff);
 		goto out_fput;
+	} else if (distributed_process(current) && (flags & MAP_FIXED)) {
+		vma_server_origin_changed(current->mm);
 	}
 #endif
 
@@ -376,6 +376,8 @@ SYSCALL_DEFINE3(mprotect, unsigned long, start, size_t, len,
 	if (distributed_remote_process(current)) {
 		error = vma_server_mprotect_remote(start, len, prot);
 		if (error) return error;
+	} else if (distributed_process(current)) {
+		vma_server_origin_changed(current->mm);
 	}
 #endif
 
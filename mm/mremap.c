@@ -499,6 +499,8 @@ SYSCALL_DEFINE5(mremap, unsigned long, addr, unsigned long, old_len,
 #ifdef CONFIG_POPCORN
 	if (distributed_remote_process(current)) {
 		vma_server_mremap_remote(addr, old_len, new_len, flags, new_addr);
+	} else if (distributed_process(current)) {
+		vma_server_origin_changed(current->mm);
 	}
 #endif
 
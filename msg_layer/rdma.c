@@ -1,6 +1,12 @@
 #include <linux/module.h>
 #include <linux/bitmap.h>
 #include <linux/seq_file.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
 
 #include <rdma/rdma_cm.h>
 #include <popcorn/stat.h>
@@ -11,13 +17,103 @@
 #define RDMA_PORT 11453
 #define RDMA_ADDR_RESOLVE_TIMEOUT_MS 5000
 
-#define MAX_RECV_DEPTH	((PAGE_SIZE << (MAX_ORDER - 1)) / PCN_KMSG_MAX_SIZE)
+#define RECV_CHUNK_SIZE	(PAGE_SIZE << (MAX_ORDER - 1))
+#define RECV_SLOT_SIZE	(sizeof(struct pcn_kmsg_recv_hdr) + PCN_KMSG_MAX_SIZE)
+#define MAX_RECV_DEPTH	(RECV_CHUNK_SIZE / RECV_SLOT_SIZE)
 #define MAX_SEND_DEPTH	(MAX_RECV_DEPTH)
+#define MAX_SRQ_CHUNKS	16
+#define MAX_RDMA_CHANNELS	8
 #define RDMA_SLOT_SIZE	(PAGE_SIZE * 2)
 #define NR_RDMA_SLOTS	((PAGE_SIZE << (MAX_ORDER - 1)) / RDMA_SLOT_SIZE)
 
 static unsigned int use_rb_thr = PAGE_SIZE / 2;
 
+/**
+ * Low-priority messages are held back while this many sends are in flight to
+ * the node, leaving room in the send queue for more urgent messages.
+ */
+static unsigned int low_prio_thr = MAX_SEND_DEPTH / 4;
+module_param(low_prio_thr, uint, 0644);
+MODULE_PARM_DESC(low_prio_thr, "Max in-flight sends that low-priority messages can join");
+
+/**
+ * Number of queue pairs to each peer. A thread always sends through the
+ * same queue pair, so its messages are delivered in order while threads
+ * do not serialize on a single queue pair. Should be the same on all nodes.
+ */
+static int nr_channels = 1;
+module_param(nr_channels, int, 0444);
+MODULE_PARM_DESC(nr_channels, "Number of queue pairs to each peer (1-8)");
+
+/**
+ * Inbound messages from all peers land in the buffers of a shared receive
+ * queue, so receive memory does not grow with the number of nodes beyond
+ * MAX_SRQ_CHUNKS. Unless given, the depth covers every peer filling up all
+ * its queue pairs to this node. Senders retry on an empty queue.
+ */
+static int srq_depth = 0;
+module_param(srq_depth, int, 0444);
+MODULE_PARM_DESC(srq_depth, "Number of receive buffers shared by all peers (0: auto)");
+
+/**
+ * Register all memory for remote writes so that buffers given to
+ * pin_rdma_buffer() are written by peers in place. Peers can then write to
+ * any memory of this node, so enable it only among trusted nodes.
+ */
+static bool direct_rdma = false;
+module_param(direct_rdma, bool, 0444);
+MODULE_PARM_DESC(direct_rdma, "Let peers RDMA-write into pinned buffers directly (exposes all memory)");
+
+/**
+ * Completions are reaped in batches of up to poll_batch entries. With
+ * poll_mode, a thread for each node busy-polls its completion queue and
+ * falls back to the completion interrupt after idling for poll_usecs.
+ */
+#define MAX_POLL_BATCH	64
+static int poll_batch = 16;
+module_param(poll_batch, int, 0644);
+MODULE_PARM_DESC(poll_batch, "Max number of completions reaped at once (1-64)");
+
+static bool poll_mode = false;
+module_param(poll_mode, bool, 0444);
+MODULE_PARM_DESC(poll_mode, "Poll completion queues with a thread for each node");
+
+static int poll_usecs = 50;
+module_param(poll_usecs, int, 0644);
+MODULE_PARM_DESC(poll_usecs, "Time to keep polling an idle completion queue in usec");
+
+/**
+ * Senders waiting for a completion spin for up to spin_usecs before
+ * sleeping, saving the wakeup when the completion comes in quickly.
+ */
+static int spin_usecs = 0;
+module_param(spin_usecs, int, 0644);
+MODULE_PARM_DESC(spin_usecs, "Time to spin for a completion before sleeping in usec");
+
+/**
+ * Only every signal_every-th posted message asks for a completion. Sends
+ * complete in order, so the completion of a signaled send reclaims the
+ * unsignaled ones before it. Synchronous sends are always signaled.
+ *
+ * The unsignaled sends after the last signaled one hold their send works
+ * until the channel sends again. So a send is signaled once the channels
+ * retain max_unsignaled works in total, and a channel left idle with such
+ * a tail posts an empty signaled send to reclaim it, which peers drop.
+ */
+static unsigned int signal_every = 1;
+module_param(signal_every, uint, 0644);
+MODULE_PARM_DESC(signal_every, "Request a completion for every n-th posted message (up to 1/8 of the send queue)");
+
+/**
+ * Messages up to inline_size bytes are sent inline; the HCA copies them
+ * into the work request at posting, saving the DMA read of the payload.
+ * Lowered to what the device supports when queue pairs are created.
+ */
+static unsigned int inline_size = 256;
+module_param(inline_size, uint, 0444);
+MODULE_PARM_DESC(inline_size, "Max size of messages sent inline with work requests");
+static unsigned int rdma_max_inline = 0;
+
 struct work_header {
 	enum {
 		WORK_TYPE_RECV,
@@ -37,16 +133,20 @@ struct recv_work {
 enum {
 	SW_FLAG_MAPPED = 0,
 	SW_FLAG_FROM_BUFFER = 1,
+	SW_FLAG_INLINE = 2,	/* @addr is the caller's, gone after posting */
 };
 
 struct send_work {
 	struct work_header header;
 	struct send_work *next;
+	struct llist_node llnode;
+	struct rdma_channel *ch;
 	struct ib_sge sgl;
 	struct ib_send_wr wr;
 	void *addr;
 	unsigned long flags;
 	struct completion *done;
+	int *posted;		/* Post result of a queued send */
 };
 
 struct rdma_work {
@@ -57,8 +157,10 @@ struct rdma_work {
 	struct completion *done;
 };
 
-struct rdma_handle {
-	int nid;
+/* Queue pair to a peer. Each peer is connected through nr_channels of them */
+struct rdma_channel {
+	struct rdma_handle *rh;
+	int index;
 	enum {
 		RDMA_INIT,
 		RDMA_ADDR_RESOLVED,
@@ -69,24 +171,66 @@ struct rdma_handle {
 		RDMA_CLOSED,
 	} state;
 	struct completion cm_done;
-
-	struct recv_work *recv_works;
-	void *recv_buffer;
-	dma_addr_t recv_buffer_dma_addr;
+	int ret;
 
 	struct rdma_cm_id *cm_id;
+	struct ib_qp *qp;
+
+	/* Sends posted but not reclaimed yet, in the posted order */
+	spinlock_t sends_lock;
+	struct send_work *sends_head;
+	struct send_work *sends_tail;
+	unsigned int nr_unsignaled;
+	struct delayed_work flush;	/* Reclaims the unsignaled tail */
+
+	/* Sends queued while the lock is held, to be posted by the holder */
+	struct llist_head pending;
+};
+
+struct rdma_handle {
+	int nid;
+
 	struct ib_device *device;
 	struct ib_cq *cq;
-	struct ib_qp *qp;
+
+	atomic_t nr_sends;
+	wait_queue_head_t sends_wait;
+
+	/* Reaped completions. Only one context polls the cq at a time */
+	struct ib_wc wcs[MAX_POLL_BATCH];
+	struct task_struct *poll_handler;
+
+	struct rdma_channel channels[MAX_RDMA_CHANNELS];
 };
 
 /* RDMA handle for each node */
 static struct rdma_handle *rdma_handles[MAX_NUM_NODES] = { NULL };
+static struct rdma_cm_id *rdma_listen_id = NULL;
+
+/* Connection private data to identify the channel */
+struct rdma_conn_data {
+	int nid;
+	int index;
+};
+
+/* Shared receive queue and its buffers */
+static struct ib_srq *rdma_srq = NULL;
+static struct recv_work *recv_works = NULL;
+static void *recv_chunks[MAX_SRQ_CHUNKS] = { NULL };
+static dma_addr_t recv_chunks_dma_addr[MAX_SRQ_CHUNKS] = { 0 };
+static int nr_recv_chunks = 0;
+
+/* Serialize setting up the resources shared by channels */
+static DEFINE_MUTEX(rdma_setup_lock);
 
 /* Global protection domain (pd) and memory region (mr) */
 static struct ib_pd *rdma_pd = NULL;
+static struct ib_device_attr rdma_device_attr;
 static struct ib_mr *rdma_mr = NULL;
 
+/* Memory region over all memory for direct RDMA */
+static struct ib_mr *rdma_dma_mr = NULL;
+
 /* Global RDMA sink */
 static DEFINE_SPINLOCK(__rdma_slots_lock);
 static DECLARE_BITMAP(__rdma_slots, NR_RDMA_SLOTS) = {0};
@@ -125,6 +269,22 @@ static inline void __put_rdma_buffer(int slot) {
 }
 
 
+#ifdef CONFIG_POPCORN_STAT
+static atomic64_t __nr_cq_polls = ATOMIC64_INIT(0);
+static atomic64_t __nr_cq_entries = ATOMIC64_INIT(0);
+static atomic64_t __nr_unsignaled = ATOMIC64_INIT(0);
+static atomic64_t __nr_poll_sleeps = ATOMIC64_INIT(0);
+static atomic64_t __nr_inline_sends = ATOMIC64_INIT(0);
+static atomic64_t __nr_sw_refills = ATOMIC64_INIT(0);
+static atomic64_t __nr_chained_sends = ATOMIC64_INIT(0);
+static atomic64_t __nr_chained_posts = ATOMIC64_INIT(0);
+static atomic64_t __nr_unsignaled_flushes = ATOMIC64_INIT(0);
+#define RDMA_STAT_ADD(x, n) atomic64_add((n), &(x))
+#else
+#define RDMA_STAT_ADD(x, n)
+#endif
+
+
 /* Global send buffer */
 struct rb_alloc_header {
 	struct send_work *sw;
@@ -135,24 +295,82 @@ struct rb_alloc_header {
 };
 const unsigned int rb_alloc_header_magic = 0xbad7face;
 
-static DEFINE_SPINLOCK(send_work_pool_lock);
 static struct ring_buffer send_buffer = {};
+
+/**
+ * Send works are recycled through per-CPU caches, which are refilled from
+ * and spilled to the global pool in batches. The pool is sized to cover
+ * the works parked in the caches on top of the send queue depth.
+ */
+#define SW_CACHE_SIZE	16
+#define SW_CACHE_BATCH	(SW_CACHE_SIZE / 2)
+
+static DEFINE_SPINLOCK(send_work_pool_lock);
 static struct send_work *send_work_pool = NULL;
+static unsigned int nr_send_works = MAX_SEND_DEPTH;
 
-static struct send_work *__get_send_work_map(struct pcn_kmsg_message *msg, size_t size)
+/* Unsignaled sends retained by all channels, bounded against the pool */
+static atomic_t nr_unsignaled_retained = ATOMIC_INIT(0);
+static unsigned int max_unsignaled = MAX_SEND_DEPTH / 8;
+
+struct send_work_cache {
+	unsigned int nr;
+	struct send_work *works[SW_CACHE_SIZE];
+};
+static DEFINE_PER_CPU(struct send_work_cache, send_work_caches);
+
+static struct send_work *__alloc_send_work(void)
 {
-	unsigned long flags;
+	struct send_work_cache *sc;
 	struct send_work *sw;
-	void *map_start = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	sc = this_cpu_ptr(&send_work_caches);
+	if (!sc->nr) {
+		RDMA_STAT_ADD(__nr_sw_refills, 1);
+		spin_lock(&send_work_pool_lock);
+		while (sc->nr < SW_CACHE_BATCH && send_work_pool) {
+			sc->works[sc->nr++] = send_work_pool;
+			send_work_pool = send_work_pool->next;
+		}
+		spin_unlock(&send_work_pool_lock);
+		BUG_ON(!sc->nr);
+	}
+	sw = sc->works[--sc->nr];
+	local_irq_restore(flags);
 
-	spin_lock_irqsave(&send_work_pool_lock, flags);
-	BUG_ON(!send_work_pool);
-	sw = send_work_pool;
-	send_work_pool = sw->next;
-	spin_unlock_irqrestore(&send_work_pool_lock, flags);
+	return sw;
+}
+
+static void __free_send_work(struct send_work *sw)
+{
+	struct send_work_cache *sc;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	sc = this_cpu_ptr(&send_work_caches);
+	if (sc->nr == SW_CACHE_SIZE) {
+		spin_lock(&send_work_pool_lock);
+		while (sc->nr > SW_CACHE_BATCH) {
+			struct send_work *w = sc->works[--sc->nr];
+			w->next = send_work_pool;
+			send_work_pool = w;
+		}
+		spin_unlock(&send_work_pool_lock);
+	}
+	sc->works[sc->nr++] = sw;
+	local_irq_restore(flags);
+}
+
+static struct send_work *__get_send_work_map(struct pcn_kmsg_message *msg, size_t size)
+{
+	struct send_work *sw = __alloc_send_work();
+	void *map_start = NULL;
 
 	sw->done = NULL;
 	sw->flags = 0;
+	sw->wr.num_sge = 1;
 
 	if (!msg) {
 		struct rb_alloc_header *ah;
@@ -201,10 +419,24 @@ static struct send_work *__get_send_work(size_t size)
 	return __get_send_work_map(NULL, size);
 }
 
-static void __put_send_work(struct send_work *sw)
+/* Send @msg inline without copying nor mapping it */
+static struct send_work *__get_send_work_inline(struct pcn_kmsg_message *msg, size_t size)
 {
-	unsigned long flags;
+	struct send_work *sw = __alloc_send_work();
+
+	sw->done = NULL;
+	sw->flags = 0;
+	sw->wr.num_sge = 1;
+	set_bit(SW_FLAG_INLINE, &sw->flags);
 
+	sw->addr = msg;
+	sw->sgl.addr = (u64)msg;
+	sw->sgl.length = size;
+	return sw;
+}
+
+static void __put_send_work(struct send_work *sw)
+{
 	if (test_bit(SW_FLAG_MAPPED, &sw->flags)) {
 		ib_dma_unmap_single(rdma_pd->device,
 				sw->sgl.addr, sw->sgl.length, DMA_TO_DEVICE);
@@ -221,10 +453,7 @@ static void __put_send_work(struct send_work *sw)
 		}
 	}
 
-	spin_lock_irqsave(&send_work_pool_lock, flags);
-	sw->next = send_work_pool;
-	send_work_pool = sw;
-	spin_unlock_irqrestore(&send_work_pool_lock, flags);
+	__free_send_work(sw);
 }
 
 
@@ -337,28 +566,312 @@ void rdma_kmsg_stat(struct seq_file *seq, void *v)
 				0ULL,
 #endif
 				"Send buffer usage");
+#ifdef CONFIG_POPCORN_STAT
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic64_read(&__nr_cq_entries),
+				(unsigned long long)atomic64_read(&__nr_cq_polls),
+				"rdma completions, polls");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic64_read(&__nr_unsignaled),
+				(unsigned long long)atomic64_read(&__nr_poll_sleeps),
+				"rdma unsignaled sends, poll sleeps");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic64_read(&__nr_inline_sends),
+				(unsigned long long)atomic64_read(&__nr_sw_refills),
+				"rdma inline sends, send work refills");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic64_read(&__nr_chained_sends),
+				(unsigned long long)atomic64_read(&__nr_chained_posts),
+				"rdma chained sends, chained posts");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic64_read(&__nr_unsignaled_flushes),
+				(unsigned long long)atomic_read(&nr_unsignaled_retained),
+				"rdma unsignaled tail flushes, retained");
+#endif
+	} else {
+#ifdef CONFIG_POPCORN_STAT
+		atomic64_set(&__nr_cq_polls, 0);
+		atomic64_set(&__nr_cq_entries, 0);
+		atomic64_set(&__nr_unsignaled, 0);
+		atomic64_set(&__nr_poll_sleeps, 0);
+		atomic64_set(&__nr_inline_sends, 0);
+		atomic64_set(&__nr_sw_refills, 0);
+		atomic64_set(&__nr_chained_sends, 0);
+		atomic64_set(&__nr_chained_posts, 0);
+		atomic64_set(&__nr_unsignaled_flushes, 0);
+#endif
 	}
 }
 
+/**
+ * Wait for @done, spinning for spin_usecs first. Return 0 if timed out.
+ */
+static unsigned long __wait_for_completion(struct completion *done, unsigned long timeout)
+{
+	if (try_wait_for_completion(done)) return 1;
+
+	if (spin_usecs > 0) {
+		u64 until = local_clock() + spin_usecs * NSEC_PER_USEC;
+		do {
+			cpu_relax();
+			if (try_wait_for_completion(done)) return 1;
+		} while (local_clock() < until);
+	}
+	return wait_for_completion_io_timeout(done, timeout);
+}
+
 
 /****************************************************************************
  * Send
  */
-static int __send_to(int to_nid, struct send_work *sw, size_t size)
+/**
+ * Pick the channel to carry messages from the current thread. Messages
+ * from a thread always go through the same channel, so they are delivered
+ * in the order they were sent.
+ */
+static inline struct rdma_channel *__get_channel(int nid)
+{
+	return rdma_handles[nid]->channels + (current->pid % nr_channels);
+}
+
+/* Should be called with sends_lock held */
+static inline void __set_signaled(struct rdma_channel *ch, struct send_work *sw)
+{
+	if (sw->done || ch->nr_unsignaled + 1 >=
+			clamp_t(unsigned int, signal_every, 1, MAX_SEND_DEPTH / 8) ||
+			atomic_read(&nr_unsignaled_retained) >= max_unsignaled) {
+		sw->wr.send_flags |= IB_SEND_SIGNALED;
+		atomic_sub(ch->nr_unsignaled, &nr_unsignaled_retained);
+		ch->nr_unsignaled = 0;
+	} else {
+		sw->wr.send_flags &= ~IB_SEND_SIGNALED;
+		atomic_inc(&nr_unsignaled_retained);
+		if (ch->nr_unsignaled++ == 0) {
+			schedule_delayed_work(&ch->flush, 1);
+		}
+		RDMA_STAT_ADD(__nr_unsignaled, 1);
+	}
+}
+
+/**
+ * Post the sends linked from @first to @last with a single doorbell.
+ * Should be called with sends_lock held. The sends that are not posted
+ * are unlinked from the channel and returned through @failed.
+ */
+static int __post_sends(struct rdma_channel *ch, struct send_work *first, struct send_work *last, struct send_work **failed)
 {
-	struct rdma_handle *rh = rdma_handles[to_nid];
+	struct send_work *prev = ch->sends_tail;
 	struct ib_send_wr *bad_wr = NULL;
+	struct send_work *sw;
+	int ret;
+
+	for (sw = first; sw != last; sw = sw->next) {
+		sw->wr.next = &sw->next->wr;
+	}
+	last->wr.next = NULL;
+	last->next = NULL;
+
+	/* Keep the list in the posted order */
+	if (prev) {
+		prev->next = first;
+	} else {
+		ch->sends_head = first;
+	}
+	ch->sends_tail = last;
+
+	ret = ib_post_send(ch->qp, &first->wr, &bad_wr);
+	if (!ret && !bad_wr) {
+		*failed = NULL;
+		return 0;
+	}
+
+	*failed = bad_wr ? container_of(bad_wr, struct send_work, wr) : first;
+	if (*failed != first) {
+		for (prev = first; prev->next != *failed; prev = prev->next);
+	}
+	ch->sends_tail = prev;
+	if (prev) {
+		prev->next = NULL;
+	} else {
+		ch->sends_head = NULL;
+	}
+	return ret ? ret : -EINVAL;
+}
+
+/**
+ * Post the sends queued by senders that could not take the lock, chained
+ * in the queued order, and hand each sender its post result. Should be
+ * called with sends_lock held, which keeps the posted sends from being
+ * reclaimed while their results are handed over.
+ */
+static void __flush_pending(struct rdma_channel *ch)
+{
+	struct llist_node *node = llist_del_all(&ch->pending);
+	struct send_work *first = NULL, *last = NULL, *failed, *sw;
+	int ret, nr = 0;
+
+	if (!node) return;
+
+	for (node = llist_reverse_order(node); node; node = node->next) {
+		struct send_work *sw = llist_entry(node, struct send_work, llnode);
+		__set_signaled(ch, sw);
+		if (last) {
+			last->next = sw;
+		} else {
+			first = sw;
+		}
+		last = sw;
+		nr++;
+	}
+	if (nr > 1) {
+		RDMA_STAT_ADD(__nr_chained_sends, nr);
+		RDMA_STAT_ADD(__nr_chained_posts, 1);
+	}
+
+	ret = __post_sends(ch, first, last, &failed);
+
+	for (sw = first; sw && sw != failed; sw = sw->next) {
+		smp_store_release(sw->posted, 0);
+	}
+	/* The senders put the failed ones back */
+	while (failed) {
+		struct send_work *next = failed->next;
+		smp_store_release(failed->posted, ret);
+		failed = next;
+	}
+}
+
+/**
+ * Post the pending sends unless the lock holder is around to do so.
+ * Every sends_lock holder should call this after releasing the lock.
+ */
+static void __kick_pending(struct rdma_channel *ch)
+{
+	unsigned long flags;
+
+	/* Pairs with llist_add() so that either side sees the other */
+	smp_mb();
+	while (!llist_empty(&ch->pending)) {
+		if (!spin_trylock_irqsave(&ch->sends_lock, flags)) break;
+		__flush_pending(ch);
+		spin_unlock_irqrestore(&ch->sends_lock, flags);
+		smp_mb();
+	}
+}
+
+/**
+ * Reclaim the unsignaled tail that a channel still holds a tick after it
+ * started the tail, with an empty signaled send. Peers drop the message.
+ */
+static void __flush_unsignaled(struct work_struct *work)
+{
+	struct rdma_channel *ch =
+			container_of(to_delayed_work(work), struct rdma_channel, flush);
+	struct rdma_handle *rh = ch->rh;
+	struct send_work *sw = __alloc_send_work();
+	struct send_work *failed = NULL;
+	unsigned long flags;
+	int ret = 0;
+
+	sw->done = NULL;
+	sw->flags = 0;
+	sw->addr = NULL;
+	sw->sgl.length = 0;
+	sw->ch = ch;
+	sw->wr.num_sge = 0;
+	sw->wr.send_flags = IB_SEND_SIGNALED;
+
+	spin_lock_irqsave(&ch->sends_lock, flags);
+	__flush_pending(ch);
+	if (ch->nr_unsignaled) {
+		atomic_sub(ch->nr_unsignaled, &nr_unsignaled_retained);
+		ch->nr_unsignaled = 0;
+		atomic_inc(&rh->nr_sends);
+		ret = __post_sends(ch, sw, sw, &failed);
+		RDMA_STAT_ADD(__nr_unsignaled_flushes, 1);
+	} else {
+		failed = sw;
+	}
+	spin_unlock_irqrestore(&ch->sends_lock, flags);
+	__kick_pending(ch);
+
+	if (!failed) return;
+	if (ret) {
+		printk_ratelimited(KERN_ERR "Cannot flush sends to %d/%d, %d\n",
+				rh->nid, ch->index, ret);
+		atomic_dec(&rh->nr_sends);
+	}
+	__put_send_work(failed);
+}
+
+static int __send_to(int to_nid, struct send_work *sw, struct pcn_kmsg_message *msg, size_t size)
+{
+	struct rdma_channel *ch = __get_channel(to_nid);
+	struct rdma_handle *rh = ch->rh;
+	struct send_work *failed;
+	unsigned long flags;
 	int ret;
 
 #ifdef CONFIG_POPCORN_CHECK_SANITY
 	BUG_ON(size > sw->sgl.length);
 #endif
 	sw->sgl.length = size; /* Might be shrunk after get*/
+	sw->ch = ch;
 
-	ret = ib_post_send(rh->qp, &sw->wr, &bad_wr);
-	if (ret) return ret;
-	if (bad_wr) return -EINVAL;
+	if (size <= rdma_max_inline && !test_bit(SW_FLAG_MAPPED, &sw->flags)) {
+		/* Inline data is copied from the virtual address */
+		if (test_bit(SW_FLAG_FROM_BUFFER, &sw->flags)) {
+			sw->sgl.addr = (u64)(sw->addr + sizeof(struct rb_alloc_header));
+		}
+		sw->wr.send_flags |= IB_SEND_INLINE;
+		RDMA_STAT_ADD(__nr_inline_sends, 1);
+	} else {
+		sw->wr.send_flags &= ~IB_SEND_INLINE;
+	}
 
+	if (msg->header.prio == PCN_KMSG_PRIO_LOW) {
+		might_sleep();
+		wait_event(rh->sends_wait,
+				atomic_read(&rh->nr_sends) < low_prio_thr);
+	}
+	atomic_inc(&rh->nr_sends);
+
+	/**
+	 * Posted messages own their buffers, so they can be left to the lock
+	 * holder, which posts them together with its own in one doorbell.
+	 * The holder does so on its way out, so wait for the post result.
+	 */
+	if (!sw->done && test_bit(SW_FLAG_FROM_BUFFER, &sw->flags)) {
+		int posted = -EINPROGRESS;
+
+		sw->posted = &posted;
+		llist_add(&sw->llnode, &ch->pending);
+		__kick_pending(ch);
+		while ((ret = smp_load_acquire(&posted)) == -EINPROGRESS) {
+			cpu_relax();
+		}
+		if (ret) {
+			printk_ratelimited(KERN_ERR "Cannot post sends to %d/%d, %d\n",
+					rh->nid, ch->index, ret);
+			atomic_dec(&rh->nr_sends);
+			if (waitqueue_active(&rh->sends_wait)) {
+				wake_up(&rh->sends_wait);
+			}
+		}
+		return ret;
+	}
+
+	spin_lock_irqsave(&ch->sends_lock, flags);
+	__flush_pending(ch);
+	__set_signaled(ch, sw);
+	ret = __post_sends(ch, sw, sw, &failed);
+	spin_unlock_irqrestore(&ch->sends_lock, flags);
+	__kick_pending(ch);
+
+	if (ret) {
+		atomic_dec(&rh->nr_sends);
+		return ret;
+	}
 	return 0;
 }
 
@@ -369,6 +882,14 @@ int rdma_kmsg_send(int dst, struct pcn_kmsg_message *msg, size_t size)
 	int ret;
 	might_sleep();
 
+	/* @msg is copied at posting, so no need to wait for the completion */
+	if (size <= rdma_max_inline) {
+		sw = __get_send_work_inline(msg, size);
+		ret = __send_to(dst, sw, msg, size);
+		if (ret) __put_send_work(sw);
+		return ret;
+	}
+
 	if (size <= use_rb_thr) {
 		sw = __get_send_work(size);
 		memcpy(sw->addr + sizeof(struct rb_alloc_header), msg, size);
@@ -378,15 +899,12 @@ int rdma_kmsg_send(int dst, struct pcn_kmsg_message *msg, size_t size)
 
 	sw->done = &done;
 
-	ret = __send_to(dst, sw, size);
+	ret = __send_to(dst, sw, msg, size);
 	if (ret) goto out;
 
-	if (!try_wait_for_completion(&done)) {
-		ret = wait_for_completion_io_timeout(&done, 60 * HZ);
-		if (!ret) {
-			ret = -ETIME;
-			goto out;
-		}
+	if (!__wait_for_completion(&done, 60 * HZ)) {
+		ret = -ETIME;
+		goto out;
 	}
 	/* send_work is returned in the completion handler */
 	return 0;
@@ -407,7 +925,7 @@ int rdma_kmsg_post(int dst, struct pcn_kmsg_message *msg, size_t size)
 	}
 #endif
 
-	ret = __send_to(dst, sw, size);
+	ret = __send_to(dst, sw, msg, size);
 	if (ret) {
 		__put_send_work(sw);
 		return ret;
@@ -420,29 +938,63 @@ int rdma_kmsg_post(int dst, struct pcn_kmsg_message *msg, size_t size)
 /****************************************************************************
  * Perform RDMA
  */
+struct rdma_pin_handle {
+	struct pcn_kmsg_rdma_handle handle;
+	int slot;		/* -1 if the buffer is pinned in place */
+	size_t size;
+};
+
 struct pcn_kmsg_rdma_handle *rdma_kmsg_pin_rdma_buffer(void *msg, size_t size)
 {
-	struct pcn_kmsg_rdma_handle *rh = kmalloc(sizeof(*rh), GFP_KERNEL);
+	struct rdma_pin_handle *ph = kmalloc(sizeof(*ph), GFP_KERNEL);
+	struct pcn_kmsg_rdma_handle *rh;
 
-	if (!rh) return ERR_PTR(-ENOMEM);
+	if (!ph) return ERR_PTR(-ENOMEM);
+	rh = &ph->handle;
+	rh->private = NULL;
+	ph->size = size;
+
+	if (msg && rdma_dma_mr) {
+		int ret;
+		rh->addr = msg;
+		rh->dma_addr = ib_dma_map_single(rdma_pd->device,
+				msg, size, DMA_FROM_DEVICE);
+		ret = ib_dma_mapping_error(rdma_pd->device, rh->dma_addr);
+		if (ret) {
+			kfree(ph);
+			return ERR_PTR(-ENOMEM);
+		}
+		rh->rkey = rdma_dma_mr->rkey;
+		ph->slot = -1;
+		return rh;
+	}
 
 #ifdef CONFIG_POPCORN_CHECK_SANITY
 	if (size > RDMA_SLOT_SIZE) {
 		BUG_ON("Too large buffer to pin");
+		kfree(ph);
 		return ERR_PTR(-EINVAL);
 	}
 #endif
 	rh->rkey = rdma_mr->rkey;
-	rh->private = (void *)
-		(unsigned long)__get_rdma_buffer(&rh->addr, &rh->dma_addr);
+	ph->slot = __get_rdma_buffer(&rh->addr, &rh->dma_addr);
 
 	return rh;
 }
 
 void rdma_kmsg_unpin_rdma_buffer(struct pcn_kmsg_rdma_handle *handle)
 {
-	__put_rdma_buffer((unsigned long)handle->private);
-	kfree(handle);
+	struct rdma_pin_handle *ph =
+			container_of(handle, struct rdma_pin_handle, handle);
+
+	if (ph->slot < 0) {
+		/* Make the data written by the peer visible to CPUs */
+		ib_dma_unmap_single(rdma_pd->device,
+				handle->dma_addr, ph->size, DMA_FROM_DEVICE);
+	} else {
+		__put_rdma_buffer(ph->slot);
+	}
+	kfree(ph);
 }
 
 int rdma_kmsg_write(int to_nid, dma_addr_t rdma_addr, void *addr, size_t size, u32 rdma_key)
@@ -463,16 +1015,13 @@ int rdma_kmsg_write(int to_nid, dma_addr_t rdma_addr, void *addr, size_t size, u
 
 	rw->done = &done;
 
-	ret = ib_post_send(rdma_handles[to_nid]->qp, &rw->wr.wr, &bad_wr);
+	ret = ib_post_send(__get_channel(to_nid)->qp, &rw->wr.wr, &bad_wr);
 	if (ret || bad_wr) {
 		printk("Cannot post rdma write, %d, %p\n", ret, bad_wr);
 		if (ret == 0) ret = -EINVAL;
 		goto out;
 	}
-	/* XXX polling??? */
-	if (!try_wait_for_completion(&done)) {
-		wait_for_completion(&done);
-	}
+	__wait_for_completion(&done, MAX_SCHEDULE_TIMEOUT);
 
 out:
 	ib_dma_unmap_single(rdma_mr->device, dma_addr, size, DMA_TO_DEVICE);
@@ -492,23 +1041,34 @@ int rdma_kmsg_read(int from_nid, void *addr, dma_addr_t rdma_addr, size_t size,
 void rdma_kmsg_done(struct pcn_kmsg_message *msg)
 {
 	/* Put back the receive work */
-	int ret;
+	int ret, i;
 	struct ib_recv_wr *bad_wr = NULL;
-	int from_nid = PCN_KMSG_FROM_NID(msg);
-	struct rdma_handle *rh = rdma_handles[from_nid];
-	int index = ((void *)msg - rh->recv_buffer) / PCN_KMSG_MAX_SIZE;
+	int index = -1;
 
+	for (i = 0; i < nr_recv_chunks; i++) {
+		unsigned long offset = (void *)msg - recv_chunks[i];
+		if (offset < RECV_CHUNK_SIZE) {
+			index = i * MAX_RECV_DEPTH + offset / RECV_SLOT_SIZE;
+			break;
+		}
+	}
 #ifdef CONFIG_POPCORN_CHECK_SANITY
-	BUG_ON(index < 0 || index >= MAX_RECV_DEPTH);
+	BUG_ON(index < 0 || index >= srq_depth);
 #endif
 
-	ret = ib_post_recv(rh->qp, &rh->recv_works[index].wr, &bad_wr);
+	ret = ib_post_srq_recv(rdma_srq, &recv_works[index].wr, &bad_wr);
 	BUG_ON(ret || bad_wr);
 }
 
 static void __process_recv(struct ib_wc *wc)
 {
 	struct recv_work *rw = (void *)wc->wr_id;
+
+	/* Sent to reclaim the unsignaled sends of the peer */
+	if (!wc->byte_len) {
+		rdma_kmsg_done(rw->addr);
+		return;
+	}
 	/*
 	printk("recv %d %d\n", wc->byte_len,
 			((struct pcn_kmsg_message *)rw->addr)->header.type);
@@ -516,14 +1076,41 @@ static void __process_recv(struct ib_wc *wc)
 	pcn_kmsg_process(rw->addr);
 }
 
+/**
+ * Reclaim the sends up to the signaled one, which have been completed
+ * since the sends complete in order.
+ */
 static void __process_sent(struct ib_wc *wc)
 {
 	struct send_work *sw = (void *)wc->wr_id;
+	struct rdma_channel *ch = sw->ch;
+	struct rdma_handle *rh = ch->rh;
+	struct send_work *head;
+	unsigned long flags;
+	int nr = 0;
+
+	spin_lock_irqsave(&ch->sends_lock, flags);
+	head = ch->sends_head;
+	ch->sends_head = sw->next;
+	if (!sw->next) ch->sends_tail = NULL;
+	sw->next = NULL;
+	spin_unlock_irqrestore(&ch->sends_lock, flags);
+	__kick_pending(ch);
+
+	while (head) {
+		struct send_work *next = head->next;
+		if (head->done) {
+			complete(head->done);
+		}
+		__put_send_work(head);
+		head = next;
+		nr++;
+	}
 
-	if (sw->done) {
-		complete(sw->done);
+	if (atomic_sub_return(nr, &rh->nr_sends) < low_prio_thr &&
+			waitqueue_active(&rh->sends_wait)) {
+		wake_up(&rh->sends_wait);
 	}
-	__put_send_work(sw);
 }
 
 static void __process_rdma_completion(struct ib_wc *wc)
@@ -548,6 +1135,8 @@ static void __process_faulty_work(struct ib_wc *wc)
 		struct send_work *w = (struct send_work *)wc->wr_id;
 		struct pcn_kmsg_message *msg;
 		printk("  type: send, %llx + %d\n", w->sgl.addr, w->sgl.length);
+		/* The message might have been released by the sender */
+		if (test_bit(SW_FLAG_INLINE, &w->flags)) break;
 		if (test_bit(SW_FLAG_FROM_BUFFER, &w->flags)) {
 			msg = w->addr + sizeof(struct rb_alloc_header);
 		} else {
@@ -573,163 +1162,335 @@ static void __process_faulty_work(struct ib_wc *wc)
 	}
 }
 
+static void __process_wc(struct ib_wc *wc)
+{
+	if (wc->opcode < 0 || wc->status) {
+		__process_faulty_work(wc);
+		return;
+	}
+	switch(wc->opcode) {
+	case IB_WC_SEND:
+		__process_sent(wc);
+		break;
+	case IB_WC_RECV:
+		__process_recv(wc);
+		break;
+	case IB_WC_RDMA_WRITE:
+	case IB_WC_RDMA_READ:
+		__process_rdma_completion(wc);
+		break;
+	case IB_WC_REG_MR:
+		__process_comp_wakeup(wc, "mr registered\n");
+		break;
+	default:
+		printk("Unknown completion op %d\n", wc->opcode);
+		break;
+	}
+}
+
+/* Reap and process completions in batches. Return the number of them */
+static int __poll_cq(struct rdma_handle *rh)
+{
+	int batch = clamp(poll_batch, 1, MAX_POLL_BATCH);
+	int nr, total = 0;
+
+	while ((nr = ib_poll_cq(rh->cq, batch, rh->wcs)) > 0) {
+		int i;
+		for (i = 0; i < nr; i++) {
+			__process_wc(rh->wcs + i);
+		}
+		total += nr;
+		RDMA_STAT_ADD(__nr_cq_polls, 1);
+		if (nr < batch) break;
+	}
+	RDMA_STAT_ADD(__nr_cq_entries, total);
+	return total;
+}
+
 void cq_comp_handler(struct ib_cq *cq, void *context)
 {
-	int ret;
-	struct ib_wc wc;
+	struct rdma_handle *rh = context;
+
+	/* The polling thread takes over from here */
+	if (rh->poll_handler) {
+		wake_up_process(rh->poll_handler);
+		return;
+	}
+
+	do {
+		__poll_cq(rh);
+	} while (ib_req_notify_cq(cq,
+			IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS) > 0);
+}
+
+/**
+ * Busy-poll the cq while completions keep coming in. After idling for
+ * poll_usecs, arm the completion interrupt and sleep until it fires.
+ */
+static int poll_handler(void *arg0)
+{
+	struct rdma_handle *rh = arg0;
+	u64 idle_since = local_clock();
 
-retry:
-	while ((ret = ib_poll_cq(cq, 1, &wc)) > 0) {
-		if (wc.opcode < 0 || wc.status) {
-			__process_faulty_work(&wc);
+	MSGPRINTK("POLL handler for %d is ready\n", rh->nid);
+
+	while (!kthread_should_stop()) {
+		if (__poll_cq(rh)) {
+			idle_since = local_clock();
+			cond_resched();
 			continue;
 		}
-		switch(wc.opcode) {
-		case IB_WC_SEND:
-			__process_sent(&wc);
-			break;
-		case IB_WC_RECV:
-			__process_recv(&wc);
-			break;
-		case IB_WC_RDMA_WRITE:
-		case IB_WC_RDMA_READ:
-			__process_rdma_completion(&wc);
-			break;
-		case IB_WC_REG_MR:
-			__process_comp_wakeup(&wc, "mr registered\n");
-			break;
-		default:
-			printk("Unknown completion op %d\n", wc.opcode);
-			break;
+		if (local_clock() - idle_since < poll_usecs * NSEC_PER_USEC) {
+			cpu_relax();
+			cond_resched();
+			continue;
 		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (ib_req_notify_cq(rh->cq,
+				IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS) > 0 ||
+				kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		RDMA_STAT_ADD(__nr_poll_sleeps, 1);
+		schedule();
+		idle_since = local_clock();
 	}
-	ret = ib_req_notify_cq(cq, IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS);
-	if (ret > 0) goto retry;
+	return 0;
 }
 
 
 /****************************************************************************
  * Setup connections
  */
-static __init int __setup_pd_cq_qp(struct rdma_handle *rh)
+static __init int __setup_srq(struct ib_device *device)
 {
-	int ret;
+	int ret, i;
+	struct ib_srq_init_attr srq_attr = {
+		.event_handler = NULL,
+		.attr = {
+			.max_wr = srq_depth,
+			.max_sge = 1,
+		},
+		.srq_type = IB_SRQT_BASIC,
+	};
+
+	rdma_srq = ib_create_srq(rdma_pd, &srq_attr);
+	if (IS_ERR(rdma_srq)) {
+		ret = PTR_ERR(rdma_srq);
+		rdma_srq = NULL;
+		return ret;
+	}
+
+	recv_works = kcalloc(srq_depth, sizeof(*recv_works), GFP_KERNEL);
+	if (!recv_works) return -ENOMEM;
+
+	/* Populate receive buffers and work requests */
+	nr_recv_chunks = DIV_ROUND_UP(srq_depth, MAX_RECV_DEPTH);
+	for (i = 0; i < nr_recv_chunks; i++) {
+		dma_addr_t dma_addr;
 
-	BUG_ON(rh->state != RDMA_ROUTE_RESOLVED && "for rh->device");
+		recv_chunks[i] = kmalloc(RECV_CHUNK_SIZE, GFP_KERNEL);
+		if (!recv_chunks[i]) return -ENOMEM;
 
-	/* Create global pd if it is not allocated yet */
+		dma_addr = ib_dma_map_single(device,
+				recv_chunks[i], RECV_CHUNK_SIZE, DMA_FROM_DEVICE);
+		ret = ib_dma_mapping_error(device, dma_addr);
+		if (ret) return ret;
+		recv_chunks_dma_addr[i] = dma_addr;
+	}
+
+	for (i = 0; i < srq_depth; i++) {
+		struct recv_work *rw = recv_works + i;
+		int chunk = i / MAX_RECV_DEPTH;
+		/* Leave room for the receive header in front of the message */
+		size_t offset = RECV_SLOT_SIZE * (i % MAX_RECV_DEPTH) +
+				sizeof(struct pcn_kmsg_recv_hdr);
+		struct ib_recv_wr *wr, *bad_wr = NULL;
+		struct ib_sge *sgl;
+
+		rw->header.type = WORK_TYPE_RECV;
+		rw->dma_addr = recv_chunks_dma_addr[chunk] + offset;
+		rw->addr = recv_chunks[chunk] + offset;
+
+		sgl = &rw->sgl;
+		sgl->lkey = rdma_pd->local_dma_lkey;
+		sgl->addr = rw->dma_addr;
+		sgl->length = PCN_KMSG_MAX_SIZE;
+
+		wr = &rw->wr;
+		wr->sg_list = sgl;
+		wr->num_sge = 1;
+		wr->next = NULL;
+		wr->wr_id = (u64)rw;
+
+		ret = ib_post_srq_recv(rdma_srq, wr, &bad_wr);
+		if (ret || bad_wr) return ret ? ret : -EINVAL;
+	}
+	return 0;
+}
+
+static void __destroy_srq(void)
+{
+	int i;
+
+	if (rdma_srq) ib_destroy_srq(rdma_srq);
+	rdma_srq = NULL;
+
+	for (i = 0; i < nr_recv_chunks; i++) {
+		if (recv_chunks_dma_addr[i]) {
+			ib_dma_unmap_single(rdma_pd->device, recv_chunks_dma_addr[i],
+					RECV_CHUNK_SIZE, DMA_FROM_DEVICE);
+		}
+		kfree(recv_chunks[i]);
+		recv_chunks[i] = NULL;
+		recv_chunks_dma_addr[i] = 0;
+	}
+	nr_recv_chunks = 0;
+
+	kfree(recv_works);
+	recv_works = NULL;
+}
+
+/**
+ * Fit the send work pool and the srq into what the device supports. The pool
+ * bounds the sends in flight over all channels, so a queue pair takes as many
+ * as the pool holds, and the cq of a peer takes the completions of the pool,
+ * the srq, and the RDMA slots.
+ */
+static __init int __fit_device_limits(void)
+{
+	int max_depth = min_t(int, rdma_device_attr.max_srq_wr,
+			MAX_RECV_DEPTH * MAX_SRQ_CHUNKS);
+	int max_works;
+
+	nr_send_works = min_t(unsigned int,
+			nr_send_works, rdma_device_attr.max_qp_wr);
+
+	if (!srq_depth) {
+		srq_depth = min_t(unsigned long, max_depth,
+				(unsigned long)(MAX_NUM_NODES - 1) *
+				nr_channels * nr_send_works);
+	}
+	srq_depth = clamp(srq_depth, 1, max_depth);
+
+	max_works = rdma_device_attr.max_cqe - srq_depth - (int)NR_RDMA_SLOTS;
+	nr_send_works = min_t(unsigned int, nr_send_works, max(max_works, 0));
+
+	/* The per-CPU caches should not drain the pool */
+	if (nr_send_works <= num_online_cpus() * SW_CACHE_SIZE) {
+		printk(KERN_ERR "Too few send works, %u, for the device\n",
+				nr_send_works);
+		return -ENOSPC;
+	}
+	max_unsignaled = nr_send_works / 8;
+	return 0;
+}
+
+/* Set up the pd, srq, and cq shared by channels if they are not yet */
+static __init int __setup_shared(struct rdma_handle *rh)
+{
+	int ret = 0;
+
+	mutex_lock(&rdma_setup_lock);
+	/* Create global pd and srq if they are not allocated yet */
 	if (!rdma_pd) {
+		ret = ib_query_device(rh->device, &rdma_device_attr);
+		if (ret) goto out;
+		ret = __fit_device_limits();
+		if (ret) goto out;
+
 		rdma_pd = ib_alloc_pd(rh->device);
 		if (IS_ERR(rdma_pd)) {
 			ret = PTR_ERR(rdma_pd);
 			rdma_pd = NULL;
-			goto out_err;
+			goto out;
 		}
+		ret = __setup_srq(rh->device);
+		if (ret) goto out;
 	}
 
 	/* create completion queue */
 	if (!rh->cq) {
 		struct ib_cq_init_attr cq_attr = {
-			.cqe = MAX_SEND_DEPTH + MAX_RECV_DEPTH + NR_RDMA_SLOTS,
+			.cqe = nr_send_works + srq_depth + NR_RDMA_SLOTS,
 			.comp_vector = 0,
 		};
+		struct ib_cq *cq;
 
-		rh->cq = ib_create_cq(
+		cq = ib_create_cq(
 				rh->device, cq_comp_handler, NULL, rh, &cq_attr);
-		if (IS_ERR(rh->cq)) {
-			ret = PTR_ERR(rh->cq);
-			goto out_err;
+		if (IS_ERR(cq)) {
+			ret = PTR_ERR(cq);
+			goto out;
+		}
+		rh->cq = cq;
+
+		if (poll_mode) {
+			/* The handler arms the cq when it gets idle */
+			struct task_struct *tsk = kthread_create(poll_handler, rh,
+					"pcn_rdma_poll_%d", rh->nid);
+			if (IS_ERR(tsk)) {
+				ret = PTR_ERR(tsk);
+				goto out;
+			}
+			rh->poll_handler = tsk;
+			wake_up_process(tsk);
+		} else {
+			ret = ib_req_notify_cq(rh->cq, IB_CQ_NEXT_COMP);
+			if (ret < 0) goto out;
 		}
-
-		ret = ib_req_notify_cq(rh->cq, IB_CQ_NEXT_COMP);
-		if (ret < 0) goto out_err;
 	}
+out:
+	mutex_unlock(&rdma_setup_lock);
+	return ret;
+}
+
+static __init int __setup_pd_cq_qp(struct rdma_channel *ch)
+{
+	int ret;
+	struct rdma_handle *rh = ch->rh;
+
+	BUG_ON(ch->state != RDMA_ROUTE_RESOLVED && "for rh->device");
+
+	ret = __setup_shared(rh);
+	if (ret) return ret;
 
 	/* create queue pair */
 	{
 		struct ib_qp_init_attr qp_attr = {
 			.event_handler = NULL, // qp_event_handler,
-			.qp_context = rh,
+			.qp_context = ch,
 			.cap = {
-				.max_send_wr = MAX_SEND_DEPTH,
-				.max_recv_wr = MAX_RECV_DEPTH + NR_RDMA_SLOTS,
+				.max_send_wr = nr_send_works,
+				.max_recv_wr = 0,
 				.max_send_sge = PCN_KMSG_MAX_SIZE >> PAGE_SHIFT,
 				.max_recv_sge = PCN_KMSG_MAX_SIZE >> PAGE_SHIFT,
+				.max_inline_data = inline_size,
 			},
 			.sq_sig_type = IB_SIGNAL_REQ_WR,
 			.qp_type = IB_QPT_RC,
 			.send_cq = rh->cq,
 			.recv_cq = rh->cq,
+			.srq = rdma_srq,
 		};
 
-		ret = rdma_create_qp(rh->cm_id, rdma_pd, &qp_attr);
-		if (ret) goto out_err;
-		rh->qp = rh->cm_id->qp;
-	}
-	return 0;
-
-out_err:
-	return ret;
-}
-
-static __init int __setup_buffers_and_pools(struct rdma_handle *rh)
-{
-	int ret = 0, i;
-	dma_addr_t dma_addr;
-	char *recv_buffer = NULL;
-	struct recv_work *rws = NULL;
-	const size_t buffer_size = PCN_KMSG_MAX_SIZE * MAX_RECV_DEPTH;
-
-	/* Initalize receive buffers */
-	recv_buffer = kmalloc(buffer_size, GFP_KERNEL);
-	if (!recv_buffer) {
-		return -ENOMEM;
-	}
-	rws = kmalloc(sizeof(*rws) * MAX_RECV_DEPTH, GFP_KERNEL);
-	if (!rws) {
-		ret = -ENOMEM;
-		goto out_free;
-	}
-
-	/* Populate receive buffer and work requests */
-	dma_addr = ib_dma_map_single(
-			rh->device, recv_buffer, buffer_size, DMA_FROM_DEVICE);
-	ret = ib_dma_mapping_error(rh->device, dma_addr);
-	if (ret) goto out_free;
-
-	for (i = 0; i < MAX_RECV_DEPTH; i++) {
-		struct recv_work *rw = rws + i;
-		struct ib_recv_wr *wr, *bad_wr = NULL;
-		struct ib_sge *sgl;
-
-		rw->header.type = WORK_TYPE_RECV;
-		rw->dma_addr = dma_addr + PCN_KMSG_MAX_SIZE * i;
-		rw->addr = recv_buffer + PCN_KMSG_MAX_SIZE * i;
-
-		sgl = &rw->sgl;
-		sgl->lkey = rdma_pd->local_dma_lkey;
-		sgl->addr = rw->dma_addr;
-		sgl->length = PCN_KMSG_MAX_SIZE;
-
-		wr = &rw->wr;
-		wr->sg_list = sgl;
-		wr->num_sge = 1;
-		wr->next = NULL;
-		wr->wr_id = (u64)rw;
+		ret = rdma_create_qp(ch->cm_id, rdma_pd, &qp_attr);
+		if (ret && qp_attr.cap.max_inline_data) {
+			/* Retry without inline data the device might not support */
+			qp_attr.cap.max_inline_data = 0;
+			ret = rdma_create_qp(ch->cm_id, rdma_pd, &qp_attr);
+		}
+		if (ret) return ret;
+		ch->qp = ch->cm_id->qp;
 
-		ret = ib_post_recv(rh->qp, wr, &bad_wr);
-		if (ret || bad_wr) goto out_free;
+		/* Inline only what all queue pairs can take */
+		mutex_lock(&rdma_setup_lock);
+		rdma_max_inline = min(rdma_max_inline, qp_attr.cap.max_inline_data);
+		mutex_unlock(&rdma_setup_lock);
 	}
-	rh->recv_works = rws;
-	rh->recv_buffer = recv_buffer;
-	rh->recv_buffer_dma_addr = dma_addr;
-
-	return ret;
-
-out_free:
-	if (recv_buffer) kfree(recv_buffer);
-	if (rws) kfree(rws);
-	return ret;
+	return 0;
 }
 
 static __init int __setup_rdma_buffer(const int nr_chunks)
@@ -777,10 +1538,10 @@ static __init int __setup_rdma_buffer(const int nr_chunks)
 	reg_wr.key = mr->rkey;
 
 	/**
-	 * rdma_handles[my_nid] is for accepting connection without qp & cp.
+	 * rdma_handles[my_nid] has no channel to itself.
 	 * So, let's use rdma_handles[1] for nid 0 and rdma_handles[0] otherwise.
 	 */
-	ret = ib_post_send(rdma_handles[!my_nid]->qp, &reg_wr.wr, &bad_wr);
+	ret = ib_post_send(rdma_handles[!my_nid]->channels[0].qp, &reg_wr.wr, &bad_wr);
 	if (ret || bad_wr) {
 		printk("Cannot register mr, %d %p\n", ret, bad_wr);
 		if (bad_wr) ret = -EINVAL;
@@ -795,6 +1556,17 @@ static __init int __setup_rdma_buffer(const int nr_chunks)
 
 	rdma_mr = mr;
 	//printk("lkey: %x, rkey: %x, length: %x\n", mr->lkey, mr->rkey, mr->length);
+
+	if (direct_rdma) {
+		mr = ib_get_dma_mr(rdma_pd,
+				IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE);
+		if (IS_ERR(mr)) {
+			printk("Cannot register memory for direct RDMA, %ld\n",
+					PTR_ERR(mr));
+		} else {
+			rdma_dma_mr = mr;
+		}
+	}
 	return 0;
 
 out_dereg:
@@ -825,7 +1597,7 @@ static int __init __setup_work_request_pools(void)
 	}
 
 	/* Initialize send work request pool */
-	for (i = 0; i < MAX_SEND_DEPTH; i++) {
+	for (i = 0; i < nr_send_works; i++) {
 		struct send_work *sw;
 
 		sw = kzalloc(sizeof(*sw), GFP_KERNEL);
@@ -881,28 +1653,28 @@ out_unmap:
  */
 int cm_client_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event *cm_event)
 {
-	struct rdma_handle *rh = cm_id->context;
+	struct rdma_channel *ch = cm_id->context;
 
 	switch (cm_event->event) {
 	case RDMA_CM_EVENT_ADDR_RESOLVED:
-		rh->state = RDMA_ADDR_RESOLVED;
-		complete(&rh->cm_done);
+		ch->state = RDMA_ADDR_RESOLVED;
+		complete(&ch->cm_done);
 		break;
 	case RDMA_CM_EVENT_ROUTE_RESOLVED:
-		rh->state = RDMA_ROUTE_RESOLVED;
-		complete(&rh->cm_done);
+		ch->state = RDMA_ROUTE_RESOLVED;
+		complete(&ch->cm_done);
 		break;
 	case RDMA_CM_EVENT_ESTABLISHED:
-		rh->state = RDMA_CONNECTED;
-		complete(&rh->cm_done);
+		ch->state = RDMA_CONNECTED;
+		complete(&ch->cm_done);
 		break;
 	case RDMA_CM_EVENT_DISCONNECTED:
-		MSGPRINTK("Disconnected from %d\n", rh->nid);
+		MSGPRINTK("Disconnected from %d/%d\n", ch->rh->nid, ch->index);
 		/* TODO deallocate associated resources */
 		break;
 	case RDMA_CM_EVENT_REJECTED:
 	case RDMA_CM_EVENT_CONNECT_ERROR:
-		complete(&rh->cm_done);
+		complete(&ch->cm_done);
 		break;
 	case RDMA_CM_EVENT_ADDR_ERROR:
 	case RDMA_CM_EVENT_ROUTE_ERROR:
@@ -914,16 +1686,21 @@ int cm_client_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event *cm_e
 	return 0;
 }
 
-static int __connect_to_server(int nid)
+static int __connect_to_server(struct rdma_channel *ch)
 {
 	int ret;
 	const char *step;
-	struct rdma_handle *rh = rdma_handles[nid];
+	struct rdma_handle *rh = ch->rh;
+	int nid = rh->nid;
 
 	step = "create rdma id";
-	rh->cm_id = rdma_create_id(&init_net,
-			cm_client_event_handler, rh, RDMA_PS_IB, IB_QPT_RC);
-	if (IS_ERR(rh->cm_id)) goto out_err;
+	ch->cm_id = rdma_create_id(&init_net,
+			cm_client_event_handler, ch, RDMA_PS_IB, IB_QPT_RC);
+	if (IS_ERR(ch->cm_id)) {
+		ret = PTR_ERR(ch->cm_id);
+		ch->cm_id = NULL;
+		goto out_err;
+	}
 
 	step = "resolve server address";
 	{
@@ -933,116 +1710,133 @@ static int __connect_to_server(int nid)
 			.sin_addr.s_addr = ip_table[nid],
 		};
 
-		ret = rdma_resolve_addr(rh->cm_id, NULL,
+		ret = rdma_resolve_addr(ch->cm_id, NULL,
 				(struct sockaddr *)&addr, RDMA_ADDR_RESOLVE_TIMEOUT_MS);
 		if (ret) goto out_err;
-		ret = wait_for_completion_interruptible(&rh->cm_done);
-		if (ret || rh->state != RDMA_ADDR_RESOLVED) goto out_err;
+		ret = wait_for_completion_interruptible(&ch->cm_done);
+		if (ret || ch->state != RDMA_ADDR_RESOLVED) goto out_err;
 	}
 
 	step = "resolve routing path";
-	ret = rdma_resolve_route(rh->cm_id, RDMA_ADDR_RESOLVE_TIMEOUT_MS);
+	ret = rdma_resolve_route(ch->cm_id, RDMA_ADDR_RESOLVE_TIMEOUT_MS);
 	if (ret) goto out_err;
-	ret = wait_for_completion_interruptible(&rh->cm_done);
-	if (ret || rh->state != RDMA_ROUTE_RESOLVED) goto out_err;
+	ret = wait_for_completion_interruptible(&ch->cm_done);
+	if (ret || ch->state != RDMA_ROUTE_RESOLVED) goto out_err;
 
 	/* cm_id->device is valid after the address and route are resolved */
-	rh->device = rh->cm_id->device;
+	rh->device = ch->cm_id->device;
 
 	step = "setup ib";
-	ret = __setup_pd_cq_qp(rh);
-	if (ret) goto out_err;
-
-	step = "setup buffers and pools";
-	ret = __setup_buffers_and_pools(rh);
+	ret = __setup_pd_cq_qp(ch);
 	if (ret) goto out_err;
 
 	step = "connect";
 	{
+		struct rdma_conn_data data = {
+			.nid = my_nid,
+			.index = ch->index,
+		};
 		struct rdma_conn_param conn_param = {
-			.private_data = &my_nid,
-			.private_data_len = sizeof(my_nid),
+			.private_data = &data,
+			.private_data_len = sizeof(data),
+			.rnr_retry_count = 7,	/* Retry until the srq is refilled */
 		};
 
-		rh->state = RDMA_CONNECTING;
-		ret = rdma_connect(rh->cm_id, &conn_param);
+		ch->state = RDMA_CONNECTING;
+		ret = rdma_connect(ch->cm_id, &conn_param);
 		if (ret) goto out_err;
-		ret = wait_for_completion_interruptible(&rh->cm_done);
+		ret = wait_for_completion_interruptible(&ch->cm_done);
 		if (ret) goto out_err;
-		if (rh->state != RDMA_CONNECTED) {
+		if (ch->state != RDMA_CONNECTED) {
 			ret = -ETIMEDOUT;
 			goto out_err;
 		}
 	}
 
-	MSGPRINTK("Connected to %d\n", nid);
+	MSGPRINTK("Connected to %d/%d\n", nid, ch->index);
 	return 0;
 
 out_err:
-	PCNPRINTK_ERR("Unable to %s, %pI4, %d\n", step, ip_table + nid, ret);
-	return ret;
+	PCNPRINTK_ERR("Unable to %s, %pI4/%d, %d\n",
+			step, ip_table + nid, ch->index, ret);
+	return ret ? ret : -EINVAL;
 }
 
 
 /****************************************************************************
  * Server-side connection handling
  */
-static int __accept_client(int nid)
+static int __accept_client(struct rdma_channel *ch)
 {
-	struct rdma_handle *rh = rdma_handles[nid];
-	struct rdma_conn_param conn_param = {};
+	struct rdma_conn_param conn_param = {
+		.rnr_retry_count = 7,	/* Retry until the srq is refilled */
+	};
 	int ret;
 
-	ret = wait_for_completion_io_timeout(&rh->cm_done, 60 * HZ);
+	ret = wait_for_completion_io_timeout(&ch->cm_done, 60 * HZ);
 	if (!ret) return -ETIMEDOUT;
-	if (rh->state != RDMA_ROUTE_RESOLVED) return -EINVAL;
-
-	ret = __setup_pd_cq_qp(rh);
-	if (ret) return ret;
+	if (ch->state != RDMA_ROUTE_RESOLVED) return -EINVAL;
 
-	ret = __setup_buffers_and_pools(rh);
+	ret = __setup_pd_cq_qp(ch);
 	if (ret) return ret;
 
-	rh->state = RDMA_CONNECTING;
-	ret = rdma_accept(rh->cm_id, &conn_param);
+	ch->state = RDMA_CONNECTING;
+	ret = rdma_accept(ch->cm_id, &conn_param);
 	if (ret) return ret;
 
-	ret = wait_for_completion_interruptible(&rh->cm_done);
+	ret = wait_for_completion_interruptible(&ch->cm_done);
 	if (ret) return ret;
 
 	return 0;
 }
+
 static int __on_client_connecting(struct rdma_cm_id *cm_id, struct rdma_cm_event *cm_event)
 {
-	int peer_nid = *(int *)cm_event->param.conn.private_data;
-	struct rdma_handle *rh = rdma_handles[peer_nid];
+	const struct rdma_conn_data *data = cm_event->param.conn.private_data;
+	struct rdma_handle *rh;
+	struct rdma_channel *ch;
+
+	if (!data || cm_event->param.conn.private_data_len < sizeof(*data)) {
+		printk(KERN_ERR "Connection request without the channel info\n");
+		rdma_reject(cm_id, NULL, 0);
+		return -EINVAL;
+	}
+	if (data->nid < 0 || data->nid >= MAX_NUM_NODES || data->nid == my_nid ||
+			data->index < 0 || data->index >= nr_channels) {
+		printk(KERN_ERR "Invalid channel %d/%d. "
+				"Check nr_channels on all nodes\n", data->nid, data->index);
+		rdma_reject(cm_id, NULL, 0);
+		return -EINVAL;
+	}
+	rh = rdma_handles[data->nid];
+	ch = rh->channels + data->index;
 
-	cm_id->context = rh;
-	rh->cm_id = cm_id;
+	cm_id->context = ch;
+	ch->cm_id = cm_id;
 	rh->device = cm_id->device;
-	rh->state = RDMA_ROUTE_RESOLVED;
+	ch->state = RDMA_ROUTE_RESOLVED;
 
-	complete(&rh->cm_done);
+	complete(&ch->cm_done);
 	return 0;
 }
 
 static int __on_client_connected(struct rdma_cm_id *cm_id, struct rdma_cm_event *cm_event)
 {
-	struct rdma_handle *rh = cm_id->context;
-	rh->state = RDMA_CONNECTED;
-	complete(&rh->cm_done);
+	struct rdma_channel *ch = cm_id->context;
+	ch->state = RDMA_CONNECTED;
+	complete(&ch->cm_done);
 
-	MSGPRINTK("Connected to %d\n", rh->nid);
+	MSGPRINTK("Connected to %d/%d\n", ch->rh->nid, ch->index);
 	return 0;
 }
 
 static int __on_client_disconnected(struct rdma_cm_id *cm_id, struct rdma_cm_event *cm_event)
 {
-	struct rdma_handle *rh = cm_id->context;
-	rh->state = RDMA_INIT;
-	set_popcorn_node_online(rh->nid, false);
+	struct rdma_channel *ch = cm_id->context;
+	ch->state = RDMA_INIT;
+	set_popcorn_node_online(ch->rh->nid, false);
 
-	MSGPRINTK("Disconnected from %d\n", rh->nid);
+	MSGPRINTK("Disconnected from %d/%d\n", ch->rh->nid, ch->index);
 	return 0;
 }
 
@@ -1063,7 +1857,8 @@ int cm_server_event_handler(struct rdma_cm_id *cm_id, struct rdma_cm_event *cm_e
 		MSGPRINTK("Unhandled server event %d\n", cm_event->event);
 		break;
 	}
-	return 0;
+	/* The cm destroys the id of a rejected request */
+	return ret;
 }
 
 static int __listen_to_connection(void)
@@ -1078,7 +1873,7 @@ static int __listen_to_connection(void)
 	struct rdma_cm_id *cm_id = rdma_create_id(&init_net,
 			cm_server_event_handler, NULL, RDMA_PS_IB, IB_QPT_RC);
 	if (IS_ERR(cm_id)) return PTR_ERR(cm_id);
-	rdma_handles[my_nid]->cm_id = cm_id;
+	rdma_listen_id = cm_id;
 
 	ret = rdma_bind_addr(cm_id, (struct sockaddr *)&addr);
 	if (ret) {
@@ -1086,7 +1881,7 @@ static int __listen_to_connection(void)
 		return ret;
 	}
 
-	ret = rdma_listen(cm_id, MAX_NUM_NODES);
+	ret = rdma_listen(cm_id, MAX_NUM_NODES * nr_channels);
 	if (ret) {
 		PCNPRINTK_ERR("Cannot listen to incoming requests, %d\n", ret);
 		return ret;
@@ -1096,9 +1891,32 @@ static int __listen_to_connection(void)
 }
 
 
+/**
+ * Channels are established in parallel, each by its own thread, connecting
+ * to the nodes before us and accepting the nodes after us.
+ */
+static atomic_t __nr_establishing = ATOMIC_INIT(0);
+static DECLARE_COMPLETION(__established);
+
+static int __establish_channel(void *arg0)
+{
+	struct rdma_channel *ch = arg0;
+
+	if (ch->rh->nid < my_nid) {
+		ch->ret = __connect_to_server(ch);
+	} else {
+		ch->ret = __accept_client(ch);
+	}
+
+	if (atomic_dec_and_test(&__nr_establishing)) {
+		complete(&__established);
+	}
+	return 0;
+}
+
 static int __establish_connections(void)
 {
-	int i, ret;
+	int i, j, ret;
 
 	ret = __listen_to_connection();
 	if (ret) return ret;
@@ -1106,17 +1924,42 @@ static int __establish_connections(void)
 	/* Wait for a while so that nodes are ready to listen to connections */
 	msleep(100);
 
-	for (i = 0; i < my_nid; i++) {
-		if ((ret = __connect_to_server(i))) return ret;
-		set_popcorn_node_online(i, true);
+	atomic_set(&__nr_establishing, 1);
+	for (i = 0; i < MAX_NUM_NODES; i++) {
+		if (i == my_nid) continue;
+		for (j = 0; j < nr_channels; j++) {
+			struct rdma_channel *ch = rdma_handles[i]->channels + j;
+			struct task_struct *tsk;
+
+			atomic_inc(&__nr_establishing);
+			tsk = kthread_run(__establish_channel, ch,
+					"pcn_rdma_conn_%d_%d", i, j);
+			if (IS_ERR(tsk)) {
+				ch->ret = PTR_ERR(tsk);
+				atomic_dec(&__nr_establishing);
+			}
+		}
+	}
+	if (!atomic_dec_and_test(&__nr_establishing)) {
+		wait_for_completion(&__established);
 	}
 
+	ret = 0;
 	set_popcorn_node_online(my_nid, true);
-
-	for (i = my_nid + 1; i < MAX_NUM_NODES; i++) {
-		if ((ret = __accept_client(i))) return ret;
-		set_popcorn_node_online(i, true);
+	for (i = 0; i < MAX_NUM_NODES; i++) {
+		bool connected = true;
+		if (i == my_nid) continue;
+
+		for (j = 0; j < nr_channels; j++) {
+			struct rdma_channel *ch = rdma_handles[i]->channels + j;
+			if (ch->ret) {
+				connected = false;
+				ret = ch->ret;
+			}
+		}
+		if (connected) set_popcorn_node_online(i, true);
 	}
+	if (ret) return ret;
 
 	MSGPRINTK("Connections are established.\n");
 	return 0;
@@ -1124,28 +1967,45 @@ static int __establish_connections(void)
 
 void __exit exit_kmsg_rdma(void)
 {
-	int i;
+	int i, j;
 
 	/* Detach from upper layer to prevent race condition during exit */
 	pcn_kmsg_set_transport(NULL);
 
+	if (rdma_listen_id && !IS_ERR(rdma_listen_id)) {
+		rdma_destroy_id(rdma_listen_id);
+		rdma_listen_id = NULL;
+	}
+
 	for (i = 0; i < MAX_NUM_NODES; i++) {
 		struct rdma_handle *rh = rdma_handles[i];
 		set_popcorn_node_online(i, false);
 		if (!rh) continue;
 
-		if (rh->recv_buffer) {
-			ib_dma_unmap_single(rh->device, rh->recv_buffer_dma_addr,
-					PCN_KMSG_MAX_SIZE * MAX_RECV_DEPTH, DMA_FROM_DEVICE);
-			kfree(rh->recv_buffer);
-			kfree(rh->recv_works);
+		if (rh->poll_handler) {
+			kthread_stop(rh->poll_handler);
+			rh->poll_handler = NULL;
+		}
+		for (j = 0; j < nr_channels; j++) {
+			struct rdma_channel *ch = rh->channels + j;
+			cancel_delayed_work_sync(&ch->flush);
+			if (ch->qp && !IS_ERR(ch->qp)) rdma_destroy_qp(ch->cm_id);
 		}
-
-		if (rh->qp && !IS_ERR(rh->qp)) rdma_destroy_qp(rh->cm_id);
 		if (rh->cq && !IS_ERR(rh->cq)) ib_destroy_cq(rh->cq);
-		if (rh->cm_id && !IS_ERR(rh->cm_id)) rdma_destroy_id(rh->cm_id);
+		for (j = 0; j < nr_channels; j++) {
+			struct rdma_channel *ch = rh->channels + j;
+			if (ch->cm_id && !IS_ERR(ch->cm_id)) rdma_destroy_id(ch->cm_id);
+		}
 
 		kfree(rdma_handles[i]);
+		rdma_handles[i] = NULL;
+	}
+
+	if (rdma_pd) __destroy_srq();
+
+	if (rdma_dma_mr) {
+		ib_dereg_mr(rdma_dma_mr);
+		rdma_dma_mr = NULL;
 	}
 
 	/* MR is set correctly iff rdma buffer and pd are correctly allocated */
@@ -1163,6 +2023,14 @@ void __exit exit_kmsg_rdma(void)
 					send_buffer.dma_addr_base[i], RB_CHUNK_SIZE, DMA_TO_DEVICE);
 		}
 	}
+	for_each_possible_cpu(i) {
+		struct send_work_cache *sc = per_cpu_ptr(&send_work_caches, i);
+		while (sc->nr) {
+			struct send_work *sw = sc->works[--sc->nr];
+			sw->next = send_work_pool;
+			send_work_pool = sw;
+		}
+	}
 	while (send_work_pool) {
 		struct send_work *sw = send_work_pool;
 		send_work_pool = sw->next;
@@ -1200,10 +2068,24 @@ struct pcn_kmsg_transport transport_rdma = {
 
 int __init init_kmsg_rdma(void)
 {
-	int i;
+	int i, j;
 
 	MSGPRINTK("\nLoading Popcorn messaging layer over RDMA...\n");
 
+	if (nr_channels < 1 || nr_channels > MAX_RDMA_CHANNELS) {
+		printk(KERN_ERR "nr_channels should be in 1-%d\n", MAX_RDMA_CHANNELS);
+		return -EINVAL;
+	}
+	if (srq_depth < 0 || srq_depth > MAX_RECV_DEPTH * MAX_SRQ_CHUNKS) {
+		printk(KERN_ERR "srq_depth should be in 0-%lu\n",
+				MAX_RECV_DEPTH * MAX_SRQ_CHUNKS);
+		return -EINVAL;
+	}
+
+	nr_send_works = MAX_SEND_DEPTH + num_online_cpus() * SW_CACHE_SIZE;
+	max_unsignaled = nr_send_works / 8;
+	rdma_max_inline = inline_size;
+
 	if (!identify_myself()) return -EINVAL;
 	pcn_kmsg_set_transport(&transport_rdma);
 
@@ -1213,8 +2095,20 @@ int __init init_kmsg_rdma(void)
 		if (!rh) goto out_free;
 
 		rh->nid = i;
-		rh->state = RDMA_INIT;
-		init_completion(&rh->cm_done);
+		atomic_set(&rh->nr_sends, 0);
+		init_waitqueue_head(&rh->sends_wait);
+
+		for (j = 0; j < nr_channels; j++) {
+			struct rdma_channel *ch = rh->channels + j;
+
+			ch->rh = rh;
+			ch->index = j;
+			ch->state = RDMA_INIT;
+			init_completion(&ch->cm_done);
+			spin_lock_init(&ch->sends_lock);
+			INIT_DELAYED_WORK(&ch->flush, __flush_unsignaled);
+			init_llist_head(&ch->pending);
+		}
 	}
 
 	if (__establish_connections())
@@ -1222,6 +2116,8 @@ int __init init_kmsg_rdma(void)
 
 	if (__setup_rdma_buffer(1))
 		goto out_free;
+	if (rdma_dma_mr)
+		transport_rdma.features |= PCN_KMSG_FEATURE_RDMA_DIRECT;
 
 	if (__setup_work_request_pools())
 		goto out_free;
@@ -1,6 +1,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
 
 #include "ring_buffer.h"
 
@@ -10,33 +11,20 @@
 #define RB_ALIGN 64
 #define RB_NR_CHUNKS 8
 
+/* Keep it 8 bytes so that buffers are 8-byte aligned */
 struct ring_buffer_header {
-	bool reclaim:1;
-#ifdef CONFIG_POPCORN_CHECK_SANITY
-	unsigned int magic:8;
-#endif
-	size_t size:22;
-} __attribute__((packed));
+	unsigned short segment;
+	unsigned short magic;
+	unsigned int size;
+};
 
 size_t ring_buffer_usage(struct ring_buffer *rb)
 {
-	size_t used = 0;
+	size_t used;
 	unsigned long flags;
 
 	spin_lock_irqsave(&rb->lock, flags);
-	if (rb->head_chunk == rb->tail_chunk) {
-		if (!rb->wraparounded) {
-			used = rb->tail - rb->head;
-		} else {
-			used  = RB_CHUNK_SIZE * rb->nr_chunks;
-			used -= rb->head - rb->tail;
-		}
-	} else {
-		used  = rb->chunk_end[rb->head_chunk] - rb->head;
-		used += rb->tail - rb->chunk_start[rb->tail_chunk];
-		used += ((rb->tail_chunk + rb->wraparounded * rb->nr_chunks)
-				- rb->head_chunk - 1) * RB_CHUNK_SIZE;
-	}
+	used = (rb->nr_segments - rb->nr_free_segments) * RB_SEGMENT_SIZE;
 #ifdef CONFIG_POPCORN_STAT
 	rb->peak_usage = max(rb->peak_usage, used);
 #endif
@@ -47,9 +35,16 @@ size_t ring_buffer_usage(struct ring_buffer *rb)
 
 static int __init_ring_buffer(struct ring_buffer *rb, const unsigned short nr_chunks, const char *fmt, va_list args)
 {
-	unsigned short i;
+	unsigned short i, j;
 	int ret = 0;
 
+	rb->cpus = alloc_percpu(struct ring_buffer_cpu);
+	if (!rb->cpus) return -ENOMEM;
+
+	spin_lock_init(&rb->lock);
+	INIT_LIST_HEAD(&rb->free_segments);
+	rb->nr_segments = 0;
+
 	for (i = 0; i < nr_chunks; i++) {
 		void *buffer = (void *)__get_free_pages(GFP_KERNEL, RB_CHUNK_ORDER);
 		if (!buffer) {
@@ -59,13 +54,19 @@ static int __init_ring_buffer(struct ring_buffer *rb, const unsigned short nr_ch
 		rb->chunk_start[i] = buffer;
 		rb->chunk_end[i] = buffer + RB_CHUNK_SIZE;
 		rb->dma_addr_base[i] = 0;
-	}
 
-	spin_lock_init(&rb->lock);
-	rb->head_chunk = rb->tail_chunk = 0;
+		for (j = 0; j < RB_SEGMENTS_PER_CHUNK; j++) {
+			struct ring_buffer_segment *seg = rb->segments + rb->nr_segments++;
+
+			seg->start = buffer + j * RB_SEGMENT_SIZE;
+			seg->end = min(seg->start + RB_SEGMENT_SIZE, rb->chunk_end[i]);
+			seg->chunk = i;
+			atomic_set(&seg->refcount, 0);
+			list_add_tail(&seg->list, &rb->free_segments);
+		}
+	}
 	rb->nr_chunks = nr_chunks;
-	rb->wraparounded = 0;
-	rb->head = rb->tail = rb->chunk_start[0];
+	rb->nr_free_segments = rb->nr_segments;
 #ifdef CONFIG_POPCORN_STAT
 	rb->total_size = RB_CHUNK_SIZE * nr_chunks;
 	rb->peak_usage = 0;
@@ -81,6 +82,8 @@ out_free:
 			rb->chunk_start[i] = NULL;
 		}
 	}
+	free_percpu(rb->cpus);
+	rb->cpus = NULL;
 	return ret;
 }
 
@@ -125,72 +128,88 @@ void ring_buffer_destroy(struct ring_buffer *rb)
 			free_pages((unsigned long)rb->chunk_start[i], RB_CHUNK_ORDER);
 		}
 	}
+	if (rb->cpus) free_percpu(rb->cpus);
 }
 
-static inline void __set_header(struct ring_buffer_header *header, bool reclaim, size_t size) {
-	header->reclaim = reclaim;
+static inline void __set_header(struct ring_buffer_header *header, unsigned short segment, size_t size) {
+	header->segment = segment;
 	header->size = size;
 #ifdef CONFIG_POPCORN_CHECK_SANITY
 	header->magic = RB_HEADER_MAGIC;
 #endif
 }
 
-static inline bool __get_next_chunk(struct ring_buffer *rb, unsigned short *index) {
-	(*index)++;
-	if (*index >= rb->nr_chunks) {
-		*index = 0;
-		return true;
+static struct ring_buffer_segment *__get_free_segment(struct ring_buffer *rb)
+{
+	struct ring_buffer_segment *seg;
+
+	spin_lock(&rb->lock);
+	seg = list_first_entry_or_null(&rb->free_segments,
+			struct ring_buffer_segment, list);
+	if (seg) {
+		list_del(&seg->list);
+		rb->nr_free_segments--;
+	}
+	spin_unlock(&rb->lock);
+
+	if (seg) {
+		/* Hold the segment while it is being carved by a CPU */
+		atomic_set(&seg->refcount, 1);
 	}
-	return false;
+	return seg;
+}
+
+static void __put_segment(struct ring_buffer *rb, struct ring_buffer_segment *seg)
+{
+	unsigned long flags;
+
+	if (!atomic_dec_and_test(&seg->refcount)) return;
+
+	spin_lock_irqsave(&rb->lock, flags);
+	list_add(&seg->list, &rb->free_segments);
+	rb->nr_free_segments++;
+	spin_unlock_irqrestore(&rb->lock, flags);
 }
 
 void *ring_buffer_get_mapped(struct ring_buffer *rb, size_t size, dma_addr_t *dma_addr)
 {
 	struct ring_buffer_header *header;
+	struct ring_buffer_cpu *rc;
+	struct ring_buffer_segment *seg;
 	unsigned long flags;
-	int alloc_index;
 
 	size = ALIGN(sizeof(*header) + size, RB_ALIGN) - sizeof(*header);
+	if (sizeof(*header) + size > RB_SEGMENT_SIZE) return NULL;
 
-	spin_lock_irqsave(&rb->lock, flags);
-	if (rb->tail + sizeof(*header) + size > rb->chunk_end[rb->tail_chunk]) {
-		/* Put the terminator and wrap around the ring */
-		header = rb->tail;
-		__set_header(header, true,
-				rb->chunk_end[rb->tail_chunk] - (rb->tail + sizeof(*header)));
-		if (__get_next_chunk(rb, &rb->tail_chunk))
-			rb->wraparounded++;
-		rb->tail = rb->chunk_start[rb->tail_chunk];
-	}
+	local_irq_save(flags);
+	rc = this_cpu_ptr(rb->cpus);
+	seg = rc->segment;
+
+	if (!seg || rc->tail + sizeof(*header) + size > seg->end) {
+		/* Retire the current segment and move on to a fresh one */
+		if (seg) __put_segment(rb, seg);
 
-	/* Is buffer full? */
-	if (rb->wraparounded && rb->head_chunk == rb->tail_chunk) {
-		if (rb->tail + sizeof(*header) + size > rb->head) {
-			spin_unlock_irqrestore(&rb->lock, flags);
+		rc->segment = seg = __get_free_segment(rb);
+		if (!seg) {
+			local_irq_restore(flags);
 			return NULL;
 		}
+		rc->tail = seg->start;
 	}
 
-	alloc_index = rb->tail_chunk;
-	header = rb->tail;
-	rb->tail += sizeof(*header) + size;
-	if (rb->tail + ALIGN(sizeof(*header), RB_ALIGN) >=
-				rb->chunk_end[rb->tail_chunk]) {
-		/* Skip small trailor */
-		size += rb->chunk_end[rb->tail_chunk] - rb->tail;
-		if (__get_next_chunk(rb, &rb->tail_chunk))
-			rb->wraparounded++;
-		rb->tail = rb->chunk_start[rb->tail_chunk];
-	}
-	__set_header(header, false, size);
-	spin_unlock_irqrestore(&rb->lock, flags);
+	header = rc->tail;
+	rc->tail += sizeof(*header) + size;
+	atomic_inc(&seg->refcount);
+	local_irq_restore(flags);
+
+	__set_header(header, seg - rb->segments, size);
 #ifdef CONFIG_POPCORN_CHECK_SANITY
 	memset(header + 1, 0xcd, size);
 #endif
 
 	if (dma_addr) {
-		*dma_addr = rb->dma_addr_base[alloc_index] +
-			((void *)(header + 1) - rb->chunk_start[alloc_index]);
+		*dma_addr = rb->dma_addr_base[seg->chunk] +
+			((void *)(header + 1) - rb->chunk_start[seg->chunk]);
 	}
 	return header + 1;
 }
@@ -203,29 +222,13 @@ void *ring_buffer_get(struct ring_buffer *rb, size_t size)
 void ring_buffer_put(struct ring_buffer *rb, void *buffer)
 {
 	struct ring_buffer_header *header;
-	unsigned long flags;
 
 	header = buffer - sizeof(*header);
 #ifdef CONFIG_POPCORN_CHECK_SANITY
+	BUG_ON(header->magic != RB_HEADER_MAGIC);
+	BUG_ON(header->segment >= rb->nr_segments);
 	memset(buffer, 0xaf, header->size);	/* put poision */
 #endif
 
-	spin_lock_irqsave(&rb->lock, flags);
-	header->reclaim = true;
-
-	header = rb->head;
-	while (header->reclaim) {
-#ifdef CONFIG_POPCORN_CHECK_SANITY
-		BUG_ON(header->magic != RB_HEADER_MAGIC);
-#endif
-		rb->head += sizeof(*header) + header->size;
-		if (rb->head == rb->chunk_end[rb->head_chunk]) {
-			if (__get_next_chunk(rb, &rb->head_chunk))
-				rb->wraparounded--;
-			rb->head = rb->chunk_start[rb->head_chunk];
-		}
-		if (rb->head == rb->tail) break;
-		header = rb->head;
-	}
-	spin_unlock_irqrestore(&rb->lock, flags);
+	__put_segment(rb, rb->segments + header->segment);
 }
@@ -5,14 +5,39 @@
 #define RB_CHUNK_ORDER	(MAX_ORDER - 1)
 #define RB_CHUNK_SIZE	(PAGE_SIZE << RB_CHUNK_ORDER)
 
-struct ring_buffer {
-	unsigned short head_chunk;
-	void *head;
-	unsigned short tail_chunk;
+/**
+ * Each chunk is split into segments, and each CPU carves buffers out of its
+ * own segment without taking any lock. A segment counts the buffers carved
+ * out of it and goes back to the free list once all of them are put, so
+ * buffers can be put in any order.
+ */
+#define RB_SEGMENT_SIZE	(256UL << 10)
+#define RB_SEGMENTS_PER_CHUNK \
+	(RB_CHUNK_SIZE > RB_SEGMENT_SIZE ? RB_CHUNK_SIZE / RB_SEGMENT_SIZE : 1)
+#define RB_MAX_SEGMENTS	(RB_MAX_CHUNKS * RB_SEGMENTS_PER_CHUNK)
+
+struct ring_buffer_segment {
+	void *start;
+	void *end;
+	unsigned short chunk;
+	atomic_t refcount;
+	struct list_head list;
+};
+
+struct ring_buffer_cpu {
+	struct ring_buffer_segment *segment;
 	void *tail;
-	int wraparounded;
+};
+
+struct ring_buffer {
+	struct ring_buffer_cpu __percpu *cpus;
 
 	spinlock_t lock;
+	struct list_head free_segments;
+	unsigned int nr_free_segments;
+	unsigned int nr_segments;
+	struct ring_buffer_segment segments[RB_MAX_SEGMENTS];
+
 	void *chunk_start[RB_MAX_CHUNKS];
 	void *chunk_end[RB_MAX_CHUNKS];
 	dma_addr_t dma_addr_base[RB_MAX_CHUNKS];
@@ -29,7 +54,6 @@ struct ring_buffer *ring_buffer_create(const char *namefmt, ...);
 int ring_buffer_init(struct ring_buffer *rb, const char *namefmt, ...);
 void *ring_buffer_get(struct ring_buffer *rb, size_t size);
 void *ring_buffer_get_mapped(struct ring_buffer *rb, size_t size, dma_addr_t *dma_addr);
-void ring_buffer_ready(struct ring_buffer *rb, void *buffer);
 void ring_buffer_put(struct ring_buffer *rb, void *buffer);
 void ring_buffer_destroy(struct ring_buffer *rb);
 
@@ -0,0 +1,689 @@
+/**
+ * shm.c
+ *  Messaging transport layer over memory shared by the nodes on a host
+ *
+ * Nodes are kernels in virtual machines on the same host that share a memory
+ * region, e.g., QEMU ivshmem. Each pair of nodes has a ring in the region
+ * for each direction. A ring has a single producer and a single consumer, so
+ * the nodes exchange messages without taking any lock in the shared memory.
+ * Senders on the same node are serialized by a local lock.
+ *
+ * Each node also has a window in the region for RDMA emulation. A pinned
+ * buffer is a slot in the window of the pinning node, and RDMA read and write
+ * are memcpy from and to the window of the peer.
+ *
+ * Optionally, the receiver holds back messages to emulate the latency and
+ * the bandwidth of a link, so that protocol changes can be evaluated without
+ * a cluster.
+ */
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/io.h>
+#include <linux/pci.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <popcorn/stat.h>
+#include "common.h"
+
+#define SHM_MAGIC			0x50434e53484d0001ULL	/* "PCNSHM" + version */
+#define SHM_IVSHMEM_VENDOR	0x1af4
+#define SHM_IVSHMEM_DEVICE	0x1110
+#define SHM_IVSHMEM_BAR		2
+
+#define SHM_RDMA_SLOT_SIZE	(PAGE_SIZE * 2)
+#define SHM_MAX_MARKS		64
+#define SHM_IDLE_USECS		50
+#define SHM_RECV_BUDGET		64
+
+/**
+ * Physical address and size of the shared region. When not given, the
+ * region is the shared memory BAR of the first ivshmem device.
+ */
+static unsigned long shm_phys = 0;
+module_param(shm_phys, ulong, 0444);
+MODULE_PARM_DESC(shm_phys, "Physical address of the shared region (default: ivshmem BAR)");
+
+static unsigned long shm_size = 0;
+module_param(shm_size, ulong, 0444);
+MODULE_PARM_DESC(shm_size, "Size of the shared region in bytes");
+
+/* Geometry of the region. Should be the same on all nodes */
+static unsigned int ring_size = 1 << 20;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Size of a ring in bytes (power of 2)");
+
+static unsigned long window_size = 4 << 20;
+module_param(window_size, ulong, 0444);
+MODULE_PARM_DESC(window_size, "Size of the RDMA window of a node in bytes");
+
+static int poll_usecs = 100;
+module_param(poll_usecs, int, 0644);
+MODULE_PARM_DESC(poll_usecs, "Time to keep polling idle rings before sleeping in usec");
+
+static int latency_usecs = 0;
+module_param(latency_usecs, int, 0644);
+MODULE_PARM_DESC(latency_usecs, "One-way latency to inject in usec");
+
+static int bandwidth_mbps = 0;
+module_param(bandwidth_mbps, int, 0644);
+MODULE_PARM_DESC(bandwidth_mbps, "Link bandwidth to emulate in Mbps (0 for unlimited)");
+
+
+/**
+ * Layout of the shared region:
+ *  header | rings[dst][src] | windows[nid]
+ */
+struct shm_header {
+	u64 magic;
+	u32 nr_nodes;
+	u32 ring_size;
+	u64 window_size;
+	u32 online[MAX_NUM_NODES];
+};
+
+/**
+ * @head and @tail are free-running byte counters, written only by the
+ * sender and the receiver, respectively. A record is the size of the message
+ * followed by the message. A record does not wrap around; the sender puts
+ * SHM_RECORD_WRAP instead when the rest of the ring is too small for it.
+ */
+struct shm_ring {
+	u64 head ____cacheline_aligned;
+	u64 tail ____cacheline_aligned;
+	char data[0] ____cacheline_aligned;
+};
+
+#define SHM_RECORD_WRAP		(~0ULL)
+#define SHM_RECORD_SIZE(x)	ALIGN(sizeof(u64) + (x), sizeof(u64))
+
+/* Per-node handle for shared memory */
+struct shm_peer {
+	int nid;
+	struct shm_ring *in;
+	struct shm_ring *out;
+	spinlock_t out_lock;
+
+	/**
+	 * For the emulation, the receiver marks when it sees the head of the
+	 * inbound ring advancing. The records below @marks_pos[i] arrived by
+	 * @marks_at[i].
+	 */
+	u64 seen_head;
+	u64 marks_pos[SHM_MAX_MARKS];
+	u64 marks_at[SHM_MAX_MARKS];
+	unsigned int marks_first;
+	unsigned int marks_nr;
+	u64 link_free_at;
+	u64 deliver_at;
+};
+
+static void *shm_base = NULL;
+static size_t shm_mapped_size = 0;
+static struct pci_dev *shm_pdev = NULL;
+static struct shm_header *shm_header = NULL;
+static struct shm_peer shm_peers[MAX_NUM_NODES] = {};
+static size_t windows_offset = 0;
+
+static unsigned long *rdma_slots = NULL;
+static unsigned long nr_rdma_slots = 0;
+static DEFINE_SPINLOCK(rdma_slots_lock);
+
+static struct task_struct *recv_handler = NULL;
+
+#ifdef CONFIG_POPCORN_STAT
+static atomic64_t __nr_ring_full = ATOMIC64_INIT(0);
+static atomic64_t __nr_held_back = ATOMIC64_INIT(0);
+static atomic64_t __nr_rdma_slots_waits = ATOMIC64_INIT(0);
+#define SHM_STAT_INC(x) atomic64_inc(&(x))
+#else
+#define SHM_STAT_INC(x)
+#endif
+
+static inline size_t __ring_stride(void)
+{
+	return sizeof(struct shm_ring) + ring_size;
+}
+
+static inline struct shm_ring *__ring_at(int dst, int src)
+{
+	return shm_base + PAGE_SIZE + (dst * MAX_NUM_NODES + src) * __ring_stride();
+}
+
+static inline size_t __window_offset(int nid)
+{
+	return windows_offset + nid * window_size;
+}
+
+static inline bool __peer_online(int nid)
+{
+	return smp_load_acquire(&shm_header->online[nid]);
+}
+
+static inline bool __shaping(void)
+{
+	return latency_usecs > 0 || bandwidth_mbps > 0;
+}
+
+static inline u64 __transfer_ns(size_t size)
+{
+	if (bandwidth_mbps <= 0) return 0;
+	return div_u64((u64)size * 8000, bandwidth_mbps);
+}
+
+
+/**
+ * Handle inbound messages
+ */
+static void __mark_arrival(struct shm_peer *p, u64 head, u64 now)
+{
+	unsigned int last;
+
+	if (p->marks_nr == SHM_MAX_MARKS) {
+		/* Too many in flight. Let the latest mark cover the new records */
+		last = (p->marks_first + p->marks_nr - 1) % SHM_MAX_MARKS;
+		p->marks_pos[last] = head;
+		return;
+	}
+	last = (p->marks_first + p->marks_nr) % SHM_MAX_MARKS;
+	p->marks_pos[last] = head;
+	p->marks_at[last] = now;
+	p->marks_nr++;
+}
+
+/* Return when the record at @tail arrived */
+static u64 __arrived_at(struct shm_peer *p, u64 tail, u64 now)
+{
+	while (p->marks_nr) {
+		unsigned int first = p->marks_first;
+		if (p->marks_pos[first] > tail) return p->marks_at[first];
+
+		p->marks_first = (first + 1) % SHM_MAX_MARKS;
+		p->marks_nr--;
+	}
+	return now;
+}
+
+/**
+ * Deliver messages in the inbound ring from @p. Return true if there were
+ * messages, including ones being held back for the emulation.
+ */
+static bool __poll_peer(struct shm_peer *p)
+{
+	struct shm_ring *in = p->in;
+	u64 head = smp_load_acquire(&in->head);
+	u64 tail = in->tail;
+	u64 now = 0;
+	int nr = 0;
+
+	if (tail == head) return false;
+
+	if (__shaping()) {
+		now = ktime_get_ns();
+		if (head != p->seen_head) {
+			__mark_arrival(p, head, now);
+			p->seen_head = head;
+		}
+	}
+
+	while (tail != head && nr++ < SHM_RECV_BUDGET) {
+		size_t off = tail & (ring_size - 1);
+		u64 size = READ_ONCE(*(u64 *)(in->data + off));
+		struct pcn_kmsg_message *msg;
+
+		if (size == SHM_RECORD_WRAP) {
+			tail += ring_size - off;
+			continue;
+		}
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+		BUG_ON(size < sizeof(struct pcn_kmsg_hdr) || size > PCN_KMSG_MAX_SIZE);
+#endif
+		if (__shaping()) {
+			if (!p->deliver_at) {
+				u64 start = max(__arrived_at(p, tail, now), p->link_free_at);
+				p->link_free_at = start + __transfer_ns(size);
+				p->deliver_at = p->link_free_at + latency_usecs * NSEC_PER_USEC;
+			}
+			if (now < p->deliver_at) {
+				SHM_STAT_INC(__nr_held_back);
+				break;
+			}
+			p->deliver_at = 0;
+		}
+
+		msg = kmalloc(sizeof(struct pcn_kmsg_recv_hdr) + size, GFP_KERNEL);
+		BUG_ON(!msg && "Unable to alloc a message");
+		msg = PCN_KMSG_RECV_MSG(msg);
+		memcpy(msg, in->data + off + sizeof(u64), size);
+
+		tail += SHM_RECORD_SIZE(size);
+		smp_store_release(&in->tail, tail);
+
+		/* Call pcn_kmsg upper layer */
+		pcn_kmsg_process(msg);
+	}
+	smp_store_release(&in->tail, tail);
+
+	return true;
+}
+
+/**
+ * Poll the inbound rings from all peers. Keep polling for poll_usecs after
+ * the last message, and then take a nap between polls.
+ */
+static int recv_handler_fn(void *arg0)
+{
+	u64 idle_since = ktime_get_ns();
+	MSGPRINTK("RECV handler is ready\n");
+
+	while (!kthread_should_stop()) {
+		bool busy = false;
+		int i;
+
+		for (i = 0; i < MAX_NUM_NODES; i++) {
+			if (i == my_nid) continue;
+			busy |= __poll_peer(shm_peers + i);
+		}
+
+		if (busy) {
+			idle_since = ktime_get_ns();
+			cond_resched();
+		} else if (ktime_get_ns() - idle_since < poll_usecs * NSEC_PER_USEC) {
+			cpu_relax();
+			cond_resched();
+		} else {
+			usleep_range(SHM_IDLE_USECS, SHM_IDLE_USECS * 2);
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * Handle outbound messages
+ */
+static int __send_to_ring(int dest_nid, struct pcn_kmsg_message *msg, size_t size)
+{
+	struct shm_peer *p = shm_peers + dest_nid;
+	struct shm_ring *out = p->out;
+	size_t need = SHM_RECORD_SIZE(size);
+	size_t off, room;
+	u64 head;
+
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+	BUG_ON(size > PCN_KMSG_MAX_SIZE);
+#endif
+	spin_lock(&p->out_lock);
+	head = out->head;
+	off = head & (ring_size - 1);
+	room = need;
+	if (off + need > ring_size) room += ring_size - off;
+
+	if (head + room - smp_load_acquire(&out->tail) > ring_size) {
+		SHM_STAT_INC(__nr_ring_full);
+		while (head + room - smp_load_acquire(&out->tail) > ring_size) {
+			if (!__peer_online(dest_nid)) {
+				spin_unlock(&p->out_lock);
+				return -ECONNRESET;
+			}
+			cpu_relax();
+		}
+	}
+
+	if (off + need > ring_size) {
+		*(u64 *)(out->data + off) = SHM_RECORD_WRAP;
+		head += ring_size - off;
+		off = 0;
+	}
+	*(u64 *)(out->data + off) = size;
+	memcpy(out->data + off + sizeof(u64), msg, size);
+
+	/* Publish the record to the receiver */
+	smp_store_release(&out->head, head + need);
+	spin_unlock(&p->out_lock);
+
+	return 0;
+}
+
+
+/**
+ * Emulate RDMA on the windows
+ */
+static void __delay_rdma(size_t size)
+{
+	u64 ns;
+
+	if (!__shaping()) return;
+
+	ns = latency_usecs * NSEC_PER_USEC + __transfer_ns(size);
+	if (ns < 10 * NSEC_PER_USEC) {
+		ndelay(ns);
+	} else {
+		unsigned long us = div_u64(ns, NSEC_PER_USEC);
+		usleep_range(us, us + 1);
+	}
+}
+
+static bool __in_window(int nid, dma_addr_t rdma_addr, size_t size, u32 rdma_key)
+{
+	size_t start = __window_offset(nid);
+
+	if (rdma_key != nid) return false;
+	return rdma_addr >= start && rdma_addr + size <= start + window_size;
+}
+
+struct pcn_kmsg_rdma_handle *shm_kmsg_pin_rdma_buffer(void *msg, size_t size)
+{
+	struct pcn_kmsg_rdma_handle *rh;
+	unsigned long slot;
+
+#ifdef CONFIG_POPCORN_CHECK_SANITY
+	if (size > SHM_RDMA_SLOT_SIZE) {
+		BUG_ON("Too large buffer to pin");
+		return ERR_PTR(-EINVAL);
+	}
+#endif
+	rh = kmalloc(sizeof(*rh), GFP_KERNEL);
+	if (!rh) return ERR_PTR(-ENOMEM);
+
+	while (true) {
+		spin_lock(&rdma_slots_lock);
+		slot = find_first_zero_bit(rdma_slots, nr_rdma_slots);
+		if (slot < nr_rdma_slots) {
+			set_bit(slot, rdma_slots);
+			spin_unlock(&rdma_slots_lock);
+			break;
+		}
+		spin_unlock(&rdma_slots_lock);
+
+		SHM_STAT_INC(__nr_rdma_slots_waits);
+		schedule();
+	}
+
+	rh->rkey = my_nid;
+	rh->dma_addr = __window_offset(my_nid) + slot * SHM_RDMA_SLOT_SIZE;
+	rh->addr = shm_base + rh->dma_addr;
+	rh->private = (void *)slot;
+
+	return rh;
+}
+
+void shm_kmsg_unpin_rdma_buffer(struct pcn_kmsg_rdma_handle *handle)
+{
+	clear_bit((unsigned long)handle->private, rdma_slots);
+	kfree(handle);
+}
+
+int shm_kmsg_rdma_write(int to_nid, dma_addr_t rdma_addr, void *addr, size_t size, u32 rdma_key)
+{
+	if (!__in_window(to_nid, rdma_addr, size, rdma_key)) return -EINVAL;
+
+	__delay_rdma(size);
+	memcpy(shm_base + rdma_addr, addr, size);
+
+	/* Make the data visible before the completion message is sent */
+	smp_wmb();
+	return 0;
+}
+
+int shm_kmsg_rdma_read(int from_nid, void *addr, dma_addr_t rdma_addr, size_t size, u32 rdma_key)
+{
+	if (!__in_window(from_nid, rdma_addr, size, rdma_key)) return -EINVAL;
+
+	__delay_rdma(size);
+	smp_rmb();
+	memcpy(addr, shm_base + rdma_addr, size);
+	return 0;
+}
+
+
+/***********************************************
+ * This is the interface for message layer
+ ***********************************************/
+struct pcn_kmsg_message *shm_kmsg_get(size_t size)
+{
+	return kmalloc(size, GFP_KERNEL);
+}
+
+void shm_kmsg_put(struct pcn_kmsg_message *msg)
+{
+	kfree(msg);
+}
+
+int shm_kmsg_send(int dest_nid, struct pcn_kmsg_message *msg, size_t size)
+{
+	return __send_to_ring(dest_nid, msg, size);
+}
+
+int shm_kmsg_post(int dest_nid, struct pcn_kmsg_message *msg, size_t size)
+{
+	int ret = __send_to_ring(dest_nid, msg, size);
+	shm_kmsg_put(msg);
+	return ret;
+}
+
+void shm_kmsg_done(struct pcn_kmsg_message *msg)
+{
+	kfree(PCN_KMSG_RECV_HDR(msg));
+}
+
+void shm_kmsg_stat(struct seq_file *seq, void *v)
+{
+	if (seq) {
+#ifdef CONFIG_POPCORN_STAT
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic64_read(&__nr_ring_full),
+				(unsigned long long)atomic64_read(&__nr_held_back),
+				"shm ring full, held back");
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)bitmap_weight(rdma_slots, nr_rdma_slots),
+				(unsigned long long)atomic64_read(&__nr_rdma_slots_waits),
+				"shm rdma slots in use, waits");
+#endif
+	} else {
+#ifdef CONFIG_POPCORN_STAT
+		atomic64_set(&__nr_ring_full, 0);
+		atomic64_set(&__nr_held_back, 0);
+		atomic64_set(&__nr_rdma_slots_waits, 0);
+#endif
+	}
+}
+
+struct pcn_kmsg_transport transport_shm = {
+	.name = "shm",
+	.features = PCN_KMSG_FEATURE_RDMA,
+
+	.get = shm_kmsg_get,
+	.put = shm_kmsg_put,
+	.stat = shm_kmsg_stat,
+
+	.send = shm_kmsg_send,
+	.post = shm_kmsg_post,
+	.done = shm_kmsg_done,
+
+	.pin_rdma_buffer = shm_kmsg_pin_rdma_buffer,
+	.unpin_rdma_buffer = shm_kmsg_unpin_rdma_buffer,
+	.rdma_write = shm_kmsg_rdma_write,
+	.rdma_read = shm_kmsg_rdma_read,
+};
+
+
+static int __init __map_shared_region(void)
+{
+	resource_size_t start = shm_phys;
+	size_t size = shm_size;
+	int ret;
+
+	if (!start) {
+		shm_pdev = pci_get_device(SHM_IVSHMEM_VENDOR, SHM_IVSHMEM_DEVICE, NULL);
+		if (!shm_pdev) {
+			printk(KERN_ERR "No shared region is given nor ivshmem found\n");
+			return -ENODEV;
+		}
+		if ((ret = pci_enable_device(shm_pdev))) goto out_put;
+		if ((ret = pci_request_region(shm_pdev, SHM_IVSHMEM_BAR, "pcn_shm"))) {
+			pci_disable_device(shm_pdev);
+			goto out_put;
+		}
+		start = pci_resource_start(shm_pdev, SHM_IVSHMEM_BAR);
+		size = pci_resource_len(shm_pdev, SHM_IVSHMEM_BAR);
+	}
+
+	shm_base = memremap(start, size, MEMREMAP_WB);
+	if (!shm_base) {
+		printk(KERN_ERR "Cannot map the shared region at %pa\n", &start);
+		ret = -ENOMEM;
+		goto out_release;
+	}
+	shm_mapped_size = size;
+	return 0;
+
+out_release:
+	if (!shm_pdev) return ret;
+	pci_release_region(shm_pdev, SHM_IVSHMEM_BAR);
+	pci_disable_device(shm_pdev);
+out_put:
+	pci_dev_put(shm_pdev);
+	shm_pdev = NULL;
+	return ret;
+}
+
+static void __unmap_shared_region(void)
+{
+	if (shm_base) memunmap(shm_base);
+	shm_base = NULL;
+
+	if (shm_pdev) {
+		pci_release_region(shm_pdev, SHM_IVSHMEM_BAR);
+		pci_disable_device(shm_pdev);
+		pci_dev_put(shm_pdev);
+		shm_pdev = NULL;
+	}
+}
+
+/**
+ * Format the header if nobody did, and check the geometry agrees with ours.
+ * The nodes write the same header, so it is fine to race here.
+ */
+static int __init __setup_header(void)
+{
+	size_t rings_end = PAGE_SIZE + MAX_NUM_NODES * MAX_NUM_NODES * __ring_stride();
+
+	windows_offset = ALIGN(rings_end, PAGE_SIZE);
+	if (__window_offset(MAX_NUM_NODES) > shm_mapped_size) {
+		printk(KERN_ERR "Shared region is too small, %zu < %zu\n",
+				shm_mapped_size, __window_offset(MAX_NUM_NODES));
+		return -ENOSPC;
+	}
+
+	shm_header = shm_base;
+	if (READ_ONCE(shm_header->magic) != SHM_MAGIC) {
+		shm_header->nr_nodes = MAX_NUM_NODES;
+		shm_header->ring_size = ring_size;
+		shm_header->window_size = window_size;
+		smp_wmb();
+		WRITE_ONCE(shm_header->magic, SHM_MAGIC);
+	}
+
+	if (shm_header->nr_nodes != MAX_NUM_NODES ||
+			shm_header->ring_size != ring_size ||
+			shm_header->window_size != window_size) {
+		printk(KERN_ERR "Geometry mismatch. Check the parameters on all nodes\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void __exit exit_kmsg_shm(void)
+{
+	if (recv_handler) kthread_stop(recv_handler);
+
+	if (shm_header) {
+		smp_store_release(&shm_header->online[my_nid], 0);
+		shm_header = NULL;
+	}
+	__unmap_shared_region();
+	kfree(rdma_slots);
+
+	MSGPRINTK("Successfully unloaded module!\n");
+}
+
+static int __init init_kmsg_shm(void)
+{
+	int i, ret;
+	bool waiting = false;
+
+	MSGPRINTK("Loading Popcorn messaging layer over shared memory...\n");
+
+	if (!is_power_of_2(ring_size) || ring_size < PCN_KMSG_MAX_SIZE * 2) {
+		printk(KERN_ERR "ring_size should be a power of 2 and at least %lu\n",
+				PCN_KMSG_MAX_SIZE * 2);
+		return -EINVAL;
+	}
+	if (window_size < SHM_RDMA_SLOT_SIZE || !PAGE_ALIGNED(window_size)) {
+		printk(KERN_ERR "window_size should be page-aligned and at least %lu\n",
+				SHM_RDMA_SLOT_SIZE);
+		return -EINVAL;
+	}
+
+	if (!identify_myself()) return -EINVAL;
+
+	nr_rdma_slots = window_size / SHM_RDMA_SLOT_SIZE;
+	rdma_slots = kzalloc(BITS_TO_LONGS(nr_rdma_slots) * sizeof(long), GFP_KERNEL);
+	if (!rdma_slots) return -ENOMEM;
+
+	if ((ret = __map_shared_region())) goto out_exit;
+	if ((ret = __setup_header())) goto out_exit;
+
+	for (i = 0; i < MAX_NUM_NODES; i++) {
+		struct shm_peer *p = shm_peers + i;
+
+		p->nid = i;
+		p->in = __ring_at(my_nid, i);
+		p->out = __ring_at(i, my_nid);
+		spin_lock_init(&p->out_lock);
+	}
+
+	/* We own the rings toward us. Reset them before getting online */
+	for (i = 0; i < MAX_NUM_NODES; i++) {
+		shm_peers[i].in->head = 0;
+		shm_peers[i].in->tail = 0;
+	}
+	smp_store_release(&shm_header->online[my_nid], 1);
+
+	pcn_kmsg_set_transport(&transport_shm);
+
+	recv_handler = kthread_run(recv_handler_fn, NULL, "pcn_shm_recv");
+	if (IS_ERR(recv_handler)) {
+		ret = PTR_ERR(recv_handler);
+		recv_handler = NULL;
+		goto out_exit;
+	}
+
+	/* Wait for all nodes to get online */
+	for (i = 0; i < MAX_NUM_NODES; i++) {
+		while (!__peer_online(i)) {
+			if (!waiting) {
+				MSGPRINTK("Waiting for node %d to get online\n", i);
+				waiting = true;
+			}
+			msleep(100);
+		}
+		waiting = false;
+		set_popcorn_node_online(i, true);
+	}
+
+	broadcast_my_node_info(MAX_NUM_NODES);
+
+	PCNPRINTK("Ready on shared memory, %zu bytes at %p\n",
+			shm_mapped_size, shm_base);
+	return 0;
+
+out_exit:
+	exit_kmsg_shm();
+	return ret;
+}
+
+module_init(init_kmsg_shm);
+module_exit(exit_kmsg_shm);
+MODULE_LICENSE("GPL");
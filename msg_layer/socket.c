@@ -9,40 +9,117 @@
 #include <linux/seq_file.h>
 #include <linux/proc_fs.h>
 #include <linux/kthread.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
 #include <popcorn/stat.h>
 #include "ring_buffer.h"
 #include "common.h"
 #define PORT 30467
-#define MAX_SEND_DEPTH	1024
+#define MAX_SOCK_CHANNELS	8
 #define NIPQUAD(addr) ((unsigned char *)&addr)[0],((unsigned char *)&addr)[1],((unsigned char *)&addr)[2],((unsigned char *)&addr)[3]
 #define NIPQUAD_FMT "%u.%u.%u.%u"
 
+/**
+ * Number of TCP connections to each peer. Every connection has its own
+ * outbound queue and sender/receiver threads, so concurrent senders do not
+ * serialize on a single socket. Should be the same on all nodes.
+ */
+static int nr_channels = 4;
+module_param(nr_channels, int, 0444);
+MODULE_PARM_DESC(nr_channels, "Number of connections to each peer (1-8)");
+
+/**
+ * Outbound messages queued on a connection can be coalesced into a single
+ * sendmsg() of up to PCN_KMSG_MAX_SIZE bytes. The receiver splits them
+ * while parsing its bulk reads, so no framing change is needed. When a
+ * message finds the queue empty, the sender may wait up to batch_usecs for
+ * others to join it.
+ */
+#define MAX_SEND_BATCH	32
+static int batch_size = 1;
+module_param(batch_size, int, 0644);
+MODULE_PARM_DESC(batch_size, "Max number of messages coalesced into a send (1 disables batching)");
+
+static int batch_usecs = 0;
+module_param(batch_usecs, int, 0644);
+MODULE_PARM_DESC(batch_usecs, "Time to wait for more messages to batch in usec");
+
 enum {
 	SEND_FLAG_POSTED = 0,
 };
 
 struct q_item {
+	struct llist_node llnode;
 	struct pcn_kmsg_message *msg;
 	unsigned long flags;
 	struct completion *done;
 };
 
-/* Per-node handle for socket */
-struct sock_handle {
-	int nid;
+/**
+ * Receive buffer pool. Inbound messages are placed in buffers recycled
+ * through a pool instead of being allocated one by one. Buffers are taken
+ * only by the receive handler of the channel and are returned from any
+ * context, which is what llist supports without locking.
+ */
+enum {
+	RPOOL_SMALL = 0,	/* Requests and short responses */
+	RPOOL_PAGE,			/* Messages carrying a page */
+	NR_RPOOLS,
+};
+
+static const size_t rpool_sizes[NR_RPOOLS] = {
+	[RPOOL_SMALL] = 512,
+	[RPOOL_PAGE] = PAGE_SIZE + 512,
+};
+
+#define RPOOL_PREALLOC		64
+#define RECV_BUFFER_SIZE	(PCN_KMSG_MAX_SIZE * 2)
+
+struct sock_rpool {
+	struct llist_head free;
+	size_t size;
+};
 
-	/* Ring buffer for queueing outbound messages */
-	struct q_item *msg_q;
-	unsigned long q_head;
-	unsigned long q_tail;
-	spinlock_t q_lock;
-	struct semaphore q_empty;
-	struct semaphore q_full;
+struct rbuf_hdr {
+	struct llist_node llnode;
+	struct sock_rpool *pool;	/* NULL if not from the pool */
+	struct pcn_kmsg_recv_hdr recv;	/* Right before the message */
+};
+
+/* Per-connection handle. Each peer is served by nr_channels of them */
+struct sock_channel {
+	int nid;
+	int index;
+
+	/* Staging buffer to read inbound bytes in bulk */
+	char *recv_buffer;
+	size_t recv_head;
+	size_t recv_tail;
+	struct sock_rpool rpools[NR_RPOOLS];
+
+	/**
+	 * Lock-free queues for outbound messages, one for each priority.
+	 * send_handler moves them to @pending and always sends out the
+	 * highest-priority messages first. A sender of pcn_kmsg_send() waits
+	 * until its message is sent, so only posted messages can be overtaken;
+	 * see enum pcn_kmsg_prio.
+	 */
+	struct llist_head q[PCN_KMSG_PRIO_MAX];
+	struct llist_node *pending[PCN_KMSG_PRIO_MAX];
+	struct llist_node *pending_tail[PCN_KMSG_PRIO_MAX];
+	wait_queue_head_t q_wait;
 
 	struct socket *sock;
 	struct task_struct *send_handler;
 	struct task_struct *recv_handler;
 };
+
+/* Per-node handle for socket */
+struct sock_handle {
+	int nid;
+	int nr_connected;
+	struct sock_channel channels[MAX_SOCK_CHANNELS];
+};
 static struct sock_handle sock_handles[MAX_NUM_NODES] = {};
 
 static struct socket *sock_listen = NULL;
@@ -52,7 +129,7 @@ static struct ring_buffer send_buffer = {};
 /**
  * Handle inbound messages
  */
-static int ksock_recv(struct socket *sock, char *buf, size_t len)
+static int ksock_recv(struct socket *sock, char *buf, size_t len, int flags)
 {
 	struct msghdr msg = {
 		.msg_flags = 0,
@@ -66,56 +143,160 @@ static int ksock_recv(struct socket *sock, char *buf, size_t len)
 		.iov_len = len,
 	};
 
-	return kernel_recvmsg(sock, &msg, &iov, 1, len, MSG_WAITALL);
+	return kernel_recvmsg(sock, &msg, &iov, 1, len, flags);
+}
+
+static struct rbuf_hdr *__alloc_rbuf(struct sock_rpool *pool, size_t size)
+{
+	struct rbuf_hdr *rb = kmalloc(sizeof(*rb) + size, GFP_KERNEL);
+	if (!rb) return NULL;
+
+	rb->pool = pool;
+	return rb;
+}
+
+static struct pcn_kmsg_message *__get_recv_msg(struct sock_channel *ch, size_t size)
+{
+	int i;
+	struct rbuf_hdr *rb = NULL;
+
+	for (i = 0; i < NR_RPOOLS; i++) {
+		struct sock_rpool *pool = ch->rpools + i;
+		struct llist_node *ln;
+
+		if (size > pool->size) continue;
+
+		ln = llist_del_first(&pool->free);
+		if (ln) {
+			rb = llist_entry(ln, struct rbuf_hdr, llnode);
+		} else {
+			/* Grow the pool. It will join the pool when it is done */
+			rb = __alloc_rbuf(pool, pool->size);
+		}
+		break;
+	}
+	if (!rb) {
+		rb = __alloc_rbuf(NULL, size);
+	}
+	BUG_ON(!rb && "Unable to alloc a message");
+
+	return PCN_KMSG_RECV_MSG(&rb->recv);
+}
+
+static void __put_recv_msg(struct pcn_kmsg_message *msg)
+{
+	struct rbuf_hdr *rb =
+			container_of(PCN_KMSG_RECV_HDR(msg), struct rbuf_hdr, recv);
+
+	if (rb->pool) {
+		llist_add(&rb->llnode, &rb->pool->free);
+	} else {
+		kfree(rb);
+	}
 }
 
+static int __init_rpools(struct sock_channel *ch)
+{
+	int i, j;
+
+	for (i = 0; i < NR_RPOOLS; i++) {
+		struct sock_rpool *pool = ch->rpools + i;
+
+		init_llist_head(&pool->free);
+		pool->size = rpool_sizes[i];
+
+		for (j = 0; j < RPOOL_PREALLOC; j++) {
+			struct rbuf_hdr *rb = __alloc_rbuf(pool, pool->size);
+			if (!rb) return -ENOMEM;
+			llist_add(&rb->llnode, &pool->free);
+		}
+	}
+	return 0;
+}
+
+static void __destroy_rpools(struct sock_channel *ch)
+{
+	int i;
+
+	for (i = 0; i < NR_RPOOLS; i++) {
+		struct llist_node *ln = llist_del_all(&ch->rpools[i].free);
+		while (ln) {
+			struct rbuf_hdr *rb = llist_entry(ln, struct rbuf_hdr, llnode);
+			ln = ln->next;
+			kfree(rb);
+		}
+	}
+}
+
+/**
+ * Read as many bytes as available into the staging buffer, at least @min
+ * bytes from the head. Return false if the connection is gone.
+ */
+static bool __fill_recv_buffer(struct sock_channel *ch, size_t min)
+{
+	if (ch->recv_head == ch->recv_tail) {
+		ch->recv_head = ch->recv_tail = 0;
+	} else if (ch->recv_head + min > RECV_BUFFER_SIZE) {
+		memmove(ch->recv_buffer, ch->recv_buffer + ch->recv_head,
+				ch->recv_tail - ch->recv_head);
+		ch->recv_tail -= ch->recv_head;
+		ch->recv_head = 0;
+	}
+
+	while (ch->recv_tail - ch->recv_head < min) {
+		int ret = ksock_recv(ch->sock, ch->recv_buffer + ch->recv_tail,
+				RECV_BUFFER_SIZE - ch->recv_tail, 0);
+		if (ret <= 0) return false;
+		ch->recv_tail += ret;
+	}
+	return true;
+}
+
+/**
+ * Receive messages in bulk. Each read takes whatever is available on the
+ * socket, and all complete messages in the staging buffer are delivered
+ * before reading again. The rest of a message larger than what is buffered
+ * is read directly into its message buffer.
+ */
 static int recv_handler(void* arg0)
 {
-	struct sock_handle *sh = arg0;
-	MSGPRINTK("RECV handler for %d is ready\n", sh->nid);
+	struct sock_channel *ch = arg0;
+	MSGPRINTK("RECV handler for %d/%d is ready\n", ch->nid, ch->index);
 
 	while (!kthread_should_stop()) {
-		int len;
-		int ret;
-		size_t offset;
 		struct pcn_kmsg_hdr header;
-		char *data;
-
-		/* compose header */
-		offset = 0;
-		len = sizeof(header);
-		while (len > 0) {
-			ret = ksock_recv(sh->sock, (char *)(&header) + offset, len);
-			if (ret == -1) break;
-			offset += ret;
-			len -= ret;
-		}
-		if (ret < 0) break;
+		struct pcn_kmsg_message *msg;
+		size_t buffered;
+
+		if (!__fill_recv_buffer(ch, sizeof(header))) break;
+
+		memcpy(&header, ch->recv_buffer + ch->recv_head, sizeof(header));
 
 #ifdef CONFIG_POPCORN_CHECK_SANITY
 		BUG_ON(header.type < 0 || header.type >= PCN_KMSG_TYPE_MAX);
 		BUG_ON(header.size < 0 || header.size >  PCN_KMSG_MAX_SIZE);
 #endif
+		msg = __get_recv_msg(ch, header.size);
 
-		/* compose body */
-		data = kmalloc(header.size, GFP_KERNEL);
-		BUG_ON(!data && "Unable to alloc a message");
-
-		memcpy(data, &header, sizeof(header));
-
-		offset = sizeof(header);
-		len = header.size - offset;
-
-		while (len > 0) {
-			ret = ksock_recv(sh->sock, data + offset, len);
-			if (ret == -1) break;
-			offset += ret;
-			len -= ret;
+		buffered = ch->recv_tail - ch->recv_head;
+		if (buffered >= header.size) {
+			memcpy(msg, ch->recv_buffer + ch->recv_head, header.size);
+			ch->recv_head += header.size;
+		} else {
+			int ret;
+			memcpy(msg, ch->recv_buffer + ch->recv_head, buffered);
+			ch->recv_head = ch->recv_tail = 0;
+
+			ret = ksock_recv(ch->sock, (char *)msg + buffered,
+					header.size - buffered, MSG_WAITALL);
+			if (ret != header.size - buffered) {
+				__put_recv_msg(msg);
+				break;
+			}
 		}
-		if (ret < 0) break;
 
 		/* Call pcn_kmsg upper layer */
-		pcn_kmsg_process((struct pcn_kmsg_message *)data);
+		pcn_kmsg_process(msg);
 	}
 	return 0;
 }
@@ -141,120 +322,209 @@ static int ksock_send(struct socket *sock, char *buf, size_t len)
 	return kernel_sendmsg(sock, &msg, &iov, 1, len);
 }
 
-static int enq_send(int dest_nid, struct pcn_kmsg_message *msg, unsigned long flags, struct completion *done)
+/**
+ * Pick the connection to carry messages from the current thread. Messages
+ * from a thread always go through the same connection, so they are delivered
+ * in the order they were enqueued.
+ */
+static inline struct sock_channel *__get_channel(int dest_nid)
 {
-	int ret;
-	unsigned long at;
-	struct sock_handle *sh = sock_handles + dest_nid;
-	struct q_item *qi;
-	do {
-		ret = down_interruptible(&sh->q_full);
-	} while (ret);
-
-	spin_lock(&sh->q_lock);
-	at = sh->q_tail;
-	qi = sh->msg_q + at;
-	sh->q_tail = (at + 1) & (MAX_SEND_DEPTH - 1);
+	return sock_handles[dest_nid].channels + (current->pid % nr_channels);
+}
 
-	qi->msg = msg;
-	qi->flags = flags;
-	qi->done = done;
-	spin_unlock(&sh->q_lock);
-	up(&sh->q_empty);
+static void enq_send(int dest_nid, struct q_item *qi)
+{
+	struct sock_channel *ch = __get_channel(dest_nid);
+	int prio = qi->msg->header.prio;
 
-	return at;
+	/* Wake up the sender only when it might have found the queue empty */
+	if (llist_add(&qi->llnode, &ch->q[prio])) {
+		wake_up(&ch->q_wait);
+	}
 }
 
 void sock_kmsg_put(struct pcn_kmsg_message *msg);
 
-static int deq_send(struct sock_handle *sh)
+#ifdef CONFIG_POPCORN_STAT
+static atomic64_t __nr_batched_msgs = ATOMIC64_INIT(0);
+static atomic64_t __nr_batches = ATOMIC64_INIT(0);
+#endif
+
+static void __send_iov(struct sock_channel *ch, struct kvec *iov, int nr_iov, size_t size)
 {
-	int ret;
-	char *p;
-	unsigned long from;
-	size_t remaining;
-	struct pcn_kmsg_message *msg;
-	struct q_item *qi;
-	unsigned long flags;
-	struct completion *done;
+	while (size > 0) {
+		struct msghdr msg = {
+			.msg_flags = 0,
+		};
+		int sent = kernel_sendmsg(ch->sock, &msg, iov, nr_iov, size);
+		if (sent < 0) {
+			MSGPRINTK("send interrupted, %d\n", sent);
+			io_schedule();
+			continue;
+		}
+		size -= sent;
+
+		/* Skip over what has been sent */
+		while (sent > 0) {
+			if (sent >= iov->iov_len) {
+				sent -= iov->iov_len;
+				iov++;
+				nr_iov--;
+			} else {
+				iov->iov_base += sent;
+				iov->iov_len -= sent;
+				sent = 0;
+			}
+		}
+	}
+}
 
-	do {
-		ret = down_interruptible(&sh->q_empty);
-	} while (ret);
+/**
+ * Send out messages from @batch as a single frame and return the rest
+ */
+static struct llist_node *__send_batch(struct sock_channel *ch, struct llist_node *batch)
+{
+	struct q_item *items[MAX_SEND_BATCH];
+	struct kvec iov[MAX_SEND_BATCH];
+	int max = clamp(batch_size, 1, MAX_SEND_BATCH);
+	int nr = 0;
+	size_t size = 0;
+	int i;
 
-	spin_lock(&sh->q_lock);
-	from = sh->q_head;
-	qi = sh->msg_q + from;
-	sh->q_head = (from + 1) & (MAX_SEND_DEPTH - 1);
+	while (batch && nr < max) {
+		struct q_item *qi = llist_entry(batch, struct q_item, llnode);
+		size_t msg_size = qi->msg->header.size;
 
-	msg = qi->msg;
-	flags = qi->flags;
-	done = qi->done;
-	spin_unlock(&sh->q_lock);
-	up(&sh->q_full);
+		if (nr && size + msg_size > PCN_KMSG_MAX_SIZE) break;
 
-	p = (char *)msg;
-	remaining = msg->header.size;
+		items[nr] = qi;
+		iov[nr].iov_base = qi->msg;
+		iov[nr].iov_len = msg_size;
+		size += msg_size;
+		nr++;
 
-	while (remaining > 0) {
-		int sent = ksock_send(sh->sock, p, remaining);
-		if (sent < 0) {
-			MSGPRINTK("send interrupted, %d\n", sent);
-			io_schedule();
-			continue;
+		/* @qi can be reclaimed once it is sent */
+		batch = batch->next;
+	}
+
+	__send_iov(ch, iov, nr, size);
+
+	for (i = 0; i < nr; i++) {
+		struct q_item *qi = items[i];
+		struct completion *done = qi->done;
+
+		if (test_bit(SEND_FLAG_POSTED, &qi->flags)) {
+			sock_kmsg_put(qi->msg);
 		}
-		p += sent;
-		remaining -= sent;
-		//printk("Sent %d remaining %d\n", sent, remaining);
+		if (done) complete(done);
+	}
+#ifdef CONFIG_POPCORN_STAT
+	if (nr > 1) {
+		atomic64_add(nr, &__nr_batched_msgs);
+		atomic64_inc(&__nr_batches);
+	}
+#endif
+	return batch;
+}
+
+static bool __has_outbound(struct sock_channel *ch)
+{
+	int i;
+	for (i = 0; i < PCN_KMSG_PRIO_MAX; i++) {
+		if (!llist_empty(&ch->q[i])) return true;
+	}
+	return false;
+}
+
+/* Move newly queued messages with @prio behind the pending ones */
+static struct llist_node *__collect_outbound(struct sock_channel *ch, int prio)
+{
+	struct llist_node *first = llist_del_all(&ch->q[prio]);
+	struct llist_node *more;
+
+	if (!first) return ch->pending[prio];
+
+	/* llist is LIFO. Reverse it to send messages in the enqueued order */
+	more = llist_reverse_order(first);
+	if (!ch->pending[prio]) {
+		ch->pending[prio] = more;
+	} else {
+		ch->pending_tail[prio]->next = more;
 	}
-	if (test_bit(SEND_FLAG_POSTED, &flags)) {
-		sock_kmsg_put(msg);
+	ch->pending_tail[prio] = first;
+	return ch->pending[prio];
+}
+
+static int deq_send(struct sock_channel *ch)
+{
+	int prio;
+
+	wait_event_interruptible(ch->q_wait,
+			__has_outbound(ch) || kthread_should_stop());
+
+	if (batch_size > 1 && batch_usecs > 0) {
+		int nr_msgs = 0;
+		for (prio = 0; prio < PCN_KMSG_PRIO_MAX; prio++) {
+			struct llist_node *ln = __collect_outbound(ch, prio);
+			for (; ln && nr_msgs < 2; ln = ln->next) nr_msgs++;
+		}
+		/* Only one message is there. Give others a chance to join it */
+		if (nr_msgs == 1) {
+			usleep_range(batch_usecs, batch_usecs * 2);
+		}
 	}
-	if (done) complete(done);
+
+	/* Re-check higher priority messages after every batch */
+	do {
+		for (prio = PCN_KMSG_PRIO_MAX - 1; prio >= 0; prio--) {
+			if (__collect_outbound(ch, prio)) break;
+		}
+		if (prio < 0) break;
+
+		ch->pending[prio] = __send_batch(ch, ch->pending[prio]);
+	} while (true);
 
 	return 0;
 }
 
 static int send_handler(void* arg0)
 {
-	struct sock_handle *sh = arg0;
-	MSGPRINTK("SEND handler for %d is ready\n", sh->nid);
+	struct sock_channel *ch = arg0;
+	MSGPRINTK("SEND handler for %d/%d is ready\n", ch->nid, ch->index);
 
 	while (!kthread_should_stop()) {
-		deq_send(sh);
+		deq_send(ch);
 	}
-	kfree(sh->msg_q);
 	return 0;
 }
 
 
-#define WORKAROUND_POOL
 /***********************************************
  * Manage send buffer
+ *
+ * A posted message carries its queue item in front of itself so that posting
+ * does not need any further allocation.
  ***********************************************/
 struct pcn_kmsg_message *sock_kmsg_get(size_t size)
 {
-	struct pcn_kmsg_message *msg;
+	struct q_item *qi;
 	might_sleep();
 
-#ifdef WORKAROUND_POOL
-	msg = kmalloc(size, GFP_KERNEL);
-#else
-	while (!(msg = ring_buffer_get(&send_buffer, size))) {
-		WARN_ON_ONCE("ring buffer is full\n");
+	while (!(qi = ring_buffer_get(&send_buffer, sizeof(*qi) + size))) {
+		if (printk_ratelimit()) {
+			printk(KERN_WARNING "%s: ring buffer is full, %zu in use\n",
+					send_buffer.name, ring_buffer_usage(&send_buffer));
+		}
 		schedule();
 	}
-#endif
-	return msg;
+	return (struct pcn_kmsg_message *)(qi + 1);
 }
 
 void sock_kmsg_put(struct pcn_kmsg_message *msg)
 {
-#ifdef WORKAROUND_POOL
-	kfree(msg);
-#else
-	ring_buffer_put(&send_buffer, msg);
-#endif
+	struct q_item *qi = (struct q_item *)msg - 1;
+
+	ring_buffer_put(&send_buffer, qi);
 }
 
 
@@ -264,24 +534,36 @@ void sock_kmsg_put(struct pcn_kmsg_message *msg)
 int sock_kmsg_send(int dest_nid, struct pcn_kmsg_message *msg, size_t size)
 {
 	DECLARE_COMPLETION_ONSTACK(done);
-	enq_send(dest_nid, msg, 0, &done);
+	struct q_item qi = {
+		.msg = msg,
+		.flags = 0,
+		.done = &done,
+	};
+	enq_send(dest_nid, &qi);
 
+	/* @qi is on the stack, so it should be dequeued before returning */
 	if (!try_wait_for_completion(&done)) {
-		int ret = wait_for_completion_io_timeout(&done, 60 * HZ);
-		if (!ret) return -EAGAIN;
+		while (!wait_for_completion_io_timeout(&done, 60 * HZ)) {
+			WARN_ONCE(1, "Sending to %d is taking too long\n", dest_nid);
+		}
 	}
 	return 0;
 }
 
 int sock_kmsg_post(int dest_nid, struct pcn_kmsg_message *msg, size_t size)
 {
-	enq_send(dest_nid, msg, 1 << SEND_FLAG_POSTED, NULL);
+	struct q_item *qi = (struct q_item *)msg - 1;
+
+	qi->msg = msg;
+	qi->flags = 1 << SEND_FLAG_POSTED;
+	qi->done = NULL;
+	enq_send(dest_nid, qi);
 	return 0;
 }
 
 void sock_kmsg_done(struct pcn_kmsg_message *msg)
 {
-	kfree(msg);
+	__put_recv_msg(msg);
 }
 
 void sock_kmsg_stat(struct seq_file *seq, void *v)
@@ -295,6 +577,17 @@ void sock_kmsg_stat(struct seq_file *seq, void *v)
 				0ULL,
 #endif
                                 "socket");
+#ifdef CONFIG_POPCORN_STAT
+		seq_printf(seq, POPCORN_STAT_FMT,
+				(unsigned long long)atomic64_read(&__nr_batched_msgs),
+				(unsigned long long)atomic64_read(&__nr_batches),
+				"socket_batch");
+#endif
+	} else {
+#ifdef CONFIG_POPCORN_STAT
+		atomic64_set(&__nr_batched_msgs, 0);
+		atomic64_set(&__nr_batches, 0);
+#endif
 	}
 }
 
@@ -356,13 +649,13 @@ static int peers_init(void)
         return 0;
 }
 
-static struct task_struct * __init __start_handler(const int nid, const char *type, int (*handler)(void *data))
+static struct task_struct * __init __start_handler(struct sock_channel *ch, const char *type, int (*handler)(void *data))
 {
 	char name[40];
 	struct task_struct *tsk;
 
-	sprintf(name, "pcn_%s_%d", type, nid);
-	tsk = kthread_run(handler, sock_handles + nid, name);
+	sprintf(name, "pcn_%s_%d_%d", type, ch->nid, ch->index);
+	tsk = kthread_run(handler, ch, name);
 	if (IS_ERR(tsk)) {
 		printk(KERN_ERR "Cannot create %s handler, %ld\n", name, PTR_ERR(tsk));
 		return tsk;
@@ -378,29 +671,31 @@ static struct task_struct * __init __start_handler(const int nid, const char *ty
 	return tsk;
 }
 
-static int __start_handlers(const int nid)
+static int __start_handlers(struct sock_channel *ch)
 {
 	struct task_struct *tsk_send, *tsk_recv;
-	tsk_send = __start_handler(nid, "send", send_handler);
+	tsk_send = __start_handler(ch, "send", send_handler);
 	if (IS_ERR(tsk_send)) {
 		return PTR_ERR(tsk_send);
 	}
 
-	tsk_recv = __start_handler(nid, "recv", recv_handler);
+	tsk_recv = __start_handler(ch, "recv", recv_handler);
 	if (IS_ERR(tsk_recv)) {
 		kthread_stop(tsk_send);
 		return PTR_ERR(tsk_recv);
 	}
-	sock_handles[nid].send_handler = tsk_send;
-	sock_handles[nid].recv_handler = tsk_recv;
+	ch->send_handler = tsk_send;
+	ch->recv_handler = tsk_recv;
 	return 0;
 }
 
-static int __init __connect_to_server(int nid)
+static int __init __connect_to_server(int nid, int index)
 {
 	int ret;
 	struct sockaddr_in addr;
 	struct socket *sock;
+	struct sock_channel *ch = sock_handles[nid].channels + index;
+	u32 channel = index;
 
 	ret = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
 	if (ret < 0) {
@@ -412,7 +707,7 @@ static int __init __connect_to_server(int nid)
 	addr.sin_port = htons(PORT);
 	addr.sin_addr.s_addr = ip_table[nid];
 
-	MSGPRINTK("Connecting to %d at %pI4\n", nid, ip_table + nid);
+	MSGPRINTK("Connecting to %d/%d at %pI4\n", nid, index, ip_table + nid);
 	do {
 		ret = kernel_connect(sock, (struct sockaddr *)&addr, sizeof(addr), 0);
 		if (ret < 0) {
@@ -421,8 +716,15 @@ static int __init __connect_to_server(int nid)
 		}
 	} while (ret < 0);
 
-	sock_handles[nid].sock = sock;
-	ret = __start_handlers(nid);
+	/* Let the peer know which channel this connection is for */
+	ret = ksock_send(sock, (char *)&channel, sizeof(channel));
+	if (ret != sizeof(channel)) {
+		sock_release(sock);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	ch->sock = sock;
+	ret = __start_handlers(ch);
 	if (ret) return ret;
 
 	return 0;
@@ -437,6 +739,8 @@ static int __init __accept_client(int *nid)
 	struct socket *sock;
 	struct sockaddr_in addr;
 	int addr_len = sizeof(addr);
+	u32 channel;
+	struct sock_channel *ch;
 
 	do {
 		ret = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
@@ -470,10 +774,27 @@ static int __init __accept_client(int *nid)
 	} while (retry++ < 10 && !found);
 
 	if (!found) return -EAGAIN;
-	sock_handles[*nid].sock = sock;
 
-	ret = __start_handlers(*nid);
-	if (ret) goto out_release;
+	/* Identify the channel that the peer is connecting */
+	ret = ksock_recv(sock, (char *)&channel, sizeof(channel), MSG_WAITALL);
+	if (ret != sizeof(channel)) {
+		ret = ret < 0 ? ret : -EIO;
+		goto out_release;
+	}
+	if (channel >= nr_channels) {
+		printk(KERN_ERR "Invalid channel %u from %d. "
+				"Check nr_channels on all nodes\n", channel, *nid);
+		ret = -EINVAL;
+		goto out_release;
+	}
+	ch = sock_handles[*nid].channels + channel;
+	ch->sock = sock;
+
+	ret = __start_handlers(ch);
+	if (ret) {
+		ch->sock = NULL;
+		goto out_release;
+	}
 
 	return 0;
 
@@ -503,7 +824,7 @@ static int __init __listen_to_connection(void)
 		goto out_release;
 	}
 
-	ret = kernel_listen(sock_listen, MAX_NUM_NODES);
+	ret = kernel_listen(sock_listen, MAX_NUM_NODES * nr_channels);
 	if (ret < 0) {
 		printk(KERN_ERR "Failed to listen to connections, %d\n", ret);
 		goto out_release;
@@ -520,22 +841,24 @@ out_release:
 
 static void __exit exit_kmsg_sock(void)
 {
-	int i;
+	int i, j;
 
 	if (sock_listen) sock_release(sock_listen);
 
 	for (i = 0; i < MAX_NUM_NODES; i++) {
-		struct sock_handle *sh = sock_handles + i;
-		if (sh->send_handler) {
-			kthread_stop(sh->send_handler);
-		} else {
-			if (sh->msg_q) kfree(sh->msg_q);
-		}
-		if (sh->recv_handler) {
-			kthread_stop(sh->recv_handler);
-		}
-		if (sh->sock) {
-			sock_release(sh->sock);
+		for (j = 0; j < nr_channels; j++) {
+			struct sock_channel *ch = sock_handles[i].channels + j;
+			if (ch->send_handler) {
+				kthread_stop(ch->send_handler);
+			}
+			if (ch->recv_handler) {
+				kthread_stop(ch->recv_handler);
+			}
+			if (ch->sock) {
+				sock_release(ch->sock);
+			}
+			__destroy_rpools(ch);
+			kfree(ch->recv_buffer);
 		}
 	}
 	ring_buffer_destroy(&send_buffer);
@@ -545,34 +868,47 @@ static void __exit exit_kmsg_sock(void)
 
 static int __init init_kmsg_sock(void)
 {
-	int i, ret;
+	int i, j, k, ret;
 
 	MSGPRINTK("Loading Popcorn messaging layer over TCP/IP...\n");
 
+	if (nr_channels < 1 || nr_channels > MAX_SOCK_CHANNELS) {
+		printk(KERN_ERR "nr_channels should be in 1-%d\n", MAX_SOCK_CHANNELS);
+		return -EINVAL;
+	}
+
 	if (!identify_myself()) return -EINVAL;
 	pcn_kmsg_set_transport(&transport_socket);
 
 	for (i = 0; i < MAX_NUM_NODES; i++) {
 		struct sock_handle *sh = sock_handles + i;
 
-		sh->msg_q = kmalloc(sizeof(*sh->msg_q) * MAX_SEND_DEPTH, GFP_KERNEL);
-		if (!sh->msg_q) {
-			ret = -ENOMEM;
-			goto out_exit;
-		}
-
 		sh->nid = i;
-		sh->q_head = 0;
-		sh->q_tail = 0;
-		spin_lock_init(&sh->q_lock);
+		sh->nr_connected = 0;
+		for (j = 0; j < nr_channels; j++) {
+			struct sock_channel *ch = sh->channels + j;
+
+			ch->nid = i;
+			ch->index = j;
+			for (k = 0; k < PCN_KMSG_PRIO_MAX; k++) {
+				init_llist_head(&ch->q[k]);
+				ch->pending[k] = NULL;
+			}
+			init_waitqueue_head(&ch->q_wait);
 
-		sema_init(&sh->q_empty, 0);
-		sema_init(&sh->q_full, MAX_SEND_DEPTH);
+			if (i == my_nid) continue;
+			ch->recv_buffer = kmalloc(RECV_BUFFER_SIZE, GFP_KERNEL);
+			if (!ch->recv_buffer) {
+				ret = -ENOMEM;
+				goto out_exit;
+			}
+			if ((ret = __init_rpools(ch))) goto out_exit;
+		}
 	}
 
 	if ((ret = ring_buffer_init(&send_buffer, "sock_send"))) goto out_exit;
 
-	if ((ret = __listen_to_connection())) return ret;
+	if ((ret = __listen_to_connection())) goto out_exit;
 
 	/* Wait for a while so that nodes are ready to listen to connections */
 	msleep(100);
@@ -586,23 +922,29 @@ static int __init init_kmsg_sock(void)
 	 * my_nid:  no need to talk to itself
 	 * connect: connecting to existing nodes
 	 * accept:  waiting for the connection requests from later nodes
+	 *
+	 * Each entry in the table consists of nr_channels connections.
 	 */
 	for (i = 0; i < my_nid; i++) {
-		if ((ret = __connect_to_server(i))) goto out_exit;
+		for (j = 0; j < nr_channels; j++) {
+			if ((ret = __connect_to_server(i, j))) goto out_exit;
+		}
 		set_popcorn_node_online(i, true);
 	}
 
 	set_popcorn_node_online(my_nid, true);
 
-	for (i = my_nid + 1; i < MAX_NUM_NODES; i++) {
+	for (i = (my_nid + 1) * nr_channels; i < MAX_NUM_NODES * nr_channels; i++) {
 		int nid;
 		if ((ret = __accept_client(&nid))) goto out_exit;
-		set_popcorn_node_online(nid, true);
+		if (++sock_handles[nid].nr_connected == nr_channels) {
+			set_popcorn_node_online(nid, true);
+		}
 	}
 
-	broadcast_my_node_info(i);
+	broadcast_my_node_info(MAX_NUM_NODES);
 
-	PCNPRINTK("Ready on TCP/IP\n");
+	PCNPRINTK("Ready on TCP/IP with %d connections per node\n", nr_channels);
 	peers_init();
 	
 	return 0;